@@ -13,11 +13,18 @@ int main( int argc, const char* argv[] )
 	// オプション
 	bool has_error = false;
 	const char* filename = nullptr;
+	const char* cache_directory = nullptr;
 	bool show_script = false;
 	bool show_preprocessed_script = false;
 	bool show_ast = false;
 	bool show_execute_code = false;
 	bool show_help = false;
+	int optimize_level = 1;
+	execute_arg_t ea;
+	ea.dispatch_ = ( is_dispatch_available( DISPATCH_THREADED ) ? DISPATCH_THREADED : DISPATCH_SWITCH );
+	ea.backend_ = BACKEND_STACK;
+	ea.profile_ngram_ = 0;
+	ea.jit_ = false;
 
 	// オプション解析
 	for( int i=1/* 0飛ばし */; i<argc; ++i )
@@ -39,6 +46,18 @@ int main( int argc, const char* argv[] )
 						has_error = true;
 					}
 					break;
+				case 'c':
+					if ( i+1 < argc )
+					{
+						++i;
+						cache_directory = argv[i];
+					}
+					else
+					{
+						fprintf( stderr, "ERROR : cannot read cache directory path\n" );
+						has_error = true;
+					}
+					break;
 				case 's':
 					show_script = true;
 					break;
@@ -51,6 +70,93 @@ int main( int argc, const char* argv[] )
 				case 'e':
 					show_execute_code = true;
 					break;
+				case 'd':
+					if ( i+1 < argc )
+					{
+						++i;
+						if ( strcmp( argv[i], "switch" ) == 0 )
+						{
+							ea.dispatch_ = DISPATCH_SWITCH;
+						}
+						else if ( strcmp( argv[i], "threaded" ) == 0 && is_dispatch_available( DISPATCH_THREADED ) )
+						{
+							ea.dispatch_ = DISPATCH_THREADED;
+						}
+						else
+						{
+							fprintf( stderr, "ERROR : unknown or unavailable dispatch mode :%s\n", argv[i] );
+							has_error = true;
+						}
+					}
+					else
+					{
+						fprintf( stderr, "ERROR : cannot read dispatch mode\n" );
+						has_error = true;
+					}
+					break;
+				case 'b':
+					if ( i+1 < argc )
+					{
+						++i;
+						if ( strcmp( argv[i], "stack" ) == 0 )
+						{
+							ea.backend_ = BACKEND_STACK;
+						}
+						else if ( strcmp( argv[i], "register" ) == 0 )
+						{
+							ea.backend_ = BACKEND_REGISTER;
+						}
+						else
+						{
+							fprintf( stderr, "ERROR : unknown backend :%s\n", argv[i] );
+							has_error = true;
+						}
+					}
+					else
+					{
+						fprintf( stderr, "ERROR : cannot read backend\n" );
+						has_error = true;
+					}
+					break;
+				case 'n':
+					if ( i+1 < argc )
+					{
+						++i;
+						ea.profile_ngram_ = atoi( argv[i] );
+						if ( ea.profile_ngram_ < 1 || ea.profile_ngram_ > MAX_OPCODE_PROFILE_NGRAM )
+						{
+							fprintf( stderr, "ERROR : n-gram length must be 1 to %d :%s\n", MAX_OPCODE_PROFILE_NGRAM, argv[i] );
+							has_error = true;
+						}
+					}
+					else
+					{
+						fprintf( stderr, "ERROR : cannot read n-gram length\n" );
+						has_error = true;
+					}
+					break;
+				case 'j':
+					if ( is_jit_available() )
+					{
+						ea.jit_ = true;
+					}
+					else
+					{
+						fprintf( stderr, "ERROR : jit is not available on this platform\n" );
+						has_error = true;
+					}
+					break;
+				case 'O':
+					if ( arg[2] == '0' || arg[2] == '1' )
+					{
+						optimize_level = arg[2] -'0';
+					}
+					else
+					{
+						fprintf( stderr, "ERROR : unknown optimization level :%s\n", arg );
+						has_error = true;
+					}
+					break;
 				case 'h':
 					show_help = true;
 					break;
@@ -85,7 +191,13 @@ int main( int argc, const char* argv[] )
 			"    -s : show loaded script file contents\n"
 			"    -p : show preprocessed script contents\n"
 			"    -a : show abstract-syntax-tree constructed from loaded script\n"
-			"    -e : show instruction code for execution\n"
+			"    -e : show instruction code for execution (and before optimization)\n"
+			"    -O0, -O1 : disable/enable optimization of instruction code (default -O1)\n"
+			"    -d <switch|threaded> : select instruction dispatch method of virtual machine\n"
+			"    -b <stack|register> : select virtual machine backend\n"
+			"    -n <N> : show frequencies of executed instruction N-grams (stack backend only)\n"
+			"    -j : compile repeat-loops of int/double arithmetic and math functions to native code (stack backend, x86-64 Linux only)\n"
+			"    -c <DIR> : reuse compiled code saved in DIR, keyed by the script contents (ignored with -p, -a, -e)\n"
 			"    -h : show (this) help\n"
 		);
 		fflush( stdout );
@@ -148,15 +260,33 @@ int main( int argc, const char* argv[] )
 			load_arg_t la;
 			la.dump_preprocessed_ = show_preprocessed_script;
 			la.dump_ast_ = show_ast;
-			load_script( env, script, &la );
+			la.dump_code_ = show_execute_code;
+			la.backend_ = ea.backend_;
+			la.optimize_level_ = optimize_level;
+			la.retain_ast_ = false;
 
-			if ( show_execute_code )
+			// コンパイルキャッシュ、中身を表示する時はコンパイルしないといけないので使わない
+			const bool is_cache_enabled = ( cache_directory != nullptr && !show_preprocessed_script && !show_ast && !show_execute_code );
+			if ( is_cache_enabled )
+			{
+				const auto hash = hash_script( script );
+				char cache_path[4096];
+				snprintf( cache_path, sizeof(cache_path), "%s/%016llx-%d%d.nhbc", cache_directory, hash, static_cast<int>( la.backend_ ), la.optimize_level_ );
+				if ( !load_program( env, cache_path, hash ) )
+				{
+					load_script( env, script, &la );
+					if ( !save_program( env, cache_path, hash ) )
+					{
+						fprintf( stderr, "WARNING : cannot write compile cache %s\n", cache_path );
+					}
+				}
+			}
+			else
 			{
-				printf( "====Instruction Code for execution\n" );
-				dump_code( env->execute_code_ );
+				load_script( env, script, &la );
 			}
 
-			execute( env );
+			execute( env, 0, &ea );
 			destroy_execute_environment( env );
 		}
 
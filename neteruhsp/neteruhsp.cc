@@ -7,9 +7,23 @@
 #include <ctime>
 #include <cmath>
 #include <cstdint>
+#include <climits>
 
 #include <cassert>
 #include <cstdarg>
+#include <initializer_list>
+
+#if NHSP_CONFIG_JIT && defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if NHSP_CONFIG_MAPPED_PROGRAM && ( defined(__unix__) || defined(__APPLE__) )
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #if NHSP_CONFIG_PERFORMANCE_TIMER
 #include <chrono>
@@ -21,6 +35,26 @@ namespace neteruhsp
 #define NHSP_UNUA(v)
 #define NHSP_UNUSE(v) ((void)v)
 
+// computed goto が使える時だけスレッデッドコードを有効にする
+#if NHSP_CONFIG_THREADED_DISPATCH && defined(__GNUC__)
+#define NHSP_THREADED_DISPATCH_AVAILABLE	(1)
+#else
+#define NHSP_THREADED_DISPATCH_AVAILABLE	(0)
+#endif
+
+// JIT が吐くのは System V ABI の x86-64 コード
+#if NHSP_CONFIG_JIT && defined(__x86_64__) && defined(__linux__)
+#define NHSP_JIT_AVAILABLE	(1)
+#else
+#define NHSP_JIT_AVAILABLE	(0)
+#endif
+
+#if NHSP_CONFIG_MAPPED_PROGRAM && ( defined(__unix__) || defined(__APPLE__) )
+#define NHSP_MAPPED_PROGRAM_AVAILABLE	(1)
+#else
+#define NHSP_MAPPED_PROGRAM_AVAILABLE	(0)
+#endif
+
 #define NHSP_MPI	(3.141592653589793238)
 
 //=============================================================================
@@ -147,6 +181,76 @@ char* create_string_from( double v )
 	return res;
 }
 
+// 値と refstr_ が持つ共有文字列、本体の直前に参照カウントを置くので読む側は普通の char* として扱える
+// 複数から参照されている間は書き換えない
+struct shared_string_header_t
+{
+	size_t		refcount_;
+};
+
+shared_string_header_t* shared_string_header( char* s )
+{
+	return reinterpret_cast<shared_string_header_t*>( s ) -1;
+}
+
+char* create_shared_string( size_t len )
+{
+	auto* const h = reinterpret_cast<shared_string_header_t*>( xmalloc( sizeof(shared_string_header_t) +len +1 ) );
+	h->refcount_ = 1;
+	return reinterpret_cast<char*>( h +1 );
+}
+
+char* create_shared_string( const char* s )
+{
+	const auto len = strlen( s );
+	auto res = create_shared_string( len );
+	memcpy( res, s, len +1 );
+	return res;
+}
+
+char* create_shared_string_from( int v )
+{
+	const auto len = snprintf( nullptr, 0, "%d", v );
+	auto res = create_shared_string( len );
+	sprintf( res, "%d", v );
+	return res;
+}
+
+char* create_shared_string_from( double v )
+{
+	const auto len = snprintf( nullptr, 0, "%lf", v );
+	auto res = create_shared_string( len );
+	sprintf( res, "%lf", v );
+	return res;
+}
+
+char* retain_shared_string( char* s )
+{
+	++shared_string_header( s )->refcount_;
+	return s;
+}
+
+void release_shared_string( char* s )
+{
+	auto* const h = shared_string_header( s );
+	assert( h->refcount_ > 0 );
+	if ( --h->refcount_ == 0 )
+	{ xfree( h ); }
+}
+
+bool is_shared_string_unique( char* s )
+{
+	return shared_string_header( s )->refcount_ == 1;
+}
+
+// 唯一の持ち主だけが呼べる、中身は len まで保たれる
+char* resize_shared_string( char* s, size_t len )
+{
+	assert( is_shared_string_unique( s ) );
+	auto* const h = reinterpret_cast<shared_string_header_t*>( xrealloc( shared_string_header( s ), sizeof(shared_string_header_t) +len +1 ) );
+	return reinterpret_cast<char*>( h +1 );
+}
+
 bool string_equal_igcase( const char* sl, const char* r, int len =-1 )
 {
 	const auto tol =[]( char c ) -> int
@@ -181,2176 +285,5628 @@ bool string_equal_igcase( const char* sl, const char* r, int len =-1 )
 }
 
 //=============================================================================
-// 値
-value_t* alloc_value()
-{
-#if NHSP_CONFIG_VALUE_ALLOCATION_CACHE
-	if ( s_value_allocation_cache_idx < static_cast<int>(MAX_VALUE_ALLOCATION_CACHE) )
-	{
-		return s_value_allocation_cache[s_value_allocation_cache_idx++];
-	}
+// 予約語
+// キーワード、演算子の別名、プリプロセッサ命令、システム変数、命令、関数の名前をまとめた表
+// 大文字小文字を区別しない完全ハッシュをコンパイル時に作り、一度の探索ですべての種類のタグを引く
+struct reserved_word_t
+{
+	const char*		word_;
+
+	// 種類ごとのタグ、その種類の語でなければ-1
+	int				keyword_;
+	int				token_shadow_;
+	int				preprocessor_;
+	int				sysvar_;
+	int				command_;
+	int				function_;
+};
+
+constexpr reserved_word_t s_reserved_words[] =
+{
+	//	語				キーワード			別名			プリプロセッサ	システム変数		命令					関数
+	{ "global",		KEYWORD_GLOBAL,		-1,				-1,				-1,				-1,					-1, },
+	{ "ctype",		KEYWORD_CTYPE,		-1,				-1,				-1,				-1,					-1, },
+	{ "end",		KEYWORD_END,		-1,				-1,				-1,				-1,					-1, },
+	{ "return",		KEYWORD_RETURN,		-1,				-1,				-1,				-1,					-1, },
+	{ "goto",		KEYWORD_GOTO,		-1,				-1,				-1,				-1,					-1, },
+	{ "gosub",		KEYWORD_GOSUB,		-1,				-1,				-1,				-1,					-1, },
+	{ "repeat",		KEYWORD_REPEAT,		-1,				-1,				-1,				-1,					-1, },
+	{ "loop",		KEYWORD_LOOP,		-1,				-1,				-1,				-1,					-1, },
+	{ "continue",	KEYWORD_CONTINUE,	-1,				-1,				-1,				-1,					-1, },
+	{ "break",		KEYWORD_BREAK,		-1,				-1,				-1,				-1,					-1, },
+	{ "if",			KEYWORD_IF,			-1,				PREPRO_IF,		-1,				-1,					-1, },
+	{ "else",		KEYWORD_ELSE,		-1,				-1,				-1,				-1,					-1, },
+
+	{ "not",		-1,					TOKEN_OP_NEQ,	-1,				-1,				-1,					-1, },
+	{ "and",		-1,					TOKEN_OP_BAND,	-1,				-1,				-1,					-1, },
+	{ "or",			-1,					TOKEN_OP_BOR,	-1,				-1,				-1,					-1, },
+	{ "xor",		-1,					TOKEN_OP_BXOR,	-1,				-1,				-1,					-1, },
+
+	{ "define",		-1,					-1,				PREPRO_DEFINE,	-1,				-1,					-1, },
+	{ "undef",		-1,					-1,				PREPRO_UNDEF,	-1,				-1,					-1, },
+	{ "ifdef",		-1,					-1,				PREPRO_IFDEF,	-1,				-1,					-1, },
+	{ "endif",		-1,					-1,				PREPRO_ENDIF,	-1,				-1,					-1, },
+	{ "enum",		-1,					-1,				PREPRO_ENUM,	-1,				-1,					-1, },
+
+	{ "cnt",		-1,					-1,				-1,				SYSVAR_CNT,		-1,					-1, },
+	{ "stat",		-1,					-1,				-1,				SYSVAR_STAT,	-1,					-1, },
+	{ "refdval",	-1,					-1,				-1,				SYSVAR_REFDVAL,	-1,					-1, },
+	{ "refstr",		-1,					-1,				-1,				SYSVAR_REFSTR,	-1,					-1, },
+	{ "strsize",	-1,					-1,				-1,				SYSVAR_STRSIZE,	-1,					-1, },
+	{ "looplev",	-1,					-1,				-1,				SYSVAR_LOOPLEV,	-1,					-1, },
+
+	{ "devterm",	-1,					-1,				-1,				-1,				COMMAND_DEVTERM,	-1, },
+	{ "dim",		-1,					-1,				-1,				-1,				COMMAND_DIM,		-1, },
+	{ "ddim",		-1,					-1,				-1,				-1,				COMMAND_DDIM,		-1, },
+	{ "sdim",		-1,					-1,				-1,				-1,				COMMAND_SDIM,		-1, },
+	{ "poke",		-1,					-1,				-1,				-1,				COMMAND_POKE,		-1, },
+	{ "wpoke",		-1,					-1,				-1,				-1,				COMMAND_WPOKE,		-1, },
+	{ "lpoke",		-1,					-1,				-1,				-1,				COMMAND_LPOKE,		-1, },
+	{ "mes",		-1,					-1,				-1,				-1,				COMMAND_MES,		-1, },
+	{ "input",		-1,					-1,				-1,				-1,				COMMAND_INPUT,		-1, },
+	{ "randomize",	-1,					-1,				-1,				-1,				COMMAND_RANDOMIZE,	-1, },
+#if NHSP_CONFIG_PERFORMANCE_TIMER
+	{ "bench",		-1,					-1,				-1,				-1,				COMMAND_BENCH,		-1, },
 #endif
-	return reinterpret_cast<value_t*>( xmalloc( sizeof(value_t) ) );
+
+	{ "int",		-1,					-1,				-1,				-1,				-1,					FUNCTION_INT, },
+	{ "double",		-1,					-1,				-1,				-1,				-1,					FUNCTION_DOUBLE, },
+	{ "str",		-1,					-1,				-1,				-1,				-1,					FUNCTION_STR, },
+	{ "peek",		-1,					-1,				-1,				-1,				-1,					FUNCTION_PEEK, },
+	{ "wpeek",		-1,					-1,				-1,				-1,				-1,					FUNCTION_WPEEK, },
+	{ "lpeek",		-1,					-1,				-1,				-1,				-1,					FUNCTION_LPEEK, },
+	{ "rnd",		-1,					-1,				-1,				-1,				-1,					FUNCTION_RND, },
+	{ "abs",		-1,					-1,				-1,				-1,				-1,					FUNCTION_ABS, },
+	{ "absf",		-1,					-1,				-1,				-1,				-1,					FUNCTION_ABSF, },
+	{ "deg2rad",	-1,					-1,				-1,				-1,				-1,					FUNCTION_DEG2RAD, },
+	{ "rad2deg",	-1,					-1,				-1,				-1,				-1,					FUNCTION_RAD2DEG, },
+	{ "sin",		-1,					-1,				-1,				-1,				-1,					FUNCTION_SIN, },
+	{ "cos",		-1,					-1,				-1,				-1,				-1,					FUNCTION_COS, },
+	{ "tan",		-1,					-1,				-1,				-1,				-1,					FUNCTION_TAN, },
+	{ "atan",		-1,					-1,				-1,				-1,				-1,					FUNCTION_ATAN, },
+	{ "expf",		-1,					-1,				-1,				-1,				-1,					FUNCTION_EXPF, },
+	{ "logf",		-1,					-1,				-1,				-1,				-1,					FUNCTION_LOGF, },
+	{ "powf",		-1,					-1,				-1,				-1,				-1,					FUNCTION_POWF, },
+	{ "sqrt",		-1,					-1,				-1,				-1,				-1,					FUNCTION_SQRT, },
+	{ "limit",		-1,					-1,				-1,				-1,				-1,					FUNCTION_LIMIT, },
+	{ "limitf",		-1,					-1,				-1,				-1,				-1,					FUNCTION_LIMITF, },
+	{ "strlen",		-1,					-1,				-1,				-1,				-1,					FUNCTION_STRLEN, },
+};
+
+constexpr int RESERVED_WORD_NUM = static_cast<int>( sizeof(s_reserved_words) /sizeof(*s_reserved_words) );
+constexpr int RESERVED_WORD_BUCKET_NUM = 512;// 2の冪
+static_assert( RESERVED_WORD_NUM < 128, "reserved word index must fit in signed char" );
+
+// 小文字にしてから FNV-1a、len が負なら終端まで
+constexpr unsigned int reserved_word_lower( char c )
+{
+	return static_cast<unsigned char>( c>='A' && c<='Z' ? c -'A' +'a' : c );
 }
 
-void free_value( value_t* p )
+constexpr unsigned int reserved_word_hash( const char* s, int len, unsigned int h )
 {
-#if NHSP_CONFIG_VALUE_ALLOCATION_CACHE
-	if ( s_value_allocation_cache_idx > 0 )
-	{
-		s_value_allocation_cache[--s_value_allocation_cache_idx] = p;
-		return;
-	}
-#endif
-	xfree( p );
+	return ( len==0 || *s=='\0' ) ? h : reserved_word_hash( s +1, len -1, ( h ^ reserved_word_lower( *s ) ) *16777619u );
 }
 
-void clear_value( value_t* t )
+constexpr int reserved_word_bucket( const char* s, int len, unsigned int seed )
 {
-	switch( t->type_ )
-	{
-		case VALUE_STRING:	destroy_string( t->svalue_ ); break;
-		default: break;
-	}
+	return static_cast<int>( ( reserved_word_hash( s, len, 2166136261u +seed *2654435761u ) >> 7 ) & (RESERVED_WORD_BUCKET_NUM -1) );
+}
+
+// 完全ハッシュになる種をコンパイル時に探す
+constexpr bool reserved_word_collides( unsigned int seed, int i, int j )
+{
+	return j >= RESERVED_WORD_NUM ? false :
+		( reserved_word_bucket( s_reserved_words[i].word_, -1, seed ) == reserved_word_bucket( s_reserved_words[j].word_, -1, seed ) || reserved_word_collides( seed, i, j +1 ) );
+}
+
+constexpr bool reserved_word_is_perfect( unsigned int seed, int i )
+{
+	return i >= RESERVED_WORD_NUM ? true : ( !reserved_word_collides( seed, i, i +1 ) && reserved_word_is_perfect( seed, i +1 ) );
+}
+
+constexpr unsigned int reserved_word_find_seed( unsigned int seed, int rest )
+{
+	return rest <= 0 ? ~0u : ( reserved_word_is_perfect( seed, 0 ) ? seed : reserved_word_find_seed( seed +1, rest -1 ) );
+}
+
+constexpr unsigned int s_reserved_word_seed = reserved_word_find_seed( 0, 256 );
+static_assert( s_reserved_word_seed != ~0u, "no perfect hash seed found for reserved words" );
+
+// バケットに入る語の番号、空なら-1
+constexpr int reserved_word_in_bucket( int bucket, int i )
+{
+	return i >= RESERVED_WORD_NUM ? -1 :
+		( reserved_word_bucket( s_reserved_words[i].word_, -1, s_reserved_word_seed ) == bucket ? i : reserved_word_in_bucket( bucket, i +1 ) );
+}
+
+template< int... Is >
+struct reserved_word_indices {};
+
+template< int N, int... Is >
+struct make_reserved_word_indices : make_reserved_word_indices< N -1, N -1, Is... > {};
+
+template< int... Is >
+struct make_reserved_word_indices< 0, Is... >
+{
+	typedef reserved_word_indices< Is... > type;
+};
+
+template< int... Is >
+const signed char* reserved_word_buckets( reserved_word_indices< Is... > )
+{
+	static constexpr signed char buckets[] = { static_cast<signed char>( reserved_word_in_bucket( Is, 0 ) )... };
+	return buckets;
+}
+
+// 予約語を引く、len が負なら s の終端まで
+const reserved_word_t* find_reserved_word( const char* s, int len =-1 )
+{
+	const auto buckets = reserved_word_buckets( make_reserved_word_indices< RESERVED_WORD_BUCKET_NUM >::type() );
+	const auto i = buckets[ reserved_word_bucket( s, len, s_reserved_word_seed ) ];
+	if ( i < 0 || !string_equal_igcase( s_reserved_words[i].word_, s, len ) )
+	{ return nullptr; }
+	return &s_reserved_words[i];
 }
 
 //=============================================================================
-// コード生成
-void code_checked_realloc( execute_environment_t* e, size_t size )
+// トークン
+// トークンの文字列を切り出す
+void fill_token_content( parse_context_t& c, token_t& t )
 {
-	const auto required = e->execute_code_->code_size_ +size;
-	if ( e->execute_code_->code_buffer_size_ <= required )
+	const auto script = c.tokenize_context_->script_;
+	switch( t.tag_ )
 	{
-		static const size_t default_size = 256;
-		if ( e->execute_code_->code_buffer_size_ < default_size )
+		case TOKEN_UNKNOWN:
 		{
-			e->execute_code_->code_buffer_size_ = default_size;
+			// 字句解析をやり直してエラーを出す
+			auto tc = *c.tokenize_context_;
+			tc.cursor_ = t.cursor_begin_;
+			tc.line_ = t.appear_line_;
+			token_t dummy;
+			get_token( tc, dummy, true );
+			assert( false );
+			break;
 		}
 
-		while( e->execute_code_->code_buffer_size_ <= required )
+		case TOKEN_STRING:
 		{
-			e->execute_code_->code_buffer_size_ *= 2;
+			// 両端の " は含めない
+			const auto len = static_cast<size_t>( t.cursor_end_ -t.cursor_begin_ -2 );
+			const auto text = alloc_token_text( c, len );
+			decode_token_string( text, script +t.cursor_begin_ +1, len );
+			t.content_ = text;
+			break;
 		}
 
-		const auto area_size = e->execute_code_->code_buffer_size_ *sizeof(code_t);
-		e->execute_code_->code_ = reinterpret_cast<code_t*>( xrealloc( e->execute_code_->code_, area_size ) );
-		if ( e->execute_code_->code_ == nullptr )
+		case TOKEN_IDENTIFIER:
 		{
-			raise_error( "仮想マシン用のコードバッファが確保できません" );
+			// 同じ綴りの識別子は同じ文字列を使う
+			const auto ident = script +t.cursor_begin_;
+			const auto len = t.cursor_end_ -t.cursor_begin_;
+			if ( c.identifiers_ == nullptr )
+			{
+				c.identifiers_ = create_name_table();
+			}
+			const auto entry = name_table_find( c.identifiers_, ident, len );
+			if ( entry >= 0 && strncmp( c.identifiers_->entries_[entry].name_, ident, len ) == 0 )
+			{
+				t.content_ = c.identifiers_->entries_[entry].name_;
+				break;
+			}
+
+			const auto text = alloc_token_text( c, len );
+			memcpy( text, ident, len );
+			text[len] = '\0';
+			if ( entry < 0 )
+			{
+				name_table_insert( c.identifiers_, text, nullptr );
+			}
+			t.content_ = text;
+			break;
+		}
+
+		default:
+		{
+			const auto len = t.cursor_end_ -t.cursor_begin_;
+			const auto text = alloc_token_text( c, len );
+			memcpy( text, script +t.cursor_begin_, len );
+			text[len] = '\0';
+			t.content_ = text;
+			break;
 		}
 	}
 }
 
-template< typename T >
-void code_write_block( execute_environment_t* e, const T block )
+// 番号のトークン、EOF より後は EOF が続いているものとして扱う
+token_t* get_parsed_token( parse_context_t& c, int idx )
 {
-	const auto size = sizeof(block);
-	const auto stride = size /sizeof(code_t) + (size %sizeof(code_t) == 0 ? 0 : 1);
-	code_checked_realloc( e, stride );
-	memcpy( e->execute_code_->code_ +e->execute_code_->code_size_, &block, size );
-	e->execute_code_->code_size_ += stride;
+	assert( idx >= 0 && c.token_num_ > 0 );
+	auto& t = c.tokens_[ idx < c.token_num_ ? idx : c.token_num_ -1 ];
+	if ( t.content_ == nullptr )
+	{
+		fill_token_content( c, t );
+	}
+	return &t;
 }
 
-void code_write( execute_environment_t* e, code_t code )
+// 字句解析の前に、トークン配列以外を初期化する
+void start_parse_context( parse_context_t* c, tokenize_context_t& t )
 {
-	code_checked_realloc( e, 1 );
-	e->execute_code_->code_[e->execute_code_->code_size_++] = code;
+	c->token_num_ = 0;
+	c->token_current_ = 0;
+	c->token_read_num_ = 0;
+	c->token_buffer_size_ = 16;
+	c->tokens_ = reinterpret_cast<token_t*>( xmalloc( sizeof(token_t) *c->token_buffer_size_ ) );
+	c->arena_ = create_arena( 256 );
+	c->ast_ = create_ast();
+	c->identifiers_ = nullptr;
+	c->tokenize_context_ = &t;
 }
 
-void code_write( execute_environment_t* e, void* ptr )
+// t の残りを EOF までトークン配列の末尾に足す
+// 読めないところがあれば、その位置を TOKEN_UNKNOWN として足して false を返す
+bool lex_tokens( parse_context_t& c, tokenize_context_t& t )
 {
-	code_write_block( e, ptr );
-}
+	for( ; ; )
+	{
+		if ( c.token_num_ >= c.token_buffer_size_ )
+		{
+			c.token_buffer_size_ *= 2;
+			c.tokens_ = reinterpret_cast<token_t*>( xrealloc( c.tokens_, sizeof(token_t) *c.token_buffer_size_ ) );
+		}
 
-template< typename T >
-int code_get_block( T& block, const code_t* codes, int pc )
-{
-	const auto size = sizeof(block);
-	const auto stride = size /sizeof(code_t) + (size %sizeof(code_t) == 0 ? 0 : 1);
-	memcpy( &block, reinterpret_cast<const void*>(codes +pc), sizeof(block) );
-	return stride;
+		auto& token = c.tokens_[ c.token_num_++ ];
+		const auto cursor = t.cursor_;
+		const auto line = t.line_;
+		if ( !get_token( t, token, false ) )
+		{
+			// 読まれた時にここから字句解析をやり直してエラーにする
+			token.tag_ = TOKEN_UNKNOWN;
+			token.content_ = nullptr;
+			token.cursor_begin_ = token.cursor_end_ = cursor;
+			token.appear_line_ = line;
+			return false;
+		}
+		if ( token.tag_ == TOKEN_EOF )
+		{ return true; }
+	}
 }
 
 //=============================================================================
-// 実行環境ユーティリティ
-label_node_t* search_label( execute_environment_t* e, const char* name )
+// 値
+value_t* alloc_value()
 {
-	auto node = e->label_table_->head_;
-	while( node != nullptr )
+#if NHSP_CONFIG_VALUE_ALLOCATION_CACHE
+	if ( s_value_allocation_cache_idx < static_cast<int>(MAX_VALUE_ALLOCATION_CACHE) )
 	{
-		const auto label = reinterpret_cast<label_node_t*>( node->value_ );
-		if ( string_equal_igcase( label->name_, name ) )
-		{ return label; }
-
-		node = node->next_;
+		return s_value_allocation_cache[s_value_allocation_cache_idx++];
 	}
-	return nullptr;
+#endif
+	return reinterpret_cast<value_t*>( xmalloc( sizeof(value_t) ) );
 }
 
-//=============================================================================
-// コマンド実体
-void command_devterm( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void free_value( value_t* p )
 {
-	stack_pop( s->stack_, arg_num );
+#if NHSP_CONFIG_VALUE_ALLOCATION_CACHE
+	if ( s_value_allocation_cache_idx > 0 )
+	{
+		s_value_allocation_cache[--s_value_allocation_cache_idx] = p;
+		return;
+	}
+#endif
+	xfree( p );
 }
 
-void command_dim( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void clear_value( value_t* t )
 {
-	if ( arg_num < 2 )
-	{
-		raise_error( "dim：引数がたりません" );
-	}
-	if ( arg_num > 2 )
+	switch( t->type_ )
 	{
-		raise_error( "dim：引数が多すぎます、配列変数は1次元までしかサポートしていません" );
+		case VALUE_STRING:
+			if ( !t->is_borrowed_ )
+			{ release_shared_string( t->svalue_ ); }
+			break;
+		default: break;
 	}
+}
 
-	const auto arg_start = -arg_num;
-	const auto v = stack_peek( s->stack_, arg_start );
-	if ( v->type_ != VALUE_VARIABLE )
-	{
-		raise_error( "dim：対象が変数ではありません" );
-	}
-	if ( v->index_ > 0 )
+void copy_value( value_t* to, const value_t& v )
+{
+	to->type_ = v.type_;
+	switch( v.type_ )
 	{
-		raise_error( "dim：対象の変数が配列として指定されています" );
+		case VALUE_INT:			to->ivalue_ =v.ivalue_; break;
+		case VALUE_DOUBLE:		to->dvalue_ =v.dvalue_; break;
+		case VALUE_STRING:
+			// 借りている文字列は借りたまま、共有文字列は参照を増やすだけで複製する
+			to->is_borrowed_ =v.is_borrowed_;
+			to->svalue_ =( v.is_borrowed_ ? v.svalue_ : retain_shared_string(v.svalue_) );
+			break;
+		case VALUE_VARIABLE:	to->variable_ =v.variable_; to->index_ =v.index_; break;
+		default: raise_error( "中身が入ってない値をコピーして作ろうとしました@@ ptr=%p", &v );
 	}
+}
 
-	const auto n = stack_peek( s->stack_, arg_start +1 );
-	const auto num = value_calc_int( *n );
-	if ( num <= 0 )
+// 二項演算の右辺を左辺の型の表現で取り出す、文字列の左辺以外では一時値を作らない
+// R は右辺の（変数なら要素の）型
+template< value_tag R >
+const void* value_operand_ptr( const value_t& r )
+{
+	if ( r.type_ == VALUE_VARIABLE )
+	{ return variable_data_ptr( *r.variable_, r.index_ ); }
+	switch( R )
 	{
-		raise_error( "dim：0個以下の要素は確保できません" );
+		case VALUE_INT:		return &r.ivalue_;
+		case VALUE_DOUBLE:	return &r.dvalue_;
+		default: break;
 	}
-
-	prepare_variable( v->variable_, VALUE_INT, 64, num );
-
-	stack_pop( s->stack_, arg_num );
+	return r.svalue_;
 }
 
-void command_ddim( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+template< value_tag L, value_tag R >
+struct value_operand;
+
+template< value_tag R >
+struct value_operand<VALUE_INT, R>
 {
-	if ( arg_num < 2 )
-	{
-		raise_error( "ddim：引数がたりません" );
-	}
-	if ( arg_num > 2 )
+	static int get( const value_t& r )
 	{
-		raise_error( "ddim：引数が多すぎます、配列変数は1次元までしかサポートしていません" );
+		const auto* const p = value_operand_ptr<R>( r );
+		switch( R )
+		{
+			case VALUE_INT:		return *reinterpret_cast<const int*>( p );
+			case VALUE_DOUBLE:	return static_cast<int>( *reinterpret_cast<const double*>( p ) );
+			default: break;
+		}
+		return atoi( reinterpret_cast<const char*>( p ) );
 	}
+};
 
-	const auto arg_start = -arg_num;
-	const auto v = stack_peek( s->stack_, arg_start );
-	if ( v->type_ != VALUE_VARIABLE )
-	{
-		raise_error( "ddim：対象が変数ではありません" );
-	}
-	if ( v->index_ > 0 )
+template< value_tag R >
+struct value_operand<VALUE_DOUBLE, R>
+{
+	static double get( const value_t& r )
 	{
-		raise_error( "ddim：対象の変数が配列として指定されています" );
+		const auto* const p = value_operand_ptr<R>( r );
+		switch( R )
+		{
+			case VALUE_INT:		return static_cast<double>( *reinterpret_cast<const int*>( p ) );
+			case VALUE_DOUBLE:	return *reinterpret_cast<const double*>( p );
+			default: break;
+		}
+		return atof( reinterpret_cast<const char*>( p ) );
 	}
+};
 
-	const auto n = stack_peek( s->stack_, arg_start +1 );
-	const auto num = value_calc_int( *n );
-	if ( num <= 0 )
+// 左辺が文字列の時だけ、必要なら文字列に変換する（変換した時は owned に入る）
+template< value_tag R >
+struct value_operand<VALUE_STRING, R>
+{
+	static const char* get( const value_t& r, char*& owned )
 	{
-		raise_error( "ddim：0個以下の要素は確保できません" );
+		const auto* const p = value_operand_ptr<R>( r );
+		switch( R )
+		{
+			case VALUE_INT:		owned = create_string_from( *reinterpret_cast<const int*>( p ) ); return owned;
+			case VALUE_DOUBLE:	owned = create_string_from( *reinterpret_cast<const double*>( p ) ); return owned;
+			default: break;
+		}
+		return reinterpret_cast<const char*>( p );
 	}
+};
 
-	prepare_variable( v->variable_, VALUE_DOUBLE, 64, num );
-
-	stack_pop( s->stack_, arg_num );
-}
-
-void command_sdim( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+// 演算の本体、Op は OPERATOR_BOR〜OPERATOR_MOD
+template< int Op >
+struct value_binary_operation
 {
-	if ( arg_num < 2 )
-	{
-		raise_error( "sdim：引数がたりません" );
-	}
-	if ( arg_num > 3 )
+	static void apply( value_t* v, int r )
 	{
-		raise_error( "sdim：引数が多すぎます、配列変数は1次元までしかサポートしていません" );
+		auto& l = v->ivalue_;
+		switch( Op )
+		{
+			case OPERATOR_BOR:	l |= r; break;
+			case OPERATOR_BAND:	l &= r; break;
+			case OPERATOR_BXOR:	l ^= r; break;
+			case OPERATOR_EQ:	l = ( l==r ? 1 : 0 ); break;
+			case OPERATOR_NEQ:	l = ( l!=r ? 1 : 0 ); break;
+			case OPERATOR_GT:	l = ( l>r ? 1 : 0 ); break;
+			case OPERATOR_GTOE:	l = ( l>=r ? 1 : 0 ); break;
+			case OPERATOR_LT:	l = ( l<r ? 1 : 0 ); break;
+			case OPERATOR_LTOE:	l = ( l<=r ? 1 : 0 ); break;
+			case OPERATOR_ADD:	l += r; break;
+			case OPERATOR_SUB:	l -= r; break;
+			case OPERATOR_MUL:	l *= r; break;
+			case OPERATOR_DIV:
+				if ( r == 0 )
+				{
+					raise_error( "0除算が行われました" );
+				}
+				l /= r;
+				break;
+			case OPERATOR_MOD:
+				if ( r == 0 )
+				{
+					raise_error( "0剰余が行われました" );
+				}
+				l %= r;
+				break;
+			default: assert( false ); break;
+		}
 	}
 
-	const auto arg_start = -arg_num;
-	const auto v = stack_peek( s->stack_, arg_start );
-	if ( v->type_ != VALUE_VARIABLE )
+	static void apply( value_t* v, double r )
 	{
-		raise_error( "sdim：対象が変数ではありません" );
+		auto& l = v->dvalue_;
+		switch( Op )
+		{
+			case OPERATOR_BOR:	raise_error( "浮動小数点同士の|演算子は挙動が定義されていません" ); break;
+			case OPERATOR_BAND:	raise_error( "浮動小数点同士の&演算子は挙動が定義されていません" ); break;
+			case OPERATOR_BXOR:	raise_error( "浮動小数点同士の^演算子は挙動が定義されていません" ); break;
+			case OPERATOR_EQ:	value_set( v, l==r ? 1 : 0 ); break;
+			case OPERATOR_NEQ:	value_set( v, l!=r ? 1 : 0 ); break;
+			case OPERATOR_GT:	value_set( v, l>r ? 1 : 0 ); break;
+			case OPERATOR_GTOE:	value_set( v, l>=r ? 1 : 0 ); break;
+			case OPERATOR_LT:	value_set( v, l<r ? 1 : 0 ); break;
+			case OPERATOR_LTOE:	value_set( v, l<=r ? 1 : 0 ); break;
+			case OPERATOR_ADD:	l += r; break;
+			case OPERATOR_SUB:	l -= r; break;
+			case OPERATOR_MUL:	l *= r; break;
+			case OPERATOR_DIV:
+				if ( r == 0.0 )
+				{
+					raise_error( "0.0除算が行われました" );
+				}
+				l /= r;
+				break;
+			case OPERATOR_MOD:
+				if ( r == 0.0 )
+				{
+					raise_error( "0.0除算が行われました" );
+				}
+				l = std::fmod( l, r );
+				break;
+			default: assert( false ); break;
+		}
 	}
-	if ( v->index_ > 0 )
+
+	static void apply( value_t* v, const char* r )
 	{
-		raise_error( "sdim：対象の変数が配列として指定されています" );
+		switch( Op )
+		{
+			case OPERATOR_BOR:	raise_error( "文字列同士の|演算子は挙動が定義されていません" ); break;
+			case OPERATOR_BAND:	raise_error( "文字列同士の&演算子は挙動が定義されていません" ); break;
+			case OPERATOR_BXOR:	raise_error( "文字列同士の^演算子は挙動が定義されていません" ); break;
+			case OPERATOR_EQ:	value_set( v, strcmp( v->svalue_, r )==0 ? 1 : 0 ); break;
+			case OPERATOR_NEQ:	value_set( v, strcmp( v->svalue_, r )!=0 ? 1 : 0 ); break;
+			case OPERATOR_GT:	raise_error( "文字列同士の>演算子は挙動が定義されていません" ); break;
+			case OPERATOR_GTOE:	raise_error( "文字列同士の>=演算子は挙動が定義されていません" ); break;
+			case OPERATOR_LT:	raise_error( "文字列同士の<演算子は挙動が定義されていません" ); break;
+			case OPERATOR_LTOE:	raise_error( "文字列同士の<=演算子は挙動が定義されていません" ); break;
+			case OPERATOR_ADD:
+			{
+				const auto llen = strlen( v->svalue_ );
+				const auto rlen = strlen( r );
+				// 自分だけが持っている文字列ならその場で伸ばす、共有や借り物なら書き換えずに作り直す
+				if ( !v->is_borrowed_ && is_shared_string_unique( v->svalue_ ) )
+				{
+					v->svalue_ = resize_shared_string( v->svalue_, llen +rlen );
+					memcpy( v->svalue_ +llen, r, rlen +1 );
+					break;
+				}
+				auto s = create_shared_string( llen +rlen );
+				memcpy( s, v->svalue_, llen );
+				memcpy( s +llen, r, rlen +1 );
+				if ( !v->is_borrowed_ )
+				{ release_shared_string( v->svalue_ ); }
+				v->svalue_ = s;
+				v->is_borrowed_ = false;
+				break;
+			}
+			case OPERATOR_SUB:	raise_error( "文字列同士の-演算子は挙動が定義されていません" ); break;
+			case OPERATOR_MUL:	raise_error( "文字列同士の*演算子は挙動が定義されていません" ); break;
+			case OPERATOR_DIV:	raise_error( "文字列同士の/演算子は挙動が定義されていません" ); break;
+			case OPERATOR_MOD:	raise_error( "文字列同士の\\演算子は挙動が定義されていません" ); break;
+			default: assert( false ); break;
+		}
 	}
+};
 
-	const auto g = stack_peek( s->stack_, arg_start +1 );
-	const auto granule = value_calc_int( *g );
-
-	const auto num = ( arg_num>2 ? value_calc_int( *stack_peek( s->stack_, arg_start +2 ) ) : 1 );
-	if ( granule <= 0 )
+template< int Op, value_tag L, value_tag R >
+struct value_binary_kernel
+{
+	static void apply( value_t* v, const value_t& r )
 	{
-		raise_error( "sdim：0以下のサイズの文字列は作れません" );
+		value_binary_operation<Op>::apply( v, value_operand<L, R>::get( r ) );
 	}
-	if ( num <= 0 )
+};
+
+template< int Op, value_tag R >
+struct value_binary_kernel<Op, VALUE_STRING, R>
+{
+	static void apply( value_t* v, const value_t& r )
 	{
-		raise_error( "sdim：0個以下の要素は確保できません" );
+		char* owned = nullptr;
+		const auto* const str = value_operand<VALUE_STRING, R>::get( r, owned );
+		value_binary_operation<Op>::apply( v, str );
+		if ( owned != nullptr )
+		{
+			destroy_string( owned );
+		}
 	}
+};
 
-	prepare_variable( v->variable_, VALUE_STRING, granule, num );
+// 左辺と右辺の型の組で引く表、左辺の型で結果の型が決まる
+template< int Op >
+void value_binary_dispatch( value_t* v, const value_t& r )
+{
+	typedef void (*kernel_t)( value_t* v, const value_t& r );
+	static const kernel_t s_kernels[3][3] =
+	{
+		{ &value_binary_kernel<Op, VALUE_INT, VALUE_INT>::apply, &value_binary_kernel<Op, VALUE_INT, VALUE_DOUBLE>::apply, &value_binary_kernel<Op, VALUE_INT, VALUE_STRING>::apply, },
+		{ &value_binary_kernel<Op, VALUE_DOUBLE, VALUE_INT>::apply, &value_binary_kernel<Op, VALUE_DOUBLE, VALUE_DOUBLE>::apply, &value_binary_kernel<Op, VALUE_DOUBLE, VALUE_STRING>::apply, },
+		{ &value_binary_kernel<Op, VALUE_STRING, VALUE_INT>::apply, &value_binary_kernel<Op, VALUE_STRING, VALUE_DOUBLE>::apply, &value_binary_kernel<Op, VALUE_STRING, VALUE_STRING>::apply, },
+	};
+	static_assert( VALUE_DOUBLE == VALUE_INT +1 && VALUE_STRING == VALUE_INT +2, "value_tag order" );
 
-	stack_pop( s->stack_, arg_num );
+	const auto lt = v->type_;
+	const auto rt = value_get_primitive_tag( r );
+	assert( lt >= VALUE_INT && lt <= VALUE_STRING );
+	assert( rt >= VALUE_INT && rt <= VALUE_STRING );
+	s_kernels[lt -VALUE_INT][rt -VALUE_INT]( v, r );
 }
 
-void command_poke( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+// 複合代入の右辺を変数の型に合わせる、型が同じならそのまま使い一時値は作らない
+// 変換した時は tmp に入るので、使い終わったら clear_value すること
+const value_t* prepare_assign_operand( value_tag to, const value_t& v, value_t& tmp )
 {
-	if ( arg_num < 3 )
-	{
-		raise_error( "poke：引数がたりません" );
-	}
-	if ( arg_num > 3 )
+	tmp.type_ = VALUE_NONE;
+	if ( v.type_ == to )
+	{ return &v; }
+
+	switch( to )
 	{
-		raise_error( "poke：引数が多すぎます、配列変数は1次元までしかサポートしていません" );
+		case VALUE_INT:		tmp.ivalue_ = value_calc_int( v ); break;
+		case VALUE_DOUBLE:	tmp.dvalue_ = value_calc_double( v ); break;
+		case VALUE_STRING:	tmp.svalue_ = value_calc_string( v ); tmp.is_borrowed_ = false; break;
+		default: assert( false ); break;
 	}
+	tmp.type_ = to;
+	return &tmp;
+}
 
-	const auto arg_start = -arg_num;
-	const auto v = stack_peek( s->stack_, arg_start );
-	if ( v->type_ != VALUE_VARIABLE )
+//=============================================================================
+// スタック
+value_t* stack_push_slot( value_stack_t* st )
+{
+	if ( st->top_+1 > st->max_ )
 	{
-		raise_error( "poke：対象が変数ではありません" );
-		return;
+		st->max_ = st->max_ *2;// 貪欲
+		st->stack_ = reinterpret_cast<value_t*>( xrealloc( st->stack_, sizeof(value_t) *st->max_ ) );
 	}
-	if ( v->index_ > 0 )
+
+	return &st->stack_[ st->top_++ ];
+}
+
+//=============================================================================
+// コード生成
+void code_checked_realloc( code_container_t* c, size_t size )
+{
+	const auto required = c->code_size_ +size;
+	if ( c->code_buffer_size_ <= required )
 	{
-		raise_error( "poke：対象の変数が配列として指定されています" );
-		return;
+		static const size_t default_size = 256;
+		if ( c->code_buffer_size_ < default_size )
+		{
+			c->code_buffer_size_ = default_size;
+		}
+
+		while( c->code_buffer_size_ <= required )
+		{
+			c->code_buffer_size_ *= 2;
+		}
+
+		assert( !c->is_readonly_ );
+		const auto area_size = c->code_buffer_size_ *sizeof(code_t);
+		c->code_ = reinterpret_cast<code_t*>( xrealloc( c->code_, area_size ) );
+		if ( c->code_ == nullptr )
+		{
+			raise_error( "仮想マシン用のコードバッファが確保できません" );
+		}
 	}
+}
 
-	auto* const var = v->variable_;
+static_assert( MAX_OPERATOR <= CODE_OPERATOR_MASK +1, "operators must fit in CODE_OPERATOR_BITS" );
 
-	const auto i = stack_peek( s->stack_, arg_start +1 );
-	const auto byte_idx = value_calc_int( *i );
+// スタックマシンの命令語の命令とオペランド
+int code_operator( code_t code )
+{
+	return code & CODE_OPERATOR_MASK;
+}
 
-	const auto wp = stack_peek( s->stack_, arg_start +2 );
-	const auto w = value_calc_int( *wp );
+int code_operand( code_t code )
+{
+	return code >> CODE_OPERATOR_BITS;// 算術シフトで符号を戻す
+}
 
-	if ( byte_idx<0 || var->data_size_<( byte_idx + 1 ) )
+bool is_code_operand_packable( int operand )
+{
+	return operand >= MIN_CODE_OPERAND && operand <= MAX_CODE_OPERAND;
+}
+
+code_t code_pack( int op, int operand )
+{
+	assert( op >= 0 && op < MAX_OPERATOR );
+	if ( !is_code_operand_packable( operand ) )
 	{
-		raise_error( "poke：対象の変数の範囲外を書き込もうとしています@@ %s(size=%d, idx=%d)", var->name_, var->data_size_, byte_idx );
-		return;
+		raise_error( "命令のオペランドが大きすぎます、スクリプトを分割してください@@ %d", operand );
 	}
+	return static_cast<code_t>( static_cast<unsigned int>( operand ) << CODE_OPERATOR_BITS ) | op;
+}
 
-	auto* const dp = reinterpret_cast<char*>( var->data_ );
-	dp[byte_idx] = static_cast<char>( w );
+void code_write( code_container_t* c, code_t code )
+{
+	code_checked_realloc( c, 1 );
+	c->code_[c->code_size_++] = code;
+}
 
-	stack_pop( s->stack_, arg_num );
+void code_write( execute_environment_t* e, code_t code )
+{
+	code_write( e->execute_code_, code );
 }
 
-void command_wpoke( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void code_write_operator( execute_environment_t* e, int op, int operand )
 {
-	if ( arg_num < 3 )
-	{
-		raise_error( "wpoke：引数がたりません" );
-	}
-	if ( arg_num > 3 )
-	{
-		raise_error( "wpoke：引数が多すぎます、配列変数は1次元までしかサポートしていません" );
-	}
+	code_write( e, code_pack( op, operand ) );
+}
 
-	const auto arg_start = -arg_num;
-	const auto v = stack_peek( s->stack_, arg_start );
-	if ( v->type_ != VALUE_VARIABLE )
-	{
-		raise_error( "wpoke：対象が変数ではありません" );
-		return;
-	}
-	if ( v->index_ > 0 )
+// 後から決まるオペランドを埋める
+void code_patch_operand( code_container_t* c, int pc, int operand )
+{
+	c->code_[ pc ] = code_pack( code_operator( c->code_[ pc ] ), operand );
+}
+
+// コマンドと関数の呼び出しは番号と引数の数を一つのオペランドにまとめる
+static const int CODE_CALL_ARG_SHIFT = 8;
+
+int code_call_operand( int callee, int arg_num )
+{
+	assert( callee >= 0 && callee < ( 1 << CODE_CALL_ARG_SHIFT ) );
+	if ( arg_num > ( MAX_CODE_OPERAND >> CODE_CALL_ARG_SHIFT ) )
 	{
-		raise_error( "wpoke：対象の変数が配列として指定されています" );
-		return;
+		raise_error( "引数が多すぎます@@ %d", arg_num );
 	}
+	return callee | ( arg_num << CODE_CALL_ARG_SHIFT );
+}
 
-	auto* const var = v->variable_;
+int code_call_callee( int operand )
+{
+	return operand & ( ( 1 << CODE_CALL_ARG_SHIFT ) -1 );
+}
 
-	const auto i = stack_peek( s->stack_, arg_start +1 );
-	const auto byte_idx = value_calc_int( *i );
+int code_call_arg_num( int operand )
+{
+	return operand >> CODE_CALL_ARG_SHIFT;
+}
 
-	const auto wp = stack_peek( s->stack_, arg_start +2 );
-	const std::int16_t w = static_cast<std::int16_t>( value_calc_int( *wp ) );
+//=============================================================================
+// 定数プール
+constant_pool_t* create_constant_pool()
+{
+	auto* const res = reinterpret_cast<constant_pool_t*>( xmalloc( sizeof(constant_pool_t) ) );
+	res->constants_ = nullptr;
+	res->constant_num_ = 0;
+	res->constant_buffer_size_ = 0;
+	return res;
+}
 
-	if ( byte_idx<0 || var->data_size_<( byte_idx + 2 ) )
+void destroy_constant_pool( constant_pool_t* pool )
+{
+	if ( pool->constants_ != nullptr )
+	{ xfree( pool->constants_ ); }
+	xfree( pool );
+}
+
+int constant_pool_add( constant_pool_t* pool, const constant_t& constant )
+{
+	if ( pool->constant_num_ >= pool->constant_buffer_size_ )
 	{
-		raise_error( "wpoke：対象の変数の範囲外を書き込もうとしています@@ %s(size=%d, idx=%d)", var->name_, var->data_size_, byte_idx );
-		return;
+		pool->constant_buffer_size_ = ( pool->constant_buffer_size_ == 0 ? 64 : pool->constant_buffer_size_ *2 );
+		pool->constants_ = reinterpret_cast<constant_t*>( xrealloc( pool->constants_, sizeof(constant_t) *pool->constant_buffer_size_ ) );
 	}
+	pool->constants_[ pool->constant_num_ ] = constant;
+	return pool->constant_num_++;
+}
 
-	auto* const dp = reinterpret_cast<char*>( var->data_ );
-	memcpy( dp + byte_idx, &w, 2 );
+int add_int_constant( execute_environment_t* e, int v )
+{
+	// 残りのバイトもそのままイメージに書き出すので0にしておく
+	constant_t c;
+	memset( &c, 0, sizeof(c) );
+	c.ivalue_ = v;
+	return constant_pool_add( e->constant_pool_, c );
+}
 
-	stack_pop( s->stack_, arg_num );
+int add_double_constant( execute_environment_t* e, double v )
+{
+	constant_t c;
+	c.dvalue_ = v;
+	return constant_pool_add( e->constant_pool_, c );
 }
 
-void command_lpoke( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+// 複合命令にまとめられるかの判定用
+const ast_node_t* unwrap_expression( const ast_t* ast, const ast_node_t* n )
 {
-	if ( arg_num < 3 )
-	{
-		raise_error( "lpoke：引数がたりません" );
-	}
-	if ( arg_num > 3 )
+	while( n->tag_ == NODE_EXPRESSION && n->child_num_ > 0 )
 	{
-		raise_error( "lpoke：引数が多すぎます、配列変数は1次元までしかサポートしていません" );
+		n = ast_child( ast, n, 0 );
 	}
+	return n;
+}
 
-	const auto arg_start = -arg_num;
-	const auto v = stack_peek( s->stack_, arg_start );
-	if ( v->type_ != VALUE_VARIABLE )
+// 文字列リテラルはパーサーと一緒に解放されるので、実行環境のリテラルプールに複製して、その位置を定数にする
+int add_string_constant( execute_environment_t* e, const char* s )
+{
+	auto* const pool = e->literal_pool_;
+	const auto position = pool->cursor_;
+	string_buffer_append( pool, s, static_cast<int>( strlen( s ) ) +1 );
+	return add_int_constant( e, position );
+}
+
+const char* literal_base( const execute_environment_t* e )
+{
+	if ( e->image_ != nullptr )
 	{
-		raise_error( "lpoke：対象が変数ではありません" );
-		return;
+		program_header_t header;
+		memcpy( &header, e->image_->data_, sizeof(header) );
+		return e->image_->data_ +header.literal_offset_;
 	}
-	if ( v->index_ > 0 )
+	return e->literal_pool_->buffer_;
+}
+
+const constant_t* constant_base( const execute_environment_t* e )
+{
+	if ( e->image_ != nullptr )
 	{
-		raise_error( "lpoke：対象の変数が配列として指定されています" );
-		return;
+		program_header_t header;
+		memcpy( &header, e->image_->data_, sizeof(header) );
+		return reinterpret_cast<const constant_t*>( e->image_->data_ +header.constant_offset_ );
 	}
+	return e->constant_pool_->constants_;
+}
 
-	auto* const var = v->variable_;
-
-	const auto i = stack_peek( s->stack_, arg_start +1 );
-	const auto byte_idx = value_calc_int( *i );
-
-	const auto wp = stack_peek( s->stack_, arg_start +2 );
-	const std::int32_t w = static_cast<std::int32_t>( value_calc_int( *wp ) );
+// 添え字なしの変数参照なら、その変数のスロット番号を返す（なければ-1）
+int query_scalar_variable( execute_environment_t* e, const ast_t* ast, const ast_node_t* n )
+{
+	n = unwrap_expression( ast, n );
+	if ( n->child_num_ > 0 )
+	{ return -1; }
 
-	if ( byte_idx<0 || var->data_size_<( byte_idx + 4 ) )
+	const auto name = n->token_->content_;
+	switch( n->tag_ )
 	{
-		raise_error( "lpoke：対象の変数の範囲外を書き込もうとしています@@ %s(size=%d, idx=%d)", var->name_, var->data_size_, byte_idx );
-		return;
+		case NODE_VARIABLE:
+			return search_variable_slot( e->variable_table_, name );
+		case NODE_IDENTIFIER_EXPR:
+		{
+			const auto w = find_reserved_word( name );
+			if ( w != nullptr && ( w->function_ >= 0 || w->sysvar_ >= 0 ) )
+			{ return -1; }
+			return search_variable_slot( e->variable_table_, name );
+		}
+		default: break;
 	}
+	return -1;
+}
 
-	auto* const dp = reinterpret_cast<char*>( var->data_ );
-	memcpy( dp + byte_idx, &w, 4 );
-
-	stack_pop( s->stack_, arg_num );
+bool query_int_literal( const ast_t* ast, const ast_node_t* n, int& v )
+{
+	n = unwrap_expression( ast, n );
+	if ( n->tag_ != NODE_PRIMITIVE_VALUE || n->token_->tag_ != TOKEN_INTEGER )
+	{ return false; }
+	v = atoi( n->token_->content_ );
+	return true;
 }
 
-void command_mes( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+// 命令語（オペランドを含んでいてもよい）から始まる命令の語数
+int code_operator_size( code_t code )
 {
-	if ( arg_num <= 0 )
+	const auto op = code_operator( code );
+	switch( op )
 	{
-		raise_error( "mes：引数がたりません" );
+		case OPERATOR_INC_VAR:			return 2;
+		case OPERATOR_CMP_JUMP_IF_FALSE:	return 2;
+		case OPERATOR_CMP_JUMP_IF_FALSE_INT_INT:	return 2;
+		default: break;
 	}
-	if ( arg_num > 1 )
-	{
-		raise_error( "mes：引数が多すぎます@@ %d個渡されました", arg_num );
+	assert( op>=0 && op<MAX_OPERATOR );
+	return 1;
+}
+
+// FNV-1a
+unsigned long long hash_bytes( const void* data, size_t size )
+{
+	const auto* const p = reinterpret_cast<const unsigned char*>( data );
+	unsigned long long h = 14695981039346656037ULL;
+	for( size_t i=0; i<size; ++i )
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+int register_code_operator_size( int op )
+{
+	switch( op )
+	{
+		case REGISTER_OPERATOR_LOAD_INT:		return 3;
+		case REGISTER_OPERATOR_LOAD_DOUBLE:		return 3;
+		case REGISTER_OPERATOR_LOAD_STRING:		return 3;
+		case REGISTER_OPERATOR_LOAD_VARIABLE:	return 4;
+		case REGISTER_OPERATOR_LOAD_SYSVAR:		return 3;
+		case REGISTER_OPERATOR_ASSIGN:
+		case REGISTER_OPERATOR_ADD_ASSIGN:
+		case REGISTER_OPERATOR_SUB_ASSIGN:
+		case REGISTER_OPERATOR_MUL_ASSIGN:
+		case REGISTER_OPERATOR_DIV_ASSIGN:
+		case REGISTER_OPERATOR_MOD_ASSIGN:
+		case REGISTER_OPERATOR_BOR_ASSIGN:
+		case REGISTER_OPERATOR_BAND_ASSIGN:
+		case REGISTER_OPERATOR_BXOR_ASSIGN:		return 4;
+		case REGISTER_OPERATOR_BOR:
+		case REGISTER_OPERATOR_BAND:
+		case REGISTER_OPERATOR_BXOR:
+		case REGISTER_OPERATOR_EQ:
+		case REGISTER_OPERATOR_NEQ:
+		case REGISTER_OPERATOR_GT:
+		case REGISTER_OPERATOR_GTOE:
+		case REGISTER_OPERATOR_LT:
+		case REGISTER_OPERATOR_LTOE:
+		case REGISTER_OPERATOR_ADD:
+		case REGISTER_OPERATOR_SUB:
+		case REGISTER_OPERATOR_MUL:
+		case REGISTER_OPERATOR_DIV:
+		case REGISTER_OPERATOR_MOD:				return 4;
+		case REGISTER_OPERATOR_UNARY_MINUS:		return 3;
+		case REGISTER_OPERATOR_IF:				return 3;
+		case REGISTER_OPERATOR_REPEAT:			return 3;
+		case REGISTER_OPERATOR_GOSUB:			return 2;
+		case REGISTER_OPERATOR_GOTO:			return 2;
+		case REGISTER_OPERATOR_COMMAND:			return 4;
+		case REGISTER_OPERATOR_FUNCTION:		return 5;
+		case REGISTER_OPERATOR_JUMP_RELATIVE:	return 2;
+		case REGISTER_OPERATOR_RETURN:			return 2;
+		default: break;
 	}
+	assert( op>=0 && op<MAX_REGISTER_OPERATOR );
+	return 1;
+}
 
-	const auto m = stack_peek( s->stack_ );
-	value_isolate( *m );
-	if ( m->type_ != VALUE_STRING )
+//=============================================================================
+// 実行環境ユーティリティ
+label_node_t* search_label( execute_environment_t* e, const char* name )
+{
+	const auto entry = name_table_find( e->label_table_, name );
+	if ( entry < 0 )
+	{ return nullptr; }
+	return reinterpret_cast<label_node_t*>( e->label_table_->entries_[entry].value_ );
+}
+
+// 生成中のコードはラベルをラベル表の番号で指し、リンクで位置に置き換える、ラベルは削除しないので番号は変わらない
+int search_label_index( execute_environment_t* e, const char* name )
+{
+	return name_table_find( e->label_table_, name );
+}
+
+const label_node_t* label_at( const execute_environment_t* e, int index )
+{
+	assert( index >= 0 && index < e->label_table_->entry_num_ );
+	return reinterpret_cast<const label_node_t*>( e->label_table_->entries_[index].value_ );
+}
+
+// ダンプ用、その位置を指すラベルの名前（なければ nullptr）
+const char* search_label_name( const execute_environment_t* e, int position, bool is_register )
+{
+	const auto* const table = e->label_table_;
+	for( int i=0; i<table->entry_num_; ++i )
 	{
-		raise_error( "mes：引数が文字列型ではありません" );
+		const auto* const label = reinterpret_cast<const label_node_t*>( table->entries_[i].value_ );
+		if ( label != nullptr && ( is_register ? label->register_position_ : label->position_ ) == position )
+		{ return label->name_; }
 	}
+	return nullptr;
+}
 
-	printf( "%s\n", m->svalue_ );
-
+//=============================================================================
+// コマンド実体
+void command_devterm( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+{
 	stack_pop( s->stack_, arg_num );
 }
 
-void command_input( execute_environment_t* e, execute_status_t* s, int arg_num )
+void command_dim( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
 	if ( arg_num < 2 )
 	{
-		raise_error( "input：引数がたりません" );
+		raise_error( "dim：引数がたりません" );
 	}
-	if ( arg_num > 3 )
+	if ( arg_num > 2 )
 	{
-		raise_error( "input：引数が多すぎます" );
+		raise_error( "dim：引数が多すぎます、配列変数は1次元までしかサポートしていません" );
 	}
 
 	const auto arg_start = -arg_num;
 	const auto v = stack_peek( s->stack_, arg_start );
 	if ( v->type_ != VALUE_VARIABLE )
 	{
-		raise_error( "input：対象が変数ではありません" );
+		raise_error( "dim：対象が変数ではありません" );
 	}
 	if ( v->index_ > 0 )
 	{
-		raise_error( "input：対象の変数が配列として指定されています" );
+		raise_error( "dim：対象の変数が配列として指定されています" );
 	}
 
 	const auto n = stack_peek( s->stack_, arg_start +1 );
-	const auto len = value_calc_int( *n ) +1;
-
-	const auto mode = ( arg_num>2 ? value_calc_int( *stack_peek( s->stack_, arg_start +2 ) ) : 0 );
-
-	auto buf = create_string( len );
-	int w =0;
-	for( ; ; )
+	const auto num = value_calc_int( *n );
+	if ( num <= 0 )
 	{
-		if ( w >= len )
-		{ break; }
-
-		const auto c = getchar();
-		if ( c == EOF )
-		{ break; }
-
-		const auto ch = static_cast<char>( c );
-
-		if ( mode==1 && ch=='\n' )
-		{ break; }
-
-		if ( mode==2 )
-		{
-			if ( ch == '\r' )
-			{
-				const auto nc =getchar();
-				if ( static_cast<char>(nc) == '\n' )
-				{ break; }
-				ungetc( nc, stdin );
-			}
-			else if ( ch == '\n' )
-			{ break; }
-		}
-
-		buf[w] = static_cast<char>( ch );
-		++w;
+		raise_error( "dim：0個以下の要素は確保できません" );
 	}
-	buf[w] = '\0';
-
-	auto t = create_value_move( buf );
-	variable_set( e->variable_table_, *t, v->variable_->name_, 0 );
-	destroy_value( t );
 
-	s->strsize_ = w;
+	prepare_variable( v->variable_, VALUE_INT, 64, num );
 
 	stack_pop( s->stack_, arg_num );
 }
 
-void command_randomize( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void command_ddim( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( arg_num > 1 )
+	if ( arg_num < 2 )
 	{
-		raise_error( "randomize：引数が多すぎます" );
+		raise_error( "ddim：引数がたりません" );
 	}
-
-	unsigned int seed = 0;
-	if ( arg_num == 0 )
+	if ( arg_num > 2 )
 	{
-		seed = static_cast<unsigned int>(time(nullptr));
+		raise_error( "ddim：引数が多すぎます、配列変数は1次元までしかサポートしていません" );
 	}
-	else
+
+	const auto arg_start = -arg_num;
+	const auto v = stack_peek( s->stack_, arg_start );
+	if ( v->type_ != VALUE_VARIABLE )
 	{
-		const auto m = stack_peek( s->stack_ );
-		seed = static_cast<unsigned int>( value_calc_int( *m ) );
+		raise_error( "ddim：対象が変数ではありません" );
 	}
-	srand( seed );
-
-	stack_pop( s->stack_, arg_num );
-}
-
-void command_bench( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
-{
-#if NHSP_CONFIG_PERFORMANCE_TIMER
-	using clock = std::chrono::high_resolution_clock;
-	static bool s_prev_time_point_valid = false;
-	static std::chrono::time_point<clock> s_prev_time_point;
-
-	const auto cur_time_point = clock::now();
-
-	bool is_display = false;
-	if ( arg_num > 0 )
+	if ( v->index_ > 0 )
 	{
-		const auto m = stack_peek( s->stack_ );
-		is_display = value_calc_boolean( *m );
+		raise_error( "ddim：対象の変数が配列として指定されています" );
 	}
 
-	const auto diff = cur_time_point -s_prev_time_point;
-	const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>( diff );
-	if ( is_display && s_prev_time_point_valid )
+	const auto n = stack_peek( s->stack_, arg_start +1 );
+	const auto num = value_calc_int( *n );
+	if ( num <= 0 )
 	{
-		printf( "bench[diff] %lld[us]\n", elapsed.count() );
+		raise_error( "ddim：0個以下の要素は確保できません" );
 	}
 
-	stack_pop( s->stack_, arg_num );
-
-	s->refdval_ = static_cast<double>( elapsed.count() );
+	prepare_variable( v->variable_, VALUE_DOUBLE, 64, num );
 
-	s_prev_time_point_valid =true;
-	s_prev_time_point = cur_time_point;
-#else
-	assert( false );
 	stack_pop( s->stack_, arg_num );
-#endif
 }
 
-//=============================================================================
-// 関数実体
-void function_int( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void command_sdim( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( arg_num <= 0 )
+	if ( arg_num < 2 )
 	{
-		raise_error( "int：引数がたりません" );
+		raise_error( "sdim：引数がたりません" );
 	}
-	if ( arg_num > 1 )
+	if ( arg_num > 3 )
 	{
-		raise_error( "int：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "sdim：引数が多すぎます、配列変数は1次元までしかサポートしていません" );
 	}
 
-	const auto m = stack_peek( s->stack_ );
-	const auto r = value_calc_int( *m );
-
-	stack_pop( s->stack_, arg_num );
-	stack_push( s->stack_, create_value( r ) );
-}
-
-void function_double( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
-{
-	if ( arg_num <= 0 )
+	const auto arg_start = -arg_num;
+	const auto v = stack_peek( s->stack_, arg_start );
+	if ( v->type_ != VALUE_VARIABLE )
 	{
-		raise_error( "double：引数がたりません" );
+		raise_error( "sdim：対象が変数ではありません" );
 	}
-	if ( arg_num > 1 )
+	if ( v->index_ > 0 )
 	{
-		raise_error( "double：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "sdim：対象の変数が配列として指定されています" );
 	}
 
-	const auto m = stack_peek( s->stack_ );
-	const auto r = value_calc_double( *m );
-
-	stack_pop( s->stack_, arg_num );
-	stack_push( s->stack_, create_value( r ) );
-}
+	const auto g = stack_peek( s->stack_, arg_start +1 );
+	const auto granule = value_calc_int( *g );
 
-void function_str( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
-{
-	if ( arg_num <= 0 )
+	const auto num = ( arg_num>2 ? value_calc_int( *stack_peek( s->stack_, arg_start +2 ) ) : 1 );
+	if ( granule <= 0 )
 	{
-		raise_error( "str：引数がたりません" );
+		raise_error( "sdim：0以下のサイズの文字列は作れません" );
 	}
-	if ( arg_num > 1 )
+	if ( num <= 0 )
 	{
-		raise_error( "str：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "sdim：0個以下の要素は確保できません" );
 	}
 
-	const auto m = stack_peek( s->stack_ );
-	const auto r = value_calc_string( *m );
+	prepare_variable( v->variable_, VALUE_STRING, granule, num );
 
 	stack_pop( s->stack_, arg_num );
-	stack_push( s->stack_, create_value_move( r ) );
 }
 
-void function_peek( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void command_poke( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( arg_num <= 1 )
+	if ( arg_num < 3 )
 	{
-		raise_error( "peek：引数がたりません" );
+		raise_error( "poke：引数がたりません" );
 	}
-	if ( arg_num > 2 )
+	if ( arg_num > 3 )
 	{
-		raise_error( "peek：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "poke：引数が多すぎます、配列変数は1次元までしかサポートしていません" );
 	}
 
 	const auto arg_start = -arg_num;
 	const auto v = stack_peek( s->stack_, arg_start );
 	if ( v->type_ != VALUE_VARIABLE )
 	{
-		raise_error( "peek：対象が変数ではありません" );
+		raise_error( "poke：対象が変数ではありません" );
+		return;
 	}
 	if ( v->index_ > 0 )
 	{
-		raise_error( "peek：対象の変数が配列として指定されています" );
+		raise_error( "poke：対象の変数が配列として指定されています" );
 		return;
 	}
 
-	const auto* const var = v->variable_;
+	auto* const var = v->variable_;
 
-	const auto n = stack_peek( s->stack_, arg_start +1 );
-	const auto byte_idx = value_calc_int( *n );
+	const auto i = stack_peek( s->stack_, arg_start +1 );
+	const auto byte_idx = value_calc_int( *i );
+
+	const auto wp = stack_peek( s->stack_, arg_start +2 );
+	const auto w = value_calc_int( *wp );
 
 	if ( byte_idx<0 || var->data_size_<( byte_idx + 1 ) )
 	{
-		raise_error( "peek：対象の変数の範囲外を読もうとしています@@ %s(size=%d, idx=%d)", var->name_, var->data_size_, byte_idx );
+		raise_error( "poke：対象の変数の範囲外を書き込もうとしています@@ %s(size=%d, idx=%d)", var->name_, var->data_size_, byte_idx );
 		return;
 	}
 
-	const auto* const dp = reinterpret_cast<const char*>( var->data_ );
-	const int res = dp[byte_idx];
+	auto* const dp = reinterpret_cast<char*>( var->data_ );
+	dp[byte_idx] = static_cast<char>( w );
 
 	stack_pop( s->stack_, arg_num );
-	stack_push( s->stack_, create_value( res ) );
 }
 
-void function_wpeek( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void command_wpoke( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( arg_num <= 1 )
+	if ( arg_num < 3 )
 	{
-		raise_error( "wpeek：引数がたりません" );
+		raise_error( "wpoke：引数がたりません" );
 	}
-	if ( arg_num > 2 )
+	if ( arg_num > 3 )
 	{
-		raise_error( "wpeek：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "wpoke：引数が多すぎます、配列変数は1次元までしかサポートしていません" );
 	}
 
 	const auto arg_start = -arg_num;
 	const auto v = stack_peek( s->stack_, arg_start );
 	if ( v->type_ != VALUE_VARIABLE )
 	{
-		raise_error( "wpeek：対象が変数ではありません" );
+		raise_error( "wpoke：対象が変数ではありません" );
+		return;
 	}
 	if ( v->index_ > 0 )
 	{
-		raise_error( "wpeek：対象の変数が配列として指定されています" );
+		raise_error( "wpoke：対象の変数が配列として指定されています" );
 		return;
 	}
 
-	const auto* const var = v->variable_;
+	auto* const var = v->variable_;
 
-	const auto n = stack_peek( s->stack_, arg_start +1 );
-	const auto byte_idx = value_calc_int( *n );
+	const auto i = stack_peek( s->stack_, arg_start +1 );
+	const auto byte_idx = value_calc_int( *i );
+
+	const auto wp = stack_peek( s->stack_, arg_start +2 );
+	const std::int16_t w = static_cast<std::int16_t>( value_calc_int( *wp ) );
 
 	if ( byte_idx<0 || var->data_size_<( byte_idx + 2 ) )
 	{
-		raise_error( "wpeek：対象の変数の範囲外を読もうとしています@@ %s(size=%d, idx=%d)", var->name_, var->data_size_, byte_idx );
+		raise_error( "wpoke：対象の変数の範囲外を書き込もうとしています@@ %s(size=%d, idx=%d)", var->name_, var->data_size_, byte_idx );
 		return;
 	}
 
-	const auto* const dp = reinterpret_cast<const char*>( var->data_ );
-	std::int16_t res =0;
-	memcpy(&res, dp + byte_idx, 2);
+	auto* const dp = reinterpret_cast<char*>( var->data_ );
+	memcpy( dp + byte_idx, &w, 2 );
 
 	stack_pop( s->stack_, arg_num );
-	stack_push( s->stack_, create_value( static_cast<int>( res ) ) );
 }
 
-void function_lpeek( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void command_lpoke( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( arg_num <= 1 )
+	if ( arg_num < 3 )
 	{
-		raise_error( "lpeek：引数がたりません" );
+		raise_error( "lpoke：引数がたりません" );
 	}
-	if ( arg_num > 2 )
+	if ( arg_num > 3 )
 	{
-		raise_error( "lpeek：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "lpoke：引数が多すぎます、配列変数は1次元までしかサポートしていません" );
 	}
 
 	const auto arg_start = -arg_num;
 	const auto v = stack_peek( s->stack_, arg_start );
 	if ( v->type_ != VALUE_VARIABLE )
 	{
-		raise_error( "lpeek：対象が変数ではありません" );
+		raise_error( "lpoke：対象が変数ではありません" );
+		return;
 	}
 	if ( v->index_ > 0 )
 	{
-		raise_error( "lpeek：対象の変数が配列として指定されています" );
+		raise_error( "lpoke：対象の変数が配列として指定されています" );
 		return;
 	}
 
-	const auto* const var = v->variable_;
+	auto* const var = v->variable_;
 
-	const auto n = stack_peek( s->stack_, arg_start +1 );
-	const auto byte_idx = value_calc_int( *n );
+	const auto i = stack_peek( s->stack_, arg_start +1 );
+	const auto byte_idx = value_calc_int( *i );
+
+	const auto wp = stack_peek( s->stack_, arg_start +2 );
+	const std::int32_t w = static_cast<std::int32_t>( value_calc_int( *wp ) );
 
 	if ( byte_idx<0 || var->data_size_<( byte_idx + 4 ) )
 	{
-		raise_error( "lpeek：対象の変数の範囲外を読もうとしています@@ %s(size=%d, idx=%d)", var->name_, var->data_size_, byte_idx );
+		raise_error( "lpoke：対象の変数の範囲外を書き込もうとしています@@ %s(size=%d, idx=%d)", var->name_, var->data_size_, byte_idx );
 		return;
 	}
 
-	const auto* const dp = reinterpret_cast<const char*>( var->data_ );
-	std::int32_t res =0;
-	memcpy(&res, dp + byte_idx, 4);
+	auto* const dp = reinterpret_cast<char*>( var->data_ );
+	memcpy( dp + byte_idx, &w, 4 );
 
 	stack_pop( s->stack_, arg_num );
-	stack_push( s->stack_, create_value( static_cast<int>( res ) ) );
 }
 
-void function_rnd( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void command_mes( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
 	if ( arg_num <= 0 )
 	{
-		raise_error( "rnd：引数がたりません" );
+		raise_error( "mes：引数がたりません" );
 	}
 	if ( arg_num > 1 )
 	{
-		raise_error( "rnd：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "mes：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
 
 	const auto m = stack_peek( s->stack_ );
-	const auto r = value_calc_int( *m );
-	if ( r < 1 )
+	value_isolate( *m );
+	if ( m->type_ != VALUE_STRING )
 	{
-		raise_error( "rnd：引数は1以上である必要があります@@ %d", r );
+		raise_error( "mes：引数が文字列型ではありません" );
 	}
 
-	stack_pop( s->stack_, arg_num );
-	const auto res = rand() %(r);
-	stack_push( s->stack_, create_value( res ) );
+	printf( "%s\n", m->svalue_ );
+
+	stack_pop( s->stack_, arg_num );
 }
 
-void function_abs( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void command_input( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( arg_num <= 0 )
+	if ( arg_num < 2 )
 	{
-		raise_error( "abs：引数がたりません" );
+		raise_error( "input：引数がたりません" );
 	}
-	if ( arg_num > 1 )
+	if ( arg_num > 3 )
 	{
-		raise_error( "abs：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "input：引数が多すぎます" );
 	}
 
-	const auto m = stack_peek( s->stack_ );
-	const auto r = value_calc_int( *m );
-
-	stack_pop( s->stack_, arg_num );
-	const auto res = ( r<0 ? -r : r );
-	stack_push( s->stack_, create_value( res ) );
-}
-
-void function_absf( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
-{
-	if ( arg_num <= 0 )
+	const auto arg_start = -arg_num;
+	const auto v = stack_peek( s->stack_, arg_start );
+	if ( v->type_ != VALUE_VARIABLE )
 	{
-		raise_error( "absf：引数がたりません" );
+		raise_error( "input：対象が変数ではありません" );
 	}
-	if ( arg_num > 1 )
+	if ( v->index_ > 0 )
 	{
-		raise_error( "absf：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "input：対象の変数が配列として指定されています" );
 	}
 
-	const auto m = stack_peek( s->stack_ );
-	const auto r = value_calc_double( *m );
+	const auto n = stack_peek( s->stack_, arg_start +1 );
+	const auto len = value_calc_int( *n ) +1;
+
+	const auto mode = ( arg_num>2 ? value_calc_int( *stack_peek( s->stack_, arg_start +2 ) ) : 0 );
+
+	auto buf = create_shared_string( len );
+	int w =0;
+	for( ; ; )
+	{
+		if ( w >= len )
+		{ break; }
+
+		const auto c = getchar();
+		if ( c == EOF )
+		{ break; }
+
+		const auto ch = static_cast<char>( c );
+
+		if ( mode==1 && ch=='\n' )
+		{ break; }
+
+		if ( mode==2 )
+		{
+			if ( ch == '\r' )
+			{
+				const auto nc =getchar();
+				if ( static_cast<char>(nc) == '\n' )
+				{ break; }
+				ungetc( nc, stdin );
+			}
+			else if ( ch == '\n' )
+			{ break; }
+		}
+
+		buf[w] = static_cast<char>( ch );
+		++w;
+	}
+	buf[w] = '\0';
+
+	auto t = create_value_move( buf );
+	variable_set( v->variable_, *t, 0 );
+	destroy_value( t );
+
+	s->strsize_ = w;
 
 	stack_pop( s->stack_, arg_num );
-	const auto res = ( r<0.0 ? -r : r );
-	stack_push( s->stack_, create_value( res ) );
 }
 
-void function_deg2rad( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void command_randomize( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( arg_num <= 0 )
-	{
-		raise_error( "deg2rad：引数がたりません" );
-	}
 	if ( arg_num > 1 )
 	{
-		raise_error( "deg2rad：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "randomize：引数が多すぎます" );
 	}
 
-	const auto m = stack_peek( s->stack_ );
-	const auto r = value_calc_double( *m );
+	unsigned int seed = 0;
+	if ( arg_num == 0 )
+	{
+		seed = static_cast<unsigned int>(time(nullptr));
+	}
+	else
+	{
+		const auto m = stack_peek( s->stack_ );
+		seed = static_cast<unsigned int>( value_calc_int( *m ) );
+	}
+	srand( seed );
 
 	stack_pop( s->stack_, arg_num );
-	const auto res = ( r * NHSP_MPI / 180.0 );
-	stack_push( s->stack_, create_value( res ) );
 }
 
-void function_rad2deg( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void command_bench( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( arg_num <= 0 )
+#if NHSP_CONFIG_PERFORMANCE_TIMER
+	using clock = std::chrono::high_resolution_clock;
+	static bool s_prev_time_point_valid = false;
+	static std::chrono::time_point<clock> s_prev_time_point;
+
+	const auto cur_time_point = clock::now();
+
+	bool is_display = false;
+	if ( arg_num > 0 )
 	{
-		raise_error( "rad2deg：引数がたりません" );
+		const auto m = stack_peek( s->stack_ );
+		is_display = value_calc_boolean( *m );
 	}
-	if ( arg_num > 1 )
+
+	const auto diff = cur_time_point -s_prev_time_point;
+	const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>( diff );
+	if ( is_display && s_prev_time_point_valid )
 	{
-		raise_error( "rad2deg：引数が多すぎます@@ %d個渡されました", arg_num );
+		printf( "bench[diff] %lld[us]\n", elapsed.count() );
 	}
 
-	const auto m = stack_peek( s->stack_ );
-	const auto r = value_calc_double( *m );
+	stack_pop( s->stack_, arg_num );
 
+	s->refdval_ = static_cast<double>( elapsed.count() );
+
+	s_prev_time_point_valid =true;
+	s_prev_time_point = cur_time_point;
+#else
+	assert( false );
 	stack_pop( s->stack_, arg_num );
-	const auto res = ( r * 180.0 / NHSP_MPI );
-	stack_push( s->stack_, create_value( res ) );
+#endif
 }
 
-void function_sin( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+//=============================================================================
+// 関数実体
+void function_int( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
 	if ( arg_num <= 0 )
 	{
-		raise_error( "sin：引数がたりません" );
+		raise_error( "int：引数がたりません" );
 	}
 	if ( arg_num > 1 )
 	{
-		raise_error( "sin：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "int：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
 
 	const auto m = stack_peek( s->stack_ );
-	const auto r = value_calc_double( *m );
+	const auto r = value_calc_int( *m );
 
 	stack_pop( s->stack_, arg_num );
-	const auto res = std::sin( r );
-	stack_push( s->stack_, create_value( res ) );
+	stack_push( s->stack_, r );
 }
 
-void function_cos( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void function_double( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
 	if ( arg_num <= 0 )
 	{
-		raise_error( "cos：引数がたりません" );
-		return;
+		raise_error( "double：引数がたりません" );
 	}
 	if ( arg_num > 1 )
 	{
-		raise_error( "cos：引数が多すぎます@@ %d個渡されました", arg_num );
-		return;
+		raise_error( "double：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
 
 	const auto m = stack_peek( s->stack_ );
 	const auto r = value_calc_double( *m );
 
 	stack_pop( s->stack_, arg_num );
-	const auto res = std::cos( r );
-	stack_push( s->stack_, create_value( res ) );
+	stack_push( s->stack_, r );
 }
 
-void function_tan( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void function_str( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
 	if ( arg_num <= 0 )
 	{
-		raise_error( "tan：引数がたりません" );
+		raise_error( "str：引数がたりません" );
 	}
 	if ( arg_num > 1 )
 	{
-		raise_error( "tan：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "str：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
 
 	const auto m = stack_peek( s->stack_ );
-	const auto r = value_calc_double( *m );
+	const auto r = value_calc_string( *m );
 
 	stack_pop( s->stack_, arg_num );
-	const auto res = std::tan( r );
-	stack_push( s->stack_, create_value( res ) );
+	stack_push_move( s->stack_, r );
 }
 
-void function_atan( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void function_peek( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( arg_num < 2 )
+	if ( arg_num <= 1 )
 	{
-		raise_error( "atan：引数がたりません" );
+		raise_error( "peek：引数がたりません" );
 	}
 	if ( arg_num > 2 )
 	{
-		raise_error( "atan：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "peek：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
 
 	const auto arg_start = -arg_num;
-	const auto vy = stack_peek( s->stack_, arg_start + 0 );
-	const auto vx = stack_peek( s->stack_, arg_start + 1 );
-	const auto y = value_calc_double( *vy );
-	const auto x = value_calc_double( *vx );
-
-	stack_pop( s->stack_, arg_num );
-	const auto res = std::atan2( y, x );
-	stack_push( s->stack_, create_value( res ) );
-}
-
-void function_expf( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
-{
-	if ( arg_num <= 0 )
+	const auto v = stack_peek( s->stack_, arg_start );
+	if ( v->type_ != VALUE_VARIABLE )
 	{
-		raise_error( "expf：引数がたりません" );
+		raise_error( "peek：対象が変数ではありません" );
 	}
-	if ( arg_num > 1 )
+	if ( v->index_ > 0 )
 	{
-		raise_error( "expf：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "peek：対象の変数が配列として指定されています" );
+		return;
 	}
 
-	const auto m = stack_peek( s->stack_ );
-	const auto r = value_calc_double( *m );
+	const auto* const var = v->variable_;
 
-	stack_pop( s->stack_, arg_num );
-	const auto res = std::exp( r );
-	stack_push( s->stack_, create_value( res ) );
-}
+	const auto n = stack_peek( s->stack_, arg_start +1 );
+	const auto byte_idx = value_calc_int( *n );
 
-void function_logf( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
-{
-	if ( arg_num <= 0 )
-	{
-		raise_error( "logf：引数がたりません" );
-	}
-	if ( arg_num > 1 )
+	if ( byte_idx<0 || var->data_size_<( byte_idx + 1 ) )
 	{
-		raise_error( "logf：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "peek：対象の変数の範囲外を読もうとしています@@ %s(size=%d, idx=%d)", var->name_, var->data_size_, byte_idx );
+		return;
 	}
 
-	const auto m = stack_peek( s->stack_ );
-	const auto r = value_calc_double( *m );
+	const auto* const dp = reinterpret_cast<const char*>( var->data_ );
+	const int res = dp[byte_idx];
 
 	stack_pop( s->stack_, arg_num );
-	const auto res = std::log( r );
-	stack_push( s->stack_, create_value( res ) );
+	stack_push( s->stack_, res );
 }
 
-void function_powf( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void function_wpeek( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( arg_num <= 0 )
+	if ( arg_num <= 1 )
 	{
-		raise_error( "powf：引数がたりません" );
+		raise_error( "wpeek：引数がたりません" );
 	}
 	if ( arg_num > 2 )
 	{
-		raise_error( "powf：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "wpeek：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
 
 	const auto arg_start = -arg_num;
-	const auto vx = stack_peek( s->stack_, arg_start + 0 );
-	const auto vy = stack_peek( s->stack_, arg_start + 1 );
-	const auto x = value_calc_double( *vx );
-	const auto y = value_calc_double( *vy );
-
-	stack_pop( s->stack_, arg_num );
-	const auto res = std::pow( x, y );
-	stack_push( s->stack_, create_value( res ) );
-}
-
-void function_sqrt( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
-{
-	if ( arg_num <= 0 )
+	const auto v = stack_peek( s->stack_, arg_start );
+	if ( v->type_ != VALUE_VARIABLE )
 	{
-		raise_error( "sqrt：引数がたりません" );
+		raise_error( "wpeek：対象が変数ではありません" );
 	}
-	if ( arg_num > 1 )
+	if ( v->index_ > 0 )
 	{
-		raise_error( "sqrt：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "wpeek：対象の変数が配列として指定されています" );
+		return;
 	}
 
-	const auto m = stack_peek( s->stack_ );
-	const auto r = value_calc_double( *m );
+	const auto* const var = v->variable_;
 
-	stack_pop( s->stack_, arg_num );
-	const auto res = std::sqrt( r );
-	stack_push( s->stack_, create_value( res ) );
-}
+	const auto n = stack_peek( s->stack_, arg_start +1 );
+	const auto byte_idx = value_calc_int( *n );
 
-void function_limit( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
-{
-	if ( arg_num < 3 )
+	if ( byte_idx<0 || var->data_size_<( byte_idx + 2 ) )
 	{
-		raise_error( "limit：引数がたりません" );
-	}
-	if ( arg_num > 3 )
-	{
-		raise_error( "limit：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "wpeek：対象の変数の範囲外を読もうとしています@@ %s(size=%d, idx=%d)", var->name_, var->data_size_, byte_idx );
+		return;
 	}
 
-	const auto arg_start = -arg_num;
-	const auto vmi = stack_peek( s->stack_, arg_start + 0 );
-	const auto vm = stack_peek( s->stack_, arg_start + 1 );
-	const auto vma = stack_peek( s->stack_, arg_start + 2 );
-	const auto mi = value_calc_int( *vmi );
-	const auto v = value_calc_int( *vm );
-	const auto ma = value_calc_int( *vma );
+	const auto* const dp = reinterpret_cast<const char*>( var->data_ );
+	std::int16_t res =0;
+	memcpy(&res, dp + byte_idx, 2);
 
 	stack_pop( s->stack_, arg_num );
-	auto res = v;
-	if ( res < mi )
-	{ res = mi; }
-	if ( res > ma )
-	{ res = ma; }
-	stack_push( s->stack_, create_value( res ) );
+	stack_push( s->stack_, static_cast<int>( res ) );
 }
 
-void function_limitf( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void function_lpeek( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( arg_num < 3 )
+	if ( arg_num <= 1 )
 	{
-		raise_error( "limitf：引数がたりません" );
+		raise_error( "lpeek：引数がたりません" );
 	}
-	if ( arg_num > 3 )
+	if ( arg_num > 2 )
 	{
-		raise_error( "limitf：引数が多すぎます@@ %d個渡されました", arg_num );
+		raise_error( "lpeek：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
 
 	const auto arg_start = -arg_num;
-	const auto vmi = stack_peek( s->stack_, arg_start + 0 );
-	const auto vm = stack_peek( s->stack_, arg_start + 1 );
-	const auto vma = stack_peek( s->stack_, arg_start + 2 );
-	const auto mi = value_calc_double( *vmi );
-	const auto v = value_calc_double( *vm );
-	const auto ma = value_calc_double( *vma );
+	const auto v = stack_peek( s->stack_, arg_start );
+	if ( v->type_ != VALUE_VARIABLE )
+	{
+		raise_error( "lpeek：対象が変数ではありません" );
+	}
+	if ( v->index_ > 0 )
+	{
+		raise_error( "lpeek：対象の変数が配列として指定されています" );
+		return;
+	}
+
+	const auto* const var = v->variable_;
+
+	const auto n = stack_peek( s->stack_, arg_start +1 );
+	const auto byte_idx = value_calc_int( *n );
+
+	if ( byte_idx<0 || var->data_size_<( byte_idx + 4 ) )
+	{
+		raise_error( "lpeek：対象の変数の範囲外を読もうとしています@@ %s(size=%d, idx=%d)", var->name_, var->data_size_, byte_idx );
+		return;
+	}
+
+	const auto* const dp = reinterpret_cast<const char*>( var->data_ );
+	std::int32_t res =0;
+	memcpy(&res, dp + byte_idx, 4);
 
 	stack_pop( s->stack_, arg_num );
-	auto res = v;
-	if ( res < mi )
-	{ res = mi; }
-	if ( res > ma )
-	{ res = ma; }
-	stack_push( s->stack_, create_value( res ) );
+	stack_push( s->stack_, static_cast<int>( res ) );
 }
 
-void function_strlen( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+void function_rnd( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
 	if ( arg_num <= 0 )
 	{
-		raise_error( "strlen：引数がたりません" );
+		raise_error( "rnd：引数がたりません" );
 	}
 	if ( arg_num > 1 )
 	{
-		raise_error( "strlen：引数が多すぎます" );
+		raise_error( "rnd：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
 
 	const auto m = stack_peek( s->stack_ );
-	if ( value_get_primitive_tag( *m ) != VALUE_STRING )
+	const auto r = value_calc_int( *m );
+	if ( r < 1 )
 	{
-		raise_error( "strlen：引数が文字列型ではありません" );
+		raise_error( "rnd：引数は1以上である必要があります@@ %d", r );
 	}
-	const auto* const str = value_get_string( *m );
-	assert( str != nullptr );
 
 	stack_pop( s->stack_, arg_num );
-	const auto res = static_cast<int>( strlen( str ) );
-	stack_push( s->stack_, create_value( res ) );
+	const auto res = rand() %(r);
+	stack_push( s->stack_, res );
 }
 
-}// namespace
+void function_abs( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+{
+	if ( arg_num <= 0 )
+	{
+		raise_error( "abs：引数がたりません" );
+	}
+	if ( arg_num > 1 )
+	{
+		raise_error( "abs：引数が多すぎます@@ %d個渡されました", arg_num );
+	}
 
-//=============================================================================
-//=============================================================================
-//=============================================================================
-// 外部リンケージを持つ人たち、ここから
+	const auto m = stack_peek( s->stack_ );
+	const auto r = value_calc_int( *m );
 
-//=============================================================================
-// 全体
-static bool s_is_system_initialized =false;
+	stack_pop( s->stack_, arg_num );
+	const auto res = ( r<0 ? -r : r );
+	stack_push( s->stack_, res );
+}
 
-void initialize_system()
+void function_absf( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	assert( !s_is_system_initialized );
-	s_is_system_initialized = true;
-
-	// UTF8 ワークアラウンド
-	//setvbuf( stdout, nullptr, _IOFBF, 1024 );
-	setvbuf( stderr, nullptr, _IOFBF, 1024 );
-
-#if NHSP_CONFIG_MEMLEAK_DETECTION
-	if ( s_memory_map_ == nullptr )
+	if ( arg_num <= 0 )
 	{
-		s_memory_map_ = reinterpret_cast<list_t*>( zmalloc( sizeof(list_t) ) );
-		s_memory_map_->head_ = s_memory_map_->tail_ = nullptr;
+		raise_error( "absf：引数がたりません" );
 	}
-#endif
-#if NHSP_CONFIG_VALUE_ALLOCATION_CACHE
-	for( size_t i=0; i<MAX_VALUE_ALLOCATION_CACHE; ++i )
+	if ( arg_num > 1 )
 	{
-		s_value_allocation_cache[i] = reinterpret_cast<value_t*>( xmalloc( sizeof(value_t) ) );
+		raise_error( "absf：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
-	s_value_allocation_cache_idx = 0;
-#endif
+
+	const auto m = stack_peek( s->stack_ );
+	const auto r = value_calc_double( *m );
+
+	stack_pop( s->stack_, arg_num );
+	const auto res = ( r<0.0 ? -r : r );
+	stack_push( s->stack_, res );
 }
 
-void uninitialize_system()
+void function_deg2rad( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	assert( s_is_system_initialized );
-	s_is_system_initialized = false;
-
-#if NHSP_CONFIG_VALUE_ALLOCATION_CACHE
-	assert( s_value_allocation_cache_idx == 0 );
-	for( size_t i=0; i<MAX_VALUE_ALLOCATION_CACHE; ++i )
+	if ( arg_num <= 0 )
 	{
-		if ( s_value_allocation_cache[i] != nullptr )
-		{
-			xfree( s_value_allocation_cache[i] );
-			s_value_allocation_cache[i] = nullptr;
-		}
+		raise_error( "deg2rad：引数がたりません" );
 	}
-	s_value_allocation_cache_idx = 0;
-#endif
-#if NHSP_CONFIG_MEMLEAK_DETECTION
-	if ( s_memory_map_ != nullptr )
+	if ( arg_num > 1 )
 	{
-		printf( "====leaked memories\n" );
-		auto node = s_memory_map_->head_;
-		while( node != nullptr )
-		{
-			printf( "[%p]\n", node->value_ );
-			node = node->next_;
-		}
-		printf( "----" );
+		raise_error( "deg2rad：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
-#endif
-}
 
-//=============================================================================
-// メモリ
+	const auto m = stack_peek( s->stack_ );
+	const auto r = value_calc_double( *m );
 
-void* xmalloc( size_t size )
+	stack_pop( s->stack_, arg_num );
+	const auto res = ( r * NHSP_MPI / 180.0 );
+	stack_push( s->stack_, res );
+}
+
+void function_rad2deg( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	const auto res = zmalloc( size );
-#if NHSP_CONFIG_MEMLEAK_DETECTION
+	if ( arg_num <= 0 )
 	{
-		//printf( "xmalloc[%p]\n", res );
-		if ( res != nullptr )
-		{ zregister_memory( res ); }
+		raise_error( "rad2deg：引数がたりません" );
 	}
-#endif
-	return res;
+	if ( arg_num > 1 )
+	{
+		raise_error( "rad2deg：引数が多すぎます@@ %d個渡されました", arg_num );
+	}
+
+	const auto m = stack_peek( s->stack_ );
+	const auto r = value_calc_double( *m );
+
+	stack_pop( s->stack_, arg_num );
+	const auto res = ( r * 180.0 / NHSP_MPI );
+	stack_push( s->stack_, res );
 }
 
-void  xfree( void* ptr )
+void function_sin( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-#if NHSP_CONFIG_MEMLEAK_DETECTION
+	if ( arg_num <= 0 )
 	{
-		//printf( "xfree[%p]\n", ptr );
-		zunregister_memory( ptr );
+		raise_error( "sin：引数がたりません" );
 	}
-#endif
-	zfree( ptr );
+	if ( arg_num > 1 )
+	{
+		raise_error( "sin：引数が多すぎます@@ %d個渡されました", arg_num );
+	}
+
+	const auto m = stack_peek( s->stack_ );
+	const auto r = value_calc_double( *m );
+
+	stack_pop( s->stack_, arg_num );
+	const auto res = std::sin( r );
+	stack_push( s->stack_, res );
 }
 
-void* xrealloc( void* ptr, size_t size )
+void function_cos( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	const auto res = zrealloc( ptr, size );
-#if NHSP_CONFIG_MEMLEAK_DETECTION
+	if ( arg_num <= 0 )
 	{
-		//printf( "xrealloc[%p->%p]\n", ptr, res );
-		if ( res != ptr )
-		{
-			if ( ptr != nullptr )
-			{ zunregister_memory( ptr ); }
-			if ( res != nullptr )
-			{ zregister_memory( res ); }
-		}
+		raise_error( "cos：引数がたりません" );
+		return;
+	}
+	if ( arg_num > 1 )
+	{
+		raise_error( "cos：引数が多すぎます@@ %d個渡されました", arg_num );
+		return;
 	}
-#endif
-	return res;
-}
 
-//=============================================================================
-// 文字列バッファ
-string_buffer_t* create_string_buffer( size_t initial_len, int expand_step )
-{
-	assert( initial_len > 0 );
-	auto* const res = reinterpret_cast<string_buffer_t*>( xmalloc( sizeof( string_buffer_t ) ) );
-	initialize_string_buffer( res, initial_len, expand_step );
-	return res;
-}
+	const auto m = stack_peek( s->stack_ );
+	const auto r = value_calc_double( *m );
 
-void destroy_string_buffer( string_buffer_t* sb )
-{
-	uninitialize_string_buffer( sb );
-	xfree( sb );
+	stack_pop( s->stack_, arg_num );
+	const auto res = std::cos( r );
+	stack_push( s->stack_, res );
 }
 
-void initialize_string_buffer( string_buffer_t* sb, size_t initial_len, int expand_step )
+void function_tan( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	sb->buffer_ = create_string( initial_len );
-	sb->buffer_size_ = static_cast<int>( initial_len );
-	sb->cursor_ = 0;
-	sb->expand_step_ = expand_step;
-	sb->buffer_[0] = '\0';
-}
-
-void uninitialize_string_buffer( string_buffer_t* sb )
-{
-	assert( sb != nullptr );
-
-	if ( sb->buffer_ != nullptr )
+	if ( arg_num <= 0 )
 	{
-		xfree( sb->buffer_ );
-		sb->buffer_ = nullptr;
+		raise_error( "tan：引数がたりません" );
 	}
-	sb->buffer_size_ = 0;
-	sb->cursor_ = 0;
-	sb->expand_step_ = 0;
-}
-
-void string_buffer_append( string_buffer_t* sb, const char* s, int len )
-{
-	if ( len < 0 )
+	if ( arg_num > 1 )
 	{
-		len = static_cast<int>( strlen( s ) );
+		raise_error( "tan：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
 
-	if ( len == 0 )
+	const auto m = stack_peek( s->stack_ );
+	const auto r = value_calc_double( *m );
+
+	stack_pop( s->stack_, arg_num );
+	const auto res = std::tan( r );
+	stack_push( s->stack_, res );
+}
+
+void function_atan( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
+{
+	if ( arg_num < 2 )
 	{
-		return;
+		raise_error( "atan：引数がたりません" );
 	}
-
-	const auto left = sb->buffer_size_ - sb->cursor_;
-	const auto required = len + 4;
-	if ( left < required )
+	if ( arg_num > 2 )
 	{
-		const int nexpand = ( required - left );
-		const int expand_step = ( sb->expand_step_ <= 0 ? sb->buffer_size_/* x2 */ : sb->expand_step_ );
-		const int expand = ( expand_step < nexpand ? nexpand : expand_step );
-		const size_t nsize = sb->buffer_size_ + expand;
-		sb->buffer_ = reinterpret_cast<char*>( xrealloc( sb->buffer_, static_cast<size_t>( nsize ) ) );
-		sb->buffer_size_ = static_cast<int>( nsize );
+		raise_error( "atan：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
 
-	memcpy( sb->buffer_ + sb->cursor_, s, len );
-	sb->cursor_ += len;
-	sb->buffer_[sb->cursor_] = '\0';
-}
+	const auto arg_start = -arg_num;
+	const auto vy = stack_peek( s->stack_, arg_start + 0 );
+	const auto vx = stack_peek( s->stack_, arg_start + 1 );
+	const auto y = value_calc_double( *vy );
+	const auto x = value_calc_double( *vx );
 
-//=============================================================================
-// リスト
-list_node_t* create_list_node()
-{
-	list_node_t* res = reinterpret_cast<list_node_t*>( xmalloc( sizeof( list_node_t ) ) );
-	res->prev_ = res->next_ = nullptr;
-	res->value_ = nullptr;
-	return res;
+	stack_pop( s->stack_, arg_num );
+	const auto res = std::atan2( y, x );
+	stack_push( s->stack_, res );
 }
 
-void destroy_list_node( list_node_t *node )
+void function_expf( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	unlink_list_node( node );
-	xfree( node );
-}
+	if ( arg_num <= 0 )
+	{
+		raise_error( "expf：引数がたりません" );
+	}
+	if ( arg_num > 1 )
+	{
+		raise_error( "expf：引数が多すぎます@@ %d個渡されました", arg_num );
+	}
 
-void link_next( list_node_t* node, list_node_t* list )
-{
-	assert( node->prev_==nullptr && node->next_==nullptr );
-	node->prev_ = list;
-	node->next_ = list->next_;
-	list->next_ = node;
-}
+	const auto m = stack_peek( s->stack_ );
+	const auto r = value_calc_double( *m );
 
-void link_prev( list_node_t* node, list_node_t* list )
-{
-	assert( node->prev_==nullptr && node->next_==nullptr );
-	node->prev_ = list->prev_;
-	node->next_ = list;
-	list->prev_ = node;
+	stack_pop( s->stack_, arg_num );
+	const auto res = std::exp( r );
+	stack_push( s->stack_, res );
 }
 
-bool unlink_list_node( list_node_t* node )
+void function_logf( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( node->prev_==nullptr && node->next_==nullptr )
-	{ 
-		return false;
-	}
-	if ( node->prev_ != nullptr )
+	if ( arg_num <= 0 )
 	{
-		node->prev_->next_ = node->next_;
+		raise_error( "logf：引数がたりません" );
 	}
-	if ( node->next_ != nullptr )
+	if ( arg_num > 1 )
 	{
-		node->next_->prev_ = node->prev_;
+		raise_error( "logf：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
-	node->prev_ = node->next_ = nullptr;
-	return true;
-}
 
-list_t* create_list()
-{
-	auto res = reinterpret_cast<list_t*>( xmalloc( sizeof(list_t) ) );
-	res->head_ = res->tail_ = nullptr;
-	return res;
-}
+	const auto m = stack_peek( s->stack_ );
+	const auto r = value_calc_double( *m );
 
-void destroy_list( list_t* list )
-{
-	xfree( list );
+	stack_pop( s->stack_, arg_num );
+	const auto res = std::log( r );
+	stack_push( s->stack_, res );
 }
 
-void list_prepend( list_t& list, list_node_t* node )
+void function_powf( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( list.head_ == nullptr )
+	if ( arg_num <= 0 )
 	{
-		assert( list.tail_==nullptr );
-		list.head_ = list.tail_ = node;
-		return;
+		raise_error( "powf：引数がたりません" );
 	}
-	link_prev( node, list.head_ );
-	list.head_ = node;
-}
-
-void list_append( list_t& list, list_node_t* node )
-{
-	if ( list.tail_ == nullptr )
+	if ( arg_num > 2 )
 	{
-		assert( list.head_==nullptr );
-		list.head_ = list.tail_ = node;
-		return;
+		raise_error( "powf：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
-	link_next( node, list.tail_ );
-	list.tail_ = node;
+
+	const auto arg_start = -arg_num;
+	const auto vx = stack_peek( s->stack_, arg_start + 0 );
+	const auto vy = stack_peek( s->stack_, arg_start + 1 );
+	const auto x = value_calc_double( *vx );
+	const auto y = value_calc_double( *vy );
+
+	stack_pop( s->stack_, arg_num );
+	const auto res = std::pow( x, y );
+	stack_push( s->stack_, res );
 }
 
-void list_erase( list_t& list, list_node_t* node )
+void function_sqrt( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	if ( list.head_ == node )
+	if ( arg_num <= 0 )
 	{
-		list.head_ = node->next_;
+		raise_error( "sqrt：引数がたりません" );
 	}
-	if ( list.tail_ == node )
+	if ( arg_num > 1 )
 	{
-		list.tail_ = node->prev_;
+		raise_error( "sqrt：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
-	unlink_list_node( node );
+
+	const auto m = stack_peek( s->stack_ );
+	const auto r = value_calc_double( *m );
+
+	stack_pop( s->stack_, arg_num );
+	const auto res = std::sqrt( r );
+	stack_push( s->stack_, res );
 }
 
-list_node_t* list_find( list_t& list, void* value )
+void function_limit( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	auto* node = list.head_;
-	while( node != nullptr )
+	if ( arg_num < 3 )
 	{
-		if ( node->value_ == value )
-		{
-			return node;
-		}
-		node = node->next_;
+		raise_error( "limit：引数がたりません" );
 	}
-	return nullptr;
-}
-
-void list_free_all( list_t& list )
-{
-	auto* node = list.head_;
-	while( node != nullptr )
+	if ( arg_num > 3 )
 	{
-		auto next = node->next_;
-		list_erase( list, node );
-		xfree( node );
-		node = next;
+		raise_error( "limit：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
-}
 
-//=============================================================================
-// キーワード
-int query_keyword( const char* s )
-{
-	static const struct
-	{
-		int				tag_;
-		const char*		word_;
-	} table[] =
-	{
-		{ KEYWORD_GLOBAL,	"global", },
-		{ KEYWORD_CTYPE,	"ctype", },
-		{ KEYWORD_END,		"end", },
-		{ KEYWORD_RETURN,	"return", },
-		{ KEYWORD_GOTO,		"goto", },
-		{ KEYWORD_GOSUB,	"gosub", },
-		{ KEYWORD_REPEAT,	"repeat", },
-		{ KEYWORD_LOOP,		"loop", },
-		{ KEYWORD_CONTINUE,	"continue", },
-		{ KEYWORD_BREAK,	"break", },
-		{ KEYWORD_IF,		"if", },
-		{ KEYWORD_ELSE,		"else", },
-		{ KEYWORD_UNDEF,	nullptr },
-	};
+	const auto arg_start = -arg_num;
+	const auto vmi = stack_peek( s->stack_, arg_start + 0 );
+	const auto vm = stack_peek( s->stack_, arg_start + 1 );
+	const auto vma = stack_peek( s->stack_, arg_start + 2 );
+	const auto mi = value_calc_int( *vmi );
+	const auto v = value_calc_int( *vm );
+	const auto ma = value_calc_int( *vma );
 
-	// 全探索
-	for( int i=0; table[i].tag_!=-1; ++i )
-	{
-		if ( string_equal_igcase( s, table[i].word_ ) )
-		{
-			return table[i].tag_;
-		}
-	}
-	return KEYWORD_UNDEF;
+	stack_pop( s->stack_, arg_num );
+	auto res = v;
+	if ( res < mi )
+	{ res = mi; }
+	if ( res > ma )
+	{ res = ma; }
+	stack_push( s->stack_, res );
 }
 
-//=============================================================================
-// トークナイザ
-int query_token_shadow( const char* ident, size_t len )
+void function_limitf( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	static const struct
+	if ( arg_num < 3 )
 	{
-		int				type_;
-		const char*		word_;
+		raise_error( "limitf：引数がたりません" );
 	}
-	shadows[] =
-	{
-		{ TOKEN_OP_NEQ,		"not" },
-		{ TOKEN_OP_BAND,	"and" },
-		{ TOKEN_OP_BOR,		"or" },
-		{ TOKEN_OP_BXOR,	"xor" },
-		{ TOKEN_UNKNOWN,	nullptr },
-	};
-
-	for( int i=0; shadows[i].type_!=-1; ++i )
+	if ( arg_num > 3 )
 	{
-		if ( string_equal_igcase( shadows[i].word_, ident, static_cast<int>( len ) ) )
-		{
-			return shadows[i].type_;
-		}
+		raise_error( "limitf：引数が多すぎます@@ %d個渡されました", arg_num );
 	}
-	return TOKEN_UNKNOWN;
+
+	const auto arg_start = -arg_num;
+	const auto vmi = stack_peek( s->stack_, arg_start + 0 );
+	const auto vm = stack_peek( s->stack_, arg_start + 1 );
+	const auto vma = stack_peek( s->stack_, arg_start + 2 );
+	const auto mi = value_calc_double( *vmi );
+	const auto v = value_calc_double( *vm );
+	const auto ma = value_calc_double( *vma );
+
+	stack_pop( s->stack_, arg_num );
+	auto res = v;
+	if ( res < mi )
+	{ res = mi; }
+	if ( res > ma )
+	{ res = ma; }
+	stack_push( s->stack_, res );
 }
 
-void initialize_tokenize_context( tokenize_context_t* c, const char* script )
+void function_strlen( execute_environment_t* NHSP_UNUA(e), execute_status_t* s, int arg_num )
 {
-	c->script_ = script;
-	c->cursor_ = 0;
-	c->line_ = 0;
-	c->line_head_ = script;
+	if ( arg_num <= 0 )
+	{
+		raise_error( "strlen：引数がたりません" );
+	}
+	if ( arg_num > 1 )
+	{
+		raise_error( "strlen：引数が多すぎます" );
+	}
+
+	const auto m = stack_peek( s->stack_ );
+	if ( value_get_primitive_tag( *m ) != VALUE_STRING )
+	{
+		raise_error( "strlen：引数が文字列型ではありません" );
+	}
+	const auto* const str = value_get_string( *m );
+	assert( str != nullptr );
+
+	const auto res = static_cast<int>( strlen( str ) );
+	stack_pop( s->stack_, arg_num );
+	stack_push( s->stack_, res );
 }
 
-void uninitialize_tokenize_context( tokenize_context_t* c )
-{
-	c->script_ = nullptr;
-	c->cursor_ = 0;
-	c->line_ = 0;
-	c->line_head_ = nullptr;
+//=============================================================================
+// 定数畳み込み
+// 副作用がなく、結果が引数だけで決まる組み込み関数なら、その引数の数を返す
+int query_pure_function_arg_num( int function )
+{
+	switch( function )
+	{
+		case FUNCTION_INT:
+		case FUNCTION_DOUBLE:
+		case FUNCTION_STR:
+		case FUNCTION_ABS:
+		case FUNCTION_ABSF:
+		case FUNCTION_DEG2RAD:
+		case FUNCTION_RAD2DEG:
+		case FUNCTION_SIN:
+		case FUNCTION_COS:
+		case FUNCTION_TAN:
+		case FUNCTION_EXPF:
+		case FUNCTION_LOGF:
+		case FUNCTION_SQRT:
+		case FUNCTION_STRLEN:	return 1;
+		case FUNCTION_ATAN:
+		case FUNCTION_POWF:		return 2;
+		case FUNCTION_LIMIT:
+		case FUNCTION_LIMITF:	return 3;
+		default: break;
+	}
+	// peek系は変数、rndは乱数の状態に依存する
+	return -1;
 }
 
-token_t* get_token( tokenize_context_t& c )
+// 数値を返す副作用のない組み込み関数を、引数をスタックに積まずに計算して res に入れる
+// 引数は関数実体と同じく value_calc_int/value_calc_double で読む、扱わない関数や引数の数が合わない時は false
+bool calc_pure_numeric_function( int function, const value_t* args, int arg_num, value_t* res )
 {
-	token_t* res = reinterpret_cast<token_t*>( xmalloc( sizeof( token_t ) ) );
-	res->tag_ = TOKEN_UNKNOWN;
-	res->content_ = nullptr;
-	res->cursor_begin_ = c.cursor_;
-	res->cursor_end_ = c.cursor_;
-	res->left_space_ =false;
-	res->right_space_ =false;
+	if ( arg_num != query_pure_function_arg_num( function ) )
+	{ return false; }
+	switch( function )
+	{
+		case FUNCTION_INT:		value_set( res, value_calc_int( args[0] ) ); break;
+		case FUNCTION_DOUBLE:	value_set( res, value_calc_double( args[0] ) ); break;
+		case FUNCTION_ABS:
+		{
+			const auto r = value_calc_int( args[0] );
+			value_set( res, ( r<0 ? -r : r ) );
+			break;
+		}
+		case FUNCTION_ABSF:
+		{
+			const auto r = value_calc_double( args[0] );
+			value_set( res, ( r<0.0 ? -r : r ) );
+			break;
+		}
+		case FUNCTION_DEG2RAD:	value_set( res, value_calc_double( args[0] ) * NHSP_MPI / 180.0 ); break;
+		case FUNCTION_RAD2DEG:	value_set( res, value_calc_double( args[0] ) * 180.0 / NHSP_MPI ); break;
+		case FUNCTION_SIN:		value_set( res, std::sin( value_calc_double( args[0] ) ) ); break;
+		case FUNCTION_COS:		value_set( res, std::cos( value_calc_double( args[0] ) ) ); break;
+		case FUNCTION_TAN:		value_set( res, std::tan( value_calc_double( args[0] ) ) ); break;
+		case FUNCTION_EXPF:		value_set( res, std::exp( value_calc_double( args[0] ) ) ); break;
+		case FUNCTION_LOGF:		value_set( res, std::log( value_calc_double( args[0] ) ) ); break;
+		case FUNCTION_SQRT:		value_set( res, std::sqrt( value_calc_double( args[0] ) ) ); break;
+		case FUNCTION_ATAN:		value_set( res, std::atan2( value_calc_double( args[0] ), value_calc_double( args[1] ) ) ); break;
+		case FUNCTION_POWF:		value_set( res, std::pow( value_calc_double( args[0] ), value_calc_double( args[1] ) ) ); break;
+		case FUNCTION_LIMIT:
+		{
+			const auto mi = value_calc_int( args[0] );
+			auto r = value_calc_int( args[1] );
+			const auto ma = value_calc_int( args[2] );
+			if ( r < mi )
+			{ r = mi; }
+			if ( r > ma )
+			{ r = ma; }
+			value_set( res, r );
+			break;
+		}
+		case FUNCTION_LIMITF:
+		{
+			const auto mi = value_calc_double( args[0] );
+			auto r = value_calc_double( args[1] );
+			const auto ma = value_calc_double( args[2] );
+			if ( r < mi )
+			{ r = mi; }
+			if ( r > ma )
+			{ r = ma; }
+			value_set( res, r );
+			break;
+		}
+		default:
+			return false;
+	}
+	return true;
+}
 
-	const auto is_space = []( char c ) { return ( c==' ' || c=='\t' ); };
-	const auto is_number = []( char c ) { return ( c>='0' && c<='9' ); };
-	const auto is_alpha = []( char c ) { return ( ( c>='a' && c<='z' ) || ( c>='A' && c<='Z' ) ); };
-	const auto is_rest_ident = [&]( char c ) { return ( is_number(c) || is_alpha(c) || c=='_' ); };
+int count_ast_arguments( const ast_node_t* args )
+{
+	return ( args != nullptr ? args->child_num_ : 0 );
+}
 
-	const auto pp = c.script_ +c.cursor_;
-	const char* p = c.script_ +c.cursor_;
+value_tag constant_node_type( const ast_node_t* n )
+{
+	assert( n->tag_ == NODE_PRIMITIVE_VALUE );
+	switch( n->token_->tag_ )
+	{
+		case TOKEN_INTEGER:	return VALUE_INT;
+		case TOKEN_REAL:	return VALUE_DOUBLE;
+		case TOKEN_STRING:	return VALUE_STRING;
+		default: assert( false ); break;
+	}
+	return VALUE_NONE;
+}
 
-restart:
-	const auto prev_p = p;
-	const auto prev_cursor = static_cast<int>( p - c.script_ );
-	res->appear_line_ = c.line_;
-	switch( p[0] )
+// 実行時にエラーとなる演算は畳み込まない（実行されない箇所にあるかもしれないので）
+bool is_constant_foldable_operation( const ast_t* ast, node_tag tag, const ast_node_t* left, const ast_node_t* right )
+{
+	const auto lt = constant_node_type( left );
+	switch( tag )
 	{
-			// EOF
-		case '\0':	res->tag_ = TOKEN_EOF; break;
+		case NODE_BOR:
+		case NODE_BAND:
+		case NODE_BXOR:
+			return ( lt == VALUE_INT );
+		case NODE_GT:
+		case NODE_GTOE:
+		case NODE_LT:
+		case NODE_LTOE:
+		case NODE_SUB:
+		case NODE_MUL:
+			return ( lt != VALUE_STRING );
+		case NODE_DIV:
+		case NODE_MOD:
+		{
+			if ( lt == VALUE_STRING )
+			{ return false; }
 
-			// 行終わり
-		case '\r':
-		case '\f':
-			++p;
-			goto restart;
+			auto* const l = evaluate_ast_immediate( ast, left );
+			auto* const r = evaluate_ast_immediate( ast, right );
+			bool res = ( l != nullptr && r != nullptr );
+			if ( res && lt == VALUE_INT )
+			{
+				const auto li = value_calc_int( *l );
+				const auto ri = value_calc_int( *r );
+				res = ( ri != 0 && !( ri == -1 && li == INT_MIN ) );
+			}
+			else if ( res )
+			{
+				res = ( value_calc_double( *r ) != 0.0 );
+			}
+			if ( l != nullptr ) { destroy_value( l ); }
+			if ( r != nullptr ) { destroy_value( r ); }
+			return res;
+		}
+		case NODE_UNARY_MINUS:
+			return ( lt != VALUE_STRING );
+		default: break;
+	}
+	return true;
+}
 
-		case '\n':
-			// この位置はマーキング
-			++p;
-			++c.line_;
-			c.line_head_ = p;
-			res->tag_ = TOKEN_EOL;
-			break;
+// 部分木の中で最初に見つかるトークン、行番号を引き継ぐため
+const token_t* find_first_token( const ast_t* ast, const ast_node_t* n )
+{
+	for( ; n != nullptr; n = ast_child( ast, n, 0 ) )
+	{
+		if ( n->token_ != nullptr )
+		{ return n->token_; }
+	}
+	return nullptr;
+}
 
-			// ステートメント終わり
-		case ':':
-			++p;
-			res->tag_ = TOKEN_EOS;
+// 評価結果の値でノードを置き換える、トークンはパーサーの領域に置く
+bool replace_with_constant_node( parse_context_t& c, ast_node_t* n, const value_t& v )
+{
+	char buf[64];
+	const char* content = nullptr;
+	token_tag tag = TOKEN_UNKNOWN;
+	switch( value_get_primitive_tag( v ) )
+	{
+		case VALUE_INT:
+			sprintf( buf, "%d", value_calc_int( v ) );
+			content = buf;
+			tag = TOKEN_INTEGER;
+			break;
+		case VALUE_DOUBLE:
+		{
+			const auto d = value_calc_double( v );
+			if ( !std::isfinite( d ) )
+			{ return false; }
+			sprintf( buf, "%.17g", d );
+			content = buf;
+			tag = TOKEN_REAL;
+			break;
+		}
+		case VALUE_STRING:
+			content = value_get_string( v );
+			tag = TOKEN_STRING;
 			break;
+		default:
+			return false;
+	}
 
-			// プリプロセッサで使う
-		case '%':	++p; res->tag_ = TOKEN_PP_ARG_INDICATOR; break;
+	const auto origin = find_first_token( c.ast_, n );
+	const auto len = strlen( content );
+	const auto text = alloc_token_text( c, len );
+	memcpy( text, content, len +1 );
 
-			// 微妙な文字
-		case '{':	++p; res->tag_ = TOKEN_LBRACE; break;
-		case '}':	++p; res->tag_ = TOKEN_RBRACE; break;
-		case '(':	++p; res->tag_ = TOKEN_LPARENTHESIS; break;
-		case ')':	++p; res->tag_ = TOKEN_RPARENTHESIS; break;
-		case ',':	++p; res->tag_ = TOKEN_COMMA; break;
+	auto token = reinterpret_cast<token_t*>( arena_alloc( c.arena_, sizeof(token_t) ) );
+	token->tag_ = tag;
+	token->content_ = text;
+	token->cursor_begin_ = ( origin ? origin->cursor_begin_ : 0 );
+	token->cursor_end_ = ( origin ? origin->cursor_end_ : 0 );
+	token->appear_line_ = ( origin ? origin->appear_line_ : 0 );
+	token->left_space_ = token->right_space_ = false;
 
-			// 演算子
-		case '|':	++p; if ( p[0] == '=' ) { ++p; res->tag_ = TOKEN_BOR_ASSIGN; } else { res->tag_ = TOKEN_OP_BOR; } break;
-		case '&':	++p; if ( p[0] == '=' ) { ++p; res->tag_ = TOKEN_BAND_ASSIGN; } else { res->tag_ = TOKEN_OP_BAND; } break;
-		case '^':	++p; if ( p[0] == '=' ) { ++p; res->tag_ = TOKEN_BXOR_ASSIGN; } else { res->tag_ = TOKEN_OP_BXOR; } break;
-		case '!':	++p; if ( p[0]=='=' ) { ++p; } res->tag_ = TOKEN_OP_NEQ; break;
-		case '>':
-			++p;
-			if ( p[0] == '=' )
-			{ ++p; res->tag_ = TOKEN_OP_GTOE; }
-			else
-			{ res->tag_ = TOKEN_OP_GT; }
-			break;
-		case '<':
-			++p;
-			if ( p[0] == '=' )
-			{ ++p; res->tag_ = TOKEN_OP_LTOE; }
-			else
-			{ res->tag_ = TOKEN_OP_LT; }
-			break;
-		case '+':	++p; if ( p[0] == '=' ) { ++p; res->tag_ = TOKEN_ADD_ASSIGN; } else { res->tag_ = TOKEN_OP_ADD; } break;
-		case '-':	++p; if ( p[0] == '=' ) { ++p; res->tag_ = TOKEN_SUB_ASSIGN; } else { res->tag_ = TOKEN_OP_SUB; } break;
-		case '*':	++p; if ( p[0] == '=' ) { ++p; res->tag_ = TOKEN_MUL_ASSIGN; } else { res->tag_ = TOKEN_OP_MUL; } break;
-		case '/':
-			++p;
-			if ( p[0] == '/' )// 一行コメント
-			{
-				++p;
-				while( p[0]!='\n' && p[0]!='\0' )
-				{ ++p; }
-				goto restart;
-			}
-			if ( p[0] == '*' )// 複数行コメント
-			{
-				++p;
-				for( ; ; )
-				{
-					if ( p[0] == '\0' )
-					{
-						raise_error( "複数行コメントの読み取り中にEOFが検出されました@@ %d行目", c.line_ );
-						break;
-					}
-					if ( p[0] == '\n' )
-					{
-						++p;
-						++c.line_;
-						c.line_head_ = p;
-						continue;
-					}
-					if ( p[0]=='*' && p[1]=='/' )
-					{
-						p += 2;
-						break;
-					}
-					++p;
-				}
-				goto restart;
-			}
-			if ( p[0] == '=' )
+	// 子のノードは配列に残るが、もう辿られない
+	n->tag_ = NODE_PRIMITIVE_VALUE;
+	n->token_ = token;
+	n->child_num_ = 0;
+	return true;
+}
+
+// 子を先に畳み込み、定数だけの部分木になったら評価して置き換える
+void fold_constant_ast_node( parse_context_t& c, ast_node_t* n )
+{
+	auto* const ast = c.ast_;
+	for( int i=0; i<n->child_num_; ++i )
+	{
+		fold_constant_ast_node( c, ast_child( ast, n, i ) );
+	}
+
+	const auto is_constant = []( const ast_node_t* x )
+	{
+		return ( x != nullptr && x->tag_ == NODE_PRIMITIVE_VALUE );
+	};
+
+	bool is_foldable = false;
+	switch( n->tag_ )
+	{
+		case NODE_EXPRESSION:
+			if ( is_constant( ast_child( ast, n, 0 ) ) )
 			{
-				++p;
-				res->tag_ = TOKEN_DIV_ASSIGN;
-			}
-			else
-			{ 
-				res->tag_ = TOKEN_OP_DIV;
+				// 括弧は外すだけでよい
+				n->tag_ = NODE_PRIMITIVE_VALUE;
+				n->token_ = ast_child( ast, n, 0 )->token_;
+				n->child_num_ = 0;
 			}
+			return;
+
+		case NODE_BOR:
+		case NODE_BAND:
+		case NODE_BXOR:
+		case NODE_EQ:
+		case NODE_NEQ:
+		case NODE_GT:
+		case NODE_GTOE:
+		case NODE_LT:
+		case NODE_LTOE:
+		case NODE_ADD:
+		case NODE_SUB:
+		case NODE_MUL:
+		case NODE_DIV:
+		case NODE_MOD:
+			is_foldable = ( is_constant( ast_child( ast, n, 0 ) ) && is_constant( ast_child( ast, n, 1 ) ) && is_constant_foldable_operation( ast, n->tag_, ast_child( ast, n, 0 ), ast_child( ast, n, 1 ) ) );
 			break;
-		case '\\':	++p; if ( p[0] == '=' ) { ++p; res->tag_ = TOKEN_MOD_ASSIGN; } else { res->tag_ = TOKEN_OP_MOD; } break;
 
-			// 代入
-		case '=':
-			++p;
-			if ( p[0] == '=' )
-			{
-				++p;
-				res->tag_ = TOKEN_OP_EQ;
-			}
-			else
-			{
-				res->tag_ = TOKEN_ASSIGN;
-			}
+		case NODE_UNARY_MINUS:
+			is_foldable = ( is_constant( ast_child( ast, n, 0 ) ) && is_constant_foldable_operation( ast, n->tag_, ast_child( ast, n, 0 ), nullptr ) );
 			break;
 
-			// 文字列
-		case '\"':
+		case NODE_IDENTIFIER_EXPR:
 		{
-			++p;
-			const auto s = p;
-			while( p[0]!='\"' )
+			const auto function = query_function( n->token_->content_ );
+			if ( function < 0 || ast_child( ast, n, 0 ) == nullptr )
+			{ break; }
+			const auto arg_num = count_ast_arguments( ast_child( ast, n, 0 ) );
+			if ( arg_num != query_pure_function_arg_num( function ) )
+			{ break; }
+
+			const auto args = ast_child( ast, n, 0 );
+			is_foldable = true;
+			for( int i=0; i<arg_num; ++i )
 			{
-				if ( p[0] == '\0' )
-				{
-					raise_error( "文字列の読み取り中にEOFが検出されました@@ %d行目", c.line_ );
-				}
-				if ( p[0]=='\\' && p[1]=='\"' )
-				{
-					++p;
-				}
-				++p;
+				is_foldable = ( is_foldable && is_constant( ast_child( ast, args, i ) ) );
 			}
-			const auto e = p;
-			res->content_ = create_token_string( s, e -s );
-			res->tag_ = TOKEN_STRING;
-			++p;
-			break;
-		}
-
-			// コメント
-		case ';':
-			++p;
-			while( p[0]!='\n' && p[0]!='\0' )
+			if ( is_foldable && function == FUNCTION_STRLEN )
 			{
-				++p;
+				is_foldable = ( constant_node_type( ast_child( ast, args, 0 ) ) == VALUE_STRING );
 			}
-			goto restart;
+			break;
+		}
 
 		default:
-			if ( is_space( p[0] ) )
-			{
-				// スペース
-				++p;
-				res->left_space_ =true;
-				while( is_space(p[0]) )
-				{
-					++p;
-				}
-				goto restart;
-			}
-			else if ( is_number( p[0] ) )
-			{
-				// 数値
-				if ( p[0] == '0' )
-				{
-					++p;
-				}
-				else
-				{
-					while( is_number(p[0]) )
-					{
-						++p;
-					}
-				}
-				if ( p[0] == '.' )
-				{
-					++p;
-					while( is_number(p[0]) )
-					{
-						++p;
-					}
-					res->tag_ = TOKEN_REAL;
-				}
-				else
-				{
-					res->tag_ = TOKEN_INTEGER;
-				}
-			}
-			else if ( is_alpha( p[0] ) )
-			{
-				// 何らかの識別子
-				++p;
-				while( is_rest_ident( p[0] ) )
-				{
-					++p;
-				}
-				res->tag_ = TOKEN_IDENTIFIER;
-				const auto shadow =query_token_shadow( c.script_ +prev_cursor, p -prev_p );
-				if ( shadow != -1 )
-				{
-					res->tag_ = static_cast<token_tag>( shadow );
-				}
-			}
-			else
-			{
-				// もう読めない
-				raise_error( "読み取れない文字[%c]@@ %d行目", p[0], c.line_ );
-			}
 			break;
 	}
 
-	if ( is_space( p[0] ) )
-	{
-		res->right_space_ = true;
-	}
+	if ( !is_foldable )
+	{ return; }
 
-	c.cursor_ += static_cast<int>( p - pp );
-	res->cursor_begin_ = prev_cursor;
-	res->cursor_end_ = c.cursor_;
+	auto* const v = evaluate_ast_immediate( ast, n );
+	if ( v == nullptr )
+	{ return; }
+	replace_with_constant_node( c, n, *v );
+	destroy_value( v );
+}
 
-	// contentが埋まってないなら埋める
-	if ( res->content_ == nullptr )
-	{
-		const auto len = res->cursor_end_ -res->cursor_begin_;
-		res->content_ = create_string( len );
-		memcpy( res->content_, c.script_ +res->cursor_begin_, len );
-		res->content_[len] = '\0';
-	}
+//=============================================================================
+// JIT
+#if NHSP_JIT_AVAILABLE
+// 翻訳したコードの呼び出し規約、variables[i] は jit_region_t::variable_slots_[i] 番の変数の添え字0の要素
+typedef void (*jit_function_t)( void** variables, int loop_num );
 
-	return res;
-}
+// 翻訳したコードから呼ぶ数学関数、組み込み関数と同じものを呼ぶ
+typedef double (*jit_math_function_t)( double );
+typedef double (*jit_math_function2_t)( double, double );
 
-void destroy_token( token_t* t )
+static const int MAX_JIT_VARIABLE = 64;
+static const int MAX_JIT_OPERAND_STACK = 64;
+
+// 翻訳時のオペランドスタックの要素、値そのものはネイティブのスタックに積まれたものだけ
+enum jit_operand_tag
 {
-	if ( t->content_ != nullptr )
-	{
-		destroy_string( t->content_ );
-		t->content_ = nullptr;
-	}
-	xfree( t );
-}
+	JIT_OPERAND_CONSTANT,// value_ が即値
+	JIT_OPERAND_VARIABLE,// value_ 番目の変数の参照
+	JIT_OPERAND_COUNTER,// cnt
+	JIT_OPERAND_STACK,// ネイティブのスタックに積まれた計算結果
+};
 
-char* create_token_string( const char* str, size_t len )
+struct jit_operand_t
 {
-	char* res = create_string( len );
+	jit_operand_tag		tag_;
+	value_tag			type_;// VALUE_INT か VALUE_DOUBLE
+	int					value_;
+	double				dvalue_;// 実数の即値
+};
 
-	size_t w =0;
-	for( size_t i=0; i<len; ++i, ++w )
+struct jit_assembler_t
+{
+	unsigned char*	buffer_;
+	size_t			size_;
+	size_t			buffer_size_;
+
+	jit_operand_t	operand_[MAX_JIT_OPERAND_STACK];
+	int				operand_num_;
+
+	// 飛び先の命令位置が決まってから埋める rel32
+	int*			patch_offset_;
+	int*			patch_target_;
+	int				patch_num_;
+};
+
+// x86-64 のレジスタ番号
+enum jit_register_tag
+{
+	JIT_EAX = 0,
+	JIT_ECX = 1,
+	JIT_EDX = 2,
+};
+
+// 実数は SSE2 のレジスタで計算する
+enum jit_xmm_register_tag
+{
+	JIT_XMM0 = 0,
+	JIT_XMM1 = 1,
+	JIT_XMM2 = 2,
+	JIT_XMM3 = 3,
+};
+
+void jit_emit( jit_assembler_t& a, std::initializer_list<int> bytes )
+{
+	if ( a.size_ +bytes.size() > a.buffer_size_ )
 	{
-		if ( str[i]=='\\' && (i+1)<len )
-		{
-			switch( str[i+1] )
-			{
-				case 't':	res[w] = '\t'; break;
-				case 'n':	res[w] = '\n'; break;
-				case '\"':	res[w] = '\"'; break;
-				default:
-					raise_error( "読み取れないエスケープシーケンス@@ %c%c", str[i], str[i+1] );
-					break;
-			}
-			++i;
-		}
-		else
-		{
-			res[w] = str[i];
-		}
+		a.buffer_size_ = ( a.buffer_size_ +bytes.size() ) *2;
+		a.buffer_ = reinterpret_cast<unsigned char*>( xrealloc( a.buffer_, a.buffer_size_ ) );
+	}
+	for( const auto b : bytes )
+	{
+		a.buffer_[ a.size_++ ] = static_cast<unsigned char>( b );
 	}
-	res[w] = '\0';
-	return res;
 }
 
-//=============================================================================
-// パーサ
-parse_context_t* create_parse_context()
+void jit_emit32( jit_assembler_t& a, int v )
 {
-	auto res = reinterpret_cast<parse_context_t*>( xmalloc( sizeof(parse_context_t) ) );
-	return res;
+	const auto u = static_cast<uint32_t>( v );
+	jit_emit( a, { static_cast<int>( u & 0xFF ), static_cast<int>( ( u >> 8 ) & 0xFF ), static_cast<int>( ( u >> 16 ) & 0xFF ), static_cast<int>( ( u >> 24 ) & 0xFF ) } );
 }
 
-void destroy_parse_context( parse_context_t* p )
+void jit_emit64( jit_assembler_t& a, uint64_t v )
 {
-	xfree( p );
+	jit_emit32( a, static_cast<int>( v & 0xFFFFFFFFu ) );
+	jit_emit32( a, static_cast<int>( v >> 32 ) );
 }
 
-void initialize_parse_context( parse_context_t* c, tokenize_context_t& t )
+// jmp/jcc rel32 を書き出し、飛び先は後で埋める
+void jit_emit_jump( jit_assembler_t& a, std::initializer_list<int> opcode, int target )
 {
-	c->token_list_ = create_list();
-	c->token_current_ = nullptr;
-	c->tokenize_context_ = &t;
+	jit_emit( a, opcode );
+	a.patch_offset_[ a.patch_num_ ] = static_cast<int>( a.size_ );
+	a.patch_target_[ a.patch_num_ ] = target;
+	++a.patch_num_;
+	jit_emit32( a, 0 );
 }
 
-void uninitialize_parse_context( parse_context_t* c )
+bool jit_push_operand( jit_assembler_t& a, jit_operand_tag tag, value_tag type, int value, double dvalue =0.0 )
 {
-	if ( c->token_list_ != nullptr )
+	if ( a.operand_num_ >= MAX_JIT_OPERAND_STACK )
+	{ return false; }
+	a.operand_[ a.operand_num_ ].tag_ = tag;
+	a.operand_[ a.operand_num_ ].type_ = type;
+	a.operand_[ a.operand_num_ ].value_ = value;
+	a.operand_[ a.operand_num_ ].dvalue_ = dvalue;
+	++a.operand_num_;
+	return true;
+}
+
+// 計算結果を、整数なら eax から、実数なら xmm0 からネイティブのスタックに積む
+bool jit_push_result( jit_assembler_t& a, value_tag type )
+{
+	if ( type == VALUE_DOUBLE )
 	{
-		list_node_t* iter =c->token_list_->head_;
-		while( iter != nullptr )
-		{
-			const auto next =iter->next_;
-			token_t* token =reinterpret_cast<token_t*>( iter->value_ );
-			destroy_token( token );
-			destroy_list_node( iter );
-			iter = next;
-		}
-		destroy_list( c->token_list_ );
+		jit_emit( a, { 0x66, 0x48, 0x0F, 0x7E, 0xC0 } );// movq rax, xmm0
 	}
-
-	c->token_list_ = nullptr;
-	c->token_current_ = nullptr;
+	jit_emit( a, { 0x50 } );// push rax
+	return jit_push_operand( a, JIT_OPERAND_STACK, type, 0 );
 }
 
-token_t* read_token( parse_context_t& c )
+// 上から i 番目（0が一番上）のオペランドの型
+value_tag jit_operand_type( const jit_assembler_t& a, int i )
 {
-	const auto read = [&c]()
-	{
-		auto list = create_list_node();
-		list->value_ = get_token( *c.tokenize_context_ );
-		return list;
-	};
+	assert( i < a.operand_num_ );
+	return a.operand_[ a.operand_num_ -1 -i ].type_;
+}
 
-	if ( c.token_current_ == nullptr )
+// 整数のオペランドを reg に読み込む
+void jit_load_int_operand( jit_assembler_t& a, const jit_operand_t& o, int reg )
+{
+	assert( o.type_ == VALUE_INT );
+	switch( o.tag_ )
 	{
-		const auto node =read();
-		list_append( *c.token_list_, node );
-		c.token_current_ = node;
+		case JIT_OPERAND_CONSTANT:
+			jit_emit( a, { 0xB8 +reg } );// mov r32, imm32
+			jit_emit32( a, o.value_ );
+			break;
+		case JIT_OPERAND_VARIABLE:
+			jit_emit( a, { 0x48, 0x8B, 0x83 | ( reg << 3 ) } );// mov r64, [rbx +disp32]
+			jit_emit32( a, o.value_ *8 );
+			jit_emit( a, { 0x8B, ( reg << 3 ) | reg } );// mov r32, [r64]
+			break;
+		case JIT_OPERAND_COUNTER:
+			jit_emit( a, { 0x44, 0x89, 0xE0 | reg } );// mov r32, r12d
+			break;
+		case JIT_OPERAND_STACK:
+			jit_emit( a, { 0x58 +reg } );// pop r64
+			break;
 	}
-	assert( c.token_current_ != nullptr );
-	const auto res = c.token_current_;
-	c.token_current_ = c.token_current_->next_;
-	return reinterpret_cast<token_t*>( res->value_ );
 }
 
-void unread_token( parse_context_t& c, size_t num )
+// xmm に実数の即値を読み込む、gpr は作業用
+void jit_emit_load_double( jit_assembler_t& a, int xmm, double v, int gpr )
 {
-	if ( num <= 0 )
-	{
-		return;
-	}
+	uint64_t bits;
+	memcpy( &bits, &v, sizeof(bits) );
+	jit_emit( a, { 0x48, 0xB8 +gpr } );// mov r64, imm64
+	jit_emit64( a, bits );
+	jit_emit( a, { 0x66, 0x48, 0x0F, 0x6E, 0xC0 | ( xmm << 3 ) | gpr } );// movq xmm, r64
+}
 
-	if ( c.token_current_ == nullptr )
+// 実数のオペランドを xmm に読み込む、gpr は作業用
+void jit_load_double_operand( jit_assembler_t& a, const jit_operand_t& o, int xmm, int gpr )
+{
+	assert( o.type_ == VALUE_DOUBLE );
+	switch( o.tag_ )
 	{
-		c.token_current_ = c.token_list_->tail_;
-		--num;
+		case JIT_OPERAND_CONSTANT:
+			jit_emit_load_double( a, xmm, o.dvalue_, gpr );
+			break;
+		case JIT_OPERAND_VARIABLE:
+			jit_emit( a, { 0x48, 0x8B, 0x83 | ( gpr << 3 ) } );// mov r64, [rbx +disp32]
+			jit_emit32( a, o.value_ *8 );
+			jit_emit( a, { 0xF2, 0x0F, 0x10, ( xmm << 3 ) | gpr } );// movsd xmm, [r64]
+			break;
+		case JIT_OPERAND_STACK:
+			jit_emit( a, { 0x58 +gpr } );// pop r64
+			jit_emit( a, { 0x66, 0x48, 0x0F, 0x6E, 0xC0 | ( xmm << 3 ) | gpr } );// movq xmm, r64
+			break;
+		default: assert( false ); break;
 	}
+}
 
-	while( num-- > 0 )
+// オペランドを一つ降ろして整数として reg に読み込む、実数は value_calc_int と同じく切り捨てる
+void jit_pop_operand( jit_assembler_t& a, int reg )
+{
+	assert( a.operand_num_ > 0 );
+	const auto o = a.operand_[ --a.operand_num_ ];
+	if ( o.type_ == VALUE_DOUBLE )
 	{
-		assert( c.token_current_ != nullptr );
-		c.token_current_ = c.token_current_->prev_;
+		jit_load_double_operand( a, o, JIT_XMM3, reg );
+		jit_emit( a, { 0xF2, 0x0F, 0x2C, 0xC0 | ( reg << 3 ) | JIT_XMM3 } );// cvttsd2si r32, xmm3
+		return;
 	}
+	jit_load_int_operand( a, o, reg );
 }
 
-token_t* prev_token( parse_context_t& c, size_t num )
+// オペランドを一つ降ろして実数として xmm に読み込む、eax を壊す
+void jit_pop_double_operand( jit_assembler_t& a, int xmm )
 {
-	auto current = c.token_current_;
-	if ( current == nullptr )
+	assert( a.operand_num_ > 0 );
+	const auto o = a.operand_[ --a.operand_num_ ];
+	if ( o.type_ == VALUE_INT )
 	{
-		current = c.token_list_->tail_;
-	}
-	while( num-- > 0 )
-	{
-		assert( current != nullptr );
-		current = current->prev_;
+		jit_load_int_operand( a, o, JIT_EAX );
+		jit_emit( a, { 0xF2, 0x0F, 0x2A, 0xC0 | ( xmm << 3 ) } );// cvtsi2sd xmm, eax
+		return;
 	}
-	return reinterpret_cast<token_t*>( current->value_ );
+	jit_load_double_operand( a, o, xmm, JIT_EAX );
 }
 
-//=============================================================================
-// プリプロセッサ
-int query_preprocessor( const char* s )
+// 後ろに続く命令を飛び越す jcc rel8 を書き出す、飛び先は jit_patch_skip で埋める
+size_t jit_emit_skip( jit_assembler_t& a, int opcode )
 {
-	static const struct
-	{
-		int				tag_;
-		const char*		word_;
-	} table[] =
-	{
-		{ PREPRO_DEFINE,	"define", },
-		{ PREPRO_UNDEF,		"undef", },
-		{ PREPRO_IF,		"if", },
-		{ PREPRO_IFDEF,		"ifdef", },
-		{ PREPRO_ENDIF,		"endif", },
-		{ PREPRO_ENUM,		"enum", },
-		{ -1,				nullptr },
-	};
-
-	// 全探索
-	for( int i=0; table[i].tag_!=-1; ++i )
-	{
-		if ( string_equal_igcase( s, table[i].word_ ) )
-		{
-			return table[i].tag_;
-		}
-	}
-	return PREPRO_UNKNOWN;
+	jit_emit( a, { opcode, 0 } );
+	return a.size_;
 }
 
-void initialize_macro_arg( macro_arg_t* ma )
+void jit_patch_skip( jit_assembler_t& a, size_t from )
 {
-	ma->arg_param_ = nullptr;
+	const auto rel = a.size_ -from;
+	assert( rel < 128 );
+	a.buffer_[ from -1 ] = static_cast<unsigned char>( rel );
 }
 
-void uninitialize_macro_arg( macro_arg_t* ma )
+// C の関数を呼ぶ、ネイティブのスタックに積んだ計算結果の数から rsp を16バイト境界に揃える
+// 関数の入口で rbx, r12, r13 を積んだ時点で揃っている
+void jit_emit_call( jit_assembler_t& a, uint64_t function )
 {
-	if ( ma->arg_param_ != nullptr )
+	int depth =0;
+	for( int i=0; i<a.operand_num_; ++i )
 	{
-		destroy_string( ma->arg_param_ );
-		ma->arg_param_ = nullptr;
+		if ( a.operand_[i].tag_ == JIT_OPERAND_STACK )
+		{ ++depth; }
+	}
+	if ( depth %2 != 0 )
+	{
+		jit_emit( a, { 0x48, 0x83, 0xEC, 0x08 } );// sub rsp, 8
+	}
+	jit_emit( a, { 0x48, 0xB8 } );// mov rax, imm64
+	jit_emit64( a, function );
+	jit_emit( a, { 0xFF, 0xD0 } );// call rax
+	if ( depth %2 != 0 )
+	{
+		jit_emit( a, { 0x48, 0x83, 0xC4, 0x08 } );// add rsp, 8
 	}
 }
 
-macro_t* create_macro()
+// 実行時エラーは元の命令と同じメッセージで出す、翻訳したコードから呼ばれる
+void raise_jit_error( int op, int type, const char* name )
 {
-	auto* const res = reinterpret_cast<macro_t*>( xmalloc( sizeof(macro_t) ) );
-	res->name_ = nullptr;
-	res->is_ctype_ = false;
-	res->param_num_ = 0;
-	for ( auto& it : res->params_ )
+	const auto is_double = ( type == VALUE_DOUBLE );
+	switch( op )
 	{
-		it.default_param_ = nullptr;
+		case OPERATOR_DIV:			raise_error( is_double ? "0.0除算が行われました" : "0除算が行われました" ); break;
+		case OPERATOR_MOD:			raise_error( is_double ? "0.0除算が行われました" : "0剰余が行われました" ); break;
+		case OPERATOR_DIV_ASSIGN:	raise_error( "0除算が行われました@@ %s(%d)", name, 0 ); break;
+		case OPERATOR_MOD_ASSIGN:	raise_error( is_double ? "0.0剰余が行われました@@ %s(%d)" : "0剰余が行われました@@ %s(%d)", name, 0 ); break;
+		default: assert( false ); break;
 	}
-	res->replacing_ = nullptr;
-	return res;
 }
 
-void destroy_macro( macro_t* m )
+// raise_jit_error を呼んで終了する、戻ってこないのでスタックはそのまま揃える
+void jit_emit_error( jit_assembler_t& a, int op, value_tag type, const char* name )
 {
-	macro_free_content( m );
-	xfree( m );
+	jit_emit( a, { 0x48, 0x83, 0xE4, 0xF0 } );// and rsp, -16
+	jit_emit( a, { 0xBF } );// mov edi, imm32
+	jit_emit32( a, op );
+	jit_emit( a, { 0xBE } );// mov esi, imm32
+	jit_emit32( a, type );
+	jit_emit( a, { 0x48, 0xBA } );// mov rdx, imm64
+	jit_emit64( a, reinterpret_cast<uint64_t>( name ) );
+	jit_emit( a, { 0x48, 0xB8 } );// mov rax, imm64
+	jit_emit64( a, reinterpret_cast<uint64_t>( &raise_jit_error ) );
+	jit_emit( a, { 0xFF, 0xD0 } );// call rax
 }
 
-void macro_free_content( macro_t* macro )
+// ecx が0なら raise_jit_error を呼んで終了する
+void jit_emit_zero_check( jit_assembler_t& a, int op, const char* name )
 {
-	if ( macro->name_ != nullptr )
-	{
-		destroy_string( macro->name_ );
-		macro->name_ = nullptr;
-	}
+	jit_emit( a, { 0x85, 0xC9 } );// test ecx, ecx
+	const auto skip = jit_emit_skip( a, 0x75 );// jnz
+	jit_emit_error( a, op, VALUE_INT, name );
+	jit_patch_skip( a, skip );
+}
 
-	if ( macro->replacing_ != nullptr )
+// xmm1 が 0.0 なら raise_jit_error を呼んで終了する、NaN は 0.0 ではない
+void jit_emit_double_zero_check( jit_assembler_t& a, int op, const char* name )
+{
+	jit_emit( a, { 0x66, 0x0F, 0x57, 0xD2 } );// xorpd xmm2, xmm2
+	jit_emit( a, { 0x66, 0x0F, 0x2E, 0xCA } );// ucomisd xmm1, xmm2
+	const auto skip_unordered = jit_emit_skip( a, 0x7A );// jp
+	const auto skip_not_equal = jit_emit_skip( a, 0x75 );// jne
+	jit_emit_error( a, op, VALUE_DOUBLE, name );
+	jit_patch_skip( a, skip_unordered );
+	jit_patch_skip( a, skip_not_equal );
+}
+
+// eax = eax (op) ecx、name は複合代入の時の代入先の変数名
+void jit_emit_arithmetic( jit_assembler_t& a, int op, const char* name )
+{
+	switch( op )
 	{
-		destroy_string( macro->replacing_ );
-		macro->replacing_ = nullptr;
+		case OPERATOR_BOR:	jit_emit( a, { 0x09, 0xC8 } ); break;// or eax, ecx
+		case OPERATOR_BAND:	jit_emit( a, { 0x21, 0xC8 } ); break;// and eax, ecx
+		case OPERATOR_BXOR:	jit_emit( a, { 0x31, 0xC8 } ); break;// xor eax, ecx
+		case OPERATOR_ADD:	jit_emit( a, { 0x01, 0xC8 } ); break;// add eax, ecx
+		case OPERATOR_SUB:	jit_emit( a, { 0x29, 0xC8 } ); break;// sub eax, ecx
+		case OPERATOR_MUL:	jit_emit( a, { 0x0F, 0xAF, 0xC1 } ); break;// imul eax, ecx
+		case OPERATOR_DIV:
+		case OPERATOR_MOD:
+		{
+			const auto error_op = ( name == nullptr ? op : ( op == OPERATOR_DIV ? OPERATOR_DIV_ASSIGN : OPERATOR_MOD_ASSIGN ) );
+			jit_emit_zero_check( a, error_op, name );
+			jit_emit( a, { 0x99, 0xF7, 0xF9 } );// cdq; idiv ecx
+			if ( op == OPERATOR_MOD )
+			{
+				jit_emit( a, { 0x89, 0xD0 } );// mov eax, edx
+			}
+			break;
+		}
+		default: assert( false ); break;
 	}
+}
 
-	for ( auto& it : macro->params_ )
+// xmm0 = xmm0 (op) xmm1、浮動小数点に定義されていない演算なら false
+// name は複合代入の時の代入先の変数名
+bool jit_emit_double_arithmetic( jit_assembler_t& a, int op, const char* name )
+{
+	switch( op )
 	{
-		if ( it.default_param_ != nullptr )
+		case OPERATOR_ADD:	jit_emit( a, { 0xF2, 0x0F, 0x58, 0xC1 } ); break;// addsd xmm0, xmm1
+		case OPERATOR_SUB:	jit_emit( a, { 0xF2, 0x0F, 0x5C, 0xC1 } ); break;// subsd xmm0, xmm1
+		case OPERATOR_MUL:	jit_emit( a, { 0xF2, 0x0F, 0x59, 0xC1 } ); break;// mulsd xmm0, xmm1
+		case OPERATOR_DIV:
+		case OPERATOR_MOD:
 		{
-			destroy_string( it.default_param_ );
-			it.default_param_ = nullptr;
+			const auto error_op = ( name == nullptr ? op : ( op == OPERATOR_DIV ? OPERATOR_DIV_ASSIGN : OPERATOR_MOD_ASSIGN ) );
+			jit_emit_double_zero_check( a, error_op, name );
+			if ( op == OPERATOR_DIV )
+			{
+				jit_emit( a, { 0xF2, 0x0F, 0x5E, 0xC1 } );// divsd xmm0, xmm1
+			}
+			else
+			{
+				jit_emit_call( a, reinterpret_cast<uint64_t>( static_cast<jit_math_function2_t>( &std::fmod ) ) );
+			}
+			break;
 		}
+		default: return false;
 	}
-	macro->param_num_ = 0;
+	return true;
 }
 
-prepro_context_t* create_prepro_context()
+// eax = ( xmm0 (op) xmm1 ? 1 : 0 )、どちらかが NaN なら != だけが成り立つ
+void jit_emit_double_compare( jit_assembler_t& a, int op )
 {
-	auto res = reinterpret_cast<prepro_context_t*>( xmalloc( sizeof(prepro_context_t) ) );
-	res->macro_list_ = create_list();
-	res->line_ = 0;
-	res->out_buffer_ = nullptr;
-	res->is_current_region_valid_ = true;
-	res->pp_region_idx_ = 0;
-	res->pp_region_[0].is_valid_ = true;
-	res->pp_region_[0].line_ = true;
-	res->enum_next_ = 0;
-	return res;
+	switch( op )
+	{
+		case OPERATOR_EQ:
+			jit_emit( a, { 0x66, 0x0F, 0x2E, 0xC1 } );// ucomisd xmm0, xmm1
+			jit_emit( a, { 0x0F, 0x94, 0xC0, 0x0F, 0x9B, 0xC1, 0x20, 0xC8 } );// sete al; setnp cl; and al, cl
+			break;
+		case OPERATOR_NEQ:
+			jit_emit( a, { 0x66, 0x0F, 0x2E, 0xC1 } );// ucomisd xmm0, xmm1
+			jit_emit( a, { 0x0F, 0x95, 0xC0, 0x0F, 0x9A, 0xC1, 0x08, 0xC8 } );// setne al; setp cl; or al, cl
+			break;
+		case OPERATOR_GT:
+			jit_emit( a, { 0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x97, 0xC0 } );// ucomisd xmm0, xmm1; seta al
+			break;
+		case OPERATOR_GTOE:
+			jit_emit( a, { 0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x93, 0xC0 } );// ucomisd xmm0, xmm1; setae al
+			break;
+		case OPERATOR_LT:
+			jit_emit( a, { 0x66, 0x0F, 0x2E, 0xC8, 0x0F, 0x97, 0xC0 } );// ucomisd xmm1, xmm0; seta al
+			break;
+		case OPERATOR_LTOE:
+			jit_emit( a, { 0x66, 0x0F, 0x2E, 0xC8, 0x0F, 0x93, 0xC0 } );// ucomisd xmm1, xmm0; setae al
+			break;
+		default: assert( false ); break;
+	}
+	jit_emit( a, { 0x0F, 0xB6, 0xC0 } );// movzx eax, al
 }
 
-void destroy_prepro_context( prepro_context_t* pctx )
+// 比較演算子に対応する条件コード
+int jit_condition_code( int op )
 {
-	assert( pctx != nullptr );
+	switch( op )
 	{
-		auto* node = pctx->macro_list_->head_;
-		while( node != nullptr )
-		{
-			auto* macro = reinterpret_cast<macro_t*>( node->value_ );
-			destroy_macro( macro );
-			node = node->next_;;
-		}
+		case OPERATOR_EQ:	return 0x4;
+		case OPERATOR_NEQ:	return 0x5;
+		case OPERATOR_GT:	return 0xF;
+		case OPERATOR_GTOE:	return 0xD;
+		case OPERATOR_LT:	return 0xC;
+		case OPERATOR_LTOE:	return 0xE;
+		default: assert( false ); break;
 	}
-	list_free_all( *pctx->macro_list_ );
-	destroy_list( pctx->macro_list_ );
+	return 0;
+}
 
-	if ( pctx->out_buffer_ != nullptr )
-	{
-		destroy_string_buffer( pctx->out_buffer_ );
-		pctx->out_buffer_ = nullptr;
+// 特殊化された整数命令を元の命令に戻す
+int jit_generic_operator( int op )
+{
+	switch( op )
+	{
+		case OPERATOR_ADD_INT_INT:	return OPERATOR_ADD;
+		case OPERATOR_SUB_INT_INT:	return OPERATOR_SUB;
+		case OPERATOR_MUL_INT_INT:	return OPERATOR_MUL;
+		case OPERATOR_EQ_INT_INT:	return OPERATOR_EQ;
+		case OPERATOR_NEQ_INT_INT:	return OPERATOR_NEQ;
+		case OPERATOR_GT_INT_INT:	return OPERATOR_GT;
+		case OPERATOR_GTOE_INT_INT:	return OPERATOR_GTOE;
+		case OPERATOR_LT_INT_INT:	return OPERATOR_LT;
+		case OPERATOR_LTOE_INT_INT:	return OPERATOR_LTOE;
+		case OPERATOR_ADD_DOUBLE_DOUBLE:	return OPERATOR_ADD;
+		case OPERATOR_SUB_DOUBLE_DOUBLE:	return OPERATOR_SUB;
+		case OPERATOR_MUL_DOUBLE_DOUBLE:	return OPERATOR_MUL;
+		case OPERATOR_ASSIGN_INT:	return OPERATOR_ASSIGN;
+		case OPERATOR_ASSIGN_DOUBLE:	return OPERATOR_ASSIGN;
+		case OPERATOR_CMP_JUMP_IF_FALSE_INT_INT:	return OPERATOR_CMP_JUMP_IF_FALSE;
+		default: break;
 	}
-	xfree( pctx );
+	return op;
 }
 
-void prepro_register_default_macros( prepro_context_t* pctx )
+// 変数のスロット番号を翻訳したコードの中での番号にする、整数でも実数でもない変数は -1
+// 型は翻訳した時のものを覚えておく
+int jit_variable_slot( jit_region_t* region, const variable_table_t* table, int variable_slot )
 {
+	for( int i=0; i<region->variable_num_; ++i )
 	{
-		auto* const nm = create_macro();
-		nm->name_ = create_string( "M_PI" );
-		nm->replacing_ = create_string( "3.141592653589793238" );
-		prepro_register_macro( pctx, nm );
+		if ( region->variable_slots_[i] == variable_slot )
+		{ return i; }
 	}
+	const auto type = table->variables_[ variable_slot ].type_;
+	if ( region->variable_num_ >= MAX_JIT_VARIABLE || ( type != VALUE_INT && type != VALUE_DOUBLE ) )
+	{ return -1; }
+	region->variable_slots_[ region->variable_num_ ] = variable_slot;
+	region->variable_types_[ region->variable_num_ ] = type;
+	return region->variable_num_++;
 }
 
-char* prepro_do( const char* src )
+// repeat_pc の repeat-loop の本体を翻訳する
+// 本体が整数と実数の変数、即値、cnt、算術演算、数学関数、代入、分岐のみで出来ている時だけ翻訳し、それ以外は false
+// 演算は元の命令と同じく左辺の型で行い、右辺はその型に変換する
+// 実行時はすべての変数が翻訳した時の型であることを確かめてから呼び、型を変える代入は翻訳しないので、本体の中で型が変わることはない
+bool jit_compile_region( jit_assembler_t& a, jit_region_t* region, const variable_table_t* table, const constant_t* constants, const code_t* codes, int code_size, int repeat_pc )
 {
-	auto* pctx = create_prepro_context();
-	prepro_register_default_macros( pctx );
-	pctx->out_buffer_ = create_string_buffer();
+	const auto check_pc = repeat_pc +1;
+	const auto loop_pc = code_operand( codes[ repeat_pc ] );
+	const auto exit_pc = loop_pc +1;
+	if ( check_pc >= code_size || code_operator( codes[ check_pc ] ) != OPERATOR_REPEAT_CHECK || loop_pc <= check_pc || loop_pc >= code_size || code_operator( codes[ loop_pc ] ) != OPERATOR_LOOP )
+	{ return false; }
 
-	const char* p = src;
-	for ( ; ; )
+	const auto base = check_pc;
+	const auto range = exit_pc -base +1;
+	auto* const native_offset = reinterpret_cast<int*>( xmalloc( sizeof(int) *range ) );
+	auto* const is_target = reinterpret_cast<bool*>( xmalloc( sizeof(bool) *range ) );
+	for( int i=0; i<range; ++i )
 	{
-		const char* const s = p;
+		native_offset[i] = -1;
+		is_target[i] = false;
+	}
 
-		string_buffer_t line;
-		initialize_string_buffer( &line );
+	bool is_succeeded = true;
 
+	// 分岐先がすべて本体の命令の先頭か loop であることを確かめる
+	int instruction_num = 0;
+	{
+		int pc = check_pc +1;
+		for( ; pc < loop_pc; pc += code_operator_size( codes[ pc ] ) )
 		{
-			bool is_in_multi_line_comment = false;
-			for ( ; ; )
+			++instruction_num;
+			int target = -1;
+			switch( code_operator( codes[ pc ] ) )
 			{
-				if ( p[0] == '/' && p[1] == '*' )
-				{
-					is_in_multi_line_comment = true;
-					p += 2;
-					continue;
-				}
-				else if ( p[0] == '*' && p[1] == '/' )
-				{
-					is_in_multi_line_comment = false;
-					p += 2;
-					continue;
-				}
-				else if ( p[0] == '\\' && p[1] == '\n' )
+				case OPERATOR_IF:			target = pc +code_operand( codes[ pc ] ); break;
+				case OPERATOR_JUMP:			target = code_operand( codes[ pc ] ); break;
+				case OPERATOR_JUMP_RELATIVE:	target = pc +code_operand( codes[ pc ] ); break;
+				case OPERATOR_CMP_JUMP_IF_FALSE:
+				case OPERATOR_CMP_JUMP_IF_FALSE_INT_INT:
+					target = pc +code_operand( codes[ pc ] ); break;
+				default: break;
+			}
+			if ( target >= 0 )
+			{
+				if ( target <= check_pc || target > loop_pc )
 				{
-					p += 2;
-					++pctx->line_;
-					continue;
+					is_succeeded = false;
+					break;
 				}
-				else if ( p[0] == '\n' )
-				{
-					if ( !is_in_multi_line_comment )
-					{
-						break;
-					}
-					++pctx->line_;
-				}
-				else if ( p[0] == '\0' )
-				{
-					break;
-				}
-				if ( !is_in_multi_line_comment )
-				{
-					string_buffer_append( &line, p, 1 );
-				}
-				++p;
+				is_target[ target -base ] = true;
 			}
 		}
-
-		const char* const e = p;
-
-		if ( e > s )
+		if ( pc != loop_pc )
+		{ is_succeeded = false; }
+	}
+	if ( is_succeeded )
+	{
+		// 命令の途中に飛び込んでいないか
+		int pc = check_pc +1;
+		for( ; pc < loop_pc; pc += code_operator_size( codes[ pc ] ) )
 		{
-			auto* out_line = prepro_line( pctx, line.buffer_, true );
-
-			if ( out_line != nullptr )
+			for( int i=pc +1; i<pc +code_operator_size( codes[ pc ] ); ++i )
 			{
-				string_buffer_append( pctx->out_buffer_, out_line );
-				destroy_string( out_line );
+				if ( is_target[ i -base ] )
+				{ is_succeeded = false; }
 			}
 		}
+	}
 
-		uninitialize_string_buffer( &line );
-
-		if ( p[0] == '\0' )
-		{
-			break;
-		}
+	a.patch_offset_ = reinterpret_cast<int*>( xmalloc( sizeof(int) *( instruction_num +1 ) ) );
+	a.patch_target_ = reinterpret_cast<int*>( xmalloc( sizeof(int) *( instruction_num +1 ) ) );
+	a.patch_num_ = 0;
+	a.operand_num_ = 0;
 
-		string_buffer_append( pctx->out_buffer_, "\n" );
+	if ( is_succeeded )
+	{
+		// push rbx; push r12; push r13; mov rbx, rdi; mov r13d, esi; xor r12d, r12d
+		jit_emit( a, { 0x53, 0x41, 0x54, 0x41, 0x55, 0x48, 0x89, 0xFB, 0x41, 0x89, 0xF5, 0x45, 0x31, 0xE4 } );
 
-		++p;
-		++pctx->line_;
+		// repeat_check、回数が負なら無限ループ
+		native_offset[ check_pc -base ] = static_cast<int>( a.size_ );
+		jit_emit( a, { 0x45, 0x85, 0xED } );// test r13d, r13d
+		jit_emit( a, { 0x78, 9 } );// js +9
+		jit_emit( a, { 0x45, 0x39, 0xEC } );// cmp r12d, r13d
+		jit_emit_jump( a, { 0x0F, 0x8D }, exit_pc );// jge exit
 	}
 
-	if ( pctx->pp_region_idx_ > 0 )
+	for( int pc = check_pc +1; is_succeeded && pc < loop_pc; pc += code_operator_size( codes[ pc ] ) )
 	{
-		raise_error( "プリプロセス：#if-#endifリージョンが正しく閉じられていません：閉じられていないリージョンの始まり（%d行目）", pctx->pp_region_[0].line_ + 1 );
-		return nullptr;
-	}
+		native_offset[ pc -base ] = static_cast<int>( a.size_ );
+		if ( is_target[ pc -base ] && a.operand_num_ != 0 )
+		{
+			is_succeeded = false;
+			break;
+		}
 
-	// 抜き取り
-	auto* const res = pctx->out_buffer_->buffer_;
-	pctx->out_buffer_->buffer_ = nullptr;
-	destroy_prepro_context( pctx );
+		const auto op = jit_generic_operator( code_operator( codes[ pc ] ) );
+		const auto operand = code_operand( codes[ pc ] );
+		switch( op )
+		{
+			case OPERATOR_NOP:
+				break;
 
-	return res;
-}
+			case OPERATOR_PUSH_INT:
+				is_succeeded = jit_push_operand( a, JIT_OPERAND_CONSTANT, VALUE_INT, operand );
+				break;
 
-char* prepro_line( prepro_context_t* pctx, const char* line, bool enable_preprocessor )
-{
-	// 最初の空白をスキップ
-	while ( line[0] == ' ' || line[0] == '\t' )
-	{ ++line; }
+			case OPERATOR_PUSH_WIDE_INT:
+				is_succeeded = jit_push_operand( a, JIT_OPERAND_CONSTANT, VALUE_INT, constants[ operand ].ivalue_ );
+				break;
 
-	// 普通の行なら展開
-	if ( !enable_preprocessor || line[0] != '#' )
-	{
-		static constexpr int MAX_REPLACE_LOOP = 256;
-		int replaced_loop = 0;
+			case OPERATOR_PUSH_DOUBLE:
+				is_succeeded = jit_push_operand( a, JIT_OPERAND_CONSTANT, VALUE_DOUBLE, 0, constants[ operand ].dvalue_ );
+				break;
 
-		char* res = nullptr;
-		char* holded = nullptr;
+			case OPERATOR_PUSH_SYSVAR:
+				is_succeeded = ( operand == SYSVAR_CNT && jit_push_operand( a, JIT_OPERAND_COUNTER, VALUE_INT, 0 ) );
+				break;
 
-		// 展開があるならずっとループ
-		for ( ; ; )
-		{
-			bool is_replaced = false;
-			res = prepro_line_expand( pctx, line, &is_replaced );
-			if ( !is_replaced )
+			case OPERATOR_LOAD_SCALAR:
 			{
+				const auto slot = jit_variable_slot( region, table, operand );
+				is_succeeded = ( slot >= 0 && jit_push_operand( a, JIT_OPERAND_VARIABLE, region->variable_types_[ slot ], slot ) );
 				break;
 			}
-			if ( holded != nullptr )
+
+			case OPERATOR_INC_VAR:
 			{
-				destroy_string( holded );
-				holded = nullptr;
+				const auto slot = jit_variable_slot( region, table, operand );
+				if ( slot < 0 )
+				{
+					is_succeeded = false;
+					break;
+				}
+				jit_emit( a, { 0x48, 0x8B, 0x8B } );// mov rcx, [rbx +disp32]
+				jit_emit32( a, slot *8 );
+				if ( region->variable_types_[ slot ] == VALUE_DOUBLE )
+				{
+					// var = var + imm と同じ結果にする
+					jit_emit( a, { 0xB8 } );// mov eax, imm32
+					jit_emit32( a, codes[ pc +1 ] );
+					jit_emit( a, { 0xF2, 0x0F, 0x2A, 0xC8 } );// cvtsi2sd xmm1, eax
+					jit_emit( a, { 0xF2, 0x0F, 0x10, 0x01 } );// movsd xmm0, [rcx]
+					jit_emit( a, { 0xF2, 0x0F, 0x58, 0xC1 } );// addsd xmm0, xmm1
+					jit_emit( a, { 0xF2, 0x0F, 0x11, 0x01 } );// movsd [rcx], xmm0
+					break;
+				}
+				jit_emit( a, { 0x81, 0x01 } );// add dword [rcx], imm32
+				jit_emit32( a, codes[ pc +1 ] );
+				break;
 			}
-			holded = res;
-			line = res;
 
-			++replaced_loop;
-			if ( replaced_loop > MAX_REPLACE_LOOP )
+			case OPERATOR_ASSIGN:
+			case OPERATOR_ADD_ASSIGN:
+			case OPERATOR_SUB_ASSIGN:
+			case OPERATOR_MUL_ASSIGN:
+			case OPERATOR_DIV_ASSIGN:
+			case OPERATOR_MOD_ASSIGN:
+			case OPERATOR_BOR_ASSIGN:
+			case OPERATOR_BAND_ASSIGN:
+			case OPERATOR_BXOR_ASSIGN:
 			{
-				raise_error( "マクロの再起展開が上限数（%d）を突破しました、マクロが無限ループしてる可能性があります@@ %d行目", replaced_loop, pctx->line_ + 1 );
-				return nullptr;
+				// 代入で変数の型が変わる時は翻訳しない、複合代入の右辺は変数の型に変換する
+				if ( a.operand_num_ < 2 || a.operand_[ a.operand_num_ -2 ].tag_ != JIT_OPERAND_VARIABLE )
+				{
+					is_succeeded = false;
+					break;
+				}
+				const auto slot = a.operand_[ a.operand_num_ -2 ].value_;
+				const auto type = region->variable_types_[ slot ];
+				const auto name = table->variables_[ region->variable_slots_[ slot ] ].name_;
+				if ( op == OPERATOR_ASSIGN && jit_operand_type( a, 0 ) != type )
+				{
+					is_succeeded = false;
+					break;
+				}
+				if ( type == VALUE_DOUBLE )
+				{
+					jit_pop_double_operand( a, JIT_XMM1 );
+					--a.operand_num_;
+					jit_emit( a, { 0x4C, 0x8B, 0x83 } );// mov r8, [rbx +disp32]
+					jit_emit32( a, slot *8 );
+					if ( op == OPERATOR_ASSIGN )
+					{
+						jit_emit( a, { 0xF2, 0x41, 0x0F, 0x11, 0x08 } );// movsd [r8], xmm1
+						break;
+					}
+					jit_emit( a, { 0xF2, 0x41, 0x0F, 0x10, 0x00 } );// movsd xmm0, [r8]
+					switch( op )
+					{
+						case OPERATOR_ADD_ASSIGN:	is_succeeded = jit_emit_double_arithmetic( a, OPERATOR_ADD, nullptr ); break;
+						case OPERATOR_SUB_ASSIGN:	is_succeeded = jit_emit_double_arithmetic( a, OPERATOR_SUB, nullptr ); break;
+						case OPERATOR_MUL_ASSIGN:	is_succeeded = jit_emit_double_arithmetic( a, OPERATOR_MUL, nullptr ); break;
+						case OPERATOR_DIV_ASSIGN:	is_succeeded = jit_emit_double_arithmetic( a, OPERATOR_DIV, name ); break;
+						case OPERATOR_MOD_ASSIGN:	is_succeeded = jit_emit_double_arithmetic( a, OPERATOR_MOD, name ); break;
+						default:					is_succeeded = false; break;
+					}
+					// fmod を呼ぶと r8 は壊れる
+					jit_emit( a, { 0x4C, 0x8B, 0x83 } );// mov r8, [rbx +disp32]
+					jit_emit32( a, slot *8 );
+					jit_emit( a, { 0xF2, 0x41, 0x0F, 0x11, 0x00 } );// movsd [r8], xmm0
+					break;
+				}
+				jit_pop_operand( a, JIT_ECX );
+				--a.operand_num_;
+				jit_emit( a, { 0x4C, 0x8B, 0x83 } );// mov r8, [rbx +disp32]
+				jit_emit32( a, slot *8 );
+				if ( op == OPERATOR_ASSIGN )
+				{
+					jit_emit( a, { 0x41, 0x89, 0x08 } );// mov [r8], ecx
+					break;
+				}
+				jit_emit( a, { 0x41, 0x8B, 0x00 } );// mov eax, [r8]
+				switch( op )
+				{
+					case OPERATOR_ADD_ASSIGN:	jit_emit_arithmetic( a, OPERATOR_ADD, nullptr ); break;
+					case OPERATOR_SUB_ASSIGN:	jit_emit_arithmetic( a, OPERATOR_SUB, nullptr ); break;
+					case OPERATOR_MUL_ASSIGN:	jit_emit_arithmetic( a, OPERATOR_MUL, nullptr ); break;
+					case OPERATOR_DIV_ASSIGN:	jit_emit_arithmetic( a, OPERATOR_DIV, name ); break;
+					case OPERATOR_MOD_ASSIGN:	jit_emit_arithmetic( a, OPERATOR_MOD, name ); break;
+					case OPERATOR_BOR_ASSIGN:	jit_emit_arithmetic( a, OPERATOR_BOR, nullptr ); break;
+					case OPERATOR_BAND_ASSIGN:	jit_emit_arithmetic( a, OPERATOR_BAND, nullptr ); break;
+					case OPERATOR_BXOR_ASSIGN:	jit_emit_arithmetic( a, OPERATOR_BXOR, nullptr ); break;
+					default: assert( false ); break;
+				}
+				jit_emit( a, { 0x41, 0x89, 0x00 } );// mov [r8], eax
+				break;
 			}
-		}
-
-		if ( holded != nullptr )
-		{
-			destroy_string( holded );
-			holded = nullptr;
-		}
-		return res;
-	}
-
-	// 最初の#はスキップ
-	++line;
-
-	tokenize_context_t tokenize_ctx{};
-	parse_context_t parse_ctx{};
-	initialize_tokenize_context( &tokenize_ctx, line );
-	initialize_parse_context( &parse_ctx, tokenize_ctx );
 
-	{
-		auto* const st = read_token( parse_ctx );
+			case OPERATOR_BOR:
+			case OPERATOR_BAND:
+			case OPERATOR_BXOR:
+			case OPERATOR_ADD:
+			case OPERATOR_SUB:
+			case OPERATOR_MUL:
+			case OPERATOR_DIV:
+			case OPERATOR_MOD:
+				if ( a.operand_num_ < 2 )
+				{
+					is_succeeded = false;
+					break;
+				}
+				if ( jit_operand_type( a, 1 ) == VALUE_DOUBLE )
+				{
+					jit_pop_double_operand( a, JIT_XMM1 );
+					jit_pop_double_operand( a, JIT_XMM0 );
+					is_succeeded = ( jit_emit_double_arithmetic( a, op, nullptr ) && jit_push_result( a, VALUE_DOUBLE ) );
+					break;
+				}
+				jit_pop_operand( a, JIT_ECX );
+				jit_pop_operand( a, JIT_EAX );
+				jit_emit_arithmetic( a, op, nullptr );
+				is_succeeded = jit_push_result( a, VALUE_INT );
+				break;
 
-		if ( st->tag_ != TOKEN_IDENTIFIER )
-		{
-			raise_error( "プリプロセス：# の後に識別子でないトークンが検出されました@@ %d行目", pctx->line_ + 1 );
-			return nullptr;
-		}
+			case OPERATOR_EQ:
+			case OPERATOR_NEQ:
+			case OPERATOR_GT:
+			case OPERATOR_GTOE:
+			case OPERATOR_LT:
+			case OPERATOR_LTOE:
+				if ( a.operand_num_ < 2 )
+				{
+					is_succeeded = false;
+					break;
+				}
+				if ( jit_operand_type( a, 1 ) == VALUE_DOUBLE )
+				{
+					jit_pop_double_operand( a, JIT_XMM1 );
+					jit_pop_double_operand( a, JIT_XMM0 );
+					jit_emit_double_compare( a, op );
+					is_succeeded = jit_push_result( a, VALUE_INT );
+					break;
+				}
+				jit_pop_operand( a, JIT_ECX );
+				jit_pop_operand( a, JIT_EAX );
+				jit_emit( a, { 0x39, 0xC8 } );// cmp eax, ecx
+				jit_emit( a, { 0x0F, 0x90 +jit_condition_code( op ), 0xC0 } );// setcc al
+				jit_emit( a, { 0x0F, 0xB6, 0xC0 } );// movzx eax, al
+				is_succeeded = jit_push_result( a, VALUE_INT );
+				break;
 
-		const auto pptag = query_preprocessor( st->content_ );
-		if ( pptag == PREPRO_UNKNOWN )
-		{
-			raise_error( "プリプロセス：想定外のプリプロセッサ（%s）@@ %d行目", st->content_, pctx->line_ + 1 );
-			return nullptr;
-		}
+			case OPERATOR_UNARY_MINUS:
+				if ( a.operand_num_ < 1 )
+				{
+					is_succeeded = false;
+					break;
+				}
+				if ( jit_operand_type( a, 0 ) == VALUE_DOUBLE )
+				{
+					jit_pop_double_operand( a, JIT_XMM0 );
+					jit_emit_load_double( a, JIT_XMM1, -0.0, JIT_EAX );
+					jit_emit( a, { 0x66, 0x0F, 0x57, 0xC1 } );// xorpd xmm0, xmm1
+					is_succeeded = jit_push_result( a, VALUE_DOUBLE );
+					break;
+				}
+				jit_pop_operand( a, JIT_EAX );
+				jit_emit( a, { 0xF7, 0xD8 } );// neg eax
+				is_succeeded = jit_push_result( a, VALUE_INT );
+				break;
 
-		switch ( pptag )
-		{
-			case PREPRO_DEFINE:
+			case OPERATOR_FUNCTION:
 			{
-				if ( pctx->is_current_region_valid_ )
+				// 引数の数が合っている、整数と実数の数学関数のみ、引数は関数と同じく value_calc_int か value_calc_double で変換する
+				const auto function = code_call_callee( operand );
+				const auto arg_num = code_call_arg_num( operand );
+				if ( arg_num > a.operand_num_ )
 				{
-					bool is_ctype = false;
+					is_succeeded = false;
+					break;
+				}
+				switch( function )
+				{
+					case FUNCTION_INT:
+						if ( arg_num != 1 ) { is_succeeded = false; break; }
+						jit_pop_operand( a, JIT_EAX );
+						is_succeeded = jit_push_result( a, VALUE_INT );
+						break;
+					case FUNCTION_DOUBLE:
+						if ( arg_num != 1 ) { is_succeeded = false; break; }
+						jit_pop_double_operand( a, JIT_XMM0 );
+						is_succeeded = jit_push_result( a, VALUE_DOUBLE );
+						break;
+					case FUNCTION_ABS:
+						if ( arg_num != 1 ) { is_succeeded = false; break; }
+						jit_pop_operand( a, JIT_EAX );
+						jit_emit( a, { 0x89, 0xC1, 0xF7, 0xD9 } );// mov ecx, eax; neg ecx
+						jit_emit( a, { 0x85, 0xC0, 0x0F, 0x4C, 0xC1 } );// test eax, eax; cmovl eax, ecx
+						is_succeeded = jit_push_result( a, VALUE_INT );
+						break;
+					case FUNCTION_ABSF:
 					{
-						const auto* const it = read_token( parse_ctx );
-						if ( it->tag_ == TOKEN_IDENTIFIER && query_keyword( it->content_ ) == KEYWORD_CTYPE )
-						{
-							is_ctype = true;
-						}
-						else
+						if ( arg_num != 1 ) { is_succeeded = false; break; }
+						jit_pop_double_operand( a, JIT_XMM0 );
+						// r<0.0 の時だけ符号を反転する、-0.0 や NaN はそのまま
+						jit_emit( a, { 0x66, 0x0F, 0x57, 0xC9 } );// xorpd xmm1, xmm1
+						jit_emit( a, { 0x66, 0x0F, 0x2E, 0xC8 } );// ucomisd xmm1, xmm0
+						const auto skip = jit_emit_skip( a, 0x76 );// jbe
+						jit_emit_load_double( a, JIT_XMM1, -0.0, JIT_EAX );
+						jit_emit( a, { 0x66, 0x0F, 0x57, 0xC1 } );// xorpd xmm0, xmm1
+						jit_patch_skip( a, skip );
+						is_succeeded = jit_push_result( a, VALUE_DOUBLE );
+						break;
+					}
+					case FUNCTION_DEG2RAD:
+					case FUNCTION_RAD2DEG:
+						if ( arg_num != 1 ) { is_succeeded = false; break; }
+						jit_pop_double_operand( a, JIT_XMM0 );
+						// 関数と同じく掛けてから割る
+						jit_emit_load_double( a, JIT_XMM1, ( function == FUNCTION_DEG2RAD ? NHSP_MPI : 180.0 ), JIT_EAX );
+						jit_emit( a, { 0xF2, 0x0F, 0x59, 0xC1 } );// mulsd xmm0, xmm1
+						jit_emit_load_double( a, JIT_XMM1, ( function == FUNCTION_DEG2RAD ? 180.0 : NHSP_MPI ), JIT_EAX );
+						jit_emit( a, { 0xF2, 0x0F, 0x5E, 0xC1 } );// divsd xmm0, xmm1
+						is_succeeded = jit_push_result( a, VALUE_DOUBLE );
+						break;
+					case FUNCTION_SQRT:
+						if ( arg_num != 1 ) { is_succeeded = false; break; }
+						jit_pop_double_operand( a, JIT_XMM0 );
+						jit_emit( a, { 0xF2, 0x0F, 0x51, 0xC0 } );// sqrtsd xmm0, xmm0
+						is_succeeded = jit_push_result( a, VALUE_DOUBLE );
+						break;
+					case FUNCTION_SIN:
+					case FUNCTION_COS:
+					case FUNCTION_TAN:
+					case FUNCTION_EXPF:
+					case FUNCTION_LOGF:
+					{
+						if ( arg_num != 1 ) { is_succeeded = false; break; }
+						jit_math_function_t f = nullptr;
+						switch( function )
 						{
-							unread_token( parse_ctx );
+							case FUNCTION_SIN:	f = &std::sin; break;
+							case FUNCTION_COS:	f = &std::cos; break;
+							case FUNCTION_TAN:	f = &std::tan; break;
+							case FUNCTION_EXPF:	f = &std::exp; break;
+							case FUNCTION_LOGF:	f = &std::log; break;
+							default: assert( false ); break;
 						}
+						jit_pop_double_operand( a, JIT_XMM0 );
+						jit_emit_call( a, reinterpret_cast<uint64_t>( f ) );
+						is_succeeded = jit_push_result( a, VALUE_DOUBLE );
+						break;
 					}
-
-					const auto* const nit = read_token( parse_ctx );
-					if ( nit->tag_ != TOKEN_IDENTIFIER )
+					case FUNCTION_ATAN:
+					case FUNCTION_POWF:
 					{
-						raise_error( "プリプロセス：define に失敗：識別子名が見つかりません@@ %d行目", pctx->line_ + 1 );
-						return nullptr;
+						// atan( y, x ) は atan2( y, x )、powf( x, y ) は pow( x, y )、どちらも引数の順に渡す
+						if ( arg_num != 2 ) { is_succeeded = false; break; }
+						const jit_math_function2_t f = ( function == FUNCTION_ATAN ? static_cast<jit_math_function2_t>( &std::atan2 ) : static_cast<jit_math_function2_t>( &std::pow ) );
+						jit_pop_double_operand( a, JIT_XMM1 );
+						jit_pop_double_operand( a, JIT_XMM0 );
+						jit_emit_call( a, reinterpret_cast<uint64_t>( f ) );
+						is_succeeded = jit_push_result( a, VALUE_DOUBLE );
+						break;
 					}
-
-					auto* const nmacro = create_macro();
-					nmacro->name_ = create_string( nit->content_ );
-					nmacro->is_ctype_ = is_ctype;
-
-					const auto* const rt = read_token( parse_ctx );
-					if ( rt->tag_ == TOKEN_LPARENTHESIS )
+					case FUNCTION_LIMIT:
+						if ( arg_num != 3 ) { is_succeeded = false; break; }
+						jit_pop_operand( a, JIT_EDX );
+						jit_pop_operand( a, JIT_ECX );
+						jit_pop_operand( a, JIT_EAX );
+						// function_limit と同じく第一引数が下限、第二引数が値、第三引数が上限
+						jit_emit( a, { 0x39, 0xC1, 0x0F, 0x4C, 0xC8 } );// cmp ecx, eax; cmovl ecx, eax
+						jit_emit( a, { 0x39, 0xD1, 0x0F, 0x4F, 0xCA } );// cmp ecx, edx; cmovg ecx, edx
+						jit_emit( a, { 0x89, 0xC8 } );// mov eax, ecx
+						is_succeeded = jit_push_result( a, VALUE_INT );
+						break;
+					case FUNCTION_LIMITF:
 					{
-						// パラメータあり
-						bool is_break = false;
-
-						for ( ; ; )
-						{
-							const auto* const ct = read_token( parse_ctx );
-							if ( ct->tag_ == TOKEN_EOF )
-							{
-								raise_error( "プリプロセス：define に失敗：パラメータのパース中に行末に到達しました@@ %d行目", pctx->line_ + 1 );
-								return nullptr;
-							}
-							if ( ct->tag_ == TOKEN_RPARENTHESIS )
-							{
-								// 何もパラメータがない、おわり
-								unread_token( parse_ctx );
-								break;
-							}
-							if ( ct->tag_ != TOKEN_PP_ARG_INDICATOR )
-							{
-								raise_error( "プリプロセス：define に失敗：パラメータは%%から始まる必要があります@@ %d行目", pctx->line_ + 1 );
-								return nullptr;
-							}
+						if ( arg_num != 3 ) { is_succeeded = false; break; }
+						jit_pop_double_operand( a, JIT_XMM2 );
+						jit_pop_double_operand( a, JIT_XMM1 );
+						jit_pop_double_operand( a, JIT_XMM0 );
+						// function_limitf と同じ比較にして NaN の扱いを揃える
+						jit_emit( a, { 0x66, 0x0F, 0x2E, 0xC1 } );// ucomisd xmm0, xmm1
+						const auto skip_min = jit_emit_skip( a, 0x76 );// jbe
+						jit_emit( a, { 0x66, 0x0F, 0x28, 0xC8 } );// movapd xmm1, xmm0
+						jit_patch_skip( a, skip_min );
+						jit_emit( a, { 0x66, 0x0F, 0x2E, 0xCA } );// ucomisd xmm1, xmm2
+						const auto skip_max = jit_emit_skip( a, 0x76 );// jbe
+						jit_emit( a, { 0x66, 0x0F, 0x28, 0xCA } );// movapd xmm1, xmm2
+						jit_patch_skip( a, skip_max );
+						jit_emit( a, { 0x66, 0x0F, 0x28, 0xC1 } );// movapd xmm0, xmm1
+						is_succeeded = jit_push_result( a, VALUE_DOUBLE );
+						break;
+					}
+					default:
+						is_succeeded = false;
+						break;
+				}
+				break;
+			}
 
-							const auto* const it = read_token( parse_ctx );
-							if ( it->tag_ != TOKEN_INTEGER || it->left_space_ )
-							{
-								raise_error( "プリプロセス：define に失敗：パラメータ%%のあと、スペースなしで数値を入れる必要があります@@ %d行目", pctx->line_ + 1 );
-								return nullptr;
-							}
+			case OPERATOR_IF:
+				if ( a.operand_num_ != 1 )
+				{
+					is_succeeded = false;
+					break;
+				}
+				if ( jit_operand_type( a, 0 ) == VALUE_DOUBLE )
+				{
+					// NaN は真
+					jit_pop_double_operand( a, JIT_XMM0 );
+					jit_emit( a, { 0x66, 0x0F, 0x57, 0xC9 } );// xorpd xmm1, xmm1
+					jit_emit( a, { 0x66, 0x0F, 0x2E, 0xC1 } );// ucomisd xmm0, xmm1
+					const auto skip = jit_emit_skip( a, 0x7A );// jp
+					jit_emit_jump( a, { 0x0F, 0x84 }, pc +operand );// je
+					jit_patch_skip( a, skip );
+					break;
+				}
+				jit_pop_operand( a, JIT_EAX );
+				jit_emit( a, { 0x85, 0xC0 } );// test eax, eax
+				jit_emit_jump( a, { 0x0F, 0x84 }, pc +operand );// jz
+				break;
 
-							const auto itidx = atoi( it->content_ );
-							if ( itidx != nmacro->param_num_ + 1 )
+			case OPERATOR_CMP_JUMP_IF_FALSE:
+				if ( a.operand_num_ != 2 )
+				{
+					is_succeeded = false;
+					break;
+				}
+				if ( jit_operand_type( a, 1 ) == VALUE_DOUBLE )
+				{
+					jit_pop_double_operand( a, JIT_XMM1 );
+					jit_pop_double_operand( a, JIT_XMM0 );
+					jit_emit_double_compare( a, codes[ pc +1 ] );
+					jit_emit( a, { 0x85, 0xC0 } );// test eax, eax
+					jit_emit_jump( a, { 0x0F, 0x84 }, pc +operand );// jz
+					break;
+				}
+				jit_pop_operand( a, JIT_ECX );
+				jit_pop_operand( a, JIT_EAX );
+				jit_emit( a, { 0x39, 0xC8 } );// cmp eax, ecx
+				// 条件の否定で飛ぶ
+				jit_emit_jump( a, { 0x0F, 0x80 +( jit_condition_code( codes[ pc +1 ] ) ^ 1 ) }, pc +operand );
+				break;
+
+			case OPERATOR_JUMP:
+			case OPERATOR_JUMP_RELATIVE:
+				if ( a.operand_num_ != 0 )
+				{
+					is_succeeded = false;
+					break;
+				}
+				jit_emit_jump( a, { 0xE9 }, ( op == OPERATOR_JUMP ? operand : pc +operand ) );
+				break;
+
+			case OPERATOR_CONTINUE:
+				if ( a.operand_num_ != 0 )
+				{
+					is_succeeded = false;
+					break;
+				}
+				jit_emit( a, { 0x41, 0xFF, 0xC4 } );// inc r12d
+				jit_emit_jump( a, { 0xE9 }, check_pc );
+				break;
+
+			case OPERATOR_BREAK:
+				if ( a.operand_num_ != 0 )
+				{
+					is_succeeded = false;
+					break;
+				}
+				jit_emit_jump( a, { 0xE9 }, exit_pc );
+				break;
+
+			default:
+				// 文字列、配列、コマンド呼び出し、サブルーチン、入れ子の repeat など
+				is_succeeded = false;
+				break;
+		}
+	}
+
+	if ( is_succeeded && a.operand_num_ != 0 )
+	{ is_succeeded = false; }
+
+	if ( is_succeeded )
+	{
+		// loop
+		native_offset[ loop_pc -base ] = static_cast<int>( a.size_ );
+		jit_emit( a, { 0x41, 0xFF, 0xC4 } );// inc r12d
+		jit_emit_jump( a, { 0xE9 }, check_pc );
+
+		// pop r13; pop r12; pop rbx; ret
+		native_offset[ exit_pc -base ] = static_cast<int>( a.size_ );
+		jit_emit( a, { 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 } );
+
+		for( int i=0; i<a.patch_num_; ++i )
+		{
+			const auto offset = a.patch_offset_[i];
+			const auto target = native_offset[ a.patch_target_[i] -base ];
+			assert( target >= 0 );
+			const auto rel = static_cast<uint32_t>( target -( offset +4 ) );
+			for( int b=0; b<4; ++b )
+			{
+				a.buffer_[ offset +b ] = static_cast<unsigned char>( ( rel >> ( b *8 ) ) & 0xFF );
+			}
+		}
+	}
+
+	xfree( a.patch_offset_ );
+	xfree( a.patch_target_ );
+	a.patch_offset_ = a.patch_target_ = nullptr;
+	xfree( native_offset );
+	xfree( is_target );
+	return is_succeeded;
+}
+
+jit_region_t* create_jit_region( const code_container_t* code, const variable_table_t* table, const constant_t* constants, int repeat_pc )
+{
+	auto region = reinterpret_cast<jit_region_t*>( xmalloc( sizeof(jit_region_t) ) );
+	region->code_ = nullptr;
+	region->code_size_ = 0;
+	region->variable_slots_ = reinterpret_cast<int*>( xmalloc( sizeof(int) *MAX_JIT_VARIABLE ) );
+	region->variable_types_ = reinterpret_cast<value_tag*>( xmalloc( sizeof(value_tag) *MAX_JIT_VARIABLE ) );
+	region->variable_num_ = 0;
+
+	jit_assembler_t a;
+	a.buffer_size_ = 256;
+	a.buffer_ = reinterpret_cast<unsigned char*>( xmalloc( a.buffer_size_ ) );
+	a.size_ = 0;
+
+	if ( jit_compile_region( a, region, table, constants, code->code_, static_cast<int>( code->code_size_ ), repeat_pc ) )
+	{
+		const auto page_size = static_cast<size_t>( sysconf( _SC_PAGESIZE ) );
+		const auto size = ( a.size_ +page_size -1 ) /page_size *page_size;
+		auto* const p = mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		if ( p != MAP_FAILED )
+		{
+			memcpy( p, a.buffer_, a.size_ );
+			if ( mprotect( p, size, PROT_READ | PROT_EXEC ) == 0 )
+			{
+				region->code_ = p;
+				region->code_size_ = size;
+			}
+			else
+			{
+				munmap( p, size );
+			}
+		}
+	}
+	if ( region->code_ == nullptr )
+	{
+		region->variable_num_ = 0;
+	}
+
+	xfree( a.buffer_ );
+	return region;
+}
+
+void destroy_jit_region( jit_region_t* region )
+{
+	if ( region->code_ != nullptr )
+	{
+		munmap( region->code_, region->code_size_ );
+	}
+	xfree( region->variable_slots_ );
+	xfree( region->variable_types_ );
+	xfree( region );
+}
+
+void destroy_jit_regions( code_container_t* code )
+{
+	if ( code->jit_regions_ == nullptr )
+	{ return; }
+	for( size_t i=0; i<code->jit_regions_size_; ++i )
+	{
+		if ( code->jit_regions_[i] != nullptr )
+		{ destroy_jit_region( code->jit_regions_[i] ); }
+	}
+	xfree( code->jit_regions_ );
+	code->jit_regions_ = nullptr;
+	code->jit_regions_size_ = 0;
+}
+
+// repeat_pc の repeat-loop の翻訳結果、初めての時は翻訳する
+const jit_region_t* query_jit_region( code_container_t* code, const variable_table_t* table, const constant_t* constants, int repeat_pc )
+{
+	if ( code->jit_regions_size_ != code->code_size_ )
+	{
+		destroy_jit_regions( code );
+		code->jit_regions_ = reinterpret_cast<jit_region_t**>( xmalloc( sizeof(jit_region_t*) *code->code_size_ ) );
+		for( size_t i=0; i<code->code_size_; ++i )
+		{
+			code->jit_regions_[i] = nullptr;
+		}
+		code->jit_regions_size_ = code->code_size_;
+	}
+
+	auto& region = code->jit_regions_[ repeat_pc ];
+	if ( region == nullptr )
+	{
+		region = create_jit_region( code, table, constants, repeat_pc );
+	}
+	return region;
+}
+
+// 変数の型を確かめてから実行する、実行できなければ false
+bool run_jit_region( const jit_region_t* region, variable_table_t* table, int loop_num )
+{
+	if ( region->code_ == nullptr )
+	{ return false; }
+
+	void* variables[MAX_JIT_VARIABLE];
+	for( int i=0; i<region->variable_num_; ++i )
+	{
+		auto* const var = &table->variables_[ region->variable_slots_[i] ];
+		if ( var->type_ != region->variable_types_[i] )
+		{ return false; }
+		variables[i] = var->data_;
+	}
+
+	reinterpret_cast<jit_function_t>( region->code_ )( variables, loop_num );
+	return true;
+}
+#endif
+
+//=============================================================================
+// 実行ループ
+// switch による実行とスレッデッドコードによる実行で処理本体を共有する
+// IsThreaded の時は各ハンドラの末尾で次の命令へ直接飛び、末尾チェックは番兵の OPERATOR_END に任せる
+// s が nullptr の時はスレッデッドコードへの翻訳のみ行う
+// IsProfiling の時は実行した命令を profile に記録する（switch のみ）
+#if NHSP_THREADED_DISPATCH_AVAILABLE
+#define NHSP_VM_CASE( op )	case op: vm_##op:
+#define NHSP_VM_NEXT()		if ( IsThreaded ) { ++pc; goto *threaded[ pc ]; } else break
+#else
+#define NHSP_VM_CASE( op )	case op:
+#define NHSP_VM_NEXT()		break
+#endif
+
+void record_opcode_profile( opcode_profile_t* p, code_t op )
+{
+	p->key_ = ( p->key_ *MAX_OPERATOR +op ) %p->table_size_;
+	++p->executed_;
+	if ( p->executed_ >= p->ngram_ )
+	{
+		++p->count_table_[ p->key_ ];
+	}
+}
+
+// 比較演算の結果を真偽値で返す、両辺が整数ならそのまま比べる
+bool compare_value( int op, value_t* l, const value_t& r )
+{
+	if ( value_get_primitive_tag( *l ) == VALUE_INT && value_get_primitive_tag( r ) == VALUE_INT )
+	{
+		const auto li = value_calc_int( *l );
+		const auto ri = value_calc_int( r );
+		switch( op )
+		{
+			case OPERATOR_EQ:		return li == ri;
+			case OPERATOR_NEQ:		return li != ri;
+			case OPERATOR_GT:		return li > ri;
+			case OPERATOR_GTOE:		return li >= ri;
+			case OPERATOR_LT:		return li < ri;
+			case OPERATOR_LTOE:		return li <= ri;
+			default: assert( false ); break;
+		}
+		return false;
+	}
+
+	value_isolate( *l );
+	switch( op )
+	{
+		case OPERATOR_EQ:		value_eq( l, r ); break;
+		case OPERATOR_NEQ:		value_neq( l, r ); break;
+		case OPERATOR_GT:		value_gt( l, r ); break;
+		case OPERATOR_GTOE:		value_gtoe( l, r ); break;
+		case OPERATOR_LT:		value_lt( l, r ); break;
+		case OPERATOR_LTOE:		value_ltoe( l, r ); break;
+		default: assert( false ); break;
+	}
+	return value_calc_boolean( *l );
+}
+
+// 型ガード用、整数（整数型変数の要素を含む）ならその値を取り出す
+bool value_peek_int( const value_t& v, int& out )
+{
+	if ( v.type_ == VALUE_INT )
+	{
+		out = v.ivalue_;
+		return true;
+	}
+	if ( v.type_ == VALUE_VARIABLE && v.variable_->type_ == VALUE_INT && v.index_ >= 0 && v.index_ < v.variable_->length_ )
+	{
+		out = reinterpret_cast<const int*>( v.variable_->data_ )[ v.index_ ];
+		return true;
+	}
+	return false;
+}
+
+bool value_peek_double( const value_t& v, double& out )
+{
+	if ( v.type_ == VALUE_DOUBLE )
+	{
+		out = v.dvalue_;
+		return true;
+	}
+	if ( v.type_ == VALUE_VARIABLE && v.variable_->type_ == VALUE_DOUBLE && v.index_ >= 0 && v.index_ < v.variable_->length_ )
+	{
+		out = reinterpret_cast<const double*>( v.variable_->data_ )[ v.index_ ];
+		return true;
+	}
+	return false;
+}
+
+// 整数型変数の要素への直接のポインタ、型や添え字が合わなければ nullptr
+template< typename T >
+T* variable_peek_element( const value_t& var, value_tag type )
+{
+	if ( var.type_ != VALUE_VARIABLE || var.variable_->type_ != type || var.index_ < 0 || var.index_ >= var.variable_->length_ )
+	{ return nullptr; }
+	return reinterpret_cast<T*>( var.variable_->data_ ) +var.index_;
+}
+
+void apply_binary_operator( int op, value_t* l, const value_t& r )
+{
+	value_isolate( *l );
+	switch( op )
+	{
+		case OPERATOR_BOR:		value_bor( l, r ); break;
+		case OPERATOR_BAND:		value_band( l, r ); break;
+		case OPERATOR_BXOR:		value_bxor( l, r ); break;
+		case OPERATOR_EQ:		value_eq( l, r ); break;
+		case OPERATOR_NEQ:		value_neq( l, r ); break;
+		case OPERATOR_GT:		value_gt( l, r ); break;
+		case OPERATOR_GTOE:		value_gtoe( l, r ); break;
+		case OPERATOR_LT:		value_lt( l, r ); break;
+		case OPERATOR_LTOE:		value_ltoe( l, r ); break;
+		case OPERATOR_ADD:		value_add( l, r ); break;
+		case OPERATOR_SUB:		value_sub( l, r ); break;
+		case OPERATOR_MUL:		value_mul( l, r ); break;
+		case OPERATOR_DIV:		value_div( l, r ); break;
+		case OPERATOR_MOD:		value_mod( l, r ); break;
+		default: assert( false ); break;
+	}
+}
+
+void apply_assign_operator( int op, value_t* var, value_t* v )
+{
+	if ( var->type_ != VALUE_VARIABLE )
+	{
+		raise_error( "変数代入：代入先が変数ではありませんでした" );
+	}
+
+	value_isolate( *v );
+	value_t tmp;
+	const auto* const t = ( op == OPERATOR_ASSIGN ? nullptr : prepare_assign_operand( value_get_primitive_tag( *var ), *v, tmp ) );
+	switch( op )
+	{
+	case OPERATOR_ASSIGN:		variable_set( var->variable_, *v, var->index_ ); break;
+	case OPERATOR_ADD_ASSIGN:	variable_add( var->variable_, *t, var->index_ ); break;
+	case OPERATOR_SUB_ASSIGN:	variable_sub( var->variable_, *t, var->index_ ); break;
+	case OPERATOR_MUL_ASSIGN:	variable_mul( var->variable_, *t, var->index_ ); break;
+	case OPERATOR_DIV_ASSIGN:	variable_div( var->variable_, *t, var->index_ ); break;
+	case OPERATOR_MOD_ASSIGN:	variable_mod( var->variable_, *t, var->index_ ); break;
+	case OPERATOR_BOR_ASSIGN:	variable_bor( var->variable_, *t, var->index_ ); break;
+	case OPERATOR_BAND_ASSIGN:	variable_band( var->variable_, *t, var->index_ ); break;
+	case OPERATOR_BXOR_ASSIGN:	variable_bxor( var->variable_, *t, var->index_ ); break;
+	default: assert( false ); break;
+	}
+	if ( t == &tmp )
+	{
+		clear_value( &tmp );
+	}
+}
+
+// 観測した型から書き換え先の命令を決める、特殊化できなければ op のまま
+int quicken_binary_operator( int op, const value_t& l, const value_t& r )
+{
+	int li =0, ri =0;
+	if ( value_peek_int( l, li ) && value_peek_int( r, ri ) )
+	{
+		switch( op )
+		{
+			case OPERATOR_ADD:		return OPERATOR_ADD_INT_INT;
+			case OPERATOR_SUB:		return OPERATOR_SUB_INT_INT;
+			case OPERATOR_MUL:		return OPERATOR_MUL_INT_INT;
+			case OPERATOR_EQ:		return OPERATOR_EQ_INT_INT;
+			case OPERATOR_NEQ:		return OPERATOR_NEQ_INT_INT;
+			case OPERATOR_GT:		return OPERATOR_GT_INT_INT;
+			case OPERATOR_GTOE:		return OPERATOR_GTOE_INT_INT;
+			case OPERATOR_LT:		return OPERATOR_LT_INT_INT;
+			case OPERATOR_LTOE:		return OPERATOR_LTOE_INT_INT;
+			default: break;
+		}
+		return op;
+	}
+
+	double ld =0.0, rd =0.0;
+	if ( value_peek_double( l, ld ) && value_peek_double( r, rd ) )
+	{
+		switch( op )
+		{
+			case OPERATOR_ADD:		return OPERATOR_ADD_DOUBLE_DOUBLE;
+			case OPERATOR_SUB:		return OPERATOR_SUB_DOUBLE_DOUBLE;
+			case OPERATOR_MUL:		return OPERATOR_MUL_DOUBLE_DOUBLE;
+			default: break;
+		}
+	}
+	return op;
+}
+
+int quicken_assign_operator( const value_t& var, const value_t& v )
+{
+	int i =0;
+	if ( variable_peek_element<int>( var, VALUE_INT ) != nullptr && value_peek_int( v, i ) )
+	{ return OPERATOR_ASSIGN_INT; }
+	double d =0.0;
+	if ( variable_peek_element<double>( var, VALUE_DOUBLE ) != nullptr && value_peek_double( v, d ) )
+	{ return OPERATOR_ASSIGN_DOUBLE; }
+	return OPERATOR_ASSIGN;
+}
+
+// repeat と gosub でフレームを積む前に、入れ物が溢れないことを確かめる
+void check_loop_frame_push( const execute_status_t* s )
+{
+	if ( s->current_loop_frame_ +1 >= static_cast<int>( MAX_LOOP_FRAME ) )
+	{
+		raise_error( "repeat：ネストが深すぎます" );
+	}
+}
+
+void check_call_frame_push( const execute_status_t* s )
+{
+	if ( s->current_call_frame_ +1 >= static_cast<int>( MAX_CALL_FRAME ) )
+	{
+		raise_error( "gosub：ネストが深すぎます" );
+	}
+}
+
+// handler_table を渡した時は何も実行せず、スレッデッドコードのハンドラの表だけを返す
+template< bool IsThreaded, bool IsProfiling >
+void execute_inner_impl( execute_environment_t* e, execute_status_t* s, opcode_profile_t* profile, const void* const** handler_table =nullptr )
+{
+	static_assert( !( IsThreaded && IsProfiling ), "profiling is not supported with threaded dispatch" );
+
+#if NHSP_THREADED_DISPATCH_AVAILABLE
+	static const void* const s_handlers[] =
+	{
+		&&vm_OPERATOR_NOP,
+
+		&&vm_OPERATOR_PUSH_INT,
+		&&vm_OPERATOR_PUSH_WIDE_INT,
+		&&vm_OPERATOR_PUSH_DOUBLE,
+		&&vm_OPERATOR_PUSH_STRING,
+		&&vm_OPERATOR_PUSH_VARIABLE,
+		&&vm_OPERATOR_PUSH_SYSVAR,
+
+		&&vm_OPERATOR_ASSIGN,
+		&&vm_OPERATOR_ADD_ASSIGN,
+		&&vm_OPERATOR_SUB_ASSIGN,
+		&&vm_OPERATOR_MUL_ASSIGN,
+		&&vm_OPERATOR_DIV_ASSIGN,
+		&&vm_OPERATOR_MOD_ASSIGN,
+		&&vm_OPERATOR_BOR_ASSIGN,
+		&&vm_OPERATOR_BAND_ASSIGN,
+		&&vm_OPERATOR_BXOR_ASSIGN,
+
+		&&vm_OPERATOR_BOR,
+		&&vm_OPERATOR_BAND,
+		&&vm_OPERATOR_BXOR,
+
+		&&vm_OPERATOR_EQ,
+		&&vm_OPERATOR_NEQ,
+		&&vm_OPERATOR_GT,
+		&&vm_OPERATOR_GTOE,
+		&&vm_OPERATOR_LT,
+		&&vm_OPERATOR_LTOE,
+
+		&&vm_OPERATOR_ADD,
+		&&vm_OPERATOR_SUB,
+		&&vm_OPERATOR_MUL,
+		&&vm_OPERATOR_DIV,
+		&&vm_OPERATOR_MOD,
+
+		&&vm_OPERATOR_UNARY_MINUS,
+
+		&&vm_OPERATOR_IF,
+
+		&&vm_OPERATOR_REPEAT,
+		&&vm_OPERATOR_REPEAT_CHECK,
+		&&vm_OPERATOR_LOOP,
+		&&vm_OPERATOR_CONTINUE,
+		&&vm_OPERATOR_BREAK,
+
+
+		&&vm_OPERATOR_GOSUB,
+		&&vm_OPERATOR_GOTO,
+
+		&&vm_OPERATOR_COMMAND,
+		&&vm_OPERATOR_FUNCTION,
+
+		&&vm_OPERATOR_JUMP,
+		&&vm_OPERATOR_JUMP_RELATIVE,
+		&&vm_OPERATOR_RETURN,
+		&&vm_OPERATOR_END,
+
+		&&vm_OPERATOR_LOAD_SCALAR,
+		&&vm_OPERATOR_INC_VAR,
+		&&vm_OPERATOR_CMP_JUMP_IF_FALSE,
+
+		&&vm_OPERATOR_ADD_INT_INT,
+		&&vm_OPERATOR_SUB_INT_INT,
+		&&vm_OPERATOR_MUL_INT_INT,
+		&&vm_OPERATOR_EQ_INT_INT,
+		&&vm_OPERATOR_NEQ_INT_INT,
+		&&vm_OPERATOR_GT_INT_INT,
+		&&vm_OPERATOR_GTOE_INT_INT,
+		&&vm_OPERATOR_LT_INT_INT,
+		&&vm_OPERATOR_LTOE_INT_INT,
+		&&vm_OPERATOR_ADD_DOUBLE_DOUBLE,
+		&&vm_OPERATOR_SUB_DOUBLE_DOUBLE,
+		&&vm_OPERATOR_MUL_DOUBLE_DOUBLE,
+		&&vm_OPERATOR_ASSIGN_INT,
+		&&vm_OPERATOR_ASSIGN_DOUBLE,
+		&&vm_OPERATOR_CMP_JUMP_IF_FALSE_INT_INT,
+	};
+	static_assert( sizeof(s_handlers) /sizeof(*s_handlers) == MAX_OPERATOR, "s_handlers size is not match with MAX_OPERATOR" );
+
+	// ラベルのアドレスはこの関数の中でしか取れないので、翻訳する側には表だけを渡す
+	if ( handler_table != nullptr )
+	{
+		*handler_table = s_handlers;
+		return;
+	}
+
+	const void** const threaded = e->execute_code_->threaded_code_;
+	assert( !IsThreaded || ( threaded != nullptr && e->execute_code_->threaded_code_size_ == e->execute_code_->code_size_ ) );
+#else
+	NHSP_UNUSE( handler_table );
+#endif
+
+	// 特殊化のために書き換えるので const にはしない
+	// プログラムイメージのコードは書き換えないので、スレッデッドコードの側だけを特殊化する
+	code_t* const codes =e->execute_code_->code_;
+	const bool is_code_writable = !e->execute_code_->is_readonly_;
+	const char* const literals =literal_base( e );
+	const constant_t* const constants =constant_base( e );
+	// 実行中は変数が追加されないので、変数の配列は動かない
+	variable_t* const variables =e->variable_table_->variables_;
+	const auto code_size = static_cast<int>(e->execute_code_->code_size_);
+
+	auto& pc = s->pc_;
+
+#if NHSP_THREADED_DISPATCH_AVAILABLE
+#define NHSP_VM_QUICKEN( q )	do { if ( is_code_writable ) { codes[ pc ] = ( codes[ pc ] & ~CODE_OPERATOR_MASK ) | ( q ); } if ( IsThreaded ) { threaded[ pc ] = s_handlers[ ( q ) ]; } } while( false )
+#else
+#define NHSP_VM_QUICKEN( q )	do { if ( is_code_writable ) { codes[ pc ] = ( codes[ pc ] & ~CODE_OPERATOR_MASK ) | ( q ); } } while( false )
+#endif
+
+#if NHSP_THREADED_DISPATCH_AVAILABLE
+	if ( IsThreaded )
+	{
+		if ( s->is_end_ || code_size <= pc )
+		{ return; }
+		goto *threaded[ pc ];
+	}
+#endif
+
+	for( ; ; )
+	{
+
+		// もう実行おわってる
+		if ( s->is_end_ )
+		{ break; }
+
+		// 末尾に到達してる
+		if ( code_size <= pc )
+		{ break; }
+
+		if ( IsProfiling )
+		{
+			record_opcode_profile( profile, code_operator( codes[ pc ] ) );
+		}
+
+		switch( code_operator( codes[ pc ] ) )
+		{
+			NHSP_VM_CASE( OPERATOR_NOP )
+				NHSP_VM_NEXT();
+
+			NHSP_VM_CASE( OPERATOR_PUSH_INT )
+				stack_push( s->stack_, code_operand( codes[ pc ] ) );
+				NHSP_VM_NEXT();
+
+			NHSP_VM_CASE( OPERATOR_PUSH_WIDE_INT )
+				stack_push( s->stack_, constants[ code_operand( codes[ pc ] ) ].ivalue_ );
+				NHSP_VM_NEXT();
+
+			NHSP_VM_CASE( OPERATOR_PUSH_DOUBLE )
+				stack_push( s->stack_, constants[ code_operand( codes[ pc ] ) ].dvalue_ );
+				NHSP_VM_NEXT();
+
+			NHSP_VM_CASE( OPERATOR_PUSH_STRING )
+				stack_push_borrowed( s->stack_, literals +constants[ code_operand( codes[ pc ] ) ].ivalue_ );
+				NHSP_VM_NEXT();
+
+			NHSP_VM_CASE( OPERATOR_PUSH_VARIABLE )
+			{
+				auto* const var = &variables[ code_operand( codes[ pc ] ) ];
+
+				assert( s->stack_->top_ >= 1 );
+				const auto i = stack_peek( s->stack_ );
+				const auto idx = value_calc_int( *i );
+				stack_pop( s->stack_, 1 );
+				stack_push( s->stack_, var, idx );
+
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_PUSH_SYSVAR )
+			{
+				const auto sysvar = code_operand( codes[ pc ] );
+				switch( sysvar )
+				{
+					case SYSVAR_CNT:
+						if ( s->current_loop_frame_ <= 0 )
+						{
+							raise_error( "システム変数cnt：repeat-loop中でないのに参照しました" );
+						}
+						stack_push( s->stack_, s->loop_frame_[s->current_loop_frame_ -1].cnt_ );
+						break;
+					case SYSVAR_STAT:
+						stack_push( s->stack_, s->stat_ );
+						break;
+					case SYSVAR_REFDVAL:
+						stack_push( s->stack_, s->refdval_ );
+						break;
+					case SYSVAR_REFSTR:
+						stack_push_move( s->stack_, retain_shared_string( s->refstr_ ) );
+						break;
+					case SYSVAR_STRSIZE:
+						stack_push( s->stack_, s->strsize_ );
+						break;
+					case SYSVAR_LOOPLEV:
+						stack_push( s->stack_, s->current_loop_frame_ );
+						break;
+					default:
+						assert( false );
+						stack_push( s->stack_, 0 );
+						break;
+				}
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_ASSIGN )
+			NHSP_VM_CASE( OPERATOR_ADD_ASSIGN )
+			NHSP_VM_CASE( OPERATOR_SUB_ASSIGN )
+			NHSP_VM_CASE( OPERATOR_MUL_ASSIGN )
+			NHSP_VM_CASE( OPERATOR_DIV_ASSIGN )
+			NHSP_VM_CASE( OPERATOR_MOD_ASSIGN )
+			NHSP_VM_CASE( OPERATOR_BOR_ASSIGN )
+			NHSP_VM_CASE( OPERATOR_BAND_ASSIGN )
+			NHSP_VM_CASE( OPERATOR_BXOR_ASSIGN )
+			{
+				assert( s->stack_->top_ >= 2 );
+
+				const auto op = code_operator( codes[ pc ] );
+				const auto var =stack_peek( s->stack_, -2 );
+				const auto v =stack_peek( s->stack_, -1 );
+				if ( NHSP_CONFIG_QUICKENING && op == OPERATOR_ASSIGN )
+				{
+					const auto q = quicken_assign_operator( *var, *v );
+					if ( q != op )
+					{ NHSP_VM_QUICKEN( q ); }
+				}
+				apply_assign_operator( op, var, v );
+				stack_pop( s->stack_, 2 );
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_BOR )
+			NHSP_VM_CASE( OPERATOR_BAND )
+			NHSP_VM_CASE( OPERATOR_BXOR )
+			NHSP_VM_CASE( OPERATOR_EQ )
+			NHSP_VM_CASE( OPERATOR_NEQ )
+			NHSP_VM_CASE( OPERATOR_GT )
+			NHSP_VM_CASE( OPERATOR_GTOE )
+			NHSP_VM_CASE( OPERATOR_LT )
+			NHSP_VM_CASE( OPERATOR_LTOE )
+			NHSP_VM_CASE( OPERATOR_ADD )
+			NHSP_VM_CASE( OPERATOR_SUB )
+			NHSP_VM_CASE( OPERATOR_MUL )
+			NHSP_VM_CASE( OPERATOR_DIV )
+			NHSP_VM_CASE( OPERATOR_MOD )
+			{
+				assert( s->stack_->top_ >= 2 );
+				value_t* l =stack_peek( s->stack_, -2 );
+				value_t* r =stack_peek( s->stack_, -1 );
+
+				const auto op = code_operator( codes[ pc ] );
+				if ( NHSP_CONFIG_QUICKENING )
+				{
+					const auto q = quicken_binary_operator( op, *l, *r );
+					if ( q != op )
+					{ NHSP_VM_QUICKEN( q ); }
+				}
+				apply_binary_operator( op, l, *r );
+				stack_pop( s->stack_ );
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_UNARY_MINUS )
+			{
+				assert( s->stack_->top_ >= 1 );
+				value_t* v =stack_peek( s->stack_ );
+				value_isolate( *v );
+				value_unary_minus( v );
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_IF )
+			{
+				const auto cond = stack_peek( s->stack_ );
+				const auto is_cond = value_calc_boolean( *cond );
+				stack_pop( s->stack_ );
+				if ( !is_cond )
+				{
+					const auto false_head = code_operand( codes[ pc ] );
+					pc += false_head -1;
+				}
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_REPEAT )
+			{
+				check_loop_frame_push( s );
+
+				const auto end_position = code_operand( codes[ pc ] );
+
+#if NHSP_JIT_AVAILABLE
+				// 翻訳できたループは loop の次まで丸ごとネイティブコードで実行する
+				if ( s->is_jit_enabled_ )
+				{
+					const auto* const region = query_jit_region( e->execute_code_, e->variable_table_, constants, pc );
+					if ( run_jit_region( region, e->variable_table_, value_calc_int( *stack_peek( s->stack_ ) ) ) )
+					{
+						stack_pop( s->stack_ );
+						pc = end_position;
+						NHSP_VM_NEXT();
+					}
+				}
+#endif
+
+				auto& frame = s->loop_frame_[s->current_loop_frame_];
+				++s->current_loop_frame_;
+				frame.start_position_ = pc +1;
+				frame.end_position_ = end_position;
+				frame.cnt_ = 0;
+				frame.counter_ = 0;
+				frame.max_ = 0;
+
+				int loop_num =-1;
+				const auto v = stack_peek( s->stack_ );
+				loop_num = value_calc_int( *v );
+				stack_pop( s->stack_ );
+
+				frame.max_ = loop_num;
+				NHSP_VM_NEXT();
+			}
+			NHSP_VM_CASE( OPERATOR_REPEAT_CHECK )
+			{
+				if ( s->current_loop_frame_ <= 0 )
+				{
+					raise_error( "repeat：repeat-loopの中にありません" );
+				}
+				auto& frame = s->loop_frame_[ s->current_loop_frame_ -1 ];
+				if ( frame.max_>=0 && frame.counter_>=frame.max_ )
+				{
+					pc = frame.end_position_;
+					--s->current_loop_frame_;
+				}
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_LOOP )
+			NHSP_VM_CASE( OPERATOR_CONTINUE )
+			{
+				if ( s->current_loop_frame_ <= 0 )
+				{
+					raise_error( "loop,continue：repeat-loopの中にありません" );
+				}
+
+				auto& frame = s->loop_frame_[ s->current_loop_frame_ -1 ];
+				++frame.counter_;
+				++frame.cnt_;
+				pc = frame.start_position_ -1;
+				NHSP_VM_NEXT();
+			}
+			NHSP_VM_CASE( OPERATOR_BREAK )
+			{
+				if ( s->current_loop_frame_ <= 0 )
+				{
+					raise_error( "break：repeat-loopの中にありません" );
+				}
+
+				auto& frame = s->loop_frame_[ s->current_loop_frame_ -1 ];
+				pc = frame.end_position_;
+
+				--s->current_loop_frame_;
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_GOSUB )
+			{
+				check_call_frame_push( s );
+
+				auto& frame = s->call_frame_[s->current_call_frame_];
+				++s->current_call_frame_;
+				frame.caller_poisition_ = pc;
+
+				pc = code_operand( codes[ pc ] ) -1;
+				NHSP_VM_NEXT();
+			}
+			NHSP_VM_CASE( OPERATOR_GOTO )
+			{
+				pc = code_operand( codes[ pc ] ) -1;
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_COMMAND )
+			{
+				const auto operand = code_operand( codes[ pc ] );
+				const auto command = code_call_callee( operand );
+				const auto arg_num = code_call_arg_num( operand );
+
+					// コマンド呼び出し
+				const auto delegate = get_command_delegate( static_cast<builtin_command_tag>( command ) );
+				assert( delegate != nullptr );
+				const auto top = s->stack_->top_;
+				delegate( e, s, arg_num );
+				assert( s->stack_->top_ == top -arg_num );// 戻り値がないことを確認
+
+				NHSP_VM_NEXT();
+			}
+			NHSP_VM_CASE( OPERATOR_FUNCTION )
+			{
+				const auto operand = code_operand( codes[ pc ] );
+				const auto function = code_call_callee( operand );
+				const auto arg_num = code_call_arg_num( operand );
+
+					// 関数呼び出し
+				const auto delegate = get_function_delegate( static_cast<builtin_function_tag>( function ) );
+				assert( delegate != nullptr );
+				const auto top = s->stack_->top_;
+				delegate( e, s, arg_num );
+				assert( s->stack_->top_ == top -arg_num +1 );// 戻り値が入っていることを確認する
+
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_JUMP )
+			{
+				pc = code_operand( codes[ pc ] ) -1;
+				NHSP_VM_NEXT();
+			}
+			NHSP_VM_CASE( OPERATOR_JUMP_RELATIVE )
+			{
+				pc += code_operand( codes[ pc ] ) -1;
+				NHSP_VM_NEXT();
+			}
+			NHSP_VM_CASE( OPERATOR_RETURN )
+			{
+				if ( s->current_call_frame_ <= 0 )
+				{
+					raise_error( "サブルーチン外からのreturnは無効です" );
+				}
+
+				const auto arg_num = code_operand( codes[ pc ] );
+				if ( arg_num > 0 )
+				{
+					assert( arg_num == 1 );
+					const auto res = stack_peek( s->stack_ );
+					switch( value_get_primitive_tag(*res) )
+					{
+						case VALUE_INT:		s->stat_ = value_calc_int(*res); break;
+						case VALUE_DOUBLE:	s->refdval_ = value_calc_double(*res); break;
+						case VALUE_STRING:	release_shared_string( s->refstr_ ); s->refstr_ = value_calc_string(*res); break;
+						default: assert( false ); break;
+					}
+					stack_pop( s->stack_ );
+				}
+
+				--s->current_call_frame_;
+				const auto& frame =s->call_frame_[ s->current_call_frame_ ];
+				pc = frame.caller_poisition_;
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_END )
+				s->is_end_ =true;
+				if ( IsThreaded )
+				{ return; }
+				break;
+
+			NHSP_VM_CASE( OPERATOR_LOAD_SCALAR )
+			{
+				stack_push( s->stack_, &variables[ code_operand( codes[ pc ] ) ], 0 );
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_INC_VAR )
+			{
+				auto* const var = &variables[ code_operand( codes[ pc ] ) ];
+				const auto imm = codes[ pc +1 ];
+				if ( var->type_ == VALUE_INT )
+				{
+					// 添え字0は常に存在する
+					reinterpret_cast<int*>( var->data_ )[0] += imm;
+				}
+				else
+				{
+					// var = var + imm と同じ結果にする
+					value_t v;
+					v.type_ = VALUE_VARIABLE;
+					v.variable_ = var;
+					v.index_ = 0;
+					value_isolate( v );
+					value_t r;
+					r.type_ = VALUE_INT;
+					r.ivalue_ = imm;
+					value_add( &v, r );
+					variable_set( var, v, 0 );
+					clear_value( &v );
+				}
+				++pc;
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_CMP_JUMP_IF_FALSE )
+			{
+				assert( s->stack_->top_ >= 2 );
+				value_t* l =stack_peek( s->stack_, -2 );
+				value_t* r =stack_peek( s->stack_, -1 );
+				int li =0, ri =0;
+				if ( NHSP_CONFIG_QUICKENING && value_peek_int( *l, li ) && value_peek_int( *r, ri ) )
+				{
+					NHSP_VM_QUICKEN( OPERATOR_CMP_JUMP_IF_FALSE_INT_INT );
+				}
+				const auto is_cond = compare_value( codes[ pc +1 ], l, *r );
+				stack_pop( s->stack_, 2 );
+				if ( is_cond )
+				{
+					++pc;
+				}
+				else
+				{
+					const auto false_head = code_operand( codes[ pc ] );
+					pc += false_head -1;
+				}
+				NHSP_VM_NEXT();
+			}
+
+			// 特殊化された命令、ガードに失敗したら汎用の処理に任せる
+#define NHSP_VM_QUICKENED_BINARY( name, generic, type, tag, member, peek, expr ) \
+			NHSP_VM_CASE( name ) \
+			{ \
+				value_t* l =stack_peek( s->stack_, -2 ); \
+				value_t* r =stack_peek( s->stack_, -1 ); \
+				type lv, rv; \
+				if ( peek( *l, lv ) && peek( *r, rv ) ) \
+				{ \
+					/* 両辺とも解放の要らない値なのでそのまま上書きして捨てる */ \
+					l->type_ = tag; \
+					l->member = ( expr ); \
+					--s->stack_->top_; \
+				} \
+				else \
+				{ \
+					apply_binary_operator( generic, l, *r ); \
+					stack_pop( s->stack_ ); \
+				} \
+				NHSP_VM_NEXT(); \
+			}
+
+			NHSP_VM_QUICKENED_BINARY( OPERATOR_ADD_INT_INT,		OPERATOR_ADD,	int, VALUE_INT, ivalue_, value_peek_int, lv + rv )
+			NHSP_VM_QUICKENED_BINARY( OPERATOR_SUB_INT_INT,		OPERATOR_SUB,	int, VALUE_INT, ivalue_, value_peek_int, lv - rv )
+			NHSP_VM_QUICKENED_BINARY( OPERATOR_MUL_INT_INT,		OPERATOR_MUL,	int, VALUE_INT, ivalue_, value_peek_int, lv * rv )
+			NHSP_VM_QUICKENED_BINARY( OPERATOR_EQ_INT_INT,		OPERATOR_EQ,	int, VALUE_INT, ivalue_, value_peek_int, lv == rv ? 1 : 0 )
+			NHSP_VM_QUICKENED_BINARY( OPERATOR_NEQ_INT_INT,		OPERATOR_NEQ,	int, VALUE_INT, ivalue_, value_peek_int, lv != rv ? 1 : 0 )
+			NHSP_VM_QUICKENED_BINARY( OPERATOR_GT_INT_INT,		OPERATOR_GT,	int, VALUE_INT, ivalue_, value_peek_int, lv > rv ? 1 : 0 )
+			NHSP_VM_QUICKENED_BINARY( OPERATOR_GTOE_INT_INT,	OPERATOR_GTOE,	int, VALUE_INT, ivalue_, value_peek_int, lv >= rv ? 1 : 0 )
+			NHSP_VM_QUICKENED_BINARY( OPERATOR_LT_INT_INT,		OPERATOR_LT,	int, VALUE_INT, ivalue_, value_peek_int, lv < rv ? 1 : 0 )
+			NHSP_VM_QUICKENED_BINARY( OPERATOR_LTOE_INT_INT,	OPERATOR_LTOE,	int, VALUE_INT, ivalue_, value_peek_int, lv <= rv ? 1 : 0 )
+			NHSP_VM_QUICKENED_BINARY( OPERATOR_ADD_DOUBLE_DOUBLE,	OPERATOR_ADD,	double, VALUE_DOUBLE, dvalue_, value_peek_double, lv + rv )
+			NHSP_VM_QUICKENED_BINARY( OPERATOR_SUB_DOUBLE_DOUBLE,	OPERATOR_SUB,	double, VALUE_DOUBLE, dvalue_, value_peek_double, lv - rv )
+			NHSP_VM_QUICKENED_BINARY( OPERATOR_MUL_DOUBLE_DOUBLE,	OPERATOR_MUL,	double, VALUE_DOUBLE, dvalue_, value_peek_double, lv * rv )
+
+#undef NHSP_VM_QUICKENED_BINARY
+
+			NHSP_VM_CASE( OPERATOR_ASSIGN_INT )
+			{
+				const auto var =stack_peek( s->stack_, -2 );
+				const auto v =stack_peek( s->stack_, -1 );
+				auto* const dst = variable_peek_element<int>( *var, VALUE_INT );
+				int i =0;
+				if ( dst != nullptr && value_peek_int( *v, i ) )
+				{
+					*dst = i;
+					s->stack_->top_ -= 2;
+				}
+				else
+				{
+					apply_assign_operator( OPERATOR_ASSIGN, var, v );
+					stack_pop( s->stack_, 2 );
+				}
+				NHSP_VM_NEXT();
+			}
+			NHSP_VM_CASE( OPERATOR_ASSIGN_DOUBLE )
+			{
+				const auto var =stack_peek( s->stack_, -2 );
+				const auto v =stack_peek( s->stack_, -1 );
+				auto* const dst = variable_peek_element<double>( *var, VALUE_DOUBLE );
+				double d =0.0;
+				if ( dst != nullptr && value_peek_double( *v, d ) )
+				{
+					*dst = d;
+					s->stack_->top_ -= 2;
+				}
+				else
+				{
+					apply_assign_operator( OPERATOR_ASSIGN, var, v );
+					stack_pop( s->stack_, 2 );
+				}
+				NHSP_VM_NEXT();
+			}
+
+			NHSP_VM_CASE( OPERATOR_CMP_JUMP_IF_FALSE_INT_INT )
+			{
+				value_t* l =stack_peek( s->stack_, -2 );
+				value_t* r =stack_peek( s->stack_, -1 );
+				const auto cmp = codes[ pc +1 ];
+				int li =0, ri =0;
+				bool is_cond = false;
+				if ( value_peek_int( *l, li ) && value_peek_int( *r, ri ) )
+				{
+					switch( cmp )
+					{
+						case OPERATOR_EQ:		is_cond = ( li == ri ); break;
+						case OPERATOR_NEQ:		is_cond = ( li != ri ); break;
+						case OPERATOR_GT:		is_cond = ( li > ri ); break;
+						case OPERATOR_GTOE:		is_cond = ( li >= ri ); break;
+						case OPERATOR_LT:		is_cond = ( li < ri ); break;
+						case OPERATOR_LTOE:		is_cond = ( li <= ri ); break;
+						default: assert( false ); break;
+					}
+					s->stack_->top_ -= 2;
+				}
+				else
+				{
+					is_cond = compare_value( cmp, l, *r );
+					stack_pop( s->stack_, 2 );
+				}
+				if ( is_cond )
+				{
+					++pc;
+				}
+				else
+				{
+					pc += code_operand( codes[ pc ] ) -1;
+				}
+				NHSP_VM_NEXT();
+			}
+
+			default: assert( false ); break;
+		}
+
+		++pc;
+	}
+}
+
+#undef NHSP_VM_CASE
+#undef NHSP_VM_NEXT
+#undef NHSP_VM_QUICKEN
+
+}// namespace
+
+//=============================================================================
+//=============================================================================
+//=============================================================================
+// 外部リンケージを持つ人たち、ここから
+
+//=============================================================================
+// 全体
+static bool s_is_system_initialized =false;
+
+void initialize_system()
+{
+	assert( !s_is_system_initialized );
+	s_is_system_initialized = true;
+
+	// UTF8 ワークアラウンド
+	//setvbuf( stdout, nullptr, _IOFBF, 1024 );
+	setvbuf( stderr, nullptr, _IOFBF, 1024 );
+
+#if NHSP_CONFIG_MEMLEAK_DETECTION
+	if ( s_memory_map_ == nullptr )
+	{
+		s_memory_map_ = reinterpret_cast<list_t*>( zmalloc( sizeof(list_t) ) );
+		s_memory_map_->head_ = s_memory_map_->tail_ = nullptr;
+	}
+#endif
+#if NHSP_CONFIG_VALUE_ALLOCATION_CACHE
+	for( size_t i=0; i<MAX_VALUE_ALLOCATION_CACHE; ++i )
+	{
+		s_value_allocation_cache[i] = reinterpret_cast<value_t*>( xmalloc( sizeof(value_t) ) );
+	}
+	s_value_allocation_cache_idx = 0;
+#endif
+}
+
+void uninitialize_system()
+{
+	assert( s_is_system_initialized );
+	s_is_system_initialized = false;
+
+#if NHSP_CONFIG_VALUE_ALLOCATION_CACHE
+	assert( s_value_allocation_cache_idx == 0 );
+	for( size_t i=0; i<MAX_VALUE_ALLOCATION_CACHE; ++i )
+	{
+		if ( s_value_allocation_cache[i] != nullptr )
+		{
+			xfree( s_value_allocation_cache[i] );
+			s_value_allocation_cache[i] = nullptr;
+		}
+	}
+	s_value_allocation_cache_idx = 0;
+#endif
+#if NHSP_CONFIG_MEMLEAK_DETECTION
+	if ( s_memory_map_ != nullptr )
+	{
+		printf( "====leaked memories\n" );
+		auto node = s_memory_map_->head_;
+		while( node != nullptr )
+		{
+			printf( "[%p]\n", node->value_ );
+			node = node->next_;
+		}
+		printf( "----" );
+	}
+#endif
+}
+
+//=============================================================================
+// メモリ
+
+void* xmalloc( size_t size )
+{
+	const auto res = zmalloc( size );
+#if NHSP_CONFIG_MEMLEAK_DETECTION
+	{
+		//printf( "xmalloc[%p]\n", res );
+		if ( res != nullptr )
+		{ zregister_memory( res ); }
+	}
+#endif
+	return res;
+}
+
+void  xfree( void* ptr )
+{
+#if NHSP_CONFIG_MEMLEAK_DETECTION
+	{
+		//printf( "xfree[%p]\n", ptr );
+		zunregister_memory( ptr );
+	}
+#endif
+	zfree( ptr );
+}
+
+void* xrealloc( void* ptr, size_t size )
+{
+	const auto res = zrealloc( ptr, size );
+#if NHSP_CONFIG_MEMLEAK_DETECTION
+	{
+		//printf( "xrealloc[%p->%p]\n", ptr, res );
+		if ( res != ptr )
+		{
+			if ( ptr != nullptr )
+			{ zunregister_memory( ptr ); }
+			if ( res != nullptr )
+			{ zregister_memory( res ); }
+		}
+	}
+#endif
+	return res;
+}
+
+arena_t* create_arena( size_t initial_chunk_size )
+{
+	auto res = reinterpret_cast<arena_t*>( xmalloc( sizeof(arena_t) ) );
+	res->chunk_ = res->cursor_ = nullptr;
+	res->rest_ = 0;
+	res->chunk_size_ = ( initial_chunk_size > 0 ? initial_chunk_size : 1024 );
+	return res;
+}
+
+void destroy_arena( arena_t* arena )
+{
+	auto chunk = arena->chunk_;
+	while( chunk != nullptr )
+	{
+		const auto prev = *reinterpret_cast<char**>( chunk );
+		xfree( chunk );
+		chunk = prev;
+	}
+	xfree( arena );
+}
+
+void* arena_alloc( arena_t* arena, size_t size )
+{
+	// ポインタとdoubleが置けるように揃える
+	static const size_t alignment = ( sizeof(void*) > sizeof(double) ? sizeof(void*) : sizeof(double) );
+	size = ( size +alignment -1 ) & ~( alignment -1 );
+
+	if ( arena->rest_ < size )
+	{
+		while( arena->chunk_size_ < size )
+		{
+			arena->chunk_size_ *= 2;
+		}
+		const auto chunk = reinterpret_cast<char*>( xmalloc( alignment +arena->chunk_size_ ) );
+		*reinterpret_cast<char**>( chunk ) = arena->chunk_;
+		arena->chunk_ = chunk;
+		arena->cursor_ = chunk +alignment;
+		arena->rest_ = arena->chunk_size_;
+		if ( arena->chunk_size_ < 64 *1024 )
+		{
+			arena->chunk_size_ *= 2;
+		}
+	}
+
+	const auto res = arena->cursor_;
+	arena->cursor_ += size;
+	arena->rest_ -= size;
+	return res;
+}
+
+//=============================================================================
+// 文字列バッファ
+string_buffer_t* create_string_buffer( size_t initial_len, int expand_step )
+{
+	assert( initial_len > 0 );
+	auto* const res = reinterpret_cast<string_buffer_t*>( xmalloc( sizeof( string_buffer_t ) ) );
+	initialize_string_buffer( res, initial_len, expand_step );
+	return res;
+}
+
+void destroy_string_buffer( string_buffer_t* sb )
+{
+	uninitialize_string_buffer( sb );
+	xfree( sb );
+}
+
+void initialize_string_buffer( string_buffer_t* sb, size_t initial_len, int expand_step )
+{
+	sb->buffer_ = create_string( initial_len );
+	sb->buffer_size_ = static_cast<int>( initial_len );
+	sb->cursor_ = 0;
+	sb->expand_step_ = expand_step;
+	sb->buffer_[0] = '\0';
+}
+
+void uninitialize_string_buffer( string_buffer_t* sb )
+{
+	assert( sb != nullptr );
+
+	if ( sb->buffer_ != nullptr )
+	{
+		xfree( sb->buffer_ );
+		sb->buffer_ = nullptr;
+	}
+	sb->buffer_size_ = 0;
+	sb->cursor_ = 0;
+	sb->expand_step_ = 0;
+}
+
+void string_buffer_append( string_buffer_t* sb, const char* s, int len )
+{
+	if ( len < 0 )
+	{
+		len = static_cast<int>( strlen( s ) );
+	}
+
+	if ( len == 0 )
+	{
+		return;
+	}
+
+	const auto left = sb->buffer_size_ - sb->cursor_;
+	const auto required = len + 4;
+	if ( left < required )
+	{
+		const int nexpand = ( required - left );
+		const int expand_step = ( sb->expand_step_ <= 0 ? sb->buffer_size_/* x2 */ : sb->expand_step_ );
+		const int expand = ( expand_step < nexpand ? nexpand : expand_step );
+		const size_t nsize = sb->buffer_size_ + expand;
+		sb->buffer_ = reinterpret_cast<char*>( xrealloc( sb->buffer_, static_cast<size_t>( nsize ) ) );
+		sb->buffer_size_ = static_cast<int>( nsize );
+	}
+
+	memcpy( sb->buffer_ + sb->cursor_, s, len );
+	sb->cursor_ += len;
+	sb->buffer_[sb->cursor_] = '\0';
+}
+
+void string_buffer_clear( string_buffer_t* sb )
+{
+	sb->cursor_ = 0;
+	sb->buffer_[0] = '\0';
+}
+
+//=============================================================================
+// リスト
+list_node_t* create_list_node()
+{
+	list_node_t* res = reinterpret_cast<list_node_t*>( xmalloc( sizeof( list_node_t ) ) );
+	res->prev_ = res->next_ = nullptr;
+	res->value_ = nullptr;
+	return res;
+}
+
+void destroy_list_node( list_node_t *node )
+{
+	unlink_list_node( node );
+	xfree( node );
+}
+
+void link_next( list_node_t* node, list_node_t* list )
+{
+	assert( node->prev_==nullptr && node->next_==nullptr );
+	node->prev_ = list;
+	node->next_ = list->next_;
+	list->next_ = node;
+}
+
+void link_prev( list_node_t* node, list_node_t* list )
+{
+	assert( node->prev_==nullptr && node->next_==nullptr );
+	node->prev_ = list->prev_;
+	node->next_ = list;
+	list->prev_ = node;
+}
+
+bool unlink_list_node( list_node_t* node )
+{
+	if ( node->prev_==nullptr && node->next_==nullptr )
+	{ 
+		return false;
+	}
+	if ( node->prev_ != nullptr )
+	{
+		node->prev_->next_ = node->next_;
+	}
+	if ( node->next_ != nullptr )
+	{
+		node->next_->prev_ = node->prev_;
+	}
+	node->prev_ = node->next_ = nullptr;
+	return true;
+}
+
+list_t* create_list()
+{
+	auto res = reinterpret_cast<list_t*>( xmalloc( sizeof(list_t) ) );
+	res->head_ = res->tail_ = nullptr;
+	return res;
+}
+
+void destroy_list( list_t* list )
+{
+	xfree( list );
+}
+
+void list_prepend( list_t& list, list_node_t* node )
+{
+	if ( list.head_ == nullptr )
+	{
+		assert( list.tail_==nullptr );
+		list.head_ = list.tail_ = node;
+		return;
+	}
+	link_prev( node, list.head_ );
+	list.head_ = node;
+}
+
+void list_append( list_t& list, list_node_t* node )
+{
+	if ( list.tail_ == nullptr )
+	{
+		assert( list.head_==nullptr );
+		list.head_ = list.tail_ = node;
+		return;
+	}
+	link_next( node, list.tail_ );
+	list.tail_ = node;
+}
+
+void list_erase( list_t& list, list_node_t* node )
+{
+	if ( list.head_ == node )
+	{
+		list.head_ = node->next_;
+	}
+	if ( list.tail_ == node )
+	{
+		list.tail_ = node->prev_;
+	}
+	unlink_list_node( node );
+}
+
+list_node_t* list_find( list_t& list, void* value )
+{
+	auto* node = list.head_;
+	while( node != nullptr )
+	{
+		if ( node->value_ == value )
+		{
+			return node;
+		}
+		node = node->next_;
+	}
+	return nullptr;
+}
+
+void list_free_all( list_t& list )
+{
+	auto* node = list.head_;
+	while( node != nullptr )
+	{
+		auto next = node->next_;
+		list_erase( list, node );
+		xfree( node );
+		node = next;
+	}
+}
+
+//=============================================================================
+// 名前表
+name_table_t* create_name_table()
+{
+	auto res = reinterpret_cast<name_table_t*>( xmalloc( sizeof(name_table_t) ) );
+	res->entries_ = nullptr;
+	res->entry_num_ = 0;
+	res->entry_buffer_size_ = 0;
+	res->erased_num_ = 0;
+	res->buckets_ = nullptr;
+	res->bucket_num_ = 0;
+	return res;
+}
+
+void destroy_name_table( name_table_t* table )
+{
+	xfree( table->entries_ );
+	xfree( table->buckets_ );
+	xfree( table );
+}
+
+// 小文字にしてから FNV-1a、len が負なら終端まで
+unsigned int name_table_hash( const char* name, int len )
+{
+	unsigned int h = 2166136261u;
+	for( int i=0; ( len<0 || i<len ) && name[i]!='\0'; ++i )
+	{
+		auto c = name[i];
+		if ( c>='A' && c<='Z' )
+		{ c = static_cast<char>( c -'A' +'a' ); }
+		h ^= static_cast<unsigned char>( c );
+		h *= 16777619u;
+	}
+	return h;
+}
+
+int name_table_find( const name_table_t* table, const char* name, int len )
+{
+	if ( table->bucket_num_ == 0 )
+	{ return -1; }
+
+	const auto h = name_table_hash( name, len );
+	auto i = table->buckets_[ h & (table->bucket_num_ -1) ];
+	while( i >= 0 )
+	{
+		const auto& entry = table->entries_[i];
+		if ( entry.hash_ == h && string_equal_igcase( entry.name_, name, len ) )
+		{ return i; }
+		i = entry.next_;
+	}
+	return -1;
+}
+
+int name_table_insert( name_table_t* table, const char* name, void* value )
+{
+	assert( name_table_find( table, name ) < 0 );
+	if ( table->entry_num_ >= table->entry_buffer_size_ )
+	{
+		if ( table->erased_num_ > table->entry_num_ /2 )
+		{
+			// 空きが多ければ詰めるだけにする、登録順は保たれる
+			int w =0;
+			for( int i=0; i<table->entry_num_; ++i )
+			{
+				if ( table->entries_[i].name_ != nullptr )
+				{ table->entries_[w++] = table->entries_[i]; }
+			}
+			table->entry_num_ = w;
+			table->erased_num_ = 0;
+		}
+		else
+		{
+			table->entry_buffer_size_ = ( table->entry_buffer_size_ > 0 ? table->entry_buffer_size_ *2 : 16 );
+			table->entries_ = reinterpret_cast<name_table_entry_t*>( xrealloc( table->entries_, sizeof(name_table_entry_t) *table->entry_buffer_size_ ) );
+		}
+
+		// バケットは要素の領域と同じ数だけ用意して引き直す
+		if ( table->bucket_num_ < table->entry_buffer_size_ )
+		{
+			xfree( table->buckets_ );
+			table->bucket_num_ = table->entry_buffer_size_;
+			table->buckets_ = reinterpret_cast<int*>( xmalloc( sizeof(int) *table->bucket_num_ ) );
+		}
+		for( int i=0; i<table->bucket_num_; ++i )
+		{
+			table->buckets_[i] = -1;
+		}
+		for( int i=0; i<table->entry_num_; ++i )
+		{
+			auto& entry = table->entries_[i];
+			if ( entry.name_ == nullptr )
+			{ continue; }
+			auto& bucket = table->buckets_[ entry.hash_ & (table->bucket_num_ -1) ];
+			entry.next_ = bucket;
+			bucket = i;
+		}
+	}
+
+	const auto h = name_table_hash( name );
+	const auto res = table->entry_num_++;
+	auto& entry = table->entries_[res];
+	auto& bucket = table->buckets_[ h & (table->bucket_num_ -1) ];
+	entry.name_ = name;
+	entry.hash_ = h;
+	entry.next_ = bucket;
+	entry.value_ = value;
+	bucket = res;
+	return res;
+}
+
+void name_table_erase( name_table_t* table, int entry )
+{
+	assert( entry>=0 && entry<table->entry_num_ && table->entries_[entry].name_ != nullptr );
+	auto& e = table->entries_[entry];
+	auto* link = &table->buckets_[ e.hash_ & (table->bucket_num_ -1) ];
+	while( *link != entry )
+	{
+		link = &table->entries_[ *link ].next_;
+	}
+	*link = e.next_;
+
+	e.name_ = nullptr;
+	e.value_ = nullptr;
+	e.next_ = -1;
+	++table->erased_num_;
+}
+
+//=============================================================================
+// キーワード
+int query_keyword( const char* s )
+{
+	const auto w = find_reserved_word( s );
+	return ( w != nullptr ? w->keyword_ : KEYWORD_UNDEF );
+}
+
+//=============================================================================
+// トークナイザ
+int query_token_shadow( const char* ident, size_t len )
+{
+	const auto w = find_reserved_word( ident, static_cast<int>( len ) );
+	return ( w != nullptr ? w->token_shadow_ : TOKEN_UNKNOWN );
+}
+
+void initialize_tokenize_context( tokenize_context_t* c, const char* script )
+{
+	c->script_ = script;
+	c->cursor_ = 0;
+	c->line_ = 0;
+	c->line_head_ = script;
+}
+
+void uninitialize_tokenize_context( tokenize_context_t* c )
+{
+	c->script_ = nullptr;
+	c->cursor_ = 0;
+	c->line_ = 0;
+	c->line_head_ = nullptr;
+}
+
+// 次のトークンを res に読む、文字列は切り出さずスクリプト上の範囲だけを記録する
+// is_raise_error が false なら、読めない時はエラーにせず false を返す
+bool get_token( tokenize_context_t& c, token_t& res, bool is_raise_error )
+{
+	res.tag_ = TOKEN_UNKNOWN;
+	res.content_ = nullptr;
+	res.cursor_begin_ = c.cursor_;
+	res.cursor_end_ = c.cursor_;
+	res.left_space_ =false;
+	res.right_space_ =false;
+
+	const auto is_space = []( char c ) { return ( c==' ' || c=='\t' ); };
+	const auto is_number = []( char c ) { return ( c>='0' && c<='9' ); };
+	const auto is_alpha = []( char c ) { return ( ( c>='a' && c<='z' ) || ( c>='A' && c<='Z' ) ); };
+	const auto is_rest_ident = [&]( char c ) { return ( is_number(c) || is_alpha(c) || c=='_' ); };
+
+	const auto pp = c.script_ +c.cursor_;
+	const char* p = c.script_ +c.cursor_;
+
+restart:
+	const auto prev_p = p;
+	const auto prev_cursor = static_cast<int>( p - c.script_ );
+	res.appear_line_ = c.line_;
+	switch( p[0] )
+	{
+			// EOF
+		case '\0':	res.tag_ = TOKEN_EOF; break;
+
+			// 行終わり
+		case '\r':
+		case '\f':
+			++p;
+			goto restart;
+
+		case '\n':
+			// この位置はマーキング
+			++p;
+			++c.line_;
+			c.line_head_ = p;
+			res.tag_ = TOKEN_EOL;
+			break;
+
+			// ステートメント終わり
+		case ':':
+			++p;
+			res.tag_ = TOKEN_EOS;
+			break;
+
+			// プリプロセッサで使う
+		case '%':	++p; res.tag_ = TOKEN_PP_ARG_INDICATOR; break;
+
+			// 微妙な文字
+		case '{':	++p; res.tag_ = TOKEN_LBRACE; break;
+		case '}':	++p; res.tag_ = TOKEN_RBRACE; break;
+		case '(':	++p; res.tag_ = TOKEN_LPARENTHESIS; break;
+		case ')':	++p; res.tag_ = TOKEN_RPARENTHESIS; break;
+		case ',':	++p; res.tag_ = TOKEN_COMMA; break;
+
+			// 演算子
+		case '|':	++p; if ( p[0] == '=' ) { ++p; res.tag_ = TOKEN_BOR_ASSIGN; } else { res.tag_ = TOKEN_OP_BOR; } break;
+		case '&':	++p; if ( p[0] == '=' ) { ++p; res.tag_ = TOKEN_BAND_ASSIGN; } else { res.tag_ = TOKEN_OP_BAND; } break;
+		case '^':	++p; if ( p[0] == '=' ) { ++p; res.tag_ = TOKEN_BXOR_ASSIGN; } else { res.tag_ = TOKEN_OP_BXOR; } break;
+		case '!':	++p; if ( p[0]=='=' ) { ++p; } res.tag_ = TOKEN_OP_NEQ; break;
+		case '>':
+			++p;
+			if ( p[0] == '=' )
+			{ ++p; res.tag_ = TOKEN_OP_GTOE; }
+			else
+			{ res.tag_ = TOKEN_OP_GT; }
+			break;
+		case '<':
+			++p;
+			if ( p[0] == '=' )
+			{ ++p; res.tag_ = TOKEN_OP_LTOE; }
+			else
+			{ res.tag_ = TOKEN_OP_LT; }
+			break;
+		case '+':	++p; if ( p[0] == '=' ) { ++p; res.tag_ = TOKEN_ADD_ASSIGN; } else { res.tag_ = TOKEN_OP_ADD; } break;
+		case '-':	++p; if ( p[0] == '=' ) { ++p; res.tag_ = TOKEN_SUB_ASSIGN; } else { res.tag_ = TOKEN_OP_SUB; } break;
+		case '*':	++p; if ( p[0] == '=' ) { ++p; res.tag_ = TOKEN_MUL_ASSIGN; } else { res.tag_ = TOKEN_OP_MUL; } break;
+		case '/':
+			++p;
+			if ( p[0] == '/' )// 一行コメント
+			{
+				++p;
+				while( p[0]!='\n' && p[0]!='\0' )
+				{ ++p; }
+				goto restart;
+			}
+			if ( p[0] == '*' )// 複数行コメント
+			{
+				++p;
+				for( ; ; )
+				{
+					if ( p[0] == '\0' )
+					{
+						if ( !is_raise_error )
+						{ return false; }
+						raise_error( "複数行コメントの読み取り中にEOFが検出されました@@ %d行目", c.line_ );
+						break;
+					}
+					if ( p[0] == '\n' )
+					{
+						++p;
+						++c.line_;
+						c.line_head_ = p;
+						continue;
+					}
+					if ( p[0]=='*' && p[1]=='/' )
+					{
+						p += 2;
+						break;
+					}
+					++p;
+				}
+				goto restart;
+			}
+			if ( p[0] == '=' )
+			{
+				++p;
+				res.tag_ = TOKEN_DIV_ASSIGN;
+			}
+			else
+			{ 
+				res.tag_ = TOKEN_OP_DIV;
+			}
+			break;
+		case '\\':	++p; if ( p[0] == '=' ) { ++p; res.tag_ = TOKEN_MOD_ASSIGN; } else { res.tag_ = TOKEN_OP_MOD; } break;
+
+			// 代入
+		case '=':
+			++p;
+			if ( p[0] == '=' )
+			{
+				++p;
+				res.tag_ = TOKEN_OP_EQ;
+			}
+			else
+			{
+				res.tag_ = TOKEN_ASSIGN;
+			}
+			break;
+
+			// 文字列
+		case '\"':
+		{
+			++p;
+			while( p[0]!='\"' )
+			{
+				if ( p[0] == '\0' )
+				{
+					if ( !is_raise_error )
+					{ return false; }
+					raise_error( "文字列の読み取り中にEOFが検出されました@@ %d行目", c.line_ );
+				}
+				if ( p[0]=='\\' && p[1]=='\"' )
+				{
+					++p;
+				}
+				++p;
+			}
+			res.tag_ = TOKEN_STRING;
+			++p;
+			break;
+		}
+
+			// コメント
+		case ';':
+			++p;
+			while( p[0]!='\n' && p[0]!='\0' )
+			{
+				++p;
+			}
+			goto restart;
+
+		default:
+			if ( is_space( p[0] ) )
+			{
+				// スペース
+				++p;
+				res.left_space_ =true;
+				while( is_space(p[0]) )
+				{
+					++p;
+				}
+				goto restart;
+			}
+			else if ( is_number( p[0] ) )
+			{
+				// 数値
+				if ( p[0] == '0' )
+				{
+					++p;
+				}
+				else
+				{
+					while( is_number(p[0]) )
+					{
+						++p;
+					}
+				}
+				if ( p[0] == '.' )
+				{
+					++p;
+					while( is_number(p[0]) )
+					{
+						++p;
+					}
+					res.tag_ = TOKEN_REAL;
+				}
+				else
+				{
+					res.tag_ = TOKEN_INTEGER;
+				}
+			}
+			else if ( is_alpha( p[0] ) )
+			{
+				// 何らかの識別子
+				++p;
+				while( is_rest_ident( p[0] ) )
+				{
+					++p;
+				}
+				res.tag_ = TOKEN_IDENTIFIER;
+				const auto shadow =query_token_shadow( c.script_ +prev_cursor, p -prev_p );
+				if ( shadow != -1 )
+				{
+					res.tag_ = static_cast<token_tag>( shadow );
+				}
+			}
+			else
+			{
+				// もう読めない
+				if ( !is_raise_error )
+				{ return false; }
+				raise_error( "読み取れない文字[%c]@@ %d行目", p[0], c.line_ );
+			}
+			break;
+	}
+
+	if ( is_space( p[0] ) )
+	{
+		res.right_space_ = true;
+	}
+
+	c.cursor_ += static_cast<int>( p - pp );
+	res.cursor_begin_ = prev_cursor;
+	res.cursor_end_ = c.cursor_;
+	return true;
+}
+
+// 文字列リテラルの中身のエスケープを解いて dst に書く、dst は len+1 以上
+size_t decode_token_string( char* dst, const char* str, size_t len )
+{
+	size_t w =0;
+	for( size_t i=0; i<len; ++i, ++w )
+	{
+		if ( str[i]=='\\' && (i+1)<len )
+		{
+			switch( str[i+1] )
+			{
+				case 't':	dst[w] = '\t'; break;
+				case 'n':	dst[w] = '\n'; break;
+				case '\"':	dst[w] = '\"'; break;
+				default:
+					raise_error( "読み取れないエスケープシーケンス@@ %c%c", str[i], str[i+1] );
+					break;
+			}
+			++i;
+		}
+		else
+		{
+			dst[w] = str[i];
+		}
+	}
+	dst[w] = '\0';
+	return w;
+}
+
+//=============================================================================
+// パーサ
+parse_context_t* create_parse_context()
+{
+	auto res = reinterpret_cast<parse_context_t*>( xmalloc( sizeof(parse_context_t) ) );
+	return res;
+}
+
+void destroy_parse_context( parse_context_t* p )
+{
+	xfree( p );
+}
+
+void initialize_parse_context( parse_context_t* c, tokenize_context_t& t )
+{
+	start_parse_context( c, t );
+
+	// EOF か読めないところまで字句解析しておく
+	lex_tokens( *c, t );
+}
+
+void initialize_parse_context( parse_context_t* c, tokenize_context_t& t, prepro_stream_t& stream )
+{
+	start_parse_context( c, t );
+
+	// 展開された行ごとに字句解析する、行の領域は次の行で使い回すので文字列もここで切り出しておく
+	auto* const chunk = stream.pctx_->out_buffer_;
+	while ( prepro_stream_next( &stream ) )
+	{
+		t.script_ = chunk->buffer_;
+		t.cursor_ = 0;
+		t.line_head_ = chunk->buffer_;
+
+		const auto first = c->token_num_;
+		const auto is_lexed = lex_tokens( *c, t );
+		if ( !is_lexed )
+		{
+			// 読まれた時に字句解析をやり直せるよう、この行だけは残す
+			auto* const rest = alloc_token_text( *c, chunk->cursor_ );
+			memcpy( rest, chunk->buffer_, chunk->cursor_ +1 );
+			t.script_ = rest;
+			t.line_head_ = rest;
+			for( int i=first; i<c->token_num_ -1; ++i )
+			{
+				fill_token_content( *c, c->tokens_[i] );
+			}
+
+			// プリプロセスのエラーは字句解析のエラーより先に出るので最後まで流す
+			string_buffer_clear( chunk );
+			while ( prepro_stream_next( &stream ) )
+			{
+				string_buffer_clear( chunk );
+			}
+			return;
+		}
+
+		// 行末の EOF は最後の行のものだけ残す
+		const auto is_last = ( stream.cursor_ == nullptr );
+		if ( !is_last )
+		{
+			--c->token_num_;
+		}
+		for( int i=first; i<c->token_num_; ++i )
+		{
+			fill_token_content( *c, c->tokens_[i] );
+		}
+		string_buffer_clear( chunk );
+
+		if ( is_last )
+		{
+			break;
+		}
+	}
+}
+
+void uninitialize_parse_context( parse_context_t* c )
+{
+	xfree( c->tokens_ );
+	c->tokens_ = nullptr;
+	c->token_num_ = 0;
+	c->token_current_ = 0;
+	c->token_read_num_ = 0;
+	c->token_buffer_size_ = 0;
+
+	destroy_arena( c->arena_ );
+	c->arena_ = nullptr;
+	destroy_ast( c->ast_ );
+	c->ast_ = nullptr;
+
+	if ( c->identifiers_ != nullptr )
+	{
+		destroy_name_table( c->identifiers_ );
+		c->identifiers_ = nullptr;
+	}
+}
+
+// len 文字と終端の分の領域を確保する、パーサーと同じだけ生きる
+char* alloc_token_text( parse_context_t& c, size_t len )
+{
+	return reinterpret_cast<char*>( arena_alloc( c.arena_, len +1 ) );
+}
+
+token_t* read_token( parse_context_t& c )
+{
+	const auto res = get_parsed_token( c, c.token_current_ );
+	++c.token_current_;
+	if ( c.token_read_num_ < c.token_current_ )
+	{
+		c.token_read_num_ = c.token_current_;
+	}
+	return res;
+}
+
+void unread_token( parse_context_t& c, size_t num )
+{
+	assert( static_cast<size_t>( c.token_current_ ) >= num );
+	c.token_current_ -= static_cast<int>( num );
+}
+
+// 次に読むトークンが既に読まれたことがあればそれを、なければ最後に読んだトークンを起点に num 個前
+token_t* prev_token( parse_context_t& c, size_t num )
+{
+	const auto current = ( c.token_current_ < c.token_read_num_ ? c.token_current_ : c.token_read_num_ -1 );
+	assert( current >= static_cast<int>( num ) );
+	return get_parsed_token( c, current -static_cast<int>( num ) );
+}
+
+//=============================================================================
+// プリプロセッサ
+int query_preprocessor( const char* s )
+{
+	const auto w = find_reserved_word( s );
+	return ( w != nullptr ? w->preprocessor_ : -1 );
+}
+
+void initialize_macro_arg( macro_arg_t* ma )
+{
+	ma->arg_param_ = nullptr;
+}
+
+void uninitialize_macro_arg( macro_arg_t* ma )
+{
+	if ( ma->arg_param_ != nullptr )
+	{
+		destroy_string( ma->arg_param_ );
+		ma->arg_param_ = nullptr;
+	}
+}
+
+macro_t* create_macro()
+{
+	auto* const res = reinterpret_cast<macro_t*>( xmalloc( sizeof(macro_t) ) );
+	res->name_ = nullptr;
+	res->is_ctype_ = false;
+	res->param_num_ = 0;
+	for ( auto& it : res->params_ )
+	{
+		it.default_param_ = nullptr;
+	}
+	res->replacing_ = nullptr;
+	res->expansions_ = nullptr;
+	return res;
+}
+
+void destroy_macro( macro_t* m )
+{
+	macro_free_content( m );
+	xfree( m );
+}
+
+void macro_free_content( macro_t* macro )
+{
+	if ( macro->name_ != nullptr )
+	{
+		destroy_string( macro->name_ );
+		macro->name_ = nullptr;
+	}
+
+	if ( macro->replacing_ != nullptr )
+	{
+		destroy_string( macro->replacing_ );
+		macro->replacing_ = nullptr;
+	}
+
+	for ( auto& it : macro->params_ )
+	{
+		if ( it.default_param_ != nullptr )
+		{
+			destroy_string( it.default_param_ );
+			it.default_param_ = nullptr;
+		}
+	}
+	macro->param_num_ = 0;
+
+	if ( macro->expansions_ != nullptr )
+	{
+		auto* const table = macro->expansions_;
+		for( int i=0; i<table->entry_num_; ++i )
+		{
+			auto* const expansion = reinterpret_cast<macro_expansion_t*>( table->entries_[i].value_ );
+			if ( expansion != nullptr )
+			{
+				destroy_string( expansion->args_ );
+				destroy_string( expansion->text_ );
+				xfree( expansion );
+			}
+		}
+		destroy_name_table( table );
+		macro->expansions_ = nullptr;
+	}
+}
+
+macro_expansion_t* macro_find_expansion( const macro_t* macro, const char* args )
+{
+	if ( macro->expansions_ == nullptr )
+	{ return nullptr; }
+
+	// 名前表は大文字小文字を区別しないので、綴りまで同じものだけ使う
+	const auto entry = name_table_find( macro->expansions_, args );
+	if ( entry < 0 || strcmp( macro->expansions_->entries_[entry].name_, args ) != 0 )
+	{ return nullptr; }
+	return reinterpret_cast<macro_expansion_t*>( macro->expansions_->entries_[entry].value_ );
+}
+
+macro_expansion_t* macro_register_expansion( macro_t* macro, const char* args, const char* text, size_t len )
+{
+	if ( macro->expansions_ == nullptr )
+	{
+		macro->expansions_ = create_name_table();
+	}
+
+	// 大文字小文字だけが違う引数の組は先に入った方だけを覚える
+	if ( name_table_find( macro->expansions_, args ) >= 0 )
+	{ return nullptr; }
+
+	auto* const expansion = reinterpret_cast<macro_expansion_t*>( xmalloc( sizeof(macro_expansion_t) ) );
+	expansion->args_ = create_string( args );
+	expansion->text_ = create_string( text, len );
+	expansion->is_final_ = false;
+	expansion->final_generation_ = -1;
+	name_table_insert( macro->expansions_, expansion->args_, expansion );
+	return expansion;
+}
+
+prepro_context_t* create_prepro_context()
+{
+	auto res = reinterpret_cast<prepro_context_t*>( xmalloc( sizeof(prepro_context_t) ) );
+	res->macro_table_ = create_name_table();
+	memset( res->macro_initial_, 0, sizeof(res->macro_initial_) );
+	res->macro_generation_ = 0;
+	res->line_ = 0;
+	res->out_buffer_ = nullptr;
+	res->is_current_region_valid_ = true;
+	res->pp_region_idx_ = 0;
+	res->pp_region_[0].is_valid_ = true;
+	res->pp_region_[0].line_ = true;
+	res->enum_next_ = 0;
+	return res;
+}
+
+void destroy_prepro_context( prepro_context_t* pctx )
+{
+	assert( pctx != nullptr );
+	{
+		auto* const table = pctx->macro_table_;
+		for( int i=0; i<table->entry_num_; ++i )
+		{
+			auto* macro = reinterpret_cast<macro_t*>( table->entries_[i].value_ );
+			if ( macro != nullptr )
+			{ destroy_macro( macro ); }
+		}
+		destroy_name_table( table );
+	}
+
+	if ( pctx->out_buffer_ != nullptr )
+	{
+		destroy_string_buffer( pctx->out_buffer_ );
+		pctx->out_buffer_ = nullptr;
+	}
+	xfree( pctx );
+}
+
+void prepro_register_default_macros( prepro_context_t* pctx )
+{
+	{
+		auto* const nm = create_macro();
+		nm->name_ = create_string( "M_PI" );
+		nm->replacing_ = create_string( "3.141592653589793238" );
+		prepro_register_macro( pctx, nm );
+	}
+}
+
+char* prepro_do( const char* src )
+{
+	prepro_stream_t stream;
+	initialize_prepro_stream( &stream, src, strlen( src ) +16 );
+	while ( prepro_stream_next( &stream ) )
+	{}
+
+	// 抜き取り
+	auto* const res = stream.pctx_->out_buffer_->buffer_;
+	stream.pctx_->out_buffer_->buffer_ = nullptr;
+	uninitialize_prepro_stream( &stream );
+
+	return res;
+}
+
+void initialize_prepro_stream( prepro_stream_t* s, const char* src, size_t out_buffer_size )
+{
+	s->pctx_ = create_prepro_context();
+	prepro_register_default_macros( s->pctx_ );
+	s->pctx_->out_buffer_ = create_string_buffer( out_buffer_size );
+	s->cursor_ = src;
+	initialize_string_buffer( &s->work_, 256, -1 );
+}
+
+void uninitialize_prepro_stream( prepro_stream_t* s )
+{
+	destroy_prepro_context( s->pctx_ );
+	s->pctx_ = nullptr;
+	s->cursor_ = nullptr;
+	uninitialize_string_buffer( &s->work_ );
+}
+
+bool prepro_stream_next( prepro_stream_t* stream )
+{
+	if ( stream->cursor_ == nullptr )
+	{
+		return false;
+	}
+
+	auto* const pctx = stream->pctx_;
+	auto& work = stream->work_;
+	const char* p = stream->cursor_;
+	const char* const s = p;
+
+	// 論理行の終わりを探す、コメントも行継続もなければ元のソースをそのまま使う
+	bool is_plain = true;
+	for ( ; ; )
+	{
+		if ( p[0] == '\n' || p[0] == '\0' )
+		{ break; }
+		if ( ( p[0] == '/' && p[1] == '*' ) || ( p[0] == '*' && p[1] == '/' ) || ( p[0] == '\\' && p[1] == '\n' ) )
+		{
+			is_plain = false;
+			break;
+		}
+		++p;
+	}
+
+	const char* line = s;
+	int line_len = static_cast<int>( p - s );
+	if ( !is_plain )
+	{
+		// 取り除かない区間ごとにまとめて写す
+		string_buffer_clear( &work );
+		string_buffer_append( &work, s, line_len );
+
+		bool is_in_multi_line_comment = false;
+		const char* span = p;
+		for ( ; ; )
+		{
+			if ( p[0] == '/' && p[1] == '*' )
+			{
+				if ( !is_in_multi_line_comment )
+				{ string_buffer_append( &work, span, static_cast<int>( p - span ) ); }
+				is_in_multi_line_comment = true;
+				p += 2;
+				span = p;
+				continue;
+			}
+			else if ( p[0] == '*' && p[1] == '/' )
+			{
+				if ( !is_in_multi_line_comment )
+				{ string_buffer_append( &work, span, static_cast<int>( p - span ) ); }
+				is_in_multi_line_comment = false;
+				p += 2;
+				span = p;
+				continue;
+			}
+			else if ( p[0] == '\\' && p[1] == '\n' )
+			{
+				if ( !is_in_multi_line_comment )
+				{ string_buffer_append( &work, span, static_cast<int>( p - span ) ); }
+				p += 2;
+				span = p;
+				++pctx->line_;
+				continue;
+			}
+			else if ( p[0] == '\n' )
+			{
+				if ( !is_in_multi_line_comment )
+				{
+					break;
+				}
+				++pctx->line_;
+			}
+			else if ( p[0] == '\0' )
+			{
+				break;
+			}
+			++p;
+		}
+		if ( !is_in_multi_line_comment )
+		{ string_buffer_append( &work, span, static_cast<int>( p - span ) ); }
+
+		line = work.buffer_;
+		line_len = work.cursor_;
+	}
+
+	if ( p > s )
+	{
+		prepro_emit_line( pctx, line, line_len, &work );
+	}
+
+	if ( p[0] == '\0' )
+	{
+		stream->cursor_ = nullptr;
+
+		if ( pctx->pp_region_idx_ > 0 )
+		{
+			raise_error( "プリプロセス：#if-#endifリージョンが正しく閉じられていません：閉じられていないリージョンの始まり（%d行目）", pctx->pp_region_[0].line_ + 1 );
+			return false;
+		}
+		return true;
+	}
+
+	string_buffer_append( pctx->out_buffer_, "\n", 1 );
+
+	stream->cursor_ = p +1;
+	++pctx->line_;
+	return true;
+}
+
+void prepro_emit_line( prepro_context_t* pctx, const char* line, int len, string_buffer_t* work )
+{
+	// 最初の空白をスキップ
+	while ( len > 0 && ( line[0] == ' ' || line[0] == '\t' ) )
+	{ ++line; --len; }
+
+	if ( line[0] != '#' || len == 0 )
+	{
+		// 無効なリージョンの行は何も出さない
+		if ( !pctx->is_current_region_valid_ )
+		{ return; }
+
+		// 展開するものがなければトークナイザを通さずにそのまま写す
+		const auto head = prepro_find_plain_line_head( pctx, line, len );
+		if ( head >= 0 )
+		{
+			string_buffer_append( pctx->out_buffer_, line +head, len -head );
+			return;
+		}
+	}
+
+	// 終端が必要なので、元のソースを指しているなら作業用の領域に写してから処理する
+	if ( line[len] != '\0' )
+	{
+		string_buffer_clear( work );
+		string_buffer_append( work, line, len );
+		line = work->buffer_;
+	}
+
+	auto* out_line = prepro_line( pctx, line, true );
+	if ( out_line != nullptr )
+	{
+		string_buffer_append( pctx->out_buffer_, out_line );
+		destroy_string( out_line );
+	}
+}
+
+int prepro_find_plain_line_head( const prepro_context_t* pctx, const char* line, int len )
+{
+	// トークナイザと同じ規則で一度だけ走査し、展開もエラーも起きない行なら最初のトークンの位置を返す
+	// マクロかもしれない識別子か、字句解析でエラーになる所があれば-1
+	const auto is_number = []( char c ) { return ( c>='0' && c<='9' ); };
+	const auto is_alpha = []( char c ) { return ( ( c>='a' && c<='z' ) || ( c>='A' && c<='Z' ) ); };
+	const auto is_rest_ident = [&]( char c ) { return ( is_number(c) || is_alpha(c) || c=='_' ); };
+
+	int head = -1;
+	int i = 0;
+	while ( i < len )
+	{
+		const auto begin = i;
+		const auto c = line[i];
+		switch ( c )
+		{
+			case ' ': case '\t': case '\r': case '\f':
+				++i;
+				continue;
+
+			case ';':
+				i = len;
+				continue;
+
+			case '/':
+				if ( i +1 < len && line[i +1] == '/' )
+				{
+					i = len;
+					continue;
+				}
+				if ( i +1 < len && line[i +1] == '*' )
+				{ return -1; }
+				++i;
+				break;
+
+			case '\"':
+				++i;
+				while ( i < len && line[i] != '\"' )
+				{
+					// エスケープシーケンスの検査はトークナイザに任せる
+					if ( line[i] == '\\' )
+					{ return -1; }
+					++i;
+				}
+				if ( i >= len )
+				{ return -1; }
+				++i;
+				break;
+
+			case ':': case '%': case '{': case '}': case '(': case ')': case ',':
+			case '|': case '&': case '^': case '!': case '>': case '<': case '=':
+			case '+': case '-': case '*': case '\\':
+				++i;
+				break;
+
+			default:
+				if ( is_number( c ) )
+				{
+					if ( c == '0' )
+					{ ++i; }
+					else
+					{
+						while ( i < len && is_number( line[i] ) )
+						{ ++i; }
+					}
+					if ( i < len && line[i] == '.' )
+					{
+						++i;
+						while ( i < len && is_number( line[i] ) )
+						{ ++i; }
+					}
+				}
+				else if ( is_alpha( c ) )
+				{
+					++i;
+					while ( i < len && is_rest_ident( line[i] ) )
+					{ ++i; }
+					const auto initial = ( c>='A' && c<='Z' ? c -'A' +'a' : c );
+					if ( pctx->macro_initial_[ static_cast<unsigned char>( initial ) ] && name_table_find( pctx->macro_table_, line +begin, i -begin ) >= 0 )
+					{ return -1; }
+				}
+				else
+				{
+					return -1;
+				}
+				break;
+		}
+
+		if ( head < 0 )
+		{ head = begin; }
+	}
+	return ( head < 0 ? len : head );
+}
+
+bool prepro_is_expansion_final( const prepro_context_t* pctx, macro_expansion_t* expansion )
+{
+	// マクロの識別子も、行の読み方を変えるものも含まなければ、読み直しても何も変わらない
+	if ( expansion->final_generation_ != pctx->macro_generation_ )
+	{
+		expansion->is_final_ = ( prepro_find_plain_line_head( pctx, expansion->text_, static_cast<int>( strlen( expansion->text_ ) ) ) >= 0 );
+		expansion->final_generation_ = pctx->macro_generation_;
+	}
+	return expansion->is_final_;
+}
+
+char* prepro_line( prepro_context_t* pctx, const char* line, bool enable_preprocessor )
+{
+	// 最初の空白をスキップ
+	while ( line[0] == ' ' || line[0] == '\t' )
+	{ ++line; }
+
+	// 普通の行なら展開
+	if ( !enable_preprocessor || line[0] != '#' )
+	{
+		static constexpr int MAX_REPLACE_LOOP = 256;
+		int replaced_loop = 0;
+
+		char* res = nullptr;
+		char* holded = nullptr;
+
+		// 展開があるならずっとループ
+		for ( ; ; )
+		{
+			bool is_replaced = false;
+			res = prepro_line_expand( pctx, line, &is_replaced );
+			if ( !is_replaced )
+			{
+				break;
+			}
+			if ( holded != nullptr )
+			{
+				destroy_string( holded );
+				holded = nullptr;
+			}
+			holded = res;
+			line = res;
+
+			++replaced_loop;
+			if ( replaced_loop > MAX_REPLACE_LOOP )
+			{
+				raise_error( "マクロの再起展開が上限数（%d）を突破しました、マクロが無限ループしてる可能性があります@@ %d行目", replaced_loop, pctx->line_ + 1 );
+				return nullptr;
+			}
+		}
+
+		if ( holded != nullptr )
+		{
+			destroy_string( holded );
+			holded = nullptr;
+		}
+		return res;
+	}
+
+	// 最初の#はスキップ
+	++line;
+
+	tokenize_context_t tokenize_ctx{};
+	parse_context_t parse_ctx{};
+	initialize_tokenize_context( &tokenize_ctx, line );
+	initialize_parse_context( &parse_ctx, tokenize_ctx );
+
+	{
+		auto* const st = read_token( parse_ctx );
+
+		if ( st->tag_ != TOKEN_IDENTIFIER )
+		{
+			raise_error( "プリプロセス：# の後に識別子でないトークンが検出されました@@ %d行目", pctx->line_ + 1 );
+			return nullptr;
+		}
+
+		const auto pptag = query_preprocessor( st->content_ );
+		if ( pptag == PREPRO_UNKNOWN )
+		{
+			raise_error( "プリプロセス：想定外のプリプロセッサ（%s）@@ %d行目", st->content_, pctx->line_ + 1 );
+			return nullptr;
+		}
+
+		switch ( pptag )
+		{
+			case PREPRO_DEFINE:
+			{
+				if ( pctx->is_current_region_valid_ )
+				{
+					bool is_ctype = false;
+					{
+						const auto* const it = read_token( parse_ctx );
+						if ( it->tag_ == TOKEN_IDENTIFIER && query_keyword( it->content_ ) == KEYWORD_CTYPE )
+						{
+							is_ctype = true;
+						}
+						else
+						{
+							unread_token( parse_ctx );
+						}
+					}
+
+					const auto* const nit = read_token( parse_ctx );
+					if ( nit->tag_ != TOKEN_IDENTIFIER )
+					{
+						raise_error( "プリプロセス：define に失敗：識別子名が見つかりません@@ %d行目", pctx->line_ + 1 );
+						return nullptr;
+					}
+
+					auto* const nmacro = create_macro();
+					nmacro->name_ = create_string( nit->content_ );
+					nmacro->is_ctype_ = is_ctype;
+
+					const auto* const rt = read_token( parse_ctx );
+					if ( rt->tag_ == TOKEN_LPARENTHESIS )
+					{
+						// パラメータあり
+						bool is_break = false;
+
+						for ( ; ; )
+						{
+							const auto* const ct = read_token( parse_ctx );
+							if ( ct->tag_ == TOKEN_EOF )
+							{
+								raise_error( "プリプロセス：define に失敗：パラメータのパース中に行末に到達しました@@ %d行目", pctx->line_ + 1 );
+								return nullptr;
+							}
+							if ( ct->tag_ == TOKEN_RPARENTHESIS )
+							{
+								// 何もパラメータがない、おわり
+								unread_token( parse_ctx );
+								break;
+							}
+							if ( ct->tag_ != TOKEN_PP_ARG_INDICATOR )
+							{
+								raise_error( "プリプロセス：define に失敗：パラメータは%%から始まる必要があります@@ %d行目", pctx->line_ + 1 );
+								return nullptr;
+							}
+
+							const auto* const it = read_token( parse_ctx );
+							if ( it->tag_ != TOKEN_INTEGER || it->left_space_ )
+							{
+								raise_error( "プリプロセス：define に失敗：パラメータ%%のあと、スペースなしで数値を入れる必要があります@@ %d行目", pctx->line_ + 1 );
+								return nullptr;
+							}
+
+							const auto itidx = atoi( it->content_ );
+							if ( itidx != nmacro->param_num_ + 1 )
 							{
 								raise_error( "プリプロセス：define に失敗：パラメータ%%は順番に定義する必要があります@@ %d行目", pctx->line_ + 1 );
 								return nullptr;
@@ -2477,14 +6033,14 @@ char* prepro_line( prepro_context_t* pctx, const char* line, bool enable_preproc
 
 					etoken_ctx.line_ = pctx->line_;// ラインを同期
 
-					auto* east = parse_expression( eparse_ctx );
-					if ( east == nullptr )
+					const auto east = parse_expression( eparse_ctx );
+					if ( east < 0 )
 					{
 						raise_error( "プリプロセス：if に失敗：式のパースに失敗@@ %d行目", pctx->line_ + 1 );
 						return nullptr;
 					}
 
-					auto* ev = evaluate_ast_immediate( east );
+					auto* ev = evaluate_ast_immediate( eparse_ctx.ast_, &eparse_ctx.ast_->nodes_[east] );
 					if ( ev == nullptr )
 					{
 						raise_error( "プリプロセス：if に失敗：式の評価に失敗@@ %d行目", pctx->line_ + 1 );
@@ -2493,7 +6049,6 @@ char* prepro_line( prepro_context_t* pctx, const char* line, bool enable_preproc
 
 					is_valid = value_calc_boolean( *ev );
 
-					destroy_ast_node( east );
 					destroy_value( ev );
 
 					uninitialize_parse_context( &eparse_ctx );
@@ -2585,14 +6140,14 @@ char* prepro_line( prepro_context_t* pctx, const char* line, bool enable_preproc
 
 						etoken_ctx.line_ = pctx->line_;// ラインを同期
 
-						auto* east = parse_expression( eparse_ctx );
-						if ( east == nullptr )
+						const auto east = parse_expression( eparse_ctx );
+						if ( east < 0 )
 						{
 							raise_error( "プリプロセス：enum に失敗：式のパースに失敗@@ %d行目", pctx->line_ + 1 );
 							return nullptr;
 						}
 
-						auto* ev = evaluate_ast_immediate( east );
+						auto* ev = evaluate_ast_immediate( eparse_ctx.ast_, &eparse_ctx.ast_->nodes_[east] );
 						if ( ev == nullptr )
 						{
 							raise_error( "プリプロセス：enum に失敗：式の評価に失敗@@ %d行目", pctx->line_ + 1 );
@@ -2608,7 +6163,6 @@ char* prepro_line( prepro_context_t* pctx, const char* line, bool enable_preproc
 
 						pctx->enum_next_ = value_calc_int( *ev );
 
-						destroy_ast_node( east );
 						destroy_value( ev );
 
 						uninitialize_parse_context( &eparse_ctx );
@@ -2688,9 +6242,10 @@ char* prepro_line_expand( prepro_context_t* pctx, const char* line, bool* out_is
 
 			if ( st->tag_ == TOKEN_IDENTIFIER )
 			{
-				const auto* const macro = prepro_find_macro( pctx, st->content_ );
+				auto* const macro = prepro_find_macro( pctx, st->content_ );
 				if ( macro != nullptr )
 				{
+					macro_expansion_t* expansion = nullptr;
 					if ( macro->param_num_ > 0 )
 					{
 						// パラメータ取得
@@ -2852,8 +6407,24 @@ char* prepro_line_expand( prepro_context_t* pctx, const char* line, bool* out_is
 							}
 						}
 
-						// 置き換え
+						// 置き換え、同じ引数の組で展開したことがあればその結果を使う
+						string_buffer_t args;
+						initialize_string_buffer( &args, 64, -1 );
+						for ( int i = 0; i < macro->param_num_; ++i )
+						{
+							if ( i > 0 )
+							{ string_buffer_append( &args, "\n", 1 ); }
+							string_buffer_append( &args, ( marg[i].arg_param_ == nullptr ? macro->params_[i].default_param_ : marg[i].arg_param_ ) );
+						}
+
+						expansion = macro_find_expansion( macro, args.buffer_ );
+						if ( expansion != nullptr )
+						{
+							string_buffer_append( sb, expansion->text_ );
+						}
+						else
 						{
+							const auto expansion_begin = sb->cursor_;
 							parse_context_t lpctx{};
 							tokenize_context_t ltctx{};
 							initialize_tokenize_context( &ltctx, macro->replacing_ );
@@ -2907,7 +6478,10 @@ char* prepro_line_expand( prepro_context_t* pctx, const char* line, bool* out_is
 
 							uninitialize_parse_context( &lpctx );
 							uninitialize_tokenize_context( &ltctx );
+
+							expansion = macro_register_expansion( macro, args.buffer_, sb->buffer_ + expansion_begin, sb->cursor_ - expansion_begin );
 						}
+						uninitialize_string_buffer( &args );
 
 						for ( auto& it : marg )
 						{
@@ -2917,10 +6491,19 @@ char* prepro_line_expand( prepro_context_t* pctx, const char* line, bool* out_is
 					else
 					{
 						// 単純置き換え
+						expansion = macro_find_expansion( macro, "" );
+						if ( expansion == nullptr )
+						{
+							expansion = macro_register_expansion( macro, "", macro->replacing_, strlen( macro->replacing_ ) );
+						}
 						string_buffer_append( sb, macro->replacing_ );
 					}
 
-					is_replaced = true;
+					// 置き換えた結果にまだ展開するものがある時だけ、行を読み直す
+					if ( expansion == nullptr || !prepro_is_expansion_final( pctx, expansion ) )
+					{
+						is_replaced = true;
+					}
 					continue;
 				}
 			}
@@ -2942,23 +6525,15 @@ char* prepro_line_expand( prepro_context_t* pctx, const char* line, bool* out_is
 	{
 		*out_is_replaced = is_replaced;
 	}
-	return res;
-}
-
-macro_t* prepro_find_macro( prepro_context_t* pctx, const char* name )
-{
-	auto* node = pctx->macro_list_->head_;
-	while( node != nullptr )
-	{
-		auto* const macro = reinterpret_cast<macro_t*>( node->value_ );
-		if ( string_equal_igcase( macro->name_, name ) )
-		{
-			return macro;
-		}
-		node = node->next_;
-	}
+	return res;
+}
 
-	return nullptr;
+macro_t* prepro_find_macro( prepro_context_t* pctx, const char* name )
+{
+	const auto entry = name_table_find( pctx->macro_table_, name );
+	if ( entry < 0 )
+	{ return nullptr; }
+	return reinterpret_cast<macro_t*>( pctx->macro_table_->entries_[entry].value_ );
 }
 
 bool prepro_register_macro( prepro_context_t* pctx, macro_t* macro )
@@ -2971,155 +6546,279 @@ bool prepro_register_macro( prepro_context_t* pctx, macro_t* macro )
 		return false;
 	}
 
-	auto* const lnode = create_list_node();
-	lnode->value_ = macro;
-
-	list_append( *pctx->macro_list_, lnode );
-
+	name_table_insert( pctx->macro_table_, macro->name_, macro );
+	const auto initial = static_cast<unsigned char>( macro->name_[0] );
+	pctx->macro_initial_[ ( initial>='A' && initial<='Z' ) ? initial -'A' +'a' : initial ] = true;
+	++pctx->macro_generation_;
 	return true;
 }
 
 bool prepro_erase_macro( prepro_context_t* pctx, const char* name )
 {
-	list_node_t* found_node = nullptr;
-	auto* node = pctx->macro_list_->head_;
-	while( node != nullptr )
-	{
-		auto* const macro = reinterpret_cast<macro_t*>( node->value_ );
-		if ( string_equal_igcase( macro->name_, name ) )
-		{
-			found_node = node;
-			break;
-		}
-		node = node->next_;
-	}
-
-	if ( found_node == nullptr )
+	const auto entry = name_table_find( pctx->macro_table_, name );
+	if ( entry < 0 )
 	{ return false; }
 
-	list_erase( *pctx->macro_list_, found_node );
+	auto* const macro = reinterpret_cast<macro_t*>( pctx->macro_table_->entries_[entry].value_ );
+	name_table_erase( pctx->macro_table_, entry );
+	destroy_macro( macro );
+	++pctx->macro_generation_;
 	return true;
 }
 
 //=============================================================================
 // 抽象構文木
-ast_node_t* create_ast_node( node_tag tag, ast_node_t* left, ast_node_t* right )
-{
-	auto res = reinterpret_cast<ast_node_t*>( xmalloc( sizeof(ast_node_t) ) );
-	res->tag_ = tag;
-	res->token_ = nullptr;
-	res->left_ = left;
-	res->right_ = right;
-	res->flag_ = 0;
+ast_t* create_ast()
+{
+	auto res = reinterpret_cast<ast_t*>( xmalloc( sizeof(ast_t) ) );
+	res->node_buffer_size_ = 64;
+	res->nodes_ = reinterpret_cast<ast_node_t*>( xmalloc( sizeof(ast_node_t) *res->node_buffer_size_ ) );
+	res->node_num_ = 0;
+	res->child_buffer_size_ = 64;
+	res->children_ = reinterpret_cast<int*>( xmalloc( sizeof(int) *res->child_buffer_size_ ) );
+	res->child_num_ = 0;
+	res->pending_buffer_size_ = 64;
+	res->pending_ = reinterpret_cast<int*>( xmalloc( sizeof(int) *res->pending_buffer_size_ ) );
+	res->pending_num_ = 0;
+	res->root_ = -1;
 	return res;
 }
 
-ast_node_t* create_ast_node( node_tag tag, token_t* token, ast_node_t* left )
+void destroy_ast( ast_t* ast )
 {
-	auto res = reinterpret_cast<ast_node_t*>( xmalloc( sizeof(ast_node_t) ) );
-	res->tag_ = tag;
-	res->token_ = token;
-	res->left_ = left;
-	res->right_ = nullptr;
-	res->flag_ = 0;
-	return res;
+	xfree( ast->nodes_ );
+	xfree( ast->children_ );
+	xfree( ast->pending_ );
+	xfree( ast );
 }
 
-void destroy_ast_node( ast_node_t* node )
+ast_node_t* ast_child( ast_t* ast, const ast_node_t* node, int i )
 {
-	assert( node != nullptr );
-	if ( node->left_ != nullptr )
-	{ destroy_ast_node( node->left_ ); }
-	if ( node->right_ != nullptr )
-	{ destroy_ast_node( node->right_ ); }
-	xfree( node );
+	if ( i >= node->child_num_ )
+	{ return nullptr; }
+	return &ast->nodes_[ ast->children_[ node->child_begin_ +i ] ];
 }
 
-bool is_eos_like_token( token_tag tag )
+const ast_node_t* ast_child( const ast_t* ast, const ast_node_t* node, int i )
 {
-	return ( tag==TOKEN_EOF || tag==TOKEN_EOL || tag==TOKEN_EOS || tag==TOKEN_RBRACE );
+	return ast_child( const_cast<ast_t*>( ast ), node, i );
 }
 
-list_t* parse_script( parse_context_t& c )
+void initialize_ast_cursor( ast_cursor_t* cur, const ast_t* ast, int root )
 {
-	auto res = create_list();
-
-	for( ; ; )
+	cur->ast_ = ast;
+	cur->stack_buffer_size_ = 64;
+	cur->stack_ = reinterpret_cast<int*>( xmalloc( sizeof(int) *cur->stack_buffer_size_ ) );
+	cur->stack_num_ = 0;
+	if ( root >= 0 )
 	{
-		auto statement = parse_statement( c );
-		if ( statement == nullptr )
-		{ break; }
-
-		auto node = create_list_node();
-		node->value_ = statement;
-		list_append( *res, node );
+		cur->stack_[cur->stack_num_++] = root;
+		cur->stack_[cur->stack_num_++] = 0;
 	}
+}
+
+void uninitialize_ast_cursor( ast_cursor_t* cur )
+{
+	xfree( cur->stack_ );
+	cur->stack_ = nullptr;
+	cur->stack_num_ = 0;
+}
+
+const ast_node_t* ast_cursor_next( ast_cursor_t* cur, int* depth )
+{
+	if ( cur->stack_num_ <= 0 )
+	{ return nullptr; }
+
+	const auto node_depth = cur->stack_[--cur->stack_num_];
+	const auto node = &cur->ast_->nodes_[ cur->stack_[--cur->stack_num_] ];
+	if ( depth != nullptr )
+	{ *depth = node_depth; }
 
+	// 先頭の子から出てくるように逆順に積む
+	const auto required = cur->stack_num_ +node->child_num_ *2;
+	if ( required > cur->stack_buffer_size_ )
 	{
-		const auto token = read_token( c );
-		if ( token->tag_ != TOKEN_EOF )
+		while( required > cur->stack_buffer_size_ )
 		{
-			raise_error( "スクリプトを最後まで正しくパースできませんでした@@ %d行目", token->appear_line_ );
+			cur->stack_buffer_size_ *= 2;
 		}
+		cur->stack_ = reinterpret_cast<int*>( xrealloc( cur->stack_, sizeof(int) *cur->stack_buffer_size_ ) );
 	}
-
-	return res;
+	for( int i=node->child_num_ -1; i>=0; --i )
+	{
+		cur->stack_[cur->stack_num_++] = cur->ast_->children_[ node->child_begin_ +i ];
+		cur->stack_[cur->stack_num_++] = node_depth +1;
+	}
+	return node;
 }
 
-void destroy_ast( list_t* ast )
+// 子の番号を children_ に並べ、それらを子に持つノードを足す
+int add_ast_node( ast_t* ast, node_tag tag, token_t* token, const int* children, int child_num )
 {
-	auto node = ast->head_;
-	while( node != nullptr )
+	if ( ast->node_num_ >= ast->node_buffer_size_ )
 	{
-		const auto ast_node = reinterpret_cast<ast_node_t*>( node->value_ );
-		destroy_ast_node( ast_node );
-		node = node->next_;
+		ast->node_buffer_size_ *= 2;
+		ast->nodes_ = reinterpret_cast<ast_node_t*>( xrealloc( ast->nodes_, sizeof(ast_node_t) *ast->node_buffer_size_ ) );
+	}
+	if ( ast->child_num_ +child_num > ast->child_buffer_size_ )
+	{
+		while( ast->child_num_ +child_num > ast->child_buffer_size_ )
+		{
+			ast->child_buffer_size_ *= 2;
+		}
+		ast->children_ = reinterpret_cast<int*>( xrealloc( ast->children_, sizeof(int) *ast->child_buffer_size_ ) );
 	}
 
-	list_free_all( *ast );
-	destroy_list( ast );
+	auto& node = ast->nodes_[ ast->node_num_ ];
+	node.token_ = token;
+	node.tag_ = tag;
+	node.child_begin_ = ast->child_num_;
+	node.child_num_ = child_num;
+	node.flag_ = 0;
+	if ( child_num > 0 )
+	{
+		memcpy( ast->children_ +ast->child_num_, children, sizeof(int) *child_num );
+		ast->child_num_ += child_num;
+	}
+	return ast->node_num_++;
 }
 
-ast_node_t* parse_statement( parse_context_t& c )
+int create_ast_node( parse_context_t& c, node_tag tag, int left, int right )
 {
-	// 何もない？
+	int children[2];
+	int child_num = 0;
+	if ( left >= 0 ) { children[child_num++] = left; }
+	if ( right >= 0 ) { children[child_num++] = right; }
+	return add_ast_node( c.ast_, tag, nullptr, children, child_num );
+}
+
+int create_ast_node( parse_context_t& c, node_tag tag, token_t* token, int left )
+{
+	return add_ast_node( c.ast_, tag, token, &left, ( left >= 0 ? 1 : 0 ) );
+}
+
+void push_ast_pending( parse_context_t& c, int node )
+{
+	auto* const ast = c.ast_;
+	if ( ast->pending_num_ >= ast->pending_buffer_size_ )
 	{
-		const auto token = read_token( c );
-		if ( token->tag_ == TOKEN_EOF )
-		{ return nullptr; }
-		if ( is_eos_like_token( token->tag_ ) )
-		{ return create_ast_node( NODE_EMPTY ); }
-		unread_token( c );
+		ast->pending_buffer_size_ *= 2;
+		ast->pending_ = reinterpret_cast<int*>( xrealloc( ast->pending_, sizeof(int) *ast->pending_buffer_size_ ) );
 	}
+	ast->pending_[ast->pending_num_++] = node;
+}
+
+int create_ast_node_from_pending( parse_context_t& c, node_tag tag, int pending_begin )
+{
+	auto* const ast = c.ast_;
+	assert( pending_begin >= 0 && pending_begin <= ast->pending_num_ );
+	const auto res = add_ast_node( ast, tag, nullptr, ast->pending_ +pending_begin, ast->pending_num_ -pending_begin );
+	ast->pending_num_ = pending_begin;
+	return res;
+}
 
-	ast_node_t* statement = nullptr;
+bool is_eos_like_token( token_tag tag )
+{
+	return ( tag==TOKEN_EOF || tag==TOKEN_EOL || tag==TOKEN_EOS || tag==TOKEN_RBRACE );
+}
 
-	// ラベルを試す
-	if ( statement == nullptr )
+int parse_script( parse_context_t& c )
+{
+	const auto pending_begin = c.ast_->pending_num_;
+	for( ; ; )
 	{
-		statement = parse_label_safe( c );
+		const auto statement = parse_statement( c );
+		if ( statement < 0 )
+		{ break; }
+		push_ast_pending( c, statement );
 	}
+	const auto res = create_ast_node_from_pending( c, NODE_BLOCK_STATEMENTS, pending_begin );
+	c.ast_->root_ = res;
 
-	// 制御構文を試す
-	if ( statement == nullptr )
 	{
-		statement = parse_control_safe( c );
+		const auto token = read_token( c );
+		if ( token->tag_ != TOKEN_EOF )
+		{
+			raise_error( "スクリプトを最後まで正しくパースできませんでした@@ %d行目", token->appear_line_ );
+		}
 	}
 
-	// コマンドを試す
-	if ( statement == nullptr )
+	return res;
+}
+
+bool is_assign_token( token_tag tag )
+{
+	switch( tag )
 	{
-		statement = parse_command_safe( c );
+	case TOKEN_ASSIGN:
+	case TOKEN_ADD_ASSIGN:
+	case TOKEN_SUB_ASSIGN:
+	case TOKEN_MUL_ASSIGN:
+	case TOKEN_DIV_ASSIGN:
+	case TOKEN_MOD_ASSIGN:
+	case TOKEN_BOR_ASSIGN:
+	case TOKEN_BAND_ASSIGN:
+	case TOKEN_BXOR_ASSIGN:
+		return true;
+	default: break;
 	}
+	return false;
+}
+
+bool is_control_keyword( int keyword )
+{
+	// global,ctypeは文の先頭に来ない
+	return ( keyword >= KEYWORD_END && keyword <= KEYWORD_ELSE );
+}
+
+int parse_statement( parse_context_t& c )
+{
+	// 何もない？
+	const auto head = read_token( c );
+	if ( head->tag_ == TOKEN_EOF )
+	{ return -1; }
+	if ( is_eos_like_token( head->tag_ ) )
+	{ return create_ast_node( c, NODE_EMPTY ); }
 
-	// それ以外は全て代入
-	if ( statement == nullptr )
+	// 先頭のトークンと、必要な時だけ次のトークンを見て文の種類を一度で決める
+	int statement = -1;
+	switch( head->tag_ )
 	{
-		statement = parse_assign_safe( c );
+		case TOKEN_OP_MUL:
+		{
+			// ラベル
+			const auto next = read_token( c );
+			unread_token( c, 2 );
+			if ( next->tag_ == TOKEN_IDENTIFIER )
+			{ statement = parse_label_safe( c ); }
+			break;
+		}
+		case TOKEN_IDENTIFIER:
+		{
+			// 制御構文
+			if ( is_control_keyword( query_keyword( head->content_ ) ) )
+			{
+				unread_token( c );
+				statement = parse_control_safe( c );
+				break;
+			}
+
+			// 代入演算子か、空白を挟まない"("が続くなら代入、それ以外は全てコマンド
+			const auto next = read_token( c );
+			unread_token( c, 2 );
+			if ( is_assign_token( next->tag_ ) || ( !head->right_space_ && next->tag_==TOKEN_LPARENTHESIS ) )
+			{ statement = parse_assign_safe( c ); }
+			else
+			{ statement = parse_command_safe( c ); }
+			break;
+		}
+		default:
+			unread_token( c );
+			break;
 	}
 
 	// ここまで来て何もないなら、パース不能
-	if ( statement == nullptr )
+	if ( statement < 0 )
 	{
 		const auto token = read_token( c );
 		raise_error( "ステートメントが解析不能です@@ %d行目", token->appear_line_ );
@@ -3137,85 +6836,86 @@ ast_node_t* parse_statement( parse_context_t& c )
 	return statement;
 }
 
-ast_node_t* parse_label_safe( parse_context_t& c )
+int parse_label_safe( parse_context_t& c )
 {
 	const auto token = read_token( c );
 	if ( token->tag_ != TOKEN_OP_MUL )
 	{
 		unread_token( c );
-		return nullptr;
+		return -1;
 	}
 
 	const auto ident = read_token( c );
 	if ( ident->tag_ != TOKEN_IDENTIFIER )
 	{
 		unread_token( c, 2 );
-		return nullptr;
+		return -1;
 	}
 
-	return create_ast_node( NODE_LABEL, ident );
+	return create_ast_node( c, NODE_LABEL, ident );
 }
 
-ast_node_t* parse_control_safe( parse_context_t& c )
+int parse_control_safe( parse_context_t& c )
 {
 	const auto ident = read_token( c );
 	if ( ident->tag_ != TOKEN_IDENTIFIER )
 	{
 		unread_token( c );
-		return nullptr;
+		return -1;
 	}
 
 	const auto keyword = query_keyword( ident->content_ );
 	if ( keyword < 0 )
 	{
 		unread_token( c );
-		return nullptr;
+		return -1;
 	}
 
 	switch( keyword )
 	{
 		case KEYWORD_END:
-			return create_ast_node( NODE_END );
+			return create_ast_node( c, NODE_END );
 		case KEYWORD_RETURN:
 		{
 			const auto next = read_token( c );
 			unread_token( c );
 
-			ast_node_t* expr =nullptr;
+			int expr =-1;
 			if ( !is_eos_like_token( next->tag_ ) )
 			{
 				expr = parse_expression( c );
 			}
-			return create_ast_node( NODE_RETURN, expr );
+			return create_ast_node( c, NODE_RETURN, expr );
 		}
 		case KEYWORD_GOTO:
 		case KEYWORD_GOSUB:
 		{
 			const auto label = parse_label_safe( c );
-			if ( label == nullptr )
+			if ( label < 0 )
 			{
 				raise_error( "gotoまたはgosubにはラベルの指定が必須です@@ %d行目", ident->appear_line_ );
 			}
-			return create_ast_node( keyword==KEYWORD_GOTO ? NODE_GOTO : NODE_GOSUB, label );
+			return create_ast_node( c, keyword==KEYWORD_GOTO ? NODE_GOTO : NODE_GOSUB, label );
 		}
 		case KEYWORD_REPEAT:
 		{
 			const auto next = read_token( c );
 			unread_token( c );
 
-			ast_node_t* expr =nullptr;
+			int expr =-1;
 			if ( !is_eos_like_token( next->tag_ ) )
 			{
 				expr = parse_expression( c );
 			}
-			return create_ast_node( NODE_REPEAT, expr );
+			// ネストが深すぎる時のエラーで行番号を出すので、キーワードのトークンを持たせる
+			return create_ast_node( c, NODE_REPEAT, ident, expr );
 		}
 		case KEYWORD_LOOP:
-			return create_ast_node( NODE_LOOP );
+			return create_ast_node( c, NODE_LOOP, ident, -1 );
 		case KEYWORD_CONTINUE:
-			return create_ast_node( NODE_CONTINUE );
+			return create_ast_node( c, NODE_CONTINUE );
 		case KEYWORD_BREAK:
-			return create_ast_node( NODE_BREAK );
+			return create_ast_node( c, NODE_BREAK );
 		case KEYWORD_IF:
 		{
 			const auto expr = parse_expression( c );
@@ -3231,8 +6931,7 @@ ast_node_t* parse_control_safe( parse_context_t& c )
 
 			bool repair_token =false;
 
-			ast_node_t* true_statements = create_ast_node( NODE_BLOCK_STATEMENTS );
-			ast_node_t* false_statements = nullptr;
+			const auto true_begin = c.ast_->pending_num_;
 			if ( next->tag_ == TOKEN_LBRACE )
 			{
 				for( ; ; )
@@ -3244,11 +6943,11 @@ ast_node_t* parse_control_safe( parse_context_t& c )
 						break;
 					}
 					const auto statement = parse_statement( c );
-					if ( statement == nullptr )
+					if ( statement < 0 )
 					{
 						raise_error( "if文の解析中、解析できないステートメントに到達しました@@ %d行目、%d行目から", pp->appear_line_, ident->appear_line_ );
 					}
-					true_statements = create_ast_node( NODE_BLOCK_STATEMENTS, true_statements, statement );
+					push_ast_pending( c, statement );
 				}
 			}
 			else
@@ -3277,20 +6976,23 @@ ast_node_t* parse_control_safe( parse_context_t& c )
 					{ break; }
 
 					const auto statement = parse_statement( c );
-					if ( statement == nullptr )
+					if ( statement < 0 )
 					{
 						raise_error( "if文の解析中、解析できないステートメントに到達しました@@ %d行目、%d行目から", nn->appear_line_, ident->appear_line_ );
 					}
-					true_statements = create_ast_node( NODE_BLOCK_STATEMENTS, true_statements, statement );
+					push_ast_pending( c, statement );
 				}
 			}
 
+			const auto true_statements = create_ast_node_from_pending( c, NODE_BLOCK_STATEMENTS, true_begin );
+			int false_statements = -1;
+
 			// elseはあるか？
 			const auto nn = read_token( c );
 			if ( is_else_token( nn ) )
 			{
 				repair_token = false;
-				false_statements = create_ast_node( NODE_BLOCK_STATEMENTS );
+				const auto false_begin = c.ast_->pending_num_;
 
 				const auto nextf = read_token( c );
 				if ( nextf->tag_ == TOKEN_LBRACE )
@@ -3304,11 +7006,11 @@ ast_node_t* parse_control_safe( parse_context_t& c )
 							break;
 						}
 						const auto statement = parse_statement( c );
-						if ( statement == nullptr )
+						if ( statement < 0 )
 						{
 							raise_error( "ifのelse文の解析中、解析できないステートメントに到達しました@@ %d行目、%d行目から", nn->appear_line_, ident->appear_line_ );
 						}
-						false_statements = create_ast_node( NODE_BLOCK_STATEMENTS, false_statements, statement );
+						push_ast_pending( c, statement );
 					}
 				}
 				else
@@ -3337,13 +7039,14 @@ ast_node_t* parse_control_safe( parse_context_t& c )
 						{ break; }
 
 						const auto statement = parse_statement( c );
-						if ( statement == nullptr )
+						if ( statement < 0 )
 						{
 							raise_error( "ifのelse文の解析中、解析できないステートメントに到達しました@@ %d行目、%d行目から", nnf->appear_line_, ident->appear_line_ );
 						}
-						false_statements = create_ast_node( NODE_BLOCK_STATEMENTS, false_statements, statement );
+						push_ast_pending( c, statement );
 					}
 				}
+				false_statements = create_ast_node_from_pending( c, NODE_BLOCK_STATEMENTS, false_begin );
 			}
 			else
 			{
@@ -3356,8 +7059,8 @@ ast_node_t* parse_control_safe( parse_context_t& c )
 				unread_token( c );
 			}
 
-			ast_node_t* dispatcher = create_ast_node( NODE_IF_DISPATCHER, true_statements, false_statements );
-			return create_ast_node( NODE_IF, expr, dispatcher );
+			const auto dispatcher = create_ast_node( c, NODE_IF_DISPATCHER, true_statements, false_statements );
+			return create_ast_node( c, NODE_IF, expr, dispatcher );
 		}
 		case KEYWORD_ELSE:
 			raise_error( "ハンドルされないelseを検出しました@@ %d行目", ident->appear_line_ );
@@ -3365,49 +7068,29 @@ ast_node_t* parse_control_safe( parse_context_t& c )
 	}
 
 	unread_token( c );
-	return nullptr;
+	return -1;
 }
 
-ast_node_t* parse_command_safe( parse_context_t& c )
+int parse_command_safe( parse_context_t& c )
 {
 	const auto ident = read_token( c );
 	if ( ident->tag_ != TOKEN_IDENTIFIER )
 	{
 		unread_token( c );
-		return nullptr;
+		return -1;
 	}
 
 	const auto next = read_token( c );
 
-	bool is_not_command = false;
-	switch( next->tag_ )
-	{
-	case TOKEN_ASSIGN:
-	case TOKEN_ADD_ASSIGN:
-	case TOKEN_SUB_ASSIGN:
-	case TOKEN_MUL_ASSIGN:
-	case TOKEN_DIV_ASSIGN:
-	case TOKEN_MOD_ASSIGN:
-	case TOKEN_BOR_ASSIGN:
-	case TOKEN_BAND_ASSIGN:
-	case TOKEN_BXOR_ASSIGN:
-		is_not_command = true;
-		break;
-	default: break;
-	}
-
-	// "("チェック
-	if ( !ident->right_space_ && next->tag_==TOKEN_LPARENTHESIS )
-	{ is_not_command = true; }
-
-	if ( is_not_command )
+	// 代入か配列変数ならコマンドではない
+	if ( is_assign_token( next->tag_ ) || ( !ident->right_space_ && next->tag_==TOKEN_LPARENTHESIS ) )
 	{
 		unread_token( c, 2 );
-		return nullptr;
+		return -1;
 	}
 
 	// あるなら引数の解析
-	ast_node_t* args = nullptr;
+	int args = -1;
 	if ( !is_eos_like_token( next->tag_ ) )
 	{
 		unread_token( c );
@@ -3418,15 +7101,14 @@ ast_node_t* parse_command_safe( parse_context_t& c )
 		unread_token( c );
 	}
 
-	const auto command = create_ast_node( NODE_COMMAND, ident, args );
+	const auto command = create_ast_node( c, NODE_COMMAND, ident, args );
  	return command;
 }
 
-ast_node_t* parse_arguments( parse_context_t& c )
+int parse_arguments( parse_context_t& c )
 {
-	auto arg = parse_expression( c );
-	auto res = create_ast_node( NODE_ARGUMENTS, arg );
-	auto args = res;
+	const auto pending_begin = c.ast_->pending_num_;
+	push_ast_pending( c, parse_expression( c ) );
 
 	for( ; ; )
 	{
@@ -3437,18 +7119,16 @@ ast_node_t* parse_arguments( parse_context_t& c )
 			break;
 		}
 
-		auto next =parse_expression( c );
-		args->right_ = create_ast_node( NODE_ARGUMENTS, next );
-		args = args->right_;
+		push_ast_pending( c, parse_expression( c ) );
 	}
-	return res;
+	return create_ast_node_from_pending( c, NODE_ARGUMENTS, pending_begin );
 }
 
-ast_node_t* parse_assign_safe( parse_context_t& c )
+int parse_assign_safe( parse_context_t& c )
 {
 	auto variable = parse_variable_safe( c );
-	if ( variable == nullptr )
-	{ return nullptr; }
+	if ( variable < 0 )
+	{ return -1; }
 
 	const auto next = read_token( c );
 
@@ -3470,27 +7150,27 @@ ast_node_t* parse_assign_safe( parse_context_t& c )
 	}
 
 	if ( node == -1 )
-	{ return nullptr; }
+	{ return -1; }
 
 	auto expr = parse_expression( c );
-	auto assign = create_ast_node( static_cast<node_tag>( node ), variable, expr );
+	auto assign = create_ast_node( c, static_cast<node_tag>( node ), variable, expr );
 	return assign;
 }
 
-ast_node_t* parse_variable_safe( parse_context_t& c )
+int parse_variable_safe( parse_context_t& c )
 {
 	const auto ident = read_token( c );
 	if ( ident->tag_ != TOKEN_IDENTIFIER )
 	{
 		unread_token( c );
-		return nullptr;
+		return -1;
 	}
 
 	const auto next = read_token( c );
 	if ( next->tag_ != TOKEN_LPARENTHESIS )
 	{
 		unread_token( c );
-		return create_ast_node( NODE_VARIABLE, ident );
+		return create_ast_node( c, NODE_VARIABLE, ident );
 	}
 
 	const auto idx = parse_expression( c );
@@ -3503,223 +7183,96 @@ ast_node_t* parse_variable_safe( parse_context_t& c )
 		raise_error( "配列変数 : 括弧が正しく閉じられていません@@ %d行目", nn->appear_line_ );
 	}
 
-	return create_ast_node( NODE_VARIABLE, ident, idx );
-}
-
-ast_node_t* parse_expression( parse_context_t& c )
-{
-	// ただの関数転送
-	return parse_borand( c );
+	return create_ast_node( c, NODE_VARIABLE, ident, idx );
 }
 
-ast_node_t* parse_borand( parse_context_t& c )
+int binary_operator_precedence( token_tag tag )
 {
-	auto node =parse_eqneq(c);
-
-	for( ; ; )
+	// 大きいほど強く結合する、二項演算子でなければ0
+	switch( tag )
 	{
-		bool is_continue = true;
-		const auto token = read_token( c );
-		switch( token->tag_ )
-		{
-			case TOKEN_OP_BOR:
-			case TOKEN_OP_BAND:
-			case TOKEN_OP_BXOR:
-			{
-				auto r = parse_eqneq( c );
-				if ( r == nullptr )
-				{ raise_error( "|,&の演算子で、右項の解析が出来ません@@ %d行目", token->appear_line_ ); }
-
-				switch( token->tag_ )
-				{
-					case TOKEN_OP_BOR:	node = create_ast_node( NODE_BOR, node, r ); break;
-					case TOKEN_OP_BAND:	node = create_ast_node( NODE_BAND, node, r ); break;
-					case TOKEN_OP_BXOR:	node = create_ast_node( NODE_BXOR, node, r ); break;
-					default: assert( false ); break;
-				}
-				break;
-			}
-			default:
-				is_continue = false;
-				break;
-		}
-		if ( !is_continue )
-		{
-			unread_token( c );
-			break;
-		}
+		case TOKEN_OP_BOR:
+		case TOKEN_OP_BAND:
+		case TOKEN_OP_BXOR:
+			return 1;
+		case TOKEN_OP_EQ:
+		case TOKEN_OP_NEQ:
+		case TOKEN_ASSIGN:
+			return 2;
+		case TOKEN_OP_GT:
+		case TOKEN_OP_GTOE:
+		case TOKEN_OP_LT:
+		case TOKEN_OP_LTOE:
+			return 3;
+		case TOKEN_OP_ADD:
+		case TOKEN_OP_SUB:
+			return 4;
+		case TOKEN_OP_MUL:
+		case TOKEN_OP_DIV:
+		case TOKEN_OP_MOD:
+			return 5;
+		default: break;
 	}
-	return node;
+	return 0;
 }
 
-ast_node_t* parse_eqneq( parse_context_t& c )
-{
-	auto node =parse_gtlt(c);
-
-	for( ; ; )
-	{
-		bool is_continue = true;
-		const auto token = read_token( c );
-		switch( token->tag_ )
-		{
-			case TOKEN_OP_EQ:
-			case TOKEN_OP_NEQ:
-			case TOKEN_ASSIGN:
-			{
-				auto r = parse_gtlt( c );
-				if ( r == nullptr )
-				{ raise_error( "==,!=の演算子で、右項の解析が出来ません@@ %d行目", token->appear_line_ ); }
-
-				switch( token->tag_ )
-				{
-					case TOKEN_OP_EQ:
-					case TOKEN_ASSIGN:
-						node = create_ast_node( NODE_EQ, node, r );
-						break;
-					case TOKEN_OP_NEQ:	node = create_ast_node( NODE_NEQ, node, r ); break;
-					default: assert( false ); break;
-				}
-				break;
-			}
-			default:
-				is_continue = false;
-				break;
-		}
-		if ( !is_continue )
-		{
-			unread_token( c );
-			break;
-		}
+node_tag binary_operator_node( token_tag tag )
+{
+	switch( tag )
+	{
+		case TOKEN_OP_BOR:	return NODE_BOR;
+		case TOKEN_OP_BAND:	return NODE_BAND;
+		case TOKEN_OP_BXOR:	return NODE_BXOR;
+		case TOKEN_OP_EQ:
+		case TOKEN_ASSIGN:	return NODE_EQ;
+		case TOKEN_OP_NEQ:	return NODE_NEQ;
+		case TOKEN_OP_GT:	return NODE_GT;
+		case TOKEN_OP_GTOE:	return NODE_GTOE;
+		case TOKEN_OP_LT:	return NODE_LT;
+		case TOKEN_OP_LTOE:	return NODE_LTOE;
+		case TOKEN_OP_ADD:	return NODE_ADD;
+		case TOKEN_OP_SUB:	return NODE_SUB;
+		case TOKEN_OP_MUL:	return NODE_MUL;
+		case TOKEN_OP_DIV:	return NODE_DIV;
+		case TOKEN_OP_MOD:	return NODE_MOD;
+		default: assert( false ); break;
 	}
-	return node;
+	return NODE_EMPTY;
 }
 
-ast_node_t* parse_gtlt( parse_context_t& c )
+int parse_expression( parse_context_t& c )
 {
-	auto node =parse_addsub(c);
-
-	for( ; ; )
-	{
-		bool is_continue = true;
-		const auto token = read_token( c );
-		switch( token->tag_ )
-		{
-			case TOKEN_OP_GT:
-			case TOKEN_OP_GTOE:
-			case TOKEN_OP_LT:
-			case TOKEN_OP_LTOE:
-			{
-				auto r = parse_addsub( c );
-				if ( r == nullptr )
-				{ raise_error( ">,>=,<,<=の演算子で、右項の解析が出来ません@@ %d行目", token->appear_line_ ); }
-
-				switch( token->tag_ )
-				{
-					case TOKEN_OP_GT:	node = create_ast_node( NODE_GT, node, r ); break;
-					case TOKEN_OP_GTOE:	node = create_ast_node( NODE_GTOE, node, r ); break;
-					case TOKEN_OP_LT:	node = create_ast_node( NODE_LT, node, r ); break;
-					case TOKEN_OP_LTOE:	node = create_ast_node( NODE_LTOE, node, r ); break;
-					default: assert( false ); break;
-				}
-				break;
-			}
-			default:
-				is_continue = false;
-				break;
-		}
-		if ( !is_continue )
-		{
-			unread_token( c );
-			break;
-		}
-	}
-	return node;
+	return parse_binary_expression( c, 1 );
 }
 
-ast_node_t* parse_addsub( parse_context_t& c )
+int parse_binary_expression( parse_context_t& c, int min_precedence )
 {
-	auto node =parse_muldivmod(c);
+	// 優先順位がmin_precedence以上の二項演算子だけをまとめる、全て左結合
+	auto node =parse_term( c );
 
 	for( ; ; )
 	{
-		bool is_continue = true;
 		const auto token = read_token( c );
-		switch( token->tag_ )
-		{
-			case TOKEN_OP_ADD:
-			case TOKEN_OP_SUB:
-			{
-				auto r = parse_muldivmod( c );
-				if ( r == nullptr )
-				{ raise_error( "+-の演算子で、右項の解析が出来ません@@ %d行目", token->appear_line_ ); }
-
-				switch( token->tag_ )
-				{
-					case TOKEN_OP_ADD:	node = create_ast_node( NODE_ADD, node, r ); break;
-					case TOKEN_OP_SUB:	node = create_ast_node( NODE_SUB, node, r ); break;
-					default: assert( false ); break;
-				}
-				break;
-			}
-			default:
-				is_continue = false;
-				break;
-		}
-		if ( !is_continue )
+		const auto precedence = binary_operator_precedence( token->tag_ );
+		if ( precedence == 0 || precedence < min_precedence )
 		{
 			unread_token( c );
 			break;
 		}
-	}
-	return node;
-}
-
-ast_node_t* parse_muldivmod( parse_context_t& c )
-{
-	auto node =parse_term(c);
-
-	for( ; ; )
-	{
-		bool is_continue = true;
-		const auto token = read_token( c );
-		switch( token->tag_ )
-		{
-			case TOKEN_OP_MUL:
-			case TOKEN_OP_DIV:
-			case TOKEN_OP_MOD:
-			{
-				auto r = parse_term( c );
-				if ( r == nullptr )
-				{ raise_error( "*/\\の演算子で、右項の解析が出来ません@@ %d行目", token->appear_line_ ); }
 
-				switch( token->tag_ )
-				{
-					case TOKEN_OP_MUL:	node = create_ast_node( NODE_MUL, node, r ); break;
-					case TOKEN_OP_DIV:	node = create_ast_node( NODE_DIV, node, r ); break;
-					case TOKEN_OP_MOD:	node = create_ast_node( NODE_MOD, node, r ); break;
-					default: assert( false ); break;
-				}
-				break;
-			}
-			default:
-				is_continue = false;
-				break;
-		}
-		if ( !is_continue )
-		{
-			unread_token( c );
-			break;
-		}
+		// 右項は自分より強く結合する演算子だけを取り込む
+		auto r = parse_binary_expression( c, precedence +1 );
+		node = create_ast_node( c, binary_operator_node( token->tag_ ), node, r );
 	}
 	return node;
 }
 
-ast_node_t* parse_term( parse_context_t& c )
+int parse_term( parse_context_t& c )
 {
 	const auto token = read_token( c );
 	switch( token->tag_ )
 	{
-		case TOKEN_OP_SUB:		return create_ast_node( NODE_UNARY_MINUS, parse_primitive( c ) );
+		case TOKEN_OP_SUB:		return create_ast_node( c, NODE_UNARY_MINUS, parse_primitive( c ) );
 		default: break;
 	}
 
@@ -3727,7 +7280,7 @@ ast_node_t* parse_term( parse_context_t& c )
 	return parse_primitive( c );
 }
 
-ast_node_t* parse_primitive( parse_context_t& c )
+int parse_primitive( parse_context_t& c )
 {
 	const auto token = read_token( c );
 	switch( token->tag_ )
@@ -3740,19 +7293,19 @@ ast_node_t* parse_primitive( parse_context_t& c )
 			{
 				raise_error( "括弧が閉じられていません@@ %d行目", token->appear_line_ );
 			}
-			return create_ast_node( NODE_EXPRESSION, node );
+			return create_ast_node( c, NODE_EXPRESSION, node );
 		}
 
 		case TOKEN_INTEGER:
 		case TOKEN_REAL:
 		case TOKEN_STRING:
-			return create_ast_node( NODE_PRIMITIVE_VALUE, token );
+			return create_ast_node( c, NODE_PRIMITIVE_VALUE, token );
 
 		case TOKEN_OP_MUL:
 		{
 			unread_token( c );
 			const auto label = parse_label_safe( c );
-			if ( label == nullptr )
+			if ( label < 0 )
 			{
 				raise_error( "ラベルが正しく解析できませんでした@@ %d行目", token->appear_line_ );
 			}
@@ -3764,7 +7317,7 @@ ast_node_t* parse_primitive( parse_context_t& c )
 		{
 			unread_token( c );
 			const auto expr = parse_identifier_expression( c );
-			if ( expr == nullptr )
+			if ( expr < 0 )
 			{
 				raise_error( "関数または変数を正しく解析できませんでした@@ %d行目", token->appear_line_ );
 			}
@@ -3774,23 +7327,23 @@ ast_node_t* parse_primitive( parse_context_t& c )
 	}
 
 	raise_error( "プリミティブな値を取得できません@@ %d行目[%s]", token->appear_line_, token->content_ );
-	return nullptr;
+	return -1;
 }
 
-ast_node_t* parse_identifier_expression( parse_context_t& c )
+int parse_identifier_expression( parse_context_t& c )
 {
 	const auto ident = read_token( c );
 	if ( ident->tag_ != TOKEN_IDENTIFIER )
 	{
 		unread_token( c );
-		return nullptr;
+		return -1;
 	}
 
 	const auto next = read_token( c );
 	if ( next->tag_ != TOKEN_LPARENTHESIS )
 	{
 		unread_token( c );
-		return create_ast_node( NODE_IDENTIFIER_EXPR, ident );
+		return create_ast_node( c, NODE_IDENTIFIER_EXPR, ident );
 	}
 
 	// 引数なしの即閉じ？
@@ -3798,7 +7351,7 @@ ast_node_t* parse_identifier_expression( parse_context_t& c )
 		const auto nn = read_token( c );
 		if ( nn->tag_ == TOKEN_RPARENTHESIS )
 		{
-			return create_ast_node( NODE_IDENTIFIER_EXPR, ident, create_ast_node( NODE_ARGUMENTS ) );
+			return create_ast_node( c, NODE_IDENTIFIER_EXPR, ident, create_ast_node( c, NODE_ARGUMENTS ) );
 		}
 		unread_token( c );
 	}
@@ -3811,30 +7364,27 @@ ast_node_t* parse_identifier_expression( parse_context_t& c )
 		raise_error( "関数または配列変数 : 括弧が正しく閉じられていません@@ %d行目", nn->appear_line_ );
 	}
 
-	return create_ast_node( NODE_IDENTIFIER_EXPR, ident, idx );
+	return create_ast_node( c, NODE_IDENTIFIER_EXPR, ident, idx );
 }
 
 //=============================================================================
 // 変数
-variable_t* create_variable( const char* name )
-{
-	const auto res = reinterpret_cast<variable_t*>( xmalloc( sizeof(variable_t) ) );
-	res->name_ = create_string( name );
-	res->type_ = VALUE_NONE;
-	res->granule_size_  = 0;
-	res->length_ = 0;
-	res->data_ = nullptr;
-	res->data_size_ = 0;
-	prepare_variable( res, VALUE_INT, 64, 16 );
-	return res;
+void initialize_variable( variable_t* v, const char* name )
+{
+	v->name_ = create_string( name );
+	v->type_ = VALUE_NONE;
+	v->granule_size_  = 0;
+	v->length_ = 0;
+	v->data_ = nullptr;
+	v->data_size_ = 0;
+	prepare_variable( v, VALUE_INT, 64, 16 );
 }
 
-void destroy_variable( variable_t* v )
+void uninitialize_variable( variable_t* v )
 {
 	xfree( v->name_ );
 	xfree( v->data_ );
 	v->data_size_ = 0;
-	xfree( v );
 }
 
 void prepare_variable( variable_t* v, value_tag type, int granule_size, int length )
@@ -3871,50 +7421,63 @@ void prepare_variable( variable_t* v, value_tag type, int granule_size, int leng
 	v->data_size_ = static_cast<int>( areasize );
 }
 
-list_t* create_variable_table()
+variable_table_t* create_variable_table()
 {
-	return create_list();
+	const auto res = reinterpret_cast<variable_table_t*>( xmalloc( sizeof(variable_table_t) ) );
+	res->variables_ = nullptr;
+	res->variable_num_ = 0;
+	res->variable_buffer_size_ = 0;
+	res->index_ = create_name_table();
+	return res;
 }
 
-void destroy_variable_table( list_t* table )
+void destroy_variable_table( variable_table_t* table )
 {
-	auto node =table->head_;
-	while( node != nullptr )
+	for ( int i=0; i<table->variable_num_; ++i )
 	{
-		const auto var =reinterpret_cast<variable_t*>( node->value_ );
-		destroy_variable( var );
-		node = node->next_;
+		uninitialize_variable( &table->variables_[i] );
 	}
+	xfree( table->variables_ );
+	destroy_name_table( table->index_ );
+	xfree( table );
+}
 
-	list_free_all( *table );
-	destroy_list( table );
+int search_variable_slot( const variable_table_t* table, const char* name )
+{
+	return name_table_find( table->index_, name );
 }
 
-variable_t* search_variable( list_t* table, const char* name )
+variable_t* search_variable( variable_table_t* table, const char* name )
 {
-	auto node =table->head_;
-	while( node != nullptr )
-	{
-		const auto var =reinterpret_cast<variable_t*>( node->value_ );
-		if ( string_equal_igcase( var->name_, name ) )
-		{ return var; }
-		node = node->next_;
-	}
-	return nullptr;
+	const auto slot = search_variable_slot( table, name );
+	if ( slot < 0 )
+	{ return nullptr; }
+	return &table->variables_[slot];
 }
 
-void variable_set( list_t* table, const value_t& v, const char* name, int idx )
+int register_variable( variable_table_t* table, const char* name )
 {
-	auto var =search_variable( table, name );
-	if ( var == nullptr )
+	const auto found = search_variable_slot( table, name );
+	if ( found >= 0 )
+	{ return found; }
+
+	// 配列が伸長されると変数のアドレスが変わるので、実行中に呼んではいけない
+	if ( table->variable_num_ >= table->variable_buffer_size_ )
 	{
-		var = create_variable( name );
-		auto node = create_list_node();
-		node->value_ = var;
-		list_append( *table, node );
+		const auto new_size = ( table->variable_buffer_size_ > 0 ? table->variable_buffer_size_ *2 : 16 );
+		table->variables_ = reinterpret_cast<variable_t*>( xrealloc( table->variables_, sizeof(variable_t) *new_size ) );
+		table->variable_buffer_size_ = new_size;
 	}
 
-	variable_set( var, v, idx );
+	const auto slot = table->variable_num_;
+	initialize_variable( &table->variables_[slot], name );
+	++table->variable_num_;
+
+	// 名前の文字列は配列が伸長されても動かない
+	const auto entry = name_table_insert( table->index_, table->variables_[slot].name_, nullptr );
+	assert( entry == slot );
+	(void)entry;
+	return slot;
 }
 
 void variable_set( variable_t* var, const value_t& v, int idx )
@@ -4224,1367 +7787,2815 @@ void variable_bor( variable_t* var, const value_t& v, int idx )
 	}
 }
 
-void variable_band( variable_t* var, const value_t& v, int idx )
+void variable_band( variable_t* var, const value_t& v, int idx )
+{
+	assert( var != nullptr );
+	if ( var->type_ != v.type_ )
+	{
+		raise_error( "型の異なる変数へのAND代入（&=）操作@@ %s(%d)", var->name_, idx );
+		return;
+	}
+
+	assert( var->type_ == v.type_ );
+	auto* data_ptr = variable_data_ptr( *var, idx );
+	switch( var->type_ )
+	{
+	case VALUE_INT:
+	{
+		reinterpret_cast<int*>( data_ptr )[0] &= v.ivalue_;
+		break;
+	}
+	case VALUE_DOUBLE:
+	{
+		raise_error( "文字列に対するAND代入（&=）操作は定義されてません@@ %s(%d)", var->name_, idx );
+		break;
+	}
+	case VALUE_STRING:
+	{
+		raise_error( "文字列に対するAND代入（&=）操作は定義されてません@@ %s(%d)", var->name_, idx );
+		break;
+	}
+	default:
+		assert( false );
+		break;
+	}
+}
+
+void variable_bxor( variable_t* var, const value_t& v, int idx )
+{
+	assert( var != nullptr );
+	if ( var->type_ != v.type_ )
+	{
+		raise_error( "型の異なる変数へのXOR代入（^=）操作@@ %s(%d)", var->name_, idx );
+		return;
+	}
+
+	assert( var->type_ == v.type_ );
+	auto* data_ptr = variable_data_ptr( *var, idx );
+	switch( var->type_ )
+	{
+	case VALUE_INT:
+	{
+		reinterpret_cast<int*>( data_ptr )[0] ^= v.ivalue_;
+		break;
+	}
+	case VALUE_DOUBLE:
+	{
+		raise_error( "文字列に対するXOR代入（^=）操作は定義されてません@@ %s(%d)", var->name_, idx );
+		break;
+	}
+	case VALUE_STRING:
+	{
+		raise_error( "文字列に対するXOR代入（|=）操作は定義されてません@@ %s(%d)", var->name_, idx );
+		break;
+	}
+	default:
+		assert( false );
+		break;
+	}
+}
+
+void* variable_data_ptr( const variable_t& v, int idx )
+{
+	if ( idx<0 || idx>=v.length_ )
+	{
+		raise_error( "変数への配列アクセスが範囲外です@@ %s(%d)", v.name_, idx );
+	}
+
+	switch( v.type_ )
+	{
+		case VALUE_INT:
+		{
+			return reinterpret_cast<int*>( v.data_ ) +idx;
+		}
+		case VALUE_DOUBLE:
+		{
+			return reinterpret_cast<double*>( v.data_ ) +idx;
+		}
+		case VALUE_STRING:
+		{
+			return reinterpret_cast<char*>( v.data_ ) + v.granule_size_ *idx;
+		}
+		default:
+			assert( false );
+			break;
+	}
+	return nullptr;
+}
+
+int variable_calc_int( const variable_t& r, int idx )
+{
+	const auto* const data_ptr = variable_data_ptr( r, idx );
+	switch( r.type_ )
+	{
+		case VALUE_INT:		return *reinterpret_cast<const int*>( data_ptr );
+		case VALUE_DOUBLE:	return static_cast<int>(*reinterpret_cast<const double*>( data_ptr ));
+		case VALUE_STRING:	return atoi( reinterpret_cast<const char*>( data_ptr ) );
+		default:
+			assert( false );
+			break;
+	}
+	return 0;
+}
+
+double variable_calc_double( const variable_t& r, int idx )
+{
+	const auto* const data_ptr = variable_data_ptr( r, idx );
+	switch( r.type_ )
+	{
+		case VALUE_INT:		return static_cast<double>(*reinterpret_cast<const int*>( data_ptr ));
+		case VALUE_DOUBLE:	return *reinterpret_cast<const double*>( data_ptr );
+		case VALUE_STRING:	return atof( reinterpret_cast<const char*>( data_ptr ) );
+		default:
+			assert( false );
+			break;
+	}
+	return 0.0;
+}
+
+const char* variable_get_string( const variable_t& r, int idx )
+{
+	if ( r.type_ != VALUE_STRING )
+	{ return nullptr; }
+
+	const auto* const data_ptr = variable_data_ptr( r, idx );
+	return reinterpret_cast<const char*>( data_ptr );
+}
+
+char* variable_calc_string( const variable_t& r, int idx )
+{
+	const auto* const data_ptr = variable_data_ptr( r, idx );
+	switch( r.type_ )
+	{
+		case VALUE_INT:		return create_shared_string_from( *reinterpret_cast<const int*>( data_ptr ) );
+		case VALUE_DOUBLE:	return create_shared_string_from( *reinterpret_cast<const double*>( data_ptr ) );
+		case VALUE_STRING:	return create_shared_string( reinterpret_cast<const char*>( data_ptr ) );
+		default:
+			assert( false );
+			break;
+	}
+	return create_shared_string("");
+}
+
+//=============================================================================
+// 値
+value_t* create_value( int v )
+{
+	value_t* res =alloc_value();
+	res->type_ = VALUE_INT;
+	res->ivalue_ = v;
+	return res;
+}
+
+value_t* create_value( double v )
+{
+	value_t* res =alloc_value();
+	res->type_ = VALUE_DOUBLE;
+	res->dvalue_ = v;
+	return res;
+}
+
+value_t* create_value( const char* v )
+{
+	value_t* res =alloc_value();
+	res->type_ = VALUE_STRING;
+	res->is_borrowed_ = false;
+	res->svalue_ = create_shared_string( v );
+	return res;
+}
+
+value_t* create_value( variable_t* v, int idx )
+{
+	value_t* res =alloc_value();
+	res->type_ = VALUE_VARIABLE;
+	res->variable_ = v;
+	res->index_ = idx;
+	return res;
+}
+
+value_t* create_value( const value_t& v )
+{
+	value_t* res =alloc_value();
+	copy_value( res, v );
+	return res;
+}
+
+value_t* create_value_move( char* v )
+{
+	value_t* res =alloc_value();
+	res->type_ = VALUE_STRING;
+	res->is_borrowed_ = false;
+	res->svalue_ = v;
+	return res;
+}
+
+void destroy_value( value_t* t )
+{
+	clear_value( t );
+	free_value( t );
+}
+
+void value_set( value_t* v, int i )
+{
+	clear_value( v );
+	v->type_ = VALUE_INT;
+	v->ivalue_ = i;
+}
+
+void value_set( value_t* v, double d )
+{
+	clear_value( v );
+	v->type_ = VALUE_DOUBLE;
+	v->dvalue_ = d;
+}
+
+void value_set( value_t* v, const char* s )
+{
+	clear_value( v );
+	v->type_ = VALUE_STRING;
+	v->is_borrowed_ = false;
+	v->svalue_ = create_shared_string( s );
+}
+
+void value_set_borrowed( value_t* v, const char* s )
+{
+	clear_value( v );
+	v->type_ = VALUE_STRING;
+	v->is_borrowed_ = true;
+	v->svalue_ = const_cast<char*>( s );
+}
+
+void value_move( value_t* v, char* s )
+{
+	clear_value( v );
+	v->type_ = VALUE_STRING;
+	v->is_borrowed_ = false;
+	v->svalue_ = s;
+}
+
+void value_move( value_t* to, value_t* from )
+{
+	clear_value( to );
+	// ここも結構遅い、アーキテクチャ確定してれば早くできるが…
+	memcpy( to, from, sizeof(*to) );
+	memset( from, 0, sizeof(*from) );
+	from->type_ = VALUE_NONE;
+}
+
+value_tag value_get_primitive_tag( const value_t& r )
+{
+	if ( r.type_ == VALUE_VARIABLE )
+	{ return r.variable_->type_; }
+	return r.type_;
+}
+
+bool value_calc_boolean( const value_t& r )
 {
-	assert( var != nullptr );
-	if ( var->type_ != v.type_ )
+	switch( value_get_primitive_tag( r ) )
 	{
-		raise_error( "型の異なる変数へのAND代入（&=）操作@@ %s(%d)", var->name_, idx );
-		return;
+		case VALUE_INT:			return value_calc_int(r) != 0;
+		case VALUE_DOUBLE:		return value_calc_double(r) != 0.0;
+		case VALUE_STRING:		return value_calc_int(r) != 0;
+		default: assert( false ); break;
 	}
+	return false;
+}
 
-	assert( var->type_ == v.type_ );
-	auto* data_ptr = variable_data_ptr( *var, idx );
-	switch( var->type_ )
-	{
-	case VALUE_INT:
-	{
-		reinterpret_cast<int*>( data_ptr )[0] &= v.ivalue_;
-		break;
-	}
-	case VALUE_DOUBLE:
-	{
-		raise_error( "文字列に対するAND代入（&=）操作は定義されてません@@ %s(%d)", var->name_, idx );
-		break;
-	}
-	case VALUE_STRING:
+int value_calc_int( const value_t& r )
+{
+	switch( r.type_ )
 	{
-		raise_error( "文字列に対するAND代入（&=）操作は定義されてません@@ %s(%d)", var->name_, idx );
-		break;
-	}
-	default:
-		assert( false );
-		break;
+		case VALUE_INT:			return r.ivalue_;
+		case VALUE_DOUBLE:		return static_cast<int>( r.dvalue_ );
+		case VALUE_STRING:		return atoi( r.svalue_ );
+		case VALUE_VARIABLE:	return variable_calc_int( *r.variable_, r.index_ ); break;
+		default: assert( false ); break;
 	}
+	return 0;
 }
 
-void variable_bxor( variable_t* var, const value_t& v, int idx )
+double value_calc_double( const value_t& r )
 {
-	assert( var != nullptr );
-	if ( var->type_ != v.type_ )
+	switch( r.type_ )
 	{
-		raise_error( "型の異なる変数へのXOR代入（^=）操作@@ %s(%d)", var->name_, idx );
-		return;
+		case VALUE_INT:			return static_cast<double>( r.ivalue_ );
+		case VALUE_DOUBLE:		return r.dvalue_;
+		case VALUE_STRING:		return atof( r.svalue_ );
+		case VALUE_VARIABLE:	return variable_calc_double( *r.variable_, r.index_ ); break;
+		default: assert( false ); break;
 	}
+	return 0.0;
+}
 
-	assert( var->type_ == v.type_ );
-	auto* data_ptr = variable_data_ptr( *var, idx );
-	switch( var->type_ )
-	{
-	case VALUE_INT:
-	{
-		reinterpret_cast<int*>( data_ptr )[0] ^= v.ivalue_;
-		break;
-	}
-	case VALUE_DOUBLE:
+const char* value_get_string( const value_t& r )
+{
+	const char* s =nullptr;
+	switch( r.type_ )
 	{
-		raise_error( "文字列に対するXOR代入（^=）操作は定義されてません@@ %s(%d)", var->name_, idx );
-		break;
+	case VALUE_STRING:		s = r.svalue_; break;
+	case VALUE_VARIABLE:	s = variable_get_string( *r.variable_, r.index_ ); break;
+	default: break;
 	}
-	case VALUE_STRING:
+	return s;
+}
+
+char* value_calc_string( const value_t& r )
+{
+	char* s =nullptr;
+	switch( r.type_ )
 	{
-		raise_error( "文字列に対するXOR代入（|=）操作は定義されてません@@ %s(%d)", var->name_, idx );
-		break;
-	}
-	default:
-		assert( false );
-		break;
+		case VALUE_INT:			s = create_shared_string_from( r.ivalue_ ); break;
+		case VALUE_DOUBLE:		s = create_shared_string_from( r.dvalue_ ); break;
+		case VALUE_STRING:		s = ( r.is_borrowed_ ? create_shared_string( r.svalue_ ) : retain_shared_string( r.svalue_ ) ); break;
+		case VALUE_VARIABLE:	s = variable_calc_string( *r.variable_, r.index_ ); break;
+		default: assert( false ); break;
 	}
+	return s;
 }
 
-void* variable_data_ptr( const variable_t& v, int idx )
+value_t* value_convert_type( value_tag to, const value_t& r )
 {
-	if ( idx<0 || idx>=v.length_ )
+	if ( to == r.type_ )
+	{ return create_value( r ); }
+
+	switch( to )
 	{
-		raise_error( "変数への配列アクセスが範囲外です@@ %s(%d)", v.name_, idx );
+		case VALUE_INT:		return create_value( value_calc_int( r ) );
+		case VALUE_DOUBLE:	return create_value( value_calc_double( r ) );
+		case VALUE_STRING:
+		{
+			auto s = value_calc_string( r );
+			auto res = create_value_move( s );
+			return res;
+		}
+		default: assert( false ); break;
 	}
+	return nullptr;
+}
 
-	switch( v.type_ )
+void value_isolate( value_t& v )
+{
+	if ( v.type_ != VALUE_VARIABLE )
+	{ return; }
+
+	switch( v.variable_->type_ )
 	{
 		case VALUE_INT:
-		{
-			return reinterpret_cast<int*>( v.data_ ) +idx;
-		}
+			value_set( &v, variable_calc_int( *v.variable_, v.index_ ) );
+			break;
 		case VALUE_DOUBLE:
-		{
-			return reinterpret_cast<double*>( v.data_ ) +idx;
-		}
+			value_set( &v, variable_calc_double( *v.variable_, v.index_ ) );
+			break;
 		case VALUE_STRING:
-		{
-			return reinterpret_cast<char*>( v.data_ ) + v.granule_size_ *idx;
-		}
+			value_move( &v, variable_calc_string( *v.variable_, v.index_ ) );
+			break;
 		default:
 			assert( false );
 			break;
 	}
-	return nullptr;
 }
 
-int variable_calc_int( const variable_t& r, int idx )
+void value_bor( value_t* v, const value_t& r )
 {
-	const auto* const data_ptr = variable_data_ptr( r, idx );
-	switch( r.type_ )
+	value_binary_dispatch<OPERATOR_BOR>( v, r );
+}
+
+void value_band( value_t* v, const value_t& r )
+{
+	value_binary_dispatch<OPERATOR_BAND>( v, r );
+}
+
+void value_bxor( value_t* v, const value_t& r )
+{
+	value_binary_dispatch<OPERATOR_BXOR>( v, r );
+}
+
+void value_eq( value_t* v, const value_t& r )
+{
+	value_binary_dispatch<OPERATOR_EQ>( v, r );
+}
+
+void value_neq( value_t* v, const value_t& r )
+{
+	value_binary_dispatch<OPERATOR_NEQ>( v, r );
+}
+
+void value_gt( value_t* v, const value_t& r )
+{
+	value_binary_dispatch<OPERATOR_GT>( v, r );
+}
+
+void value_gtoe( value_t* v, const value_t& r )
+{
+	value_binary_dispatch<OPERATOR_GTOE>( v, r );
+}
+
+void value_lt( value_t* v, const value_t& r )
+{
+	value_binary_dispatch<OPERATOR_LT>( v, r );
+}
+
+void value_ltoe( value_t* v, const value_t& r )
+{
+	value_binary_dispatch<OPERATOR_LTOE>( v, r );
+}
+
+void value_add( value_t* v, const value_t& r )
+{
+	value_binary_dispatch<OPERATOR_ADD>( v, r );
+}
+
+void value_sub( value_t* v, const value_t& r )
+{
+	value_binary_dispatch<OPERATOR_SUB>( v, r );
+}
+
+void value_mul( value_t* v, const value_t& r )
+{
+	value_binary_dispatch<OPERATOR_MUL>( v, r );
+}
+
+void value_div( value_t* v, const value_t& r )
+{
+	value_binary_dispatch<OPERATOR_DIV>( v, r );
+}
+
+void value_mod( value_t* v, const value_t& r )
+{
+	value_binary_dispatch<OPERATOR_MOD>( v, r );
+}
+
+void value_unary_minus( value_t* v )
+{
+	switch( v->type_ )
 	{
-		case VALUE_INT:		return *reinterpret_cast<const int*>( data_ptr );
-		case VALUE_DOUBLE:	return static_cast<int>(*reinterpret_cast<const double*>( data_ptr ));
-		case VALUE_STRING:	return atoi( reinterpret_cast<const char*>( data_ptr ) );
-		default:
-			assert( false );
-			break;
+		case VALUE_INT:		v->ivalue_ = -v->ivalue_; break;
+		case VALUE_DOUBLE:	v->dvalue_ = -v->dvalue_; break;
+		case VALUE_STRING:	raise_error( "文字列に負値は存在しません[%s]", v->svalue_ ); break;
+		default: assert( false ); break;
 	}
-	return 0;
 }
 
-double variable_calc_double( const variable_t& r, int idx )
+//=============================================================================
+// スタック
+value_stack_t* create_value_stack()
+{
+	auto res = reinterpret_cast<value_stack_t*>( xmalloc( sizeof(value_stack_t) ) );
+	initialize_value_stack( res );
+	return res;
+}
+
+void destroy_value_stack( value_stack_t* st )
+{
+	uninitialize_value_stack( st );
+	xfree( st );
+}
+
+void initialize_value_stack( value_stack_t* st )
+{
+	const auto l =16;// 初期サイズ
+	st->stack_ = reinterpret_cast<value_t*>( xmalloc( sizeof(value_t) *l ) );
+	st->top_ = 0;
+	st->max_ = l;
+}
+
+void uninitialize_value_stack( value_stack_t* st )
+{
+	stack_pop( st, st->top_ );
+	xfree( st->stack_ );
+	st->stack_ = nullptr;
+	st->top_ = 0;
+	st->max_ = 0;
+}
+
+void stack_push( value_stack_t* st, int v )
+{
+	auto* const slot = stack_push_slot( st );
+	slot->type_ = VALUE_INT;
+	slot->ivalue_ = v;
+}
+
+void stack_push( value_stack_t* st, double v )
+{
+	auto* const slot = stack_push_slot( st );
+	slot->type_ = VALUE_DOUBLE;
+	slot->dvalue_ = v;
+}
+
+void stack_push( value_stack_t* st, const char* v )
+{
+	auto* const slot = stack_push_slot( st );
+	slot->type_ = VALUE_STRING;
+	slot->is_borrowed_ = false;
+	slot->svalue_ = create_shared_string( v );
+}
+
+void stack_push( value_stack_t* st, variable_t* v, int idx )
+{
+	auto* const slot = stack_push_slot( st );
+	slot->type_ = VALUE_VARIABLE;
+	slot->variable_ = v;
+	slot->index_ = idx;
+}
+
+void stack_push( value_stack_t* st, const value_t& v )
+{
+	auto* const slot = stack_push_slot( st );
+	copy_value( slot, v );
+}
+
+void stack_push_move( value_stack_t* st, char* v )
 {
-	const auto* const data_ptr = variable_data_ptr( r, idx );
-	switch( r.type_ )
-	{
-		case VALUE_INT:		return static_cast<double>(*reinterpret_cast<const int*>( data_ptr ));
-		case VALUE_DOUBLE:	return *reinterpret_cast<const double*>( data_ptr );
-		case VALUE_STRING:	return atof( reinterpret_cast<const char*>( data_ptr ) );
-		default:
-			assert( false );
-			break;
-	}
-	return 0.0;
+	auto* const slot = stack_push_slot( st );
+	slot->type_ = VALUE_STRING;
+	slot->is_borrowed_ = false;
+	slot->svalue_ = v;
 }
 
-const char* variable_get_string( const variable_t& r, int idx )
+// リテラルプールの文字列を複製せずに積む、プールが生きている間だけ有効
+void stack_push_borrowed( value_stack_t* st, const char* v )
 {
-	if ( r.type_ != VALUE_STRING )
-	{ return nullptr; }
+	auto* const slot = stack_push_slot( st );
+	slot->type_ = VALUE_STRING;
+	slot->is_borrowed_ = true;
+	slot->svalue_ = const_cast<char*>( v );
+}
 
-	const auto* const data_ptr = variable_data_ptr( r, idx );
-	return reinterpret_cast<const char*>( data_ptr );
+value_t* stack_peek( value_stack_t* st, int i )
+{
+	const auto idx = ( i<0 ? st->top_ +i : i );
+	assert( idx>=0 && idx<st->top_ );
+	return &st->stack_[ idx ];
 }
 
-char* variable_calc_string( const variable_t& r, int idx )
+void stack_pop( value_stack_t* st, size_t n )
 {
-	const auto* const data_ptr = variable_data_ptr( r, idx );
-	switch( r.type_ )
+	assert( n <= static_cast<size_t>(st->top_) );
+	while( n-- > 0 )
 	{
-		case VALUE_INT:		return create_string_from( *reinterpret_cast<const int*>( data_ptr ) );
-		case VALUE_DOUBLE:	return create_string_from( *reinterpret_cast<const double*>( data_ptr ) );
-		case VALUE_STRING:	return create_string( reinterpret_cast<const char*>( data_ptr ) );
-		default:
-			assert( false );
-			break;
+		--st->top_;
+		clear_value( &st->stack_[ st->top_ ] );
 	}
-	return create_string("");
 }
 
 //=============================================================================
-// 値
-value_t* create_value( int v )
+// システム変数
+int query_sysvar( const char* s )
 {
-	value_t* res =alloc_value();
-	res->type_ = VALUE_INT;
-	res->ivalue_ = v;
-	return res;
+	const auto w = find_reserved_word( s );
+	return ( w != nullptr ? w->sysvar_ : -1 );
 }
 
-value_t* create_value( double v )
+//=============================================================================
+// 実行コード
+code_container_t* create_code_container()
 {
-	value_t* res =alloc_value();
-	res->type_ = VALUE_DOUBLE;
-	res->dvalue_ = v;
+	auto res = reinterpret_cast<code_container_t*>( xmalloc( sizeof(code_container_t) ) );
+	res->code_ = nullptr;
+	res->code_size_ = 0;
+	res->code_buffer_size_ = 0;
+	res->threaded_code_ = nullptr;
+	res->threaded_code_size_ = 0;
+	res->jit_regions_ = nullptr;
+	res->jit_regions_size_ = 0;
+	res->is_readonly_ = false;
 	return res;
 }
 
-value_t* create_value( const char* v )
+void destroy_code_container( code_container_t* c )
 {
-	value_t* res =alloc_value();
-	res->type_ = VALUE_STRING;
-	res->svalue_ = create_string( v );
-	return res;
+	if ( c->code_ != nullptr && !c->is_readonly_ )
+	{ xfree( c->code_ ); }
+	if ( c->threaded_code_ != nullptr )
+	{ xfree( c->threaded_code_ ); }
+#if NHSP_JIT_AVAILABLE
+	destroy_jit_regions( c );
+#endif
+	xfree( c );
 }
 
-value_t* create_value( variable_t* v, int idx )
+//=============================================================================
+// プログラムイメージ
+// 読み取り専用で共有マッピングできればそうする、できなければ普通に読み込む
+program_image_t* open_program_image( const char* path )
 {
-	value_t* res =alloc_value();
-	res->type_ = VALUE_VARIABLE;
-	res->variable_ = v;
-	res->index_ = idx;
+	char* data = nullptr;
+	size_t size = 0;
+	bool is_mapped = false;
+
+#if NHSP_MAPPED_PROGRAM_AVAILABLE
+	{
+		const int fd = open( path, O_RDONLY );
+		if ( fd < 0 )
+		{
+			return nullptr;
+		}
+		struct stat st;
+		if ( fstat( fd, &st ) == 0 && st.st_size >= static_cast<off_t>( sizeof(program_header_t) ) )
+		{
+			auto* const p = mmap( nullptr, static_cast<size_t>( st.st_size ), PROT_READ, MAP_PRIVATE, fd, 0 );
+			if ( p != MAP_FAILED )
+			{
+				data = reinterpret_cast<char*>( p );
+				size = static_cast<size_t>( st.st_size );
+				is_mapped = true;
+			}
+		}
+		close( fd );
+	}
+#endif
+
+	if ( !is_mapped )
+	{
+		FILE* file = fopen( path, "rb" );
+		if ( file == nullptr )
+		{
+			return nullptr;
+		}
+		fseek( file, 0, SEEK_END );
+		const auto file_size = ftell( file );
+		fseek( file, 0, SEEK_SET );
+		if ( file_size < static_cast<long>( sizeof(program_header_t) ) )
+		{
+			fclose( file );
+			return nullptr;
+		}
+		data = reinterpret_cast<char*>( xmalloc( file_size ) );
+		size = static_cast<size_t>( file_size );
+		const auto is_read = ( fread( data, 1, size, file ) == size );
+		fclose( file );
+		if ( !is_read )
+		{
+			xfree( data );
+			return nullptr;
+		}
+	}
+
+	auto* const res = reinterpret_cast<program_image_t*>( xmalloc( sizeof(program_image_t) ) );
+	res->data_ = data;
+	res->size_ = size;
+	res->is_mapped_ = is_mapped;
 	return res;
 }
 
-value_t* create_value( const value_t& v )
+void close_program_image( program_image_t* image )
 {
-	value_t* res =alloc_value();
-	res->type_ = v.type_;
-	switch( v.type_ )
+#if NHSP_MAPPED_PROGRAM_AVAILABLE
+	if ( image->is_mapped_ )
 	{
-		case VALUE_INT:			res->ivalue_ =v.ivalue_; break;
-		case VALUE_DOUBLE:		res->dvalue_ =v.dvalue_; break;
-		case VALUE_STRING:		res->svalue_ =create_string(v.svalue_); break;
-		case VALUE_VARIABLE:	res->variable_ =v.variable_; res->index_ =v.index_; break;
-		default: raise_error( "中身が入ってない値をコピーして作ろうとしました@@ ptr=%p", &v );
+		munmap( image->data_, image->size_ );
 	}
-	return res;
+	else
+#endif
+	{
+		xfree( image->data_ );
+	}
+	xfree( image );
 }
 
-value_t* create_value_move( char* v )
+//=============================================================================
+// 実行環境
+execute_environment_t* create_execute_environment()
 {
-	value_t* res =alloc_value();
-	res->type_ = VALUE_STRING;
-	res->svalue_ = v;
+	auto res = reinterpret_cast<execute_environment_t*>( xmalloc( sizeof( execute_environment_t ) ) );
+	res->parser_list_ = create_list();
+	res->literal_pool_ = create_string_buffer();
+	res->constant_pool_ = create_constant_pool();
+	res->label_table_ = create_name_table();
+	res->variable_table_ = create_variable_table();
+	res->execute_code_ = create_code_container();
+	res->register_code_ = create_code_container();
+	res->register_frame_size_ = 0;
+	res->image_ = nullptr;
 	return res;
 }
 
-void destroy_value( value_t* t )
+void destroy_execute_environment( execute_environment_t* e )
 {
-	clear_value( t );
-	free_value( t );
+	{
+		auto node =e->parser_list_->head_;
+		while( node != nullptr )
+		{
+			const auto parser = reinterpret_cast<parse_context_t*>( node->value_ );
+			uninitialize_parse_context( parser );
+			destroy_parse_context( parser );
+			node = node->next_;
+		}
+		list_free_all( *e->parser_list_ );
+		destroy_list( e->parser_list_ );
+	}
+	destroy_string_buffer( e->literal_pool_ );
+	destroy_constant_pool( e->constant_pool_ );
+	{
+		const auto table = e->label_table_;
+		for( int i=0; i<table->entry_num_; ++i )
+		{
+			const auto label_node =reinterpret_cast<label_node_t*>( table->entries_[i].value_ );
+			if ( label_node == nullptr )
+			{ continue; }
+			xfree( label_node->name_ );
+			xfree( label_node );
+		}
+		destroy_name_table( table );
+	}
+	{
+		destroy_code_container( e->execute_code_ );
+		destroy_code_container( e->register_code_ );
+	}
+	if ( e->image_ != nullptr )
+	{
+		close_program_image( e->image_ );
+	}
+	destroy_variable_table( e->variable_table_ );
+	xfree( e );
 }
 
-void value_set( value_t* v, int i )
+void initialize_execute_status( execute_status_t* s )
 {
-	clear_value( v );
-	v->type_ = VALUE_INT;
-	v->ivalue_ = i;
+	s->stack_ = create_value_stack();
+	s->pc_ = 0;
+	s->current_call_frame_ = 0;
+	s->call_frame_[0].caller_poisition_ = 0;
+	s->current_loop_frame_ = 0;
+	s->loop_frame_[0].start_position_ = 0;
+	s->loop_frame_[0].counter_ = 0;
+	s->loop_frame_[0].max_ = 0;
+	s->loop_frame_[0].cnt_ = 0;
+	s->is_end_ = false;
+	s->stat_ =0;
+	s->refdval_ = 0.0;
+	s->refstr_ = create_shared_string( "" );
+	s->strsize_ = 0;
+	s->registers_ = nullptr;
+	s->register_num_ = 0;
+	s->is_jit_enabled_ = false;
 }
 
-void value_set( value_t* v, double d )
+void uninitialize_execute_status( execute_status_t* s )
 {
-	clear_value( v );
-	v->type_ = VALUE_DOUBLE;
-	v->dvalue_ = d;
+	destroy_value_stack( s->stack_ );
+	release_shared_string( s->refstr_ );
+	s->refstr_ = nullptr;
+	if ( s->registers_ != nullptr )
+	{
+		for( int i=0; i<s->register_num_; ++i )
+		{
+			clear_value( &s->registers_[i] );
+		}
+		xfree( s->registers_ );
+		s->registers_ = nullptr;
+	}
 }
 
-void value_set( value_t* v, const char* s )
+void load_script( execute_environment_t* e, const char* script, const load_arg_t* arg )
 {
-	clear_value( v );
-	v->type_ = VALUE_STRING;
-	v->svalue_ = create_string( s );
-}
+	// プログラムイメージのコードには追記できない
+	assert( e->image_ == nullptr );
 
-void value_move( value_t* v, char* s )
-{
-	clear_value( v );
-	v->type_ = VALUE_STRING;
-	v->svalue_ = s;;
-}
+	// プリプロセスとパース
+	// 展開後の全文は表示する時だけ作り、普段は展開された行をそのまま字句解析していく
+	char* preprocessed = nullptr;
+	tokenize_context_t tokenizer;
+	auto parser = create_parse_context();
+	if ( arg && arg->dump_preprocessed_ )
+	{
+		preprocessed = prepro_do( script );
+		printf( "====PREPROCESSED SCRIPT FILE(%d bytes)\n----begin----\n%s\n----end----\n", static_cast<int>( strlen( preprocessed ) ), preprocessed );
 
-void value_move( value_t* to, value_t* from )
-{
-	clear_value( to );
-	// ここも結構遅い、アーキテクチャ確定してれば早くできるが…
-	memcpy( to, from, sizeof(*to) );
-	memset( from, 0, sizeof(*from) );
-	from->type_ = VALUE_NONE;
+		initialize_tokenize_context( &tokenizer, preprocessed );
+		initialize_parse_context( parser, tokenizer );
+	}
+	else
+	{
+		prepro_stream_t stream;
+		initialize_prepro_stream( &stream, script, 256 );
+		initialize_tokenize_context( &tokenizer, "" );
+		initialize_parse_context( parser, tokenizer, stream );
+		uninitialize_prepro_stream( &stream );
+	}
+
+	parse_script( *parser );
+	const auto ast = parser->ast_;
+
+	if ( arg && arg->dump_ast_ )
+	{
+		dump_ast( ast );
+	}
+
+	// 定数の部分木を畳み込む
+	if ( arg && arg->optimize_level_ >= 1 )
+	{
+		fold_constant_ast( *parser );
+	}
+
+	uninitialize_tokenize_context( &tokenizer );
+
+	if ( preprocessed != nullptr )
+	{
+		destroy_string( preprocessed );
+		preprocessed = nullptr;
+	}
+
+	// 特定の部分木マッチング
+	// 先に必要な変数のインスタンスを作っておき、ラベルテーブルも生成しておく
+	{
+		struct _
+		{
+			static void visit( execute_environment_t* e, const ast_node_t* node )
+			{
+				if ( node->tag_==NODE_VARIABLE || node->tag_==NODE_IDENTIFIER_EXPR/*変数配列の可能性あり*/ )
+				{
+					// スロットを割り当て、適当な変数として初期化しておく
+					register_variable( e->variable_table_, node->token_->content_ );
+				}
+				else if ( node->tag_ == NODE_LABEL && search_label( e, node->token_->content_ ) == nullptr )
+				{
+					// 同名のラベルは一つにまとめる（位置は後に出てきた方で上書きされる）
+					label_node_t* label =reinterpret_cast<label_node_t*>( xmalloc( sizeof(label_node_t) ) );
+					label->name_ = create_string( node->token_->content_ );
+					// 使わない側のバックエンドの位置も保存されるので、先頭を指しておく
+					label->position_ = 0;
+					label->register_position_ = 0;
+					name_table_insert( e->label_table_, label->name_, label );
+				}
+			}
+		};
+
+		ast_cursor_t cursor;
+		initialize_ast_cursor( &cursor, ast, ast->root_ );
+		while( const auto node = ast_cursor_next( &cursor ) )
+		{
+			_::visit( e, node );
+		}
+		uninitialize_ast_cursor( &cursor );
+	}
+
+	// コード生成
+	if ( arg && arg->backend_ == BACKEND_REGISTER )
+	{
+		generate_and_append_register_code( e, ast );
+
+		if ( arg->dump_code_ )
+		{
+			printf( "====Instruction Code for execution\n" );
+			dump_register_code( e );
+		}
+	}
+	else
+	{
+		generate_and_append_code( e, ast );
+
+		const auto is_optimize = ( arg && arg->optimize_level_ >= 1 );
+		if ( arg && arg->dump_code_ && is_optimize )
+		{
+			printf( "====Instruction Code before optimization\n" );
+			dump_code( e );
+		}
+		if ( is_optimize )
+		{
+			optimize_code( e );
+		}
+		if ( arg && arg->dump_code_ )
+		{
+			printf( "====Instruction Code for execution\n" );
+			dump_code( e );
+		}
+
+		translate_threaded_code( e );
+	}
+
+	// コード生成が済めば構文木は要らないので、パーサーの領域ごとまとめて解放する
+	if ( arg && arg->retain_ast_ )
+	{
+		auto parser_node = create_list_node();
+		parser_node->value_ = parser;
+		list_append( *e->parser_list_, parser_node );
+	}
+	else
+	{
+		uninitialize_parse_context( parser );
+		destroy_parse_context( parser );
+	}
 }
 
-value_tag value_get_primitive_tag( const value_t& r )
+unsigned long long hash_script( const char* script )
 {
-	if ( r.type_ == VALUE_VARIABLE )
-	{ return r.variable_->type_; }
-	return r.type_;
+	return hash_bytes( script, strlen( script ) );
 }
 
-bool value_calc_boolean( const value_t& r )
+// path と同じディレクトリに書き込み用の一時ファイルを作る、名前は temp_path に入るので使い終わったら xfree すること
+// 他のプロセスと名前がぶつからないようにする
+FILE* create_program_temp_file( const char* path, char*& temp_path )
 {
-	switch( value_get_primitive_tag( r ) )
+	const auto size = strlen( path ) +32;
+	temp_path = reinterpret_cast<char*>( xmalloc( size ) );
+#if NHSP_MAPPED_PROGRAM_AVAILABLE
+	snprintf( temp_path, size, "%s.XXXXXX", path );
+	const int fd = mkstemp( temp_path );
+	if ( fd < 0 )
 	{
-		case VALUE_INT:			return value_calc_int(r) != 0;
-		case VALUE_DOUBLE:		return value_calc_double(r) != 0.0;
-		case VALUE_STRING:		return value_calc_int(r) != 0;
-		default: assert( false ); break;
+		xfree( temp_path );
+		temp_path = nullptr;
+		return nullptr;
 	}
-	return false;
+	// mkstemp は本人しか読めないので、普通に作ったファイルと同じく他のユーザーからも読めるようにする
+	fchmod( fd, 0644 );
+	FILE* file = fdopen( fd, "wb" );
+	if ( file == nullptr )
+	{
+		close( fd );
+		remove( temp_path );
+	}
+#else
+	static int s_temp_counter = 0;
+	snprintf( temp_path, size, "%s.%lx-%d.tmp", path, static_cast<unsigned long>( clock() ), s_temp_counter++ );
+	FILE* file = fopen( temp_path, "wb" );
+#endif
+	if ( file == nullptr )
+	{
+		xfree( temp_path );
+		temp_path = nullptr;
+	}
+	return file;
 }
 
-int value_calc_int( const value_t& r )
+bool save_program( const execute_environment_t* e, const char* path, unsigned long long source_hash )
 {
-	switch( r.type_ )
+	program_header_t header;
+	memset( &header, 0, sizeof(header) );
+	memcpy( header.magic_, "NHBC", 4 );
+	header.version_ = PROGRAM_FORMAT_VERSION;
+	header.code_unit_size_ = static_cast<int>( sizeof(code_t) );
+	header.register_frame_size_ = e->register_frame_size_;
+	header.source_hash_ = source_hash;
+
+	// ヘッダより後ろをまとめてから書く、位置はイメージの先頭から数える
+	size_t body_size = 0;
+	size_t body_buffer_size = 256;
+	auto* body = reinterpret_cast<char*>( xmalloc( body_buffer_size ) );
+	const auto put = [&]( const void* data, size_t size )
 	{
-		case VALUE_INT:			return r.ivalue_;
-		case VALUE_DOUBLE:		return static_cast<int>( r.dvalue_ );
-		case VALUE_STRING:		return atoi( r.svalue_ );
-		case VALUE_VARIABLE:	return variable_calc_int( *r.variable_, r.index_ ); break;
-		default: assert( false ); break;
+		while ( body_size +size > body_buffer_size )
+		{
+			body_buffer_size *= 2;
+			body = reinterpret_cast<char*>( xrealloc( body, body_buffer_size ) );
+		}
+		if ( size > 0 )
+		{ memcpy( body +body_size, data, size ); }
+		body_size += size;
+	};
+	const auto tell = [&]()
+	{
+		return static_cast<int>( sizeof(header) +body_size );
+	};
+	// コードを mmap したまま読めるように、数値の並ぶ部分は8バイト境界から始める
+	const auto align = [&]()
+	{
+		static const char zeros[8] = {};
+		put( zeros, ( 8 -tell() %8 ) %8 );
+	};
+
+	// 実行コードは定数を番号で、定数はリテラルを位置で指しているので、プールをそのまま書く
+	header.literal_offset_ = tell();
+	if ( e->image_ != nullptr )
+	{
+		program_header_t image_header;
+		memcpy( &image_header, e->image_->data_, sizeof(image_header) );
+		put( e->image_->data_ +image_header.literal_offset_, image_header.literal_size_ );
+		header.constant_num_ = image_header.constant_num_;
 	}
-	return 0;
-}
+	else
+	{
+		put( e->literal_pool_->buffer_, e->literal_pool_->cursor_ );
+		header.constant_num_ = e->constant_pool_->constant_num_;
+	}
+	header.literal_size_ = tell() -header.literal_offset_;
 
-double value_calc_double( const value_t& r )
-{
-	switch( r.type_ )
+	align();
+	header.constant_offset_ = tell();
+	put( constant_base( e ), sizeof(constant_t) *header.constant_num_ );
+
+	const auto* const var_table = e->variable_table_;
+	const auto* const label_table = e->label_table_;
+	header.variable_num_ = var_table->variable_num_;
+	header.label_num_ = label_table->entry_num_;
+
+	auto* const name_positions = reinterpret_cast<int*>( xmalloc( sizeof(int) *( header.variable_num_ +header.label_num_ +1 ) ) );
+	header.name_offset_ = tell();
+	for( int i=0; i<header.variable_num_; ++i )
 	{
-		case VALUE_INT:			return static_cast<double>( r.ivalue_ );
-		case VALUE_DOUBLE:		return r.dvalue_;
-		case VALUE_STRING:		return atof( r.svalue_ );
-		case VALUE_VARIABLE:	return variable_calc_double( *r.variable_, r.index_ ); break;
-		default: assert( false ); break;
+		const auto name = var_table->variables_[i].name_;
+		name_positions[i] = tell() -header.name_offset_;
+		put( name, strlen( name ) +1 );
 	}
-	return 0.0;
-}
+	for( int i=0; i<header.label_num_; ++i )
+	{
+		assert( label_table->entries_[i].name_ != nullptr );// ラベルは削除しない
+		const auto name = reinterpret_cast<const label_node_t*>( label_table->entries_[i].value_ )->name_;
+		name_positions[ header.variable_num_ +i ] = tell() -header.name_offset_;
+		put( name, strlen( name ) +1 );
+	}
+	header.name_size_ = tell() -header.name_offset_;
 
-const char* value_get_string( const value_t& r )
-{
-	const char* s =nullptr;
-	switch( r.type_ )
+	align();
+	header.variable_offset_ = tell();
+	put( name_positions, sizeof(int) *header.variable_num_ );
+
+	header.label_offset_ = tell();
+	for( int i=0; i<header.label_num_; ++i )
 	{
-	case VALUE_STRING:		s = r.svalue_; break;
-	case VALUE_VARIABLE:	s = variable_get_string( *r.variable_, r.index_ ); break;
-	default: break;
+		const auto* const label = reinterpret_cast<const label_node_t*>( label_table->entries_[i].value_ );
+		program_label_t record;
+		record.name_ = name_positions[ header.variable_num_ +i ];
+		record.position_ = label->position_;
+		record.register_position_ = label->register_position_;
+		put( &record, sizeof(record) );
 	}
-	return s;
+
+	align();
+	header.code_offset_ = tell();
+	header.code_size_ = static_cast<int>( e->execute_code_->code_size_ );
+	put( e->execute_code_->code_, sizeof(code_t) *header.code_size_ );
+
+	align();
+	header.register_code_offset_ = tell();
+	header.register_code_size_ = static_cast<int>( e->register_code_->code_size_ );
+	put( e->register_code_->code_, sizeof(code_t) *header.register_code_size_ );
+
+	header.body_hash_ = hash_bytes( body, body_size );
+
+	// 既にあるイメージは他のプロセスが mmap しているかもしれないので、その場で書き換えずに
+	// 一時ファイルに書き終えてから rename で置き換える、読む側は古いイメージか新しいイメージのどちらかを丸ごと見る
+	bool is_succeeded = false;
+	char* temp_path = nullptr;
+	FILE* file = create_program_temp_file( path, temp_path );
+	if ( file != nullptr )
+	{
+		is_succeeded = ( fwrite( &header, sizeof(header), 1, file ) == 1 );
+		is_succeeded = is_succeeded && ( fwrite( body, 1, body_size, file ) == body_size );
+		is_succeeded = is_succeeded && ( fflush( file ) == 0 );
+		is_succeeded = ( fclose( file ) == 0 ) && is_succeeded;
+		is_succeeded = is_succeeded && ( rename( temp_path, path ) == 0 );
+
+		// 途中までしか書けなかったものは残さない
+		if ( !is_succeeded )
+		{
+			remove( temp_path );
+		}
+		xfree( temp_path );
+	}
+
+	xfree( name_positions );
+	xfree( body );
+	return is_succeeded;
 }
 
-char* value_calc_string( const value_t& r )
+// イメージのオペランドが指す先の範囲
+struct program_bounds_t
 {
-	char* s =nullptr;
-	switch( r.type_ )
+	const program_header_t*	header_;
+	const constant_t*		constants_;
+
+	bool is_constant( int index ) const
 	{
-		case VALUE_INT:			s = create_string_from( r.ivalue_ ); break;
-		case VALUE_DOUBLE:		s = create_string_from( r.dvalue_ ); break;
-		case VALUE_STRING:		s = create_string( r.svalue_ ); break;
-		case VALUE_VARIABLE:	s = variable_calc_string( *r.variable_, r.index_ ); break;
-		default: assert( false ); break;
+		return index >= 0 && index < header_->constant_num_;
 	}
-	return s;
+	bool is_string_constant( int index ) const
+	{
+		return is_constant( index ) && constants_[ index ].ivalue_ >= 0 && constants_[ index ].ivalue_ < header_->literal_size_;
+	}
+	bool is_variable( int slot ) const
+	{
+		return slot >= 0 && slot < header_->variable_num_;
+	}
+	bool is_register( int r ) const
+	{
+		return r >= 0 && r < header_->register_frame_size_;
+	}
+	bool is_register_range( int head, int num ) const
+	{
+		return num >= 0 && ( num == 0 || ( is_register( head ) && head +num <= header_->register_frame_size_ ) );
+	}
+};
+
+program_bounds_t make_program_bounds( const program_header_t& header, const char* data )
+{
+	program_bounds_t res;
+	res.header_ = &header;
+	res.constants_ = reinterpret_cast<const constant_t*>( data +header.constant_offset_ );
+	return res;
 }
 
-value_t* value_convert_type( value_tag to, const value_t& r )
+bool is_compare_operator( int op )
 {
-	if ( to == r.type_ )
-	{ return create_value( r ); }
+	return op >= OPERATOR_EQ && op <= OPERATOR_LTOE;
+}
 
-	switch( to )
+// スタックマシンのコード
+// 実行時はスタックの深さを確かめないので、どの経路で合流しても深さが同じで、文の境目（goto と gosub の飛び先、ループ、サブルーチンの出入り）では空になっていることまで確かめる
+bool validate_stack_code( const program_header_t& header, const char* data )
+{
+	const auto bounds = make_program_bounds( header, data );
+	const auto* const codes = reinterpret_cast<const code_t*>( data +header.code_offset_ );
+	const auto code_size = header.code_size_;
+
+	// 命令の先頭での深さ、NOT_HEAD は命令の途中、UNKNOWN はまだ辿っていない
+	static const int NOT_HEAD = -2;
+	static const int UNKNOWN = -1;
+	auto* const depth = reinterpret_cast<int*>( xmalloc( sizeof(int) *( code_size +1 ) ) );
+	auto* const pending = reinterpret_cast<int*>( xmalloc( sizeof(int) *( code_size +1 ) ) );
+	for( int pc=0; pc<=code_size; ++pc )
+	{ depth[ pc ] = NOT_HEAD; }
+
+	bool is_valid = true;
+	for( int pc=0; is_valid && pc<code_size; )
 	{
-		case VALUE_INT:		return create_value( value_calc_int( r ) );
-		case VALUE_DOUBLE:	return create_value( value_calc_double( r ) );
-		case VALUE_STRING:
+		const auto op = code_operator( codes[ pc ] );
+		const auto operand = code_operand( codes[ pc ] );
+		const auto size = code_operator_size( codes[ pc ] );
+		depth[ pc ] = UNKNOWN;
+		is_valid = ( op < MAX_OPERATOR && pc +size <= code_size );
+		if ( !is_valid )
+		{ break; }
+
+		switch( op )
 		{
-			auto s = value_calc_string( r );
-			auto res = create_value_move( s );
-			return res;
+			case OPERATOR_PUSH_WIDE_INT:
+			case OPERATOR_PUSH_DOUBLE:		is_valid = bounds.is_constant( operand ); break;
+			case OPERATOR_PUSH_STRING:		is_valid = bounds.is_string_constant( operand ); break;
+			case OPERATOR_PUSH_VARIABLE:
+			case OPERATOR_LOAD_SCALAR:
+			case OPERATOR_INC_VAR:			is_valid = bounds.is_variable( operand ); break;
+			case OPERATOR_PUSH_SYSVAR:		is_valid = ( operand >= 0 && operand < MAX_SYSVAR ); break;
+			case OPERATOR_COMMAND:			is_valid = ( code_call_callee( operand ) < MAX_COMMAND && code_call_arg_num( operand ) >= 0 ); break;
+			case OPERATOR_FUNCTION:			is_valid = ( code_call_callee( operand ) < MAX_FUNCTION && code_call_arg_num( operand ) >= 0 ); break;
+			case OPERATOR_RETURN:			is_valid = ( operand == 0 || operand == 1 ); break;
+			case OPERATOR_CMP_JUMP_IF_FALSE:
+			case OPERATOR_CMP_JUMP_IF_FALSE_INT_INT:	is_valid = is_compare_operator( codes[ pc +1 ] ); break;
+			default: break;
 		}
-		default: assert( false ); break;
+		pc += size;
 	}
-	return nullptr;
-}
+	if ( code_size >= 0 )
+	{ depth[ code_size ] = UNKNOWN; }
 
-void value_isolate( value_t& v )
-{
-	if ( v.type_ != VALUE_VARIABLE )
-	{ return; }
+	// 深さを伝える、命令の途中に飛び込むものや深さが食い違うものは不正
+	int pending_num =0;
+	const auto merge = [&]( int pc, int d )
+	{
+		if ( pc < 0 || pc > code_size || depth[ pc ] == NOT_HEAD )
+		{ return false; }
+		if ( depth[ pc ] == UNKNOWN )
+		{
+			depth[ pc ] = d;
+			pending[ pending_num++ ] = pc;
+			return true;
+		}
+		return depth[ pc ] == d;
+	};
+	is_valid = is_valid && merge( 0, 0 );
 
-	switch( v.variable_->type_ )
+	while( is_valid && pending_num > 0 )
 	{
-		case VALUE_INT:
-			value_set( &v, variable_calc_int( *v.variable_, v.index_ ) );
-			break;
-		case VALUE_DOUBLE:
-			value_set( &v, variable_calc_double( *v.variable_, v.index_ ) );
-			break;
-		case VALUE_STRING:
-			value_move( &v, variable_calc_string( *v.variable_, v.index_ ) );
-			break;
-		default:
-			assert( false );
-			break;
+		const auto pc = pending[ --pending_num ];
+		if ( pc >= code_size )
+		{ continue; }
+
+		const auto op = code_operator( codes[ pc ] );
+		const auto operand = code_operand( codes[ pc ] );
+		const auto next = pc +code_operator_size( codes[ pc ] );
+		const auto d = depth[ pc ];
+
+		int pop =0, push =0;
+		switch( op )
+		{
+			case OPERATOR_PUSH_INT:
+			case OPERATOR_PUSH_WIDE_INT:
+			case OPERATOR_PUSH_DOUBLE:
+			case OPERATOR_PUSH_STRING:
+			case OPERATOR_PUSH_SYSVAR:
+			case OPERATOR_LOAD_SCALAR:
+				push = 1;
+				break;
+			case OPERATOR_PUSH_VARIABLE:
+			case OPERATOR_UNARY_MINUS:
+				pop = 1; push = 1;
+				break;
+			case OPERATOR_ASSIGN:
+			case OPERATOR_ADD_ASSIGN:
+			case OPERATOR_SUB_ASSIGN:
+			case OPERATOR_MUL_ASSIGN:
+			case OPERATOR_DIV_ASSIGN:
+			case OPERATOR_MOD_ASSIGN:
+			case OPERATOR_BOR_ASSIGN:
+			case OPERATOR_BAND_ASSIGN:
+			case OPERATOR_BXOR_ASSIGN:
+			case OPERATOR_ASSIGN_INT:
+			case OPERATOR_ASSIGN_DOUBLE:
+			case OPERATOR_CMP_JUMP_IF_FALSE:
+			case OPERATOR_CMP_JUMP_IF_FALSE_INT_INT:
+				pop = 2;
+				break;
+			case OPERATOR_BOR:
+			case OPERATOR_BAND:
+			case OPERATOR_BXOR:
+			case OPERATOR_EQ:
+			case OPERATOR_NEQ:
+			case OPERATOR_GT:
+			case OPERATOR_GTOE:
+			case OPERATOR_LT:
+			case OPERATOR_LTOE:
+			case OPERATOR_ADD:
+			case OPERATOR_SUB:
+			case OPERATOR_MUL:
+			case OPERATOR_DIV:
+			case OPERATOR_MOD:
+			case OPERATOR_ADD_INT_INT:
+			case OPERATOR_SUB_INT_INT:
+			case OPERATOR_MUL_INT_INT:
+			case OPERATOR_EQ_INT_INT:
+			case OPERATOR_NEQ_INT_INT:
+			case OPERATOR_GT_INT_INT:
+			case OPERATOR_GTOE_INT_INT:
+			case OPERATOR_LT_INT_INT:
+			case OPERATOR_LTOE_INT_INT:
+			case OPERATOR_ADD_DOUBLE_DOUBLE:
+			case OPERATOR_SUB_DOUBLE_DOUBLE:
+			case OPERATOR_MUL_DOUBLE_DOUBLE:
+				pop = 2; push = 1;
+				break;
+			case OPERATOR_IF:
+			case OPERATOR_REPEAT:
+				pop = 1;
+				break;
+			case OPERATOR_COMMAND:
+				pop = code_call_arg_num( operand );
+				break;
+			case OPERATOR_FUNCTION:
+				pop = code_call_arg_num( operand ); push = 1;
+				break;
+			case OPERATOR_RETURN:
+				pop = operand;
+				break;
+			default: break;
+		}
+		if ( d < pop )
+		{ is_valid = false; break; }
+		const auto nd = d -pop +push;
+
+		switch( op )
+		{
+			case OPERATOR_IF:
+			case OPERATOR_CMP_JUMP_IF_FALSE:
+			case OPERATOR_CMP_JUMP_IF_FALSE_INT_INT:
+				is_valid = merge( next, nd ) && merge( pc +operand, nd );
+				break;
+			case OPERATOR_JUMP:
+				is_valid = merge( operand, nd );
+				break;
+			case OPERATOR_JUMP_RELATIVE:
+				is_valid = merge( pc +operand, nd );
+				break;
+
+			// ループの終わりは loop の次、repeat から始まるものとして深さを決める
+			case OPERATOR_REPEAT:
+				is_valid = ( nd == 0 && operand > pc && operand < code_size && depth[ operand ] != NOT_HEAD
+					&& code_operator( codes[ operand ] ) == OPERATOR_LOOP
+					&& merge( next, 0 ) && merge( operand +1, 0 ) );
+				break;
+			case OPERATOR_REPEAT_CHECK:
+				is_valid = ( d == 0 && merge( next, 0 ) );
+				break;
+			case OPERATOR_LOOP:
+			case OPERATOR_CONTINUE:
+			case OPERATOR_BREAK:
+			case OPERATOR_RETURN:
+				is_valid = ( nd == 0 );
+				break;
+			case OPERATOR_GOTO:
+				is_valid = ( d == 0 && merge( operand, 0 ) );
+				break;
+			case OPERATOR_GOSUB:
+				is_valid = ( d == 0 && merge( operand, 0 ) && merge( next, 0 ) );
+				break;
+			case OPERATOR_END:
+				break;
+
+			default:
+				is_valid = merge( next, nd );
+				break;
+		}
 	}
+
+	xfree( pending );
+	xfree( depth );
+	return is_valid;
 }
 
-void value_bor( value_t* v, const value_t& r )
+// レジスタマシンのコード
+bool validate_register_code( const program_header_t& header, const char* data )
 {
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
+	const auto bounds = make_program_bounds( header, data );
+	const auto* const codes = reinterpret_cast<const code_t*>( data +header.register_code_offset_ );
+	const auto code_size = header.register_code_size_;
+
+	// レジスタはどれも一度は書かれるので、コードの長さより多くはならない
+	if ( header.register_frame_size_ > code_size )
+	{ return false; }
+
+	auto* const is_head = reinterpret_cast<bool*>( xmalloc( sizeof(bool) *( code_size +1 ) ) );
+	memset( is_head, 0, sizeof(bool) *( code_size +1 ) );
+	bool is_valid = true;
+	for( int pc=0; is_valid && pc<code_size; )
 	{
-		case VALUE_INT:		value_set( v, v->ivalue_ | t->ivalue_ ); break;
-		case VALUE_DOUBLE:
+		const auto op = codes[ pc ];
+		is_valid = ( op >= 0 && op < MAX_REGISTER_OPERATOR );
+		if ( !is_valid )
+		{ break; }
+		const auto size = register_code_operator_size( op );
+		is_valid = ( pc +size <= code_size );
+		if ( !is_valid )
+		{ break; }
+
+		const auto* const o = codes +pc;
+		switch( op )
 		{
-			raise_error( "浮動小数点同士の|演算子は挙動が定義されていません" );
-			break;
+			case REGISTER_OPERATOR_LOAD_INT:		is_valid = bounds.is_register( o[1] ); break;
+			case REGISTER_OPERATOR_LOAD_DOUBLE:		is_valid = bounds.is_register( o[1] ) && bounds.is_constant( o[2] ); break;
+			case REGISTER_OPERATOR_LOAD_STRING:		is_valid = bounds.is_register( o[1] ) && bounds.is_string_constant( o[2] ); break;
+			case REGISTER_OPERATOR_LOAD_VARIABLE:	is_valid = bounds.is_register( o[1] ) && bounds.is_variable( o[2] ) && ( o[3] < 0 || bounds.is_register( o[3] ) ); break;
+			case REGISTER_OPERATOR_LOAD_SYSVAR:		is_valid = bounds.is_register( o[1] ) && o[2] >= 0 && o[2] < MAX_SYSVAR; break;
+			case REGISTER_OPERATOR_ASSIGN:
+			case REGISTER_OPERATOR_ADD_ASSIGN:
+			case REGISTER_OPERATOR_SUB_ASSIGN:
+			case REGISTER_OPERATOR_MUL_ASSIGN:
+			case REGISTER_OPERATOR_DIV_ASSIGN:
+			case REGISTER_OPERATOR_MOD_ASSIGN:
+			case REGISTER_OPERATOR_BOR_ASSIGN:
+			case REGISTER_OPERATOR_BAND_ASSIGN:
+			case REGISTER_OPERATOR_BXOR_ASSIGN:
+				is_valid = bounds.is_variable( o[1] ) && ( o[2] < 0 || bounds.is_register( o[2] ) ) && bounds.is_register( o[3] );
+				break;
+			case REGISTER_OPERATOR_BOR:
+			case REGISTER_OPERATOR_BAND:
+			case REGISTER_OPERATOR_BXOR:
+			case REGISTER_OPERATOR_EQ:
+			case REGISTER_OPERATOR_NEQ:
+			case REGISTER_OPERATOR_GT:
+			case REGISTER_OPERATOR_GTOE:
+			case REGISTER_OPERATOR_LT:
+			case REGISTER_OPERATOR_LTOE:
+			case REGISTER_OPERATOR_ADD:
+			case REGISTER_OPERATOR_SUB:
+			case REGISTER_OPERATOR_MUL:
+			case REGISTER_OPERATOR_DIV:
+			case REGISTER_OPERATOR_MOD:
+				is_valid = bounds.is_register( o[1] ) && bounds.is_register( o[2] ) && bounds.is_register( o[3] );
+				break;
+			case REGISTER_OPERATOR_UNARY_MINUS:		is_valid = bounds.is_register( o[1] ) && bounds.is_register( o[2] ); break;
+			case REGISTER_OPERATOR_IF:				is_valid = bounds.is_register( o[1] ); break;
+			case REGISTER_OPERATOR_REPEAT:			is_valid = ( o[1] < 0 || bounds.is_register( o[1] ) ); break;
+			case REGISTER_OPERATOR_COMMAND:			is_valid = o[1] >= 0 && o[1] < MAX_COMMAND && bounds.is_register_range( o[2], o[3] ); break;
+			case REGISTER_OPERATOR_FUNCTION:		is_valid = bounds.is_register( o[1] ) && o[2] >= 0 && o[2] < MAX_FUNCTION && bounds.is_register_range( o[3], o[4] ); break;
+			case REGISTER_OPERATOR_RETURN:			is_valid = ( o[1] < 0 || bounds.is_register( o[1] ) ); break;
+			default: break;
 		}
-		case VALUE_STRING:
+		is_head[ pc ] = true;
+		pc += size;
+	}
+	is_head[ code_size ] = true;
+
+	// 飛び先は命令の先頭、repeat は loop を指す
+	const auto is_target = [&]( long long target )
+	{
+		return target >= 0 && target <= code_size && is_head[ target ];
+	};
+	for( int pc=0; is_valid && pc<code_size; pc+=register_code_operator_size( codes[ pc ] ) )
+	{
+		switch( codes[ pc ] )
 		{
-			raise_error( "文字列同士の|演算子は挙動が定義されていません" );
-			break;
+			case REGISTER_OPERATOR_IF:				is_valid = is_target( static_cast<long long>( pc ) +codes[ pc +2 ] ); break;
+			case REGISTER_OPERATOR_JUMP_RELATIVE:	is_valid = is_target( static_cast<long long>( pc ) +codes[ pc +1 ] ); break;
+			case REGISTER_OPERATOR_GOSUB:
+			case REGISTER_OPERATOR_GOTO:			is_valid = is_target( codes[ pc +1 ] ); break;
+			case REGISTER_OPERATOR_REPEAT:
+			{
+				const auto target = codes[ pc +2 ];
+				is_valid = ( is_target( target ) && target < code_size && codes[ target ] == REGISTER_OPERATOR_LOOP );
+				break;
+			}
+			default: break;
 		}
-		default: assert( false ); break;
 	}
-	destroy_value( t );
+
+	xfree( is_head );
+	return is_valid;
 }
 
-void value_band( value_t* v, const value_t& r )
-{
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
+// 実行環境に触れる前に、イメージの中の位置や番号がすべて範囲内にあることを確かめる
+bool validate_program_image( const program_image_t* image, unsigned long long source_hash )
+{
+	const auto* const data = image->data_;
+	const auto size = static_cast<long long>( image->size_ );
+
+	program_header_t header;
+	if ( size < static_cast<long long>( sizeof(header) ) )
+	{ return false; }
+	memcpy( &header, data, sizeof(header) );
+	if ( memcmp( header.magic_, "NHBC", 4 ) != 0
+		|| header.version_ != PROGRAM_FORMAT_VERSION
+		|| header.code_unit_size_ != static_cast<int>( sizeof(code_t) )
+		|| header.source_hash_ != source_hash
+		|| header.body_hash_ != hash_bytes( data +sizeof(header), size -sizeof(header) ) )
+	{ return false; }
+	if ( header.register_frame_size_ < 0 || header.constant_num_ < 0 || header.variable_num_ < 0 || header.label_num_ < 0
+		|| header.code_size_ < 0 || header.register_code_size_ < 0 )
+	{ return false; }
+
+	// 各部分はこの順に重ならずに並び、数値の部分は境界がそろっている
+	long long tail = sizeof(header);
+	const auto section = [&]( int offset, long long bytes, int alignment )
+	{
+		if ( offset < tail || bytes < 0 || offset %alignment != 0 || offset +bytes > size )
+		{ return false; }
+		tail = offset +bytes;
+		return true;
+	};
+	if ( !section( header.literal_offset_, header.literal_size_, 1 )
+		|| !section( header.constant_offset_, static_cast<long long>( sizeof(constant_t) ) *header.constant_num_, alignof(constant_t) )
+		|| !section( header.name_offset_, header.name_size_, 1 )
+		|| !section( header.variable_offset_, static_cast<long long>( sizeof(int) ) *header.variable_num_, alignof(int) )
+		|| !section( header.label_offset_, static_cast<long long>( sizeof(program_label_t) ) *header.label_num_, alignof(program_label_t) )
+		|| !section( header.code_offset_, static_cast<long long>( sizeof(code_t) ) *header.code_size_, alignof(code_t) )
+		|| !section( header.register_code_offset_, static_cast<long long>( sizeof(code_t) ) *header.register_code_size_, alignof(code_t) )
+		|| tail != size )
+	{ return false; }
+
+	// 文字列はどの位置から読んでも部分の中で終わる
+	if ( ( header.literal_size_ > 0 && data[ header.literal_offset_ +header.literal_size_ -1 ] != '\0' )
+		|| ( header.name_size_ > 0 && data[ header.name_offset_ +header.name_size_ -1 ] != '\0' ) )
+	{ return false; }
+
+	const auto* const names = data +header.name_offset_;
+	const auto* const variables = reinterpret_cast<const int*>( data +header.variable_offset_ );
+	const auto* const labels = reinterpret_cast<const program_label_t*>( data +header.label_offset_ );
+
+	// 名前は空でなく、変数とラベルそれぞれで重複しない
+	bool is_valid = true;
+	auto* const variable_names = create_name_table();
+	auto* const label_names = create_name_table();
+	for( int i=0; is_valid && i<header.variable_num_ +header.label_num_; ++i )
+	{
+		const auto is_variable = ( i < header.variable_num_ );
+		const auto position = ( is_variable ? variables[i] : labels[ i -header.variable_num_ ].name_ );
+		is_valid = ( position >= 0 && position < header.name_size_ );
+		if ( !is_valid )
+		{ break; }
+
+		const auto name = names +position;
+		auto* const table = ( is_variable ? variable_names : label_names );
+		is_valid = ( name[0] != '\0' && name_table_find( table, name ) < 0 );
+		if ( is_valid )
+		{ name_table_insert( table, name, nullptr ); }
+	}
+	destroy_name_table( variable_names );
+	destroy_name_table( label_names );
+
+	for( int i=0; is_valid && i<header.label_num_; ++i )
 	{
-		case VALUE_INT:		value_set( v, v->ivalue_ & t->ivalue_ ); break;
-		case VALUE_DOUBLE:
-		{
-			raise_error( "浮動小数点同士の&演算子は挙動が定義されていません" );
-			break;
-		}
-		case VALUE_STRING:
-		{
-			raise_error( "文字列同士の&演算子は挙動が定義されていません" );
-			break;
-		}
-		default: assert( false ); break;
+		is_valid = ( labels[i].position_ >= 0 && labels[i].position_ <= header.code_size_
+			&& labels[i].register_position_ >= 0 && labels[i].register_position_ <= header.register_code_size_ );
 	}
-	destroy_value( t );
+
+	// コードはオペランドの範囲だけでなく、飛び先と実行中の状態まで確かめる
+	is_valid = is_valid && validate_stack_code( header, data );
+	is_valid = is_valid && validate_register_code( header, data );
+	return is_valid;
 }
 
-void value_bxor( value_t* v, const value_t& r )
+bool load_program( execute_environment_t* e, const char* path, unsigned long long source_hash )
 {
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
+	assert( e->image_ == nullptr );
+	assert( e->execute_code_->code_size_ == 0 && e->register_code_->code_size_ == 0 );
+	assert( e->variable_table_->variable_num_ == 0 && e->label_table_->entry_num_ == 0 );
+
+	auto* const image = open_program_image( path );
+	if ( image == nullptr )
 	{
-	case VALUE_INT:		value_set( v, v->ivalue_ ^ t->ivalue_ ); break;
-	case VALUE_DOUBLE:
+		return false;
+	}
+	if ( !validate_program_image( image, source_hash ) )
 	{
-		raise_error( "浮動小数点同士の^演算子は挙動が定義されていません" );
-		break;
+		close_program_image( image );
+		return false;
 	}
-	case VALUE_STRING:
+
+	// ここからは失敗しない
+	// 変数とラベル表はプロセスごとに書き換えるので実行環境に作り、コードとリテラルはイメージを直接指す
+	program_header_t header;
+	memcpy( &header, image->data_, sizeof(header) );
+	const auto* const names = image->data_ +header.name_offset_;
+	const auto* const variables = reinterpret_cast<const int*>( image->data_ +header.variable_offset_ );
+	const auto* const labels = reinterpret_cast<const program_label_t*>( image->data_ +header.label_offset_ );
+
+	for( int i=0; i<header.variable_num_; ++i )
 	{
-		raise_error( "文字列同士の^演算子は挙動が定義されていません" );
-		break;
+		const auto slot = register_variable( e->variable_table_, names +variables[i] );
+		assert( slot == i );
+		(void)slot;
 	}
-	default: assert( false ); break;
+
+	for( int i=0; i<header.label_num_; ++i )
+	{
+		auto* const label = reinterpret_cast<label_node_t*>( xmalloc( sizeof(label_node_t) ) );
+		label->name_ = create_string( names +labels[i].name_ );
+		label->position_ = labels[i].position_;
+		label->register_position_ = labels[i].register_position_;
+		name_table_insert( e->label_table_, label->name_, label );
 	}
-	destroy_value( t );
-}
 
-void value_eq( value_t* v, const value_t& r )
-{
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
+	const auto map_code = [&]( code_container_t* code, int offset, int code_size )
 	{
-		case VALUE_INT:		value_set( v, v->ivalue_==t->ivalue_ ? 1 : 0 ); break;
-		case VALUE_DOUBLE:	value_set( v, v->dvalue_==t->dvalue_ ? 1 : 0 ); break;
-		case VALUE_STRING:	value_set( v, strcmp(v->svalue_, t->svalue_)==0 ? 1: 0 ); break;
-		default: assert( false ); break;
+		code->code_ = reinterpret_cast<code_t*>( image->data_ +offset );
+		code->code_size_ = code_size;
+		code->code_buffer_size_ = code_size;
+		code->is_readonly_ = true;
+	};
+	map_code( e->execute_code_, header.code_offset_, header.code_size_ );
+	map_code( e->register_code_, header.register_code_offset_, header.register_code_size_ );
+	e->register_frame_size_ = header.register_frame_size_;
+	e->image_ = image;
+
+	if ( e->execute_code_->code_size_ > 0 )
+	{
+		translate_threaded_code( e );
 	}
-	destroy_value( t );
+	return true;
 }
 
-void value_neq( value_t* v, const value_t& r )
+void execute_inner( execute_environment_t* e, execute_status_t* s )
 {
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
-	{
-		case VALUE_INT:		value_set( v, v->ivalue_!=t->ivalue_ ? 1 : 0 ); break;
-		case VALUE_DOUBLE:	value_set( v, v->dvalue_!=t->dvalue_ ? 1 : 0 ); break;
-		case VALUE_STRING:	value_set( v, strcmp(v->svalue_, t->svalue_)!=0 ? 1: 0 ); break;
-		default: assert( false ); break;
-	}
-	destroy_value( t );
+	execute_inner_impl<false, false>( e, s, nullptr );
 }
 
-void value_gt( value_t* v, const value_t& r )
+void execute_inner_threaded( execute_environment_t* e, execute_status_t* s )
 {
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
+#if NHSP_THREADED_DISPATCH_AVAILABLE
+	// コードが追加されていたら翻訳しなおす
+	if ( e->execute_code_->threaded_code_ == nullptr || e->execute_code_->threaded_code_size_ != e->execute_code_->code_size_ )
 	{
-		case VALUE_INT:		value_set( v, v->ivalue_>t->ivalue_ ? 1 : 0 ); break;
-		case VALUE_DOUBLE:	value_set( v, v->dvalue_>t->dvalue_ ? 1 : 0 ); break;
-		case VALUE_STRING:
-		{
-			raise_error( "文字列同士の>演算子は挙動が定義されていません" );
-			break;
-		}
-		default: assert( false ); break;
+		translate_threaded_code( e );
 	}
-	destroy_value( t );
+	execute_inner_impl<true, false>( e, s, nullptr );
+#else
+	execute_inner_impl<false, false>( e, s, nullptr );
+#endif
 }
 
-void value_gtoe( value_t* v, const value_t& r )
+void execute_inner_profile( execute_environment_t* e, execute_status_t* s, opcode_profile_t* p )
 {
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
-	{
-		case VALUE_INT:		value_set( v, v->ivalue_>=t->ivalue_ ? 1 : 0 ); break;
-		case VALUE_DOUBLE:	value_set( v, v->dvalue_>=t->dvalue_ ? 1 : 0 ); break;
-		case VALUE_STRING:
-		{
-			raise_error( "文字列同士の>=演算子は挙動が定義されていません" );
-			break;
-		}
-		default: assert( false ); break;
-	}
-	destroy_value( t );
+	execute_inner_impl<false, true>( e, s, p );
 }
 
-void value_lt( value_t* v, const value_t& r )
+#if NHSP_THREADED_DISPATCH_AVAILABLE
+// スレッデッドコードのハンドラの表、添え字は命令の番号
+const void* const* threaded_handler_table()
 {
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
-	{
-		case VALUE_INT:		value_set( v, v->ivalue_<t->ivalue_ ? 1 : 0 ); break;
-		case VALUE_DOUBLE:	value_set( v, v->dvalue_<t->dvalue_ ? 1 : 0 ); break;
-		case VALUE_STRING:
-		{
-			raise_error( "文字列同士の<演算子は挙動が定義されていません" );
-			break;
-		}
-		default: assert( false ); break;
-	}
-	destroy_value( t );
+	const void* const* handlers = nullptr;
+	execute_inner_impl<true, false>( nullptr, nullptr, nullptr, &handlers );
+	return handlers;
 }
+#endif
 
-void value_ltoe( value_t* v, const value_t& r )
+void translate_threaded_code( execute_environment_t* e )
 {
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
+#if NHSP_THREADED_DISPATCH_AVAILABLE
+	const auto* const handlers = threaded_handler_table();
+	auto* const code = e->execute_code_;
+	const auto code_size = static_cast<int>( code->code_size_ );
+	if ( code->threaded_code_ != nullptr )
+	{ xfree( code->threaded_code_ ); }
+
+	// 末尾の一つ先は番兵、命令の途中に飛び込んだ場合も終了させる
+	code->threaded_code_ = reinterpret_cast<const void**>( xmalloc( sizeof(void*) *( code_size +1 ) ) );
+	for( int i=0; i<=code_size; ++i )
 	{
-		case VALUE_INT:		value_set( v, v->ivalue_<=t->ivalue_ ? 1 : 0 ); break;
-		case VALUE_DOUBLE:	value_set( v, v->dvalue_<=t->dvalue_ ? 1 : 0 ); break;
-		case VALUE_STRING:
-		{
-			raise_error( "文字列同士の<=演算子は挙動が定義されていません" );
-			break;
-		}
-		default: assert( false ); break;
+		code->threaded_code_[i] = handlers[ OPERATOR_END ];
 	}
-	destroy_value( t );
+	for( int i=0; i<code_size; i+=code_operator_size( code->code_[i] ) )
+	{
+		code->threaded_code_[i] = handlers[ code_operator( code->code_[i] ) ];
+	}
+	code->threaded_code_size_ = code->code_size_;
+#else
+	NHSP_UNUSE( e );
+#endif
 }
 
-void value_add( value_t* v, const value_t& r )
+bool is_dispatch_available( dispatch_tag dispatch )
 {
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
+	switch( dispatch )
 	{
-		case VALUE_INT:		v->ivalue_ += t->ivalue_; break;
-		case VALUE_DOUBLE:	v->dvalue_ += t->dvalue_; break;
-		case VALUE_STRING:
-		{
-			const auto required = snprintf( nullptr, 0, "%s%s", v->svalue_, t->svalue_ );
-			auto s = create_string( required );
-			sprintf( s, "%s%s", v->svalue_, t->svalue_ );
-			destroy_string( v->svalue_ );
-			v->svalue_ = s;
-			break;
-		}
-		default: assert( false ); break;
+		case DISPATCH_SWITCH:	return true;
+		case DISPATCH_THREADED:	return ( NHSP_THREADED_DISPATCH_AVAILABLE != 0 );
+		default: break;
 	}
-	destroy_value( t );
+	return false;
 }
 
-void value_sub( value_t* v, const value_t& r )
+bool is_jit_available()
 {
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
-	{
-		case VALUE_INT:		v->ivalue_ -= t->ivalue_; break;
-		case VALUE_DOUBLE:	v->dvalue_ -= t->dvalue_; break;
-		case VALUE_STRING:
-		{
-			raise_error( "文字列同士の-演算子は挙動が定義されていません" );
-			break;
-		}
-		default: assert( false ); break;
-	}
-	destroy_value( t );
+	return ( NHSP_JIT_AVAILABLE != 0 );
 }
 
-void value_mul( value_t* v, const value_t& r )
+void execute_inner_register( execute_environment_t* e, execute_status_t* s )
 {
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
+	const code_t* codes =e->register_code_->code_;
+	const char* const literals =literal_base( e );
+	const constant_t* const constants =constant_base( e );
+	variable_t* const variables =e->variable_table_->variables_;
+	const auto code_size = static_cast<int>(e->register_code_->code_size_);
+	const auto frame_size = e->register_frame_size_;
+
+	// レジスタウィンドウはコールフレームの深さ分だけ確保しておく
+	if ( s->registers_ == nullptr )
 	{
-		case VALUE_INT:		v->ivalue_ *= t->ivalue_; break;
-		case VALUE_DOUBLE:	v->dvalue_ *= t->dvalue_; break;
-		case VALUE_STRING:
+		s->register_num_ = frame_size *static_cast<int>( MAX_CALL_FRAME );
+		s->registers_ = reinterpret_cast<value_t*>( xmalloc( sizeof(value_t) *( s->register_num_ > 0 ? s->register_num_ : 1 ) ) );
+		for( int i=0; i<s->register_num_; ++i )
 		{
-			raise_error( "文字列同士の*演算子は挙動が定義されていません" );
-			break;
+			s->registers_[i].type_ = VALUE_INT;
+			s->registers_[i].ivalue_ = 0;
 		}
-		default: assert( false ); break;
 	}
-	destroy_value( t );
-}
+	assert( s->register_num_ >= frame_size *static_cast<int>( MAX_CALL_FRAME ) );
+
+	auto& pc = s->pc_;
+	value_t* regs = s->registers_ +s->current_call_frame_ *frame_size;
+
+	for( ; ; )
+	{
+
+		// もう実行おわってる
+		if ( s->is_end_ )
+		{ break; }
+
+		// 末尾に到達してる
+		if ( code_size <= pc )
+		{ break; }
+
+		const auto op = codes[ pc ];
+		switch( op )
+		{
+			case REGISTER_OPERATOR_NOP:
+				break;
+
+			case REGISTER_OPERATOR_LOAD_INT:
+				value_set( &regs[ codes[ pc +1 ] ], codes[ pc +2 ] );
+				pc += 2;
+				break;
+
+			case REGISTER_OPERATOR_LOAD_DOUBLE:
+				value_set( &regs[ codes[ pc +1 ] ], constants[ codes[ pc +2 ] ].dvalue_ );
+				pc += 2;
+				break;
+
+			case REGISTER_OPERATOR_LOAD_STRING:
+				value_set_borrowed( &regs[ codes[ pc +1 ] ], literals +constants[ codes[ pc +2 ] ].ivalue_ );
+				pc += 2;
+				break;
+
+			case REGISTER_OPERATOR_LOAD_VARIABLE:
+			{
+				auto* const var = &variables[ codes[ pc +2 ] ];
+				const auto idx_reg = codes[ pc +3 ];
+				const auto idx = ( idx_reg < 0 ? 0 : value_calc_int( regs[ idx_reg ] ) );
+
+				auto& d = regs[ codes[ pc +1 ] ];
+				clear_value( &d );
+				d.type_ = VALUE_VARIABLE;
+				d.variable_ = var;
+				d.index_ = idx;
+
+				pc += 3;
+				break;
+			}
+
+			case REGISTER_OPERATOR_LOAD_SYSVAR:
+			{
+				auto& d = regs[ codes[ pc +1 ] ];
+				const auto sysvar = codes[ pc +2 ];
+				switch( sysvar )
+				{
+					case SYSVAR_CNT:
+						if ( s->current_loop_frame_ <= 0 )
+						{
+							raise_error( "システム変数cnt：repeat-loop中でないのに参照しました" );
+						}
+						value_set( &d, s->loop_frame_[s->current_loop_frame_ -1].cnt_ );
+						break;
+					case SYSVAR_STAT:
+						value_set( &d, s->stat_ );
+						break;
+					case SYSVAR_REFDVAL:
+						value_set( &d, s->refdval_ );
+						break;
+					case SYSVAR_REFSTR:
+						value_move( &d, retain_shared_string( s->refstr_ ) );
+						break;
+					case SYSVAR_STRSIZE:
+						value_set( &d, s->strsize_ );
+						break;
+					case SYSVAR_LOOPLEV:
+						value_set( &d, s->current_loop_frame_ );
+						break;
+					default:
+						assert( false );
+						value_set( &d, 0 );
+						break;
+				}
+				pc += 2;
+				break;
+			}
+
+			case REGISTER_OPERATOR_ASSIGN:
+			case REGISTER_OPERATOR_ADD_ASSIGN:
+			case REGISTER_OPERATOR_SUB_ASSIGN:
+			case REGISTER_OPERATOR_MUL_ASSIGN:
+			case REGISTER_OPERATOR_DIV_ASSIGN:
+			case REGISTER_OPERATOR_MOD_ASSIGN:
+			case REGISTER_OPERATOR_BOR_ASSIGN:
+			case REGISTER_OPERATOR_BAND_ASSIGN:
+			case REGISTER_OPERATOR_BXOR_ASSIGN:
+			{
+				auto* const var = &variables[ codes[ pc +1 ] ];
+				const auto idx_reg = codes[ pc +2 ];
+				const auto idx = ( idx_reg < 0 ? 0 : value_calc_int( regs[ idx_reg ] ) );
+
+				auto& v = regs[ codes[ pc +3 ] ];
+
+				// 整数の変数へ整数を代入する時は要素へ直接書き込む
+				int i =0;
+				if ( op == REGISTER_OPERATOR_ASSIGN && var->type_ == VALUE_INT && idx >= 0 && idx < var->length_ && value_peek_int( v, i ) )
+				{
+					reinterpret_cast<int*>( var->data_ )[ idx ] = i;
+					pc += 3;
+					break;
+				}
+
+				value_isolate( v );
+				value_t tmp;
+				const auto* const t = ( op == REGISTER_OPERATOR_ASSIGN ? nullptr : prepare_assign_operand( var->type_, v, tmp ) );
+				switch( op )
+				{
+				case REGISTER_OPERATOR_ASSIGN:		variable_set( var, v, idx ); break;
+				case REGISTER_OPERATOR_ADD_ASSIGN:	variable_add( var, *t, idx ); break;
+				case REGISTER_OPERATOR_SUB_ASSIGN:	variable_sub( var, *t, idx ); break;
+				case REGISTER_OPERATOR_MUL_ASSIGN:	variable_mul( var, *t, idx ); break;
+				case REGISTER_OPERATOR_DIV_ASSIGN:	variable_div( var, *t, idx ); break;
+				case REGISTER_OPERATOR_MOD_ASSIGN:	variable_mod( var, *t, idx ); break;
+				case REGISTER_OPERATOR_BOR_ASSIGN:	variable_bor( var, *t, idx ); break;
+				case REGISTER_OPERATOR_BAND_ASSIGN:	variable_band( var, *t, idx ); break;
+				case REGISTER_OPERATOR_BXOR_ASSIGN:	variable_bxor( var, *t, idx ); break;
+				default: assert( false ); break;
+				}
+				if ( t == &tmp )
+				{
+					clear_value( &tmp );
+				}
+				pc += 3;
+				break;
+			}
+
+			case REGISTER_OPERATOR_BOR:
+			case REGISTER_OPERATOR_BAND:
+			case REGISTER_OPERATOR_BXOR:
+			case REGISTER_OPERATOR_EQ:
+			case REGISTER_OPERATOR_NEQ:
+			case REGISTER_OPERATOR_GT:
+			case REGISTER_OPERATOR_GTOE:
+			case REGISTER_OPERATOR_LT:
+			case REGISTER_OPERATOR_LTOE:
+			case REGISTER_OPERATOR_ADD:
+			case REGISTER_OPERATOR_SUB:
+			case REGISTER_OPERATOR_MUL:
+			case REGISTER_OPERATOR_DIV:
+			case REGISTER_OPERATOR_MOD:
+			{
+				const auto d = codes[ pc +1 ];
+				const auto l = codes[ pc +2 ];
+				const auto r = codes[ pc +3 ];
+
+				// 両辺が整数なら変数の要素からも直接読んで計算する、スタックマシンの *_INT_INT と同じ
+				int li =0, ri =0;
+				if ( value_peek_int( regs[ l ], li ) && value_peek_int( regs[ r ], ri ) )
+				{
+					bool is_done = true;
+					switch( op )
+					{
+						case REGISTER_OPERATOR_ADD:		value_set( &regs[ d ], li + ri ); break;
+						case REGISTER_OPERATOR_SUB:		value_set( &regs[ d ], li - ri ); break;
+						case REGISTER_OPERATOR_MUL:		value_set( &regs[ d ], li * ri ); break;
+						case REGISTER_OPERATOR_EQ:		value_set( &regs[ d ], li == ri ? 1 : 0 ); break;
+						case REGISTER_OPERATOR_NEQ:		value_set( &regs[ d ], li != ri ? 1 : 0 ); break;
+						case REGISTER_OPERATOR_GT:		value_set( &regs[ d ], li > ri ? 1 : 0 ); break;
+						case REGISTER_OPERATOR_GTOE:	value_set( &regs[ d ], li >= ri ? 1 : 0 ); break;
+						case REGISTER_OPERATOR_LT:		value_set( &regs[ d ], li < ri ? 1 : 0 ); break;
+						case REGISTER_OPERATOR_LTOE:	value_set( &regs[ d ], li <= ri ? 1 : 0 ); break;
+						default: is_done = false; break;
+					}
+					if ( is_done )
+					{
+						pc += 3;
+						break;
+					}
+				}
+
+				if ( d != l )
+				{
+					assert( d != r );
+					clear_value( &regs[ d ] );
+					copy_value( &regs[ d ], regs[ l ] );
+				}
+				value_t* v = &regs[ d ];
+				value_isolate( *v );
+
+				switch( op )
+				{
+					case REGISTER_OPERATOR_BOR:		value_bor( v, regs[ r ] ); break;
+					case REGISTER_OPERATOR_BAND:	value_band( v, regs[ r ] ); break;
+					case REGISTER_OPERATOR_BXOR:	value_bxor( v, regs[ r ] ); break;
+					case REGISTER_OPERATOR_EQ:		value_eq( v, regs[ r ] ); break;
+					case REGISTER_OPERATOR_NEQ:		value_neq( v, regs[ r ] ); break;
+					case REGISTER_OPERATOR_GT:		value_gt( v, regs[ r ] ); break;
+					case REGISTER_OPERATOR_GTOE:	value_gtoe( v, regs[ r ] ); break;
+					case REGISTER_OPERATOR_LT:		value_lt( v, regs[ r ] ); break;
+					case REGISTER_OPERATOR_LTOE:	value_ltoe( v, regs[ r ] ); break;
+					case REGISTER_OPERATOR_ADD:		value_add( v, regs[ r ] ); break;
+					case REGISTER_OPERATOR_SUB:		value_sub( v, regs[ r ] ); break;
+					case REGISTER_OPERATOR_MUL:		value_mul( v, regs[ r ] ); break;
+					case REGISTER_OPERATOR_DIV:		value_div( v, regs[ r ] ); break;
+					case REGISTER_OPERATOR_MOD:		value_mod( v, regs[ r ] ); break;
+					default: assert( false ); break;
+				}
+				pc += 3;
+				break;
+			}
+
+			case REGISTER_OPERATOR_UNARY_MINUS:
+			{
+				const auto d = codes[ pc +1 ];
+				const auto l = codes[ pc +2 ];
+				if ( d != l )
+				{
+					clear_value( &regs[ d ] );
+					copy_value( &regs[ d ], regs[ l ] );
+				}
+				value_isolate( regs[ d ] );
+				value_unary_minus( &regs[ d ] );
+				pc += 2;
+				break;
+			}
+
+			case REGISTER_OPERATOR_IF:
+			{
+				const auto is_cond = value_calc_boolean( regs[ codes[ pc +1 ] ] );
+				if ( is_cond )
+				{
+					pc += 2;
+				}
+				else
+				{
+					const auto false_head = codes[ pc +2 ];
+					pc += false_head -1;
+				}
+				break;
+			}
+
+			case REGISTER_OPERATOR_REPEAT:
+			{
+				check_loop_frame_push( s );
+
+				const auto num_reg = codes[ pc +1 ];
+				const auto end_position = codes[ pc +2 ];
+
+				auto& frame = s->loop_frame_[s->current_loop_frame_];
+				++s->current_loop_frame_;
+				frame.start_position_ = pc +3;
+				frame.end_position_ = end_position;
+				frame.cnt_ = 0;
+				frame.counter_ = 0;
+				frame.max_ = ( num_reg < 0 ? -1 : value_calc_int( regs[ num_reg ] ) );
+
+				pc += 2;
+				break;
+			}
+			case REGISTER_OPERATOR_REPEAT_CHECK:
+			{
+				if ( s->current_loop_frame_ <= 0 )
+				{
+					raise_error( "repeat：repeat-loopの中にありません" );
+				}
+				auto& frame = s->loop_frame_[ s->current_loop_frame_ -1 ];
+				if ( frame.max_>=0 && frame.counter_>=frame.max_ )
+				{
+					pc = frame.end_position_;
+					--s->current_loop_frame_;
+				}
+				break;
+			}
 
-void value_div( value_t* v, const value_t& r )
-{
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
-	{
-		case VALUE_INT:
-			if ( t->ivalue_ == 0 )
+			case REGISTER_OPERATOR_LOOP:
+			case REGISTER_OPERATOR_CONTINUE:
 			{
-				raise_error( "0除算が行われました" );
+				if ( s->current_loop_frame_ <= 0 )
+				{
+					raise_error( "loop,continue：repeat-loopの中にありません" );
+				}
+
+				auto& frame = s->loop_frame_[ s->current_loop_frame_ -1 ];
+				++frame.counter_;
+				++frame.cnt_;
+				pc = frame.start_position_ -1;
 				break;
 			}
-			v->ivalue_ /= t->ivalue_;
-			break;
-		case VALUE_DOUBLE:
-			if ( t->dvalue_ == 0.0 )
+			case REGISTER_OPERATOR_BREAK:
 			{
-				raise_error( "0.0除算が行われました" );
+				if ( s->current_loop_frame_ <= 0 )
+				{
+					raise_error( "break：repeat-loopの中にありません" );
+				}
+
+				auto& frame = s->loop_frame_[ s->current_loop_frame_ -1 ];
+				pc = frame.end_position_;
+
+				--s->current_loop_frame_;
 				break;
 			}
-			v->dvalue_ /= t->dvalue_;
-			break;
-		case VALUE_STRING:
-		{
-			raise_error( "文字列同士の/演算子は挙動が定義されていません" );
-			break;
-		}
-		default: assert( false ); break;
-	}
-	destroy_value( t );
-}
 
-void value_mod( value_t* v, const value_t& r )
-{
-	value_t* t = value_convert_type( v->type_, r );
-	switch( v->type_ )
-	{
-		case VALUE_INT:
-			if ( t->ivalue_ == 0 )
+			case REGISTER_OPERATOR_GOSUB:
 			{
-				raise_error( "0剰余が行われました" );
+				check_call_frame_push( s );
+
+				auto& frame = s->call_frame_[s->current_call_frame_];
+				++s->current_call_frame_;
+				frame.caller_poisition_ = pc +1;
+				regs += frame_size;
+
+				pc = codes[ pc +1 ] -1;
 				break;
 			}
-			v->ivalue_ %= t->ivalue_;
-			break;
-		case VALUE_DOUBLE:
-			if ( t->dvalue_ == 0.0 )
+			case REGISTER_OPERATOR_GOTO:
 			{
-				raise_error( "0.0除算が行われました" );
+				pc = codes[ pc +1 ] -1;
 				break;
 			}
-			v->dvalue_ = std::fmod(v->dvalue_, t->dvalue_);
-			break;
-		case VALUE_STRING:
-		{
-			raise_error( "文字列同士の\\演算子は挙動が定義されていません" );
-			break;
-		}
-		default: assert( false ); break;
-	}
-	destroy_value( t );
-}
 
-void value_unary_minus( value_t* v )
-{
-	switch( v->type_ )
-	{
-		case VALUE_INT:		v->ivalue_ = -v->ivalue_; break;
-		case VALUE_DOUBLE:	v->dvalue_ = -v->dvalue_; break;
-		case VALUE_STRING:	raise_error( "文字列に負値は存在しません[%s]", v->svalue_ ); break;
-		default: assert( false ); break;
-	}
-}
+			case REGISTER_OPERATOR_COMMAND:
+			{
+				const auto command = codes[ pc +1 ];
+				assert( command >= 0 );
+				const auto arg_head = codes[ pc +2 ];
+				const auto arg_num = codes[ pc +3 ];
 
-//=============================================================================
-// スタック
-value_stack_t* create_value_stack()
-{
-	auto res = reinterpret_cast<value_stack_t*>( xmalloc( sizeof(value_stack_t) ) );
-	initialize_value_stack( res );
-	return res;
-}
+				// 引数はレジスタからスタックへ移してからコマンドに渡す
+				for( int i=0; i<arg_num; ++i )
+				{
+					auto* const slot = stack_push_slot( s->stack_ );
+					slot->type_ = VALUE_NONE;
+					value_move( slot, &regs[ arg_head +i ] );
+				}
 
-void destroy_value_stack( value_stack_t* st )
-{
-	uninitialize_value_stack( st );
-	xfree( st );
-}
+				const auto delegate = get_command_delegate( static_cast<builtin_command_tag>( command ) );
+				assert( delegate != nullptr );
+				const auto top = s->stack_->top_;
+				delegate( e, s, arg_num );
+				assert( s->stack_->top_ == top -arg_num );// 戻り値がないことを確認
 
-void initialize_value_stack( value_stack_t* st )
-{
-	const auto l =16;// 初期サイズ
-	st->stack_ = reinterpret_cast<value_t**>( xmalloc( sizeof(value_t*) *l ) );
-	st->top_ = 0;
-	st->max_ = l;
-}
+				pc += 3;
+				break;
+			}
+			case REGISTER_OPERATOR_FUNCTION:
+			{
+				const auto d = codes[ pc +1 ];
+				const auto function = codes[ pc +2 ];
+				assert( function >= 0 );
+				const auto arg_head = codes[ pc +3 ];
+				const auto arg_num = codes[ pc +4 ];
 
-void uninitialize_value_stack( value_stack_t* st )
-{
-	stack_pop( st, st->top_ );
-	xfree( st->stack_ );
-	st->stack_ = nullptr;
-	st->top_ = 0;
-	st->max_ = 0;
-}
+				// 副作用のない数値の関数は、引数をスタックへ移さずにレジスタのまま計算する
+				if ( calc_pure_numeric_function( function, &regs[ arg_head ], arg_num, &regs[ d ] ) )
+				{
+					pc += 4;
+					break;
+				}
 
-void stack_push( value_stack_t* st, value_t* v )
-{
-	if ( st->top_+1 > st->max_ )
-	{
-		st->max_ = st->max_ *2;// 貪欲
-		st->stack_ = reinterpret_cast<value_t**>( xrealloc( st->stack_, sizeof(value_t*) *st->max_ ) );
-	}
+				for( int i=0; i<arg_num; ++i )
+				{
+					auto* const slot = stack_push_slot( s->stack_ );
+					slot->type_ = VALUE_NONE;
+					value_move( slot, &regs[ arg_head +i ] );
+				}
 
-	st->stack_[st->top_] =v;
-	++st->top_;
-}
+				const auto delegate = get_function_delegate( static_cast<builtin_function_tag>( function ) );
+				assert( delegate != nullptr );
+				const auto top = s->stack_->top_;
+				delegate( e, s, arg_num );
+				assert( s->stack_->top_ == top -arg_num +1 );// 戻り値が入っていることを確認する
 
-void stack_push( value_stack_t* st, const value_t& v )
-{
-	value_t* vp = create_value( v );
-	stack_push( st, vp );
-}
+				value_move( &regs[ d ], stack_peek( s->stack_ ) );
+				stack_pop( s->stack_ );
 
-value_t* stack_peek( value_stack_t* st, int i )
-{
-	const auto idx = ( i<0 ? st->top_ +i : i );
-	assert( idx>=0 && idx<st->top_ );
-	return st->stack_[ idx ];
-}
+				pc += 4;
+				break;
+			}
 
-void stack_pop( value_stack_t* st, size_t n )
-{
-	assert( n <= static_cast<size_t>(st->top_) );
-	while( n-- > 0 )
-	{
-		--st->top_;
-		assert( st->stack_[ st->top_ ] != nullptr );
-		destroy_value( st->stack_[ st->top_ ] );
-		st->stack_[ st->top_ ] = nullptr;
-	}
-}
+			case REGISTER_OPERATOR_JUMP_RELATIVE:
+			{
+				pc += codes[ pc +1 ] -1;
+				break;
+			}
+			case REGISTER_OPERATOR_RETURN:
+			{
+				if ( s->current_call_frame_ <= 0 )
+				{
+					raise_error( "サブルーチン外からのreturnは無効です" );
+				}
 
-//=============================================================================
-// システム変数
-int query_sysvar( const char* s )
-{
-	static const struct
-	{
-		int				tag_;
-		const char*		word_;
-	} table[] =
-	{
-		{ SYSVAR_CNT,		"cnt", },
-		{ SYSVAR_STAT,		"stat", },
-		{ SYSVAR_REFDVAL,	"refdval", },
-		{ SYSVAR_REFSTR,	"refstr", },
-		{ SYSVAR_STRSIZE,	"strsize", },
-		{ SYSVAR_LOOPLEV,	"looplev", },
-		{ -1,				nullptr },
-	};
+				const auto res_reg = codes[ pc +1 ];
+				if ( res_reg >= 0 )
+				{
+					const auto& res = regs[ res_reg ];
+					switch( value_get_primitive_tag(res) )
+					{
+						case VALUE_INT:		s->stat_ = value_calc_int(res); break;
+						case VALUE_DOUBLE:	s->refdval_ = value_calc_double(res); break;
+						case VALUE_STRING:	release_shared_string( s->refstr_ ); s->refstr_ = value_calc_string(res); break;
+						default: assert( false ); break;
+					}
+				}
 
-	// 全探索
-	for( int i=0; table[i].tag_!=-1; ++i )
-	{
-		if ( string_equal_igcase( s, table[i].word_ ) )
-		{ return table[i].tag_; }
-	}
-	return -1;
-}
+				--s->current_call_frame_;
+				regs -= frame_size;
+				const auto& frame =s->call_frame_[ s->current_call_frame_ ];
+				pc = frame.caller_poisition_;
+				break;
+			}
 
-//=============================================================================
-// 実行コード
-code_container_t* create_code_container()
-{
-	auto res = reinterpret_cast<code_container_t*>( xmalloc( sizeof(code_container_t) ) );
-	res->code_ = nullptr;
-	res->code_size_ = 0;
-	res->code_buffer_size_ = 0;
-	return res;
-}
+			case REGISTER_OPERATOR_END:
+				s->is_end_ =true;
+				break;
 
-void destroy_code_container( code_container_t* c )
-{
-	if ( c->code_ != nullptr )
-	{ xfree( c->code_ ); }
-	xfree( c );
-}
+			default: assert( false ); break;
+		}
 
-//=============================================================================
-// 実行環境
-execute_environment_t* create_execute_environment()
-{
-	auto res = reinterpret_cast<execute_environment_t*>( xmalloc( sizeof( execute_environment_t ) ) );
-	res->parser_list_ = create_list();
-	res->ast_list_ = create_list();
-	res->label_table_ = create_list();
-	res->variable_table_ = create_variable_table();
-	res->execute_code_ = create_code_container();
-	return res;
+		++pc;
+	}
 }
 
-void destroy_execute_environment( execute_environment_t* e )
+void execute( execute_environment_t* e, int initial_pc, const execute_arg_t* arg )
 {
+	execute_status_t s;
+	initialize_execute_status( &s );
+	s.pc_ = initial_pc;
+
+	const auto backend = ( arg != nullptr ? arg->backend_ : ( e->execute_code_->code_ != nullptr ? BACKEND_STACK : BACKEND_REGISTER ) );
+	const auto code = ( backend == BACKEND_REGISTER ? e->register_code_ : e->execute_code_ );
+	if ( code->code_ == nullptr )
 	{
-		auto node =e->parser_list_->head_;
-		while( node != nullptr )
-		{
-			const auto parser = reinterpret_cast<parse_context_t*>( node->value_ );
-			uninitialize_parse_context( parser );
-			destroy_parse_context( parser );
-			node = node->next_;
-		}
-		list_free_all( *e->parser_list_ );
-		destroy_list( e->parser_list_ );
-	}
-	{
-		auto node =e->ast_list_->head_;
-		while( node != nullptr )
-		{
-			const auto ast = reinterpret_cast<list_t*>( node->value_ );
-			destroy_ast( ast );
-			node = node->next_;
-		}
-		list_free_all( *e->ast_list_ );
-		destroy_list( e->ast_list_ );
-	}
-	{
-		auto node = e->label_table_->head_;
-		while( node != nullptr )
-		{
-			const auto label_node =reinterpret_cast<label_node_t*>( node->value_ );
-			xfree( label_node->name_ );
-			xfree( label_node );
-			node->value_ = nullptr;
-			node = node->next_;
-		}
-		list_free_all( *e->label_table_ );
-		destroy_list( e->label_table_ );
+		raise_error( "実行できるノードがありません@@ [%p]", e );
 	}
+
+	if ( backend == BACKEND_REGISTER )
 	{
-		destroy_code_container( e->execute_code_ );
+		execute_inner_register( e, &s );
 	}
-	destroy_variable_table( e->variable_table_ );
-	xfree( e );
-}
-
-void initialize_execute_status( execute_status_t* s )
-{
-	s->stack_ = create_value_stack();
-	s->pc_ = 0;
-	s->current_call_frame_ = 0;
-	s->call_frame_[0].caller_poisition_ = 0;
-	s->current_loop_frame_ = 0;
-	s->loop_frame_[0].start_position_ = 0;
-	s->loop_frame_[0].counter_ = 0;
-	s->loop_frame_[0].max_ = 0;
-	s->loop_frame_[0].cnt_ = 0;
-	s->is_end_ = false;
-	s->stat_ =0;
-	s->refdval_ = 0.0;
-	s->refstr_ = create_string( "" );
-	s->strsize_ = 0;
+	else if ( arg != nullptr && arg->profile_ngram_ > 0 )
+	{
+		auto profile = create_opcode_profile( arg->profile_ngram_ );
+		execute_inner_profile( e, &s, profile );
+		dump_opcode_profile( profile, 32 );
+		destroy_opcode_profile( profile );
+	}
+	else
+	{
+		s.is_jit_enabled_ = ( arg != nullptr && arg->jit_ && is_jit_available() );
+
+		const auto dispatch = ( arg != nullptr ? arg->dispatch_ : ( is_dispatch_available( DISPATCH_THREADED ) ? DISPATCH_THREADED : DISPATCH_SWITCH ) );
+		switch( dispatch )
+		{
+			case DISPATCH_THREADED:	execute_inner_threaded( e, &s ); break;
+			default:				execute_inner( e, &s ); break;
+		}
+	}
+
+	uninitialize_execute_status( &s );
 }
 
-void uninitialize_execute_status( execute_status_t* s )
+// goto と gosub のオペランドを、ラベル表の番号からラベルの位置に置き換える
+// ラベルは後方にも書けるので、生成し終わってからまとめて解決する
+void link_code( execute_environment_t* e, int head )
 {
-	destroy_value_stack( s->stack_ );
-	destroy_string( s->refstr_ );
-	s->refstr_ = nullptr;
+	auto* const code = e->execute_code_;
+	for( int pc=head; pc<static_cast<int>( code->code_size_ ); pc+=code_operator_size( code->code_[ pc ] ) )
+	{
+		const auto op = code_operator( code->code_[ pc ] );
+		if ( op == OPERATOR_GOSUB || op == OPERATOR_GOTO )
+		{
+			const auto label = label_at( e, code_operand( code->code_[ pc ] ) );
+			code_patch_operand( code, pc, label->position_ );
+		}
+	}
 }
 
-void load_script( execute_environment_t* e, const char* script, const load_arg_t* arg )
+void link_register_code( execute_environment_t* e, int head )
 {
-	// プリプロセス
-	char* preprocessed = prepro_do( script );
-
-	if ( arg && arg->dump_preprocessed_ )
+	auto* const code = e->register_code_;
+	for( int pc=head; pc<static_cast<int>( code->code_size_ ); pc+=register_code_operator_size( code->code_[ pc ] ) )
 	{
-		printf( "====PREPROCESSED SCRIPT FILE(%d bytes)\n----begin----\n%s\n----end----\n", static_cast<int>( strlen( preprocessed ) ), preprocessed );
+		const auto op = code->code_[ pc ];
+		if ( op == REGISTER_OPERATOR_GOSUB || op == REGISTER_OPERATOR_GOTO )
+		{
+			const auto label = label_at( e, code->code_[ pc +1 ] );
+			code->code_[ pc +1 ] = label->register_position_;
+		}
 	}
+}
 
-	// パース
-	tokenize_context_t tokenizer;
-	initialize_tokenize_context( &tokenizer, preprocessed );
-
-	auto parser = create_parse_context();
-	initialize_parse_context( parser, tokenizer );
-
-	auto ast = parse_script( *parser );
+// ソースコード上の repeat-loop のネストの上限、スタックマシンとレジスタマシンのコード生成で共有する
+static const int MAX_REPEAT_NEST = 32;
 
-	if ( arg && arg->dump_ast_ )
+void check_repeat_nest( int repeat_depth, const ast_node_t* n )
+{
+	if ( repeat_depth >= MAX_REPEAT_NEST )
 	{
-		dump_ast( ast );
+		raise_error( "repeat-loop: ソースコード上でネストが深すぎます@@ %d行目", n->token_->appear_line_ );
 	}
+}
 
-	uninitialize_tokenize_context( &tokenizer );
+void generate_and_append_code( execute_environment_t* e, const ast_t* ast )
+{
+	struct generate_context_t
+	{
+		const ast_t*		ast_;
 
-	destroy_string( preprocessed );
-	preprocessed = nullptr;
+		int			stack_;
 
-	// 特定の部分木マッチング
-	// 先に必要な変数のインスタンスを作っておき、ラベルテーブルも生成しておく
+		int			repeat_head_[MAX_REPEAT_NEST];
+		int			repeat_depth_;
+	};
+
+	generate_context_t context;
+	context.ast_ = ast;
+	context.stack_ = 0;
+	context.repeat_depth_ = 0;
+	const auto code_head = static_cast<int>( e->execute_code_->code_size_ );
+
+	const auto root = ( ast->root_ >= 0 ? &ast->nodes_[ ast->root_ ] : nullptr );
+	for( int i=0; root != nullptr && i<root->child_num_; ++i )
 	{
+		const auto node = ast_child( ast, root, i );
+
 		struct _
 		{
-			static void walk( execute_environment_t* e, ast_node_t* node )
+			static void walk( execute_environment_t* e, const ast_node_t* n, generate_context_t* c )
 			{
-				if ( node->tag_==NODE_VARIABLE || node->tag_==NODE_IDENTIFIER_EXPR/*変数配列の可能性あり*/ )
+				switch( n->tag_ )
 				{
-					auto var_name = node->token_->content_;
-					if ( search_variable( e->variable_table_, var_name ) == nullptr )
+					case NODE_EMPTY:
+						break;
+
+					case NODE_LABEL:
 					{
-						// 適当な変数として初期化しておく
-						value_t v;
-						v.type_ = VALUE_INT;
-						v.ivalue_ = 0;
-						variable_set( e->variable_table_, v, var_name, 0 );
+						const auto label_name = n->token_->content_;
+						const auto label = search_label( e, label_name );
+						assert( label != nullptr );
+						// 位置を覚えるだけで命令は置かない、飛び先はリンクで解決する
+						label->position_ = static_cast<int>( e->execute_code_->code_size_ );
+						break;
 					}
-				}
-				else if ( node->tag_ == NODE_LABEL )
-				{
-					auto label_node = create_list_node();
-					label_node_t* label =reinterpret_cast<label_node_t*>( xmalloc( sizeof(label_node_t) ) );
-					label->name_ = create_string( node->token_->content_ );
-					label_node->value_ = label;
-					list_append( *e->label_table_, label_node );
-				}
-				if ( node->left_ != nullptr )
-				{ walk( e, node->left_ ); }
-				if ( node->right_ != nullptr )
-				{ walk( e, node->right_ ); }
-			}
-		};
 
-		list_node_t* st =ast->head_;
-		while( st != nullptr )
-		{
-			ast_node_t* node = reinterpret_cast<ast_node_t*>( st->value_ );
-			_::walk( e, node );
-			st = st->next_;
-		}
-	}
+					case NODE_BLOCK_STATEMENTS:
+					case NODE_ARGUMENTS:
+						for( int i=0; i<n->child_num_; ++i )
+						{
+							walk( e, ast_child( c->ast_, n, i ), c );
+						}
+						break;
 
-	// コード生成
-	generate_and_append_code( e, ast );
+					case NODE_COMMAND:
+					{
+						assert( n->token_->tag_ == TOKEN_IDENTIFIER );
+						const auto command_name = n->token_->content_;
 
-	// パーサーとASTを保存しておく
-	{
-		auto parser_node = create_list_node();
-		parser_node->value_ = parser;
-		list_append( *e->parser_list_, parser_node );
-	}
-	{
-		auto ast_node = create_list_node();
-		ast_node->value_ = ast;
-		list_append( *e->ast_list_, ast_node );
-	}
-}
+						const auto command = query_command( command_name );
+						if ( command == -1 )
+						{
+							raise_error( "コマンドが見つかりません：%s", command_name );
+						}
 
-void execute_inner( execute_environment_t* e, execute_status_t* s )
-{
-	const code_t* codes =e->execute_code_->code_;
-	const auto code_size = static_cast<int>(e->execute_code_->code_size_);
+						const auto top = c->stack_;
+						if ( ast_child( c->ast_, n, 0 ) != nullptr )
+						{
+							walk( e, ast_child( c->ast_, n, 0 ), c );
+						}
+						const auto arg_num = c->stack_ -top;
 
-	auto& pc = s->pc_;
+						code_write_operator( e, OPERATOR_COMMAND, code_call_operand( command, arg_num ) );
 
-	for( ; ; )
-	{
+						c->stack_ = top;
+						break;
+					}
 
-		// もう実行おわってる
-		if ( s->is_end_ )
-		{ break; }
+					case NODE_ASSIGN:
+					case NODE_ADD_ASSIGN:
+					case NODE_SUB_ASSIGN:
+					case NODE_MUL_ASSIGN:
+					case NODE_DIV_ASSIGN:
+					case NODE_MOD_ASSIGN:
+					case NODE_BOR_ASSIGN:
+					case NODE_BAND_ASSIGN:
+					case NODE_BXOR_ASSIGN:
+					{
+						// var += 即値、var = var + 即値
+						{
+							const auto var = query_scalar_variable( e, c->ast_, ast_child( c->ast_, n, 0 ) );
+							int imm =0;
+							bool is_inc = false;
+							if ( var >= 0 && n->tag_ == NODE_ADD_ASSIGN )
+							{
+								is_inc = query_int_literal( c->ast_, ast_child( c->ast_, n, 1 ), imm );
+							}
+							else if ( var >= 0 && n->tag_ == NODE_ASSIGN )
+							{
+								const auto r = unwrap_expression( c->ast_, ast_child( c->ast_, n, 1 ) );
+								is_inc = ( r->tag_ == NODE_ADD && query_scalar_variable( e, c->ast_, ast_child( c->ast_, r, 0 ) ) == var && query_int_literal( c->ast_, ast_child( c->ast_, r, 1 ), imm ) );
+							}
+							if ( is_inc )
+							{
+								code_write_operator( e, OPERATOR_INC_VAR, var );
+								code_write( e, imm );
+								break;
+							}
+						}
 
-		// 末尾に到達してる
-		if ( code_size <= pc )
-		{ break; }
+						walk( e, ast_child( c->ast_, n, 0 ), c );
+						walk( e, ast_child( c->ast_, n, 1 ), c );
+						switch( n->tag_ )
+						{
+						case NODE_ASSIGN:		code_write( e, OPERATOR_ASSIGN ); break;
+						case NODE_ADD_ASSIGN:	code_write( e, OPERATOR_ADD_ASSIGN ); break;
+						case NODE_SUB_ASSIGN:	code_write( e, OPERATOR_SUB_ASSIGN ); break;
+						case NODE_MUL_ASSIGN:	code_write( e, OPERATOR_MUL_ASSIGN ); break;
+						case NODE_DIV_ASSIGN:	code_write( e, OPERATOR_DIV_ASSIGN ); break;
+						case NODE_MOD_ASSIGN:	code_write( e, OPERATOR_MOD_ASSIGN ); break;
+						case NODE_BOR_ASSIGN:	code_write( e, OPERATOR_BOR_ASSIGN ); break;
+						case NODE_BAND_ASSIGN:	code_write( e, OPERATOR_BAND_ASSIGN ); break;
+						case NODE_BXOR_ASSIGN:	code_write( e, OPERATOR_BXOR_ASSIGN ); break;
+						default: assert( false ); break;
+						}
+						c->stack_ -= 2; 
+						break;
+					}
+					case NODE_VARIABLE:
+					{
+						const auto var_name = n->token_->content_;
+						const auto var = search_variable_slot( e->variable_table_, var_name );
+						assert( var >= 0 );
 
-		const auto op = codes[ pc ];
-		switch( op )
-		{
-			case OPERATOR_NOP:
-				break;
+						auto idx_node = ast_child( c->ast_, n, 0 );
+						if ( idx_node )
+						{
+							walk( e, idx_node, c );
+							code_write_operator( e, OPERATOR_PUSH_VARIABLE, var );
+						}
+						else
+						{
+							code_write_operator( e, OPERATOR_LOAD_SCALAR, var );
+						}
+						++c->stack_;
+						break;
+					}
+
+					case NODE_EXPRESSION:
+						assert( ast_child( c->ast_, n, 0 ) != nullptr );
+						walk( e, ast_child( c->ast_, n, 0 ), c );
+						break;
+
+					case NODE_BOR:
+					case NODE_BAND:
+					case NODE_BXOR:
+					case NODE_EQ:
+					case NODE_NEQ:
+					case NODE_GT:
+					case NODE_GTOE:
+					case NODE_LT:
+					case NODE_LTOE:
+					case NODE_ADD:
+					case NODE_SUB:
+					case NODE_MUL:
+					case NODE_DIV:
+					case NODE_MOD:
+					{
+						assert( ast_child( c->ast_, n, 0 ) != nullptr );
+						walk( e, ast_child( c->ast_, n, 0 ), c );
+						assert( ast_child( c->ast_, n, 1 ) != nullptr );
+						walk( e, ast_child( c->ast_, n, 1 ), c );
+
+						switch( n->tag_ )
+						{
+							case NODE_BOR:		code_write( e, OPERATOR_BOR ); break;
+							case NODE_BAND:		code_write( e, OPERATOR_BAND ); break;
+							case NODE_BXOR:		code_write( e, OPERATOR_BXOR ); break;
+							case NODE_EQ:		code_write( e, OPERATOR_EQ ); break;
+							case NODE_NEQ:		code_write( e, OPERATOR_NEQ ); break;
+							case NODE_GT:		code_write( e, OPERATOR_GT ); break;
+							case NODE_GTOE:		code_write( e, OPERATOR_GTOE ); break;
+							case NODE_LT:		code_write( e, OPERATOR_LT ); break;
+							case NODE_LTOE:		code_write( e, OPERATOR_LTOE ); break;
+							case NODE_ADD:		code_write( e, OPERATOR_ADD ); break;
+							case NODE_SUB:		code_write( e, OPERATOR_SUB ); break;
+							case NODE_MUL:		code_write( e, OPERATOR_MUL ); break;
+							case NODE_DIV:		code_write( e, OPERATOR_DIV ); break;
+							case NODE_MOD:		code_write( e, OPERATOR_MOD ); break;
+							default: assert( false ); break;
+						}
+
+						--c->stack_;
+						break;
+					}
+
+					case NODE_UNARY_MINUS:
+					{
+						assert( ast_child( c->ast_, n, 0 ) != nullptr );
+						walk( e, ast_child( c->ast_, n, 0 ), c );
+						code_write( e, OPERATOR_UNARY_MINUS );
+						break;
+					}
+
+					case NODE_PRIMITIVE_VALUE:
+					{
+						switch( n->token_->tag_ )
+						{
+							case TOKEN_INTEGER:
+							{
+								// 命令語に収まらない整数は定数プールに置く
+								const auto v = atoi( n->token_->content_ );
+								if ( is_code_operand_packable( v ) )
+								{ code_write_operator( e, OPERATOR_PUSH_INT, v ); }
+								else
+								{ code_write_operator( e, OPERATOR_PUSH_WIDE_INT, add_int_constant( e, v ) ); }
+								break;
+							}
+							case TOKEN_REAL:	code_write_operator( e, OPERATOR_PUSH_DOUBLE, add_double_constant( e, atof( n->token_->content_ ) ) ); break;
+							case TOKEN_STRING:	code_write_operator( e, OPERATOR_PUSH_STRING, add_string_constant( e, n->token_->content_ ) ); break;
+							default: assert( false ); break;
+						}
+						++c->stack_;
+						break;
+					}
+					case NODE_IDENTIFIER_EXPR:
+					{
+						assert( n->token_->tag_ == TOKEN_IDENTIFIER );
+						const auto ident = n->token_->content_;
+
+						const auto top = c->stack_;
+						if ( ast_child( c->ast_, n, 0 ) != nullptr )
+						{
+							walk( e, ast_child( c->ast_, n, 0 ), c );
+						}
+						const auto arg_num = c->stack_ -top;
+
+						const auto reserved = find_reserved_word( ident );
+						const auto function = ( reserved != nullptr ? reserved->function_ : -1 );
+						if ( function >= 0 )
+						{
+							code_write_operator( e, OPERATOR_FUNCTION, code_call_operand( function, arg_num ) );
+						}
+						else
+						{
+							// システム変数
+							const auto sysvar = ( reserved != nullptr ? reserved->sysvar_ : -1 );
+							if ( sysvar >= 0 )
+							{
+								if ( arg_num > 0 )
+								{
+									raise_error( "システム変数に添え字はありません : %s", ident );
+								}
+
+								code_write_operator( e, OPERATOR_PUSH_SYSVAR, sysvar );
+							}
+							else
+							{
+								// 配列変数
+								if ( arg_num > 1 )
+								{
+									raise_error( "関数がみつかりません、配列変数の添え字は1次元までです@@ %s", ident );
+								}
 
-			case OPERATOR_PUSH_INT:
-				stack_push( s->stack_, create_value( codes[ pc +1 ] ) );
-				++pc;
-				break;
+								const auto var = search_variable_slot( e->variable_table_, ident );
+								assert( var >= 0 );
 
-			case OPERATOR_PUSH_DOUBLE:
-			{
-				double v =0.0;
-				const auto stride = code_get_block( v, codes, pc +1 );
-				stack_push( s->stack_, create_value( v ) );
-				pc += stride;
-				break;
-			}
+								code_write_operator( e, arg_num == 0 ? OPERATOR_LOAD_SCALAR : OPERATOR_PUSH_VARIABLE, var );
+							}
+						}
 
-			case OPERATOR_PUSH_STRING:
-			{
-				const char* v =nullptr;
-				const auto stride = code_get_block( v, codes, pc +1 );
-				stack_push( s->stack_, create_value( v ) );
-				pc += stride;
-				break;
-			}
+						c->stack_ = top +1;
+						break;
+					}
 
-			case OPERATOR_PUSH_VARIABLE:
-			{
-				variable_t* var =nullptr;
-				const auto stride = code_get_block( var, codes, pc +1 );
+					case NODE_END:
+						code_write( e, OPERATOR_END );
+						break;
 
-				assert( s->stack_->top_ >= 1 );
-				const auto i = stack_peek( s->stack_ );
-				const auto idx = value_calc_int( *i );
-				stack_pop( s->stack_, 1 );
-				stack_push( s->stack_, create_value( var, idx ) );
+					case NODE_RETURN:
+					{
+						if ( ast_child( c->ast_, n, 0 ) )
+						{
+							walk( e, ast_child( c->ast_, n, 0 ), c );
+							--c->stack_;
+						}
+						code_write_operator( e, OPERATOR_RETURN, ast_child( c->ast_, n, 0 )==nullptr ? 0 : 1 );
+						break;
+					}
 
-				pc += stride;
-				break;
-			}
+					case NODE_GOTO:
+					{
+						const auto label_node = ast_child( c->ast_, n, 0 );
+						assert( label_node != nullptr );
+						assert( label_node->tag_ == NODE_LABEL );
 
-			case OPERATOR_PUSH_SYSVAR:
-			{
-				const auto sysvar = codes[ pc +1 ];
-				switch( sysvar )
-				{
-					case SYSVAR_CNT:
-						if ( s->current_loop_frame_ <= 0 )
+						const auto label_name = label_node->token_->content_;
+						const auto label = search_label_index( e, label_name );
+						if ( label < 0 )
 						{
-							raise_error( "システム変数cnt：repeat-loop中でないのに参照しました" );
+							raise_error( "goto：ラベルがみつかりません@@ %s", label_name );
 						}
-						stack_push( s->stack_, create_value( s->loop_frame_[s->current_loop_frame_ -1].cnt_ ) );
-						break;
-					case SYSVAR_STAT:
-						stack_push( s->stack_, create_value( s->stat_ ) );
-						break;
-					case SYSVAR_REFDVAL:
-						stack_push( s->stack_, create_value( s->refdval_ ) );
-						break;
-					case SYSVAR_REFSTR:
-						stack_push( s->stack_, create_value( s->refstr_ ) );
-						break;
-					case SYSVAR_STRSIZE:
-						stack_push( s->stack_, create_value( s->strsize_ ) );
-						break;
-					case SYSVAR_LOOPLEV:
-						stack_push( s->stack_, create_value( s->current_loop_frame_ ) );
-						break;
-					default:
-						assert( false );
-						stack_push( s->stack_, create_value( 0 ) );
+
+						code_write_operator( e, OPERATOR_GOTO, label );
 						break;
-				}
-				++pc;
-				break;
-			}
+					}
+					case NODE_GOSUB:
+					{
+						const auto label_node = ast_child( c->ast_, n, 0 );
+						assert( label_node != nullptr );
+						assert( label_node->tag_ == NODE_LABEL );
 
-			case OPERATOR_ASSIGN:
-			case OPERATOR_ADD_ASSIGN:
-			case OPERATOR_SUB_ASSIGN:
-			case OPERATOR_MUL_ASSIGN:
-			case OPERATOR_DIV_ASSIGN:
-			case OPERATOR_MOD_ASSIGN:
-			case OPERATOR_BOR_ASSIGN:
-			case OPERATOR_BAND_ASSIGN:
-			case OPERATOR_BXOR_ASSIGN:
-			{
-				assert( s->stack_->top_ >= 2 );
+						const auto label_name = label_node->token_->content_;
+						const auto label = search_label_index( e, label_name );
+						if ( label < 0 )
+						{
+							raise_error( "gosub：ラベルがみつかりません@@ %s", label_name );
+						}
 
-				const auto var =stack_peek( s->stack_, -2 );
-				if ( var->type_ != VALUE_VARIABLE )
-				{
-					raise_error( "変数代入：代入先が変数ではありませんでした" );
-				}
+						code_write_operator( e, OPERATOR_GOSUB, label );
+						break;
+					}
 
-				const auto v =stack_peek( s->stack_, -1 );
-				value_isolate( *v );
-				auto* t = ( op == OPERATOR_ASSIGN ? nullptr : value_convert_type( value_get_primitive_tag( *var ), *v ) );
-				switch( op )
-				{
-				case OPERATOR_ASSIGN:		variable_set( var->variable_, *v, var->index_ ); break;
-				case OPERATOR_ADD_ASSIGN:	variable_add( var->variable_, *t, var->index_ ); break;
-				case OPERATOR_SUB_ASSIGN:	variable_sub( var->variable_, *t, var->index_ ); break;
-				case OPERATOR_MUL_ASSIGN:	variable_mul( var->variable_, *t, var->index_ ); break;
-				case OPERATOR_DIV_ASSIGN:	variable_div( var->variable_, *t, var->index_ ); break;
-				case OPERATOR_MOD_ASSIGN:	variable_mod( var->variable_, *t, var->index_ ); break;
-				case OPERATOR_BOR_ASSIGN:	variable_bor( var->variable_, *t, var->index_ ); break;
-				case OPERATOR_BAND_ASSIGN:	variable_band( var->variable_, *t, var->index_ ); break;
-				case OPERATOR_BXOR_ASSIGN:	variable_bxor( var->variable_, *t, var->index_ ); break;
-				default: assert( false ); break;
-				}
-				if ( t != nullptr )
-				{
-					destroy_value( t );
-					t = nullptr;
-				}
-				stack_pop( s->stack_, 2 );
-				break;
-			}
+					case NODE_REPEAT:
+					{
+						if ( ast_child( c->ast_, n, 0 ) )
+						{
+							walk( e, ast_child( c->ast_, n, 0 ), c );
+							--c->stack_;
+						}
+						else
+						{
+							code_write_operator( e, OPERATOR_PUSH_INT, -1 );
+						}
+						const auto pos_head = e->execute_code_->code_size_;
+						code_write_operator( e, OPERATOR_REPEAT, 0 );// dummy TAIL
 
-			case OPERATOR_BOR:
-			case OPERATOR_BAND:
-			case OPERATOR_BXOR:
-			case OPERATOR_EQ:
-			case OPERATOR_NEQ:
-			case OPERATOR_GT:
-			case OPERATOR_GTOE:
-			case OPERATOR_LT:
-			case OPERATOR_LTOE:
-			case OPERATOR_ADD:
-			case OPERATOR_SUB:
-			case OPERATOR_MUL:
-			case OPERATOR_DIV:
-			case OPERATOR_MOD:
-			{
-				assert( s->stack_->top_ >= 2 );
-				value_t* l =stack_peek( s->stack_, -2 );
-				value_t* r =stack_peek( s->stack_, -1 );
-				value_isolate( *l );
+						check_repeat_nest( c->repeat_depth_, n );
+						c->repeat_head_[c->repeat_depth_] = static_cast<int>( pos_head );
+						++c->repeat_depth_;
 
-				switch( op )
-				{
-					case OPERATOR_BOR:		value_bor( l, *r ); break;
-					case OPERATOR_BAND:		value_band( l, *r ); break;
-					case OPERATOR_BXOR:		value_bxor( l, *r ); break;
-					case OPERATOR_EQ:		value_eq( l, *r ); break;
-					case OPERATOR_NEQ:		value_neq( l, *r ); break;
-					case OPERATOR_GT:		value_gt( l, *r ); break;
-					case OPERATOR_GTOE:		value_gtoe( l, *r ); break;
-					case OPERATOR_LT:		value_lt( l, *r ); break;
-					case OPERATOR_LTOE:		value_ltoe( l, *r ); break;
-					case OPERATOR_ADD:		value_add( l, *r ); break;
-					case OPERATOR_SUB:		value_sub( l, *r ); break;
-					case OPERATOR_MUL:		value_mul( l, *r ); break;
-					case OPERATOR_DIV:		value_div( l, *r ); break;
-					case OPERATOR_MOD:		value_mod( l, *r ); break;
-					default: assert( false ); break;
-				}
-				stack_pop( s->stack_ );
-				break;
-			}
+						code_write( e, OPERATOR_REPEAT_CHECK );
+						break;
+					}
+					case NODE_LOOP:
+					{
+						if ( c->repeat_depth_ <= 0 )
+						{
+							raise_error( "repeat-loop: repeatがないのにloopを検出しました@@ %d行目", n->token_->appear_line_ );
+						}
 
-			case OPERATOR_UNARY_MINUS:
-			{
-				assert( s->stack_->top_ >= 1 );
-				value_t* v =stack_peek( s->stack_ );
-				value_isolate( *v );
-				value_unary_minus( v );
-				break;
-			}
+						const auto loop_head = e->execute_code_->code_size_;
+						code_write( e, OPERATOR_LOOP );
 
-			case OPERATOR_IF:
-			{
-				const auto cond = stack_peek( s->stack_ );
-				const auto is_cond = value_calc_boolean( *cond );
-				stack_pop( s->stack_ );
-				if ( is_cond )
-				{
-					++pc;
-				}
-				else
-				{
-					const auto false_head = codes[ pc +1 ];
-					pc += false_head -1;
-				}
-				break;
-			}
+						code_patch_operand( e->execute_code_, c->repeat_head_[c->repeat_depth_ -1], static_cast<int>( loop_head ) );
+						--c->repeat_depth_;
+						break;
+					}
+					case NODE_CONTINUE:		code_write( e, OPERATOR_CONTINUE ); break;
+					case NODE_BREAK:		code_write( e, OPERATOR_BREAK ); break;
 
-			case OPERATOR_REPEAT:
-			{
-				if ( s->current_loop_frame_ +1 >= MAX_LOOP_FRAME )
-				{
-					raise_error( "repeat：ネストが深すぎます" );
-				}
+					case NODE_IF:
+					{
+						assert( ast_child( c->ast_, n, 0 ) != nullptr );
+						const auto cond = unwrap_expression( c->ast_, ast_child( c->ast_, n, 0 ) );
+						int cmp_op =-1;
+						switch( cond->tag_ )
+						{
+							case NODE_EQ:		cmp_op = OPERATOR_EQ; break;
+							case NODE_NEQ:		cmp_op = OPERATOR_NEQ; break;
+							case NODE_GT:		cmp_op = OPERATOR_GT; break;
+							case NODE_GTOE:		cmp_op = OPERATOR_GTOE; break;
+							case NODE_LT:		cmp_op = OPERATOR_LT; break;
+							case NODE_LTOE:		cmp_op = OPERATOR_LTOE; break;
+							default: break;
+						}
+						if ( cmp_op >= 0 )
+						{
+							walk( e, ast_child( c->ast_, cond, 0 ), c );
+							walk( e, ast_child( c->ast_, cond, 1 ), c );
+							c->stack_ -= 2;
+						}
+						else
+						{
+							walk( e, ast_child( c->ast_, n, 0 ), c );
+						}
 
-				const auto end_position = codes[ pc +1 ];
+						assert( ast_child( c->ast_, n, 1 ) != nullptr );
+						const auto dispatcher = ast_child( c->ast_, n, 1 );
+						assert( dispatcher->tag_ == NODE_IF_DISPATCHER );
 
-				auto& frame = s->loop_frame_[s->current_loop_frame_];
-				++s->current_loop_frame_;
-				frame.start_position_ = pc +2;
-				frame.end_position_ = end_position;
-				frame.cnt_ = 0;
-				frame.counter_ = 0;
-				frame.max_ = 0;
+						// 比較してそのまま分岐するものは一つにまとめる、偽の時の相対位置は命令語のオペランドに置く
+						const auto pos_root = e->execute_code_->code_size_;
+						if ( cmp_op >= 0 )
+						{
+							code_write_operator( e, OPERATOR_CMP_JUMP_IF_FALSE, 0 );// dummy FALSE
+							code_write( e, cmp_op );
+						}
+						else
+						{
+							code_write_operator( e, OPERATOR_IF, 0 );// dummy FALSE
+						}
 
-				int loop_num =-1;
-				const auto v = stack_peek( s->stack_ );
-				loop_num = value_calc_int( *v );
-				stack_pop( s->stack_ );
+						walk( e, ast_child( c->ast_, dispatcher, 0 ), c );
+						const auto pos_true_tail = e->execute_code_->code_size_;
+						code_write_operator( e, OPERATOR_JUMP_RELATIVE, 0 );// dummy TAIL
 
-				frame.max_ = loop_num;
-				++pc;
-				break;
-			}
-			case OPERATOR_REPEAT_CHECK:
-			{
-				assert( s->current_loop_frame_ > 0 );
-				auto& frame = s->loop_frame_[ s->current_loop_frame_ -1 ];
-				if ( frame.max_>=0 && frame.counter_>=frame.max_ )
-				{
-					pc = frame.end_position_;
-					--s->current_loop_frame_;
-				}
-				break;
-			}
+						const auto pos_false_head = e->execute_code_->code_size_;
+						if ( ast_child( c->ast_, dispatcher, 1 ) )
+						{
+							walk( e, ast_child( c->ast_, dispatcher, 1 ), c );
+						}
 
-			case OPERATOR_LOOP:
-			case OPERATOR_CONTINUE:
-			{
-				if ( s->current_loop_frame_ <= 0 )
-				{
-					raise_error( "loop,continue：repeat-loopの中にありません" );
-				}
+						const auto pos_tail = e->execute_code_->code_size_;
+						code_patch_operand( e->execute_code_, static_cast<int>( pos_root ), static_cast<int>( pos_false_head - pos_root ) );
+						code_patch_operand( e->execute_code_, static_cast<int>( pos_true_tail ), static_cast<int>( pos_tail - pos_true_tail ) );
+						break;
+					}
+					case NODE_IF_DISPATCHER:
+						assert( false );
+						break;
 
-				auto& frame = s->loop_frame_[ s->current_loop_frame_ -1 ];
-				++frame.counter_;
-				++frame.cnt_;
-				pc = frame.start_position_ -1;
-				break;
-			}
-			case OPERATOR_BREAK:
-			{
-				if ( s->current_loop_frame_ <= 0 )
-				{
-					raise_error( "break：repeat-loopの中にありません" );
+					default: assert( false ); break;
 				}
+			}
+		};
 
-				auto& frame = s->loop_frame_[ s->current_loop_frame_ -1 ];
-				pc = frame.end_position_;
+		_::walk( e, node, &context );
+	}
 
-				--s->current_loop_frame_;
-				break;
-			}
+	if ( context.repeat_depth_ > 0 )
+	{
+		raise_error( "repeat-loop: 閉じられていないrepeat-loopが存在します" );
+	}
 
-			case OPERATOR_LABEL:
-				break;
+	link_code( e, code_head );
 
-			case OPERATOR_GOSUB:
-			{
-				if ( (s->current_call_frame_ +1) >= MAX_CALL_FRAME )
-				{
-					raise_error( "gosub：ネストが深すぎます" );
-				}
+	// 何もないならとりあえず書いておく
+	if ( e->execute_code_->code_size_ <= 0 )
+	{
+		code_write( e, OPERATOR_NOP );
+	}
+}
 
-				label_node_t* label =nullptr;
-				const auto stride = code_get_block( label, codes, pc +1 );
-				assert( label != nullptr );
+void optimize_code( execute_environment_t* e )
+{
+	auto* const code = e->execute_code_;
+	const auto code_size = static_cast<int>( code->code_size_ );
+	auto* const codes = code->code_;
+	if ( codes == nullptr || code_size <= 0 )
+	{ return; }
 
-				auto& frame = s->call_frame_[s->current_call_frame_];
-				++s->current_call_frame_;
-				frame.caller_poisition_ = pc +stride;
+	struct _
+	{
+		static bool is_removable( code_t code )
+		{
+			return code_operator( code ) == OPERATOR_NOP;
+		}
 
-				pc = label->position_ -1;
-				break;
-			}
-			case OPERATOR_GOTO:
+		// 分岐先を命令語のオペランドに持つ命令か
+		static bool is_jump( code_t code )
+		{
+			switch( code_operator( code ) )
 			{
-				label_node_t* label =nullptr;
-				code_get_block( label, codes, pc +1 );
-				assert( label != nullptr );
-				pc = label->position_ -1;
-				break;
+				case OPERATOR_IF:
+				case OPERATOR_JUMP_RELATIVE:
+				case OPERATOR_JUMP:
+				case OPERATOR_CMP_JUMP_IF_FALSE:
+				case OPERATOR_CMP_JUMP_IF_FALSE_INT_INT:
+				case OPERATOR_GOSUB:
+				case OPERATOR_GOTO:
+					return true;
+				default: break;
 			}
+			return false;
+		}
+		static bool is_relative_jump( code_t code )
+		{
+			const auto op = code_operator( code );
+			return op != OPERATOR_JUMP && op != OPERATOR_GOSUB && op != OPERATOR_GOTO;
+		}
+		static int jump_target( const code_t* codes, int pc )
+		{
+			assert( is_jump( codes[ pc ] ) );
+			const auto operand = code_operand( codes[ pc ] );
+			return ( is_relative_jump( codes[ pc ] ) ? pc +operand : operand );
+		}
+		static void set_jump_target( code_t* codes, int pc, int target )
+		{
+			assert( is_jump( codes[ pc ] ) );
+			codes[ pc ] = code_pack( code_operator( codes[ pc ] ), is_relative_jump( codes[ pc ] ) ? target -pc : target );
+		}
+		static bool is_unconditional_jump( code_t code )
+		{
+			const auto op = code_operator( code );
+			return op == OPERATOR_JUMP_RELATIVE || op == OPERATOR_JUMP || op == OPERATOR_GOTO;
+		}
+	};
 
-			case OPERATOR_COMMAND:
-			{
-				const auto command = codes[ pc +1 ];
-				assert( command >= 0 );
-				const auto arg_num = codes[ pc +2 ];
+	// 命令の先頭位置かどうか
+	auto* const is_head = reinterpret_cast<bool*>( xmalloc( sizeof(bool) *( code_size +1 ) ) );
+	auto* const is_removed = reinterpret_cast<bool*>( xmalloc( sizeof(bool) *( code_size +1 ) ) );
+	auto* const new_pos = reinterpret_cast<int*>( xmalloc( sizeof(int) *( code_size +1 ) ) );
+	memset( is_head, 0, sizeof(bool) *( code_size +1 ) );
+	memset( is_removed, 0, sizeof(bool) *( code_size +1 ) );
+	for( int pc=0; pc<code_size; pc+=code_operator_size( codes[ pc ] ) )
+	{
+		is_head[ pc ] = true;
+		is_removed[ pc ] = _::is_removable( codes[ pc ] );
+	}
+	is_head[ code_size ] = true;
 
-					// コマンド呼び出し
-				const auto delegate = get_command_delegate( static_cast<builtin_command_tag>( command ) );
-				assert( delegate != nullptr );
-				const auto top = s->stack_->top_;
-				delegate( e, s, arg_num );
-				assert( s->stack_->top_ == top -arg_num );// 戻り値がないことを確認
+	// 飛び先が無条件ジャンプならその先へ直接飛ぶ
+	for( int pc=0; pc<code_size; pc+=code_operator_size( codes[ pc ] ) )
+	{
+		if ( !_::is_jump( codes[ pc ] ) )
+		{ continue; }
 
-				pc += 2;
-				break;
-			}
-			case OPERATOR_FUNCTION:
+		auto target = _::jump_target( codes, pc );
+		for( int chain=0; chain<64; ++chain )
+		{
+			while( target < code_size && is_removed[ target ] )
 			{
-				const auto function = codes[ pc +1 ];
-				assert( function >= 0 );
-				const auto arg_num = codes[ pc +2 ];
-
-					// 関数呼び出し
-				const auto delegate = get_function_delegate( static_cast<builtin_function_tag>( function ) );
-				assert( delegate != nullptr );
-				const auto top = s->stack_->top_;
-				delegate( e, s, arg_num );
-				assert( s->stack_->top_ == top -arg_num +1 );// 戻り値が入っていることを確認する
-
-				 pc += 2;
-				break;
+				target += code_operator_size( codes[ target ] );
 			}
+			if ( target >= code_size || !_::is_unconditional_jump( codes[ target ] ) || target == pc )
+			{ break; }
+			target = _::jump_target( codes, target );
+		}
+		_::set_jump_target( codes, pc, target );
+	}
 
-			case OPERATOR_JUMP:
+	// 消える命令しか飛び越さない無条件ジャンプは消す、消すことで新たに該当するものがあるので変化がなくなるまで
+	for( bool is_changed =true; is_changed; )
+	{
+		is_changed = false;
+		for( int pc=0; pc<code_size; pc+=code_operator_size( codes[ pc ] ) )
+		{
+			if ( is_removed[ pc ] || !_::is_unconditional_jump( codes[ pc ] ) )
+			{ continue; }
+
+			const auto target = _::jump_target( codes, pc );
+			auto next = pc +code_operator_size( codes[ pc ] );
+			while( next < target && is_removed[ next ] )
 			{
-				pc = codes[ pc +1 ] -1;
-				break;
+				next += code_operator_size( codes[ next ] );
 			}
-			case OPERATOR_JUMP_RELATIVE:
+			if ( next == target )
 			{
-				pc += codes[ pc +1 ] -1;
-				break;
+				is_removed[ pc ] = true;
+				is_changed = true;
 			}
-			case OPERATOR_RETURN:
-			{
-				if ( s->current_call_frame_ <= 0 )
-				{
-					raise_error( "サブルーチン外からのreturnは無効です" );
-				}
+		}
+	}
 
-				const auto arg_num = codes[ pc +1 ];
-				if ( arg_num > 0 )
-				{
-					assert( arg_num == 1 );
-					const auto res = stack_peek( s->stack_ );
-					switch( value_get_primitive_tag(*res) )
-					{
-						case VALUE_INT:		s->stat_ = value_calc_int(*res); break;
-						case VALUE_DOUBLE:	s->refdval_ = value_calc_double(*res); break;
-						case VALUE_STRING:	destroy_string( s->refstr_ ); s->refstr_ = value_calc_string(*res); break;
-						default: assert( false ); break;
-					}
-					stack_pop( s->stack_ );
-				}
+	// 新しい位置、消えた命令は次に残る命令の位置になる
+	{
+		int removed_size =0;
+		for( int pc=0; pc<code_size; pc+=code_operator_size( codes[ pc ] ) )
+		{
+			new_pos[ pc ] = pc -removed_size;
+			if ( is_removed[ pc ] )
+			{ removed_size += code_operator_size( codes[ pc ] ); }
+		}
+		new_pos[ code_size ] = code_size -removed_size;
+	}
 
-				--s->current_call_frame_;
-				const auto& frame =s->call_frame_[ s->current_call_frame_ ];
-				pc = frame.caller_poisition_;
-				break;
-			}
+	// 詰めながらオペランドを付け替える
+	int write =0;
+	for( int pc=0; pc<code_size; )
+	{
+		const auto op = code_operator( codes[ pc ] );
+		const auto size = code_operator_size( codes[ pc ] );
+		if ( is_removed[ pc ] )
+		{
+			pc += size;
+			continue;
+		}
 
-			case OPERATOR_END:
-				s->is_end_ =true;
-				break;
+		int target =-1;
+		if ( _::is_jump( codes[ pc ] ) )
+		{
+			target = _::jump_target( codes, pc );
+		}
+		else if ( op == OPERATOR_REPEAT )
+		{
+			target = code_operand( codes[ pc ] );
+		}
+		assert( target < 0 || is_head[ target ] );
 
-			default: assert( false ); break;
+		memmove( codes +write, codes +pc, sizeof(code_t) *size );
+		if ( op == OPERATOR_REPEAT )
+		{
+			codes[ write ] = code_pack( op, new_pos[ target ] );
+		}
+		else if ( target >= 0 )
+		{
+			_::set_jump_target( codes, write, new_pos[ target ] );
 		}
 
-		++pc;
+		write += size;
+		pc += size;
 	}
-}
-
-void execute( execute_environment_t* e, int initial_pc )
-{
-	execute_status_t s;
-	initialize_execute_status( &s );
-	s.pc_ = initial_pc;
+	assert( write == new_pos[ code_size ] );
+	code->code_size_ = write;
 
-	if ( e->execute_code_->code_ == nullptr )
+	// ラベル
+	for( int i=0; i<e->label_table_->entry_num_; ++i )
 	{
-		raise_error( "実行できるノードがありません@@ [%p]", e );
+		const auto label = reinterpret_cast<label_node_t*>( e->label_table_->entries_[i].value_ );
+		if ( label == nullptr )
+		{ continue; }
+		if ( label->position_ >= 0 && label->position_ <= code_size && is_head[ label->position_ ] )
+		{
+			label->position_ = new_pos[ label->position_ ];
+		}
 	}
 
-	execute_inner( e, &s );
-
-	uninitialize_execute_status( &s );
+	xfree( new_pos );
+	xfree( is_removed );
+	xfree( is_head );
 }
 
-void generate_and_append_code( execute_environment_t* e, list_t* ast )
+void generate_and_append_register_code( execute_environment_t* e, const ast_t* ast )
 {
 	struct generate_context_t
 	{
-		int			stack_;
+		const ast_t*		ast_;
 
-		int			repeat_head_[32];
+		code_container_t*	code_;
+
+		int			register_;// 次に空いている一時レジスタ
+		int			register_max_;
+
+		int			repeat_head_[MAX_REPEAT_NEST];
 		int			repeat_depth_;
 	};
 
 	generate_context_t context;
-	context.stack_ = 0;
+	context.ast_ = ast;
+	context.code_ = e->register_code_;
+	context.register_ = 0;
+	context.register_max_ = 0;
 	context.repeat_depth_ = 0;
+	const auto code_head = static_cast<int>( e->register_code_->code_size_ );
 
-	list_node_t* st =ast->head_;
-	while( st != nullptr )
+	const auto root = ( ast->root_ >= 0 ? &ast->nodes_[ ast->root_ ] : nullptr );
+	for( int i=0; root != nullptr && i<root->child_num_; ++i )
 	{
-		ast_node_t* node = reinterpret_cast<ast_node_t*>( st->value_ );
+		const auto node = ast_child( ast, root, i );
 
 		struct _
 		{
+			// 式の結果は呼び出し時点の c->register_ に入り、c->register_ はその一つ先を指す
+			static int allocate( generate_context_t* c )
+			{
+				const auto r = c->register_++;
+				if ( c->register_max_ < c->register_ )
+				{
+					c->register_max_ = c->register_;
+				}
+				return r;
+			}
+
 			static void walk( execute_environment_t* e, const ast_node_t* n, generate_context_t* c )
 			{
+				const auto code = c->code_;
 				switch( n->tag_ )
 				{
 					case NODE_EMPTY:
@@ -5595,17 +10606,17 @@ void generate_and_append_code( execute_environment_t* e, list_t* ast )
 						const auto label_name = n->token_->content_;
 						const auto label = search_label( e, label_name );
 						assert( label != nullptr );
-						label->position_ = static_cast<int>( e->execute_code_->code_size_ );
-
-						code_write( e, OPERATOR_LABEL );
+						// 位置を覚えるだけで命令は置かない、飛び先はリンクで解決する
+						label->register_position_ = static_cast<int>( code->code_size_ );
 						break;
 					}
 
 					case NODE_BLOCK_STATEMENTS:
-						if ( n->left_ )
-						{ walk( e, n->left_, c ); }
-						if ( n->right_ )
-						{ walk( e, n->right_, c ); }
+					case NODE_ARGUMENTS:
+						for( int i=0; i<n->child_num_; ++i )
+						{
+							walk( e, ast_child( c->ast_, n, i ), c );
+						}
 						break;
 
 					case NODE_COMMAND:
@@ -5619,26 +10630,19 @@ void generate_and_append_code( execute_environment_t* e, list_t* ast )
 							raise_error( "コマンドが見つかりません：%s", command_name );
 						}
 
-						const auto top = c->stack_;
-						if ( n->left_ != nullptr )
+						const auto top = c->register_;
+						if ( ast_child( c->ast_, n, 0 ) != nullptr )
 						{
-							walk( e, n->left_, c );
+							walk( e, ast_child( c->ast_, n, 0 ), c );
 						}
-						const auto arg_num = c->stack_ -top;
+						const auto arg_num = c->register_ -top;
 
-						code_write( e, OPERATOR_COMMAND );
-						code_write( e, command );
-						code_write( e, arg_num );
+						code_write( code, REGISTER_OPERATOR_COMMAND );
+						code_write( code, command );
+						code_write( code, top );
+						code_write( code, arg_num );
 
-						c->stack_ = top;
-						break;
-					}
-					case NODE_ARGUMENTS:
-					{
-						if ( n->left_ != nullptr )
-						{ walk( e, n->left_, c ); }
-						if ( n->right_ != nullptr )
-						{ walk( e, n->right_, c ); }
+						c->register_ = top;
 						break;
 					}
 
@@ -5652,50 +10656,67 @@ void generate_and_append_code( execute_environment_t* e, list_t* ast )
 					case NODE_BAND_ASSIGN:
 					case NODE_BXOR_ASSIGN:
 					{
-						walk( e, n->left_, c );
-						walk( e, n->right_, c );
+						// 代入先は変数を直接オペランドに取る
+						const auto var_node = ast_child( c->ast_, n, 0 );
+						assert( var_node != nullptr && var_node->tag_ == NODE_VARIABLE );
+						const auto var = search_variable_slot( e->variable_table_, var_node->token_->content_ );
+						assert( var >= 0 );
+
+						const auto top = c->register_;
+						int idx_reg =-1;
+						if ( ast_child( c->ast_, var_node, 0 ) )
+						{
+							idx_reg = c->register_;
+							walk( e, ast_child( c->ast_, var_node, 0 ), c );
+						}
+						const auto src_reg = c->register_;
+						walk( e, ast_child( c->ast_, n, 1 ), c );
+
 						switch( n->tag_ )
 						{
-						case NODE_ASSIGN:		code_write( e, OPERATOR_ASSIGN ); break;
-						case NODE_ADD_ASSIGN:	code_write( e, OPERATOR_ADD_ASSIGN ); break;
-						case NODE_SUB_ASSIGN:	code_write( e, OPERATOR_SUB_ASSIGN ); break;
-						case NODE_MUL_ASSIGN:	code_write( e, OPERATOR_MUL_ASSIGN ); break;
-						case NODE_DIV_ASSIGN:	code_write( e, OPERATOR_DIV_ASSIGN ); break;
-						case NODE_MOD_ASSIGN:	code_write( e, OPERATOR_MOD_ASSIGN ); break;
-						case NODE_BOR_ASSIGN:	code_write( e, OPERATOR_BOR_ASSIGN ); break;
-						case NODE_BAND_ASSIGN:	code_write( e, OPERATOR_BAND_ASSIGN ); break;
-						case NODE_BXOR_ASSIGN:	code_write( e, OPERATOR_BXOR_ASSIGN ); break;
+						case NODE_ASSIGN:		code_write( code, REGISTER_OPERATOR_ASSIGN ); break;
+						case NODE_ADD_ASSIGN:	code_write( code, REGISTER_OPERATOR_ADD_ASSIGN ); break;
+						case NODE_SUB_ASSIGN:	code_write( code, REGISTER_OPERATOR_SUB_ASSIGN ); break;
+						case NODE_MUL_ASSIGN:	code_write( code, REGISTER_OPERATOR_MUL_ASSIGN ); break;
+						case NODE_DIV_ASSIGN:	code_write( code, REGISTER_OPERATOR_DIV_ASSIGN ); break;
+						case NODE_MOD_ASSIGN:	code_write( code, REGISTER_OPERATOR_MOD_ASSIGN ); break;
+						case NODE_BOR_ASSIGN:	code_write( code, REGISTER_OPERATOR_BOR_ASSIGN ); break;
+						case NODE_BAND_ASSIGN:	code_write( code, REGISTER_OPERATOR_BAND_ASSIGN ); break;
+						case NODE_BXOR_ASSIGN:	code_write( code, REGISTER_OPERATOR_BXOR_ASSIGN ); break;
 						default: assert( false ); break;
 						}
-						c->stack_ -= 2; 
+						code_write( code, var );
+						code_write( code, idx_reg );
+						code_write( code, src_reg );
+
+						c->register_ = top;
 						break;
 					}
 					case NODE_VARIABLE:
 					{
-						auto idx_node = n->left_;
-						if ( idx_node )
-						{
-							walk( e, idx_node, c );
-						}
-						else
+						const auto top = c->register_;
+						int idx_reg =-1;
+						if ( ast_child( c->ast_, n, 0 ) )
 						{
-							code_write( e, OPERATOR_PUSH_INT );
-							code_write( e, 0 );
+							idx_reg = c->register_;
+							walk( e, ast_child( c->ast_, n, 0 ), c );
 						}
 
 						const auto var_name = n->token_->content_;
-						const auto var = search_variable( e->variable_table_, var_name );
-						assert( var != nullptr );
-
-						code_write( e, OPERATOR_PUSH_VARIABLE );
-						code_write( e, var );
-						++c->stack_;
+						const auto var = search_variable_slot( e->variable_table_, var_name );
+						assert( var >= 0 );
+
+						c->register_ = top;
+						code_write( code, REGISTER_OPERATOR_LOAD_VARIABLE );
+						code_write( code, allocate( c ) );
+						code_write( code, var );
+						code_write( code, idx_reg );
 						break;
 					}
 
 					case NODE_EXPRESSION:
-						assert( n->left_ != nullptr );
-						walk( e, n->left_, c );
+						assert( ast_child( c->ast_, n, 0 ) != nullptr );
+						walk( e, ast_child( c->ast_, n, 0 ), c );
 						break;
 
 					case NODE_BOR:
@@ -5713,39 +10734,46 @@ void generate_and_append_code( execute_environment_t* e, list_t* ast )
 					case NODE_DIV:
 					case NODE_MOD:
 					{
-						assert( n->left_ != nullptr );
-						walk( e, n->left_, c );
-						assert( n->right_ != nullptr );
-						walk( e, n->right_, c );
+						const auto top = c->register_;
+						assert( ast_child( c->ast_, n, 0 ) != nullptr );
+						walk( e, ast_child( c->ast_, n, 0 ), c );
+						assert( ast_child( c->ast_, n, 1 ) != nullptr );
+						walk( e, ast_child( c->ast_, n, 1 ), c );
 
 						switch( n->tag_ )
 						{
-							case NODE_BOR:		code_write( e, OPERATOR_BOR ); break;
-							case NODE_BAND:		code_write( e, OPERATOR_BAND ); break;
-							case NODE_BXOR:		code_write( e, OPERATOR_BXOR ); break;
-							case NODE_EQ:		code_write( e, OPERATOR_EQ ); break;
-							case NODE_NEQ:		code_write( e, OPERATOR_NEQ ); break;
-							case NODE_GT:		code_write( e, OPERATOR_GT ); break;
-							case NODE_GTOE:		code_write( e, OPERATOR_GTOE ); break;
-							case NODE_LT:		code_write( e, OPERATOR_LT ); break;
-							case NODE_LTOE:		code_write( e, OPERATOR_LTOE ); break;
-							case NODE_ADD:		code_write( e, OPERATOR_ADD ); break;
-							case NODE_SUB:		code_write( e, OPERATOR_SUB ); break;
-							case NODE_MUL:		code_write( e, OPERATOR_MUL ); break;
-							case NODE_DIV:		code_write( e, OPERATOR_DIV ); break;
-							case NODE_MOD:		code_write( e, OPERATOR_MOD ); break;
+							case NODE_BOR:		code_write( code, REGISTER_OPERATOR_BOR ); break;
+							case NODE_BAND:		code_write( code, REGISTER_OPERATOR_BAND ); break;
+							case NODE_BXOR:		code_write( code, REGISTER_OPERATOR_BXOR ); break;
+							case NODE_EQ:		code_write( code, REGISTER_OPERATOR_EQ ); break;
+							case NODE_NEQ:		code_write( code, REGISTER_OPERATOR_NEQ ); break;
+							case NODE_GT:		code_write( code, REGISTER_OPERATOR_GT ); break;
+							case NODE_GTOE:		code_write( code, REGISTER_OPERATOR_GTOE ); break;
+							case NODE_LT:		code_write( code, REGISTER_OPERATOR_LT ); break;
+							case NODE_LTOE:		code_write( code, REGISTER_OPERATOR_LTOE ); break;
+							case NODE_ADD:		code_write( code, REGISTER_OPERATOR_ADD ); break;
+							case NODE_SUB:		code_write( code, REGISTER_OPERATOR_SUB ); break;
+							case NODE_MUL:		code_write( code, REGISTER_OPERATOR_MUL ); break;
+							case NODE_DIV:		code_write( code, REGISTER_OPERATOR_DIV ); break;
+							case NODE_MOD:		code_write( code, REGISTER_OPERATOR_MOD ); break;
 							default: assert( false ); break;
 						}
+						code_write( code, top );
+						code_write( code, top );
+						code_write( code, top +1 );
 
-						--c->stack_;
+						c->register_ = top +1;
 						break;
 					}
 
 					case NODE_UNARY_MINUS:
 					{
-						assert( n->left_ != nullptr );
-						walk( e, n->left_, c );
-						code_write( e, OPERATOR_UNARY_MINUS );
+						const auto top = c->register_;
+						assert( ast_child( c->ast_, n, 0 ) != nullptr );
+						walk( e, ast_child( c->ast_, n, 0 ), c );
+						code_write( code, REGISTER_OPERATOR_UNARY_MINUS );
+						code_write( code, top );
+						code_write( code, top );
 						break;
 					}
 
@@ -5753,12 +10781,11 @@ void generate_and_append_code( execute_environment_t* e, list_t* ast )
 					{
 						switch( n->token_->tag_ )
 						{
-							case TOKEN_INTEGER:	code_write( e, OPERATOR_PUSH_INT ); code_write( e, atoi( n->token_->content_ ) ); break;
-							case TOKEN_REAL:	code_write( e, OPERATOR_PUSH_DOUBLE ); code_write_block( e, atof( n->token_->content_ ) ); break;
-							case TOKEN_STRING:	code_write( e, OPERATOR_PUSH_STRING ); code_write( e, n->token_->content_ ); break;
+							case TOKEN_INTEGER:	code_write( code, REGISTER_OPERATOR_LOAD_INT ); code_write( code, allocate( c ) ); code_write( code, atoi( n->token_->content_ ) ); break;
+							case TOKEN_REAL:	code_write( code, REGISTER_OPERATOR_LOAD_DOUBLE ); code_write( code, allocate( c ) ); code_write( code, add_double_constant( e, atof( n->token_->content_ ) ) ); break;
+							case TOKEN_STRING:	code_write( code, REGISTER_OPERATOR_LOAD_STRING ); code_write( code, allocate( c ) ); code_write( code, add_string_constant( e, n->token_->content_ ) ); break;
 							default: assert( false ); break;
 						}
-						++c->stack_;
 						break;
 					}
 					case NODE_IDENTIFIER_EXPR:
@@ -5766,24 +10793,28 @@ void generate_and_append_code( execute_environment_t* e, list_t* ast )
 						assert( n->token_->tag_ == TOKEN_IDENTIFIER );
 						const auto ident = n->token_->content_;
 
-						const auto top = c->stack_;
-						if ( n->left_ != nullptr )
+						const auto top = c->register_;
+						if ( ast_child( c->ast_, n, 0 ) != nullptr )
 						{
-							walk( e, n->left_, c );
+							walk( e, ast_child( c->ast_, n, 0 ), c );
 						}
-						const auto arg_num = c->stack_ -top;
+						const auto arg_num = c->register_ -top;
+						c->register_ = top;
 
-						const auto function = query_function( ident );
+						const auto reserved = find_reserved_word( ident );
+						const auto function = ( reserved != nullptr ? reserved->function_ : -1 );
 						if ( function >= 0 )
 						{
-							code_write( e, OPERATOR_FUNCTION );
-							code_write( e, function );
-							code_write( e, arg_num );
+							code_write( code, REGISTER_OPERATOR_FUNCTION );
+							code_write( code, allocate( c ) );
+							code_write( code, function );
+							code_write( code, top );
+							code_write( code, arg_num );
 						}
 						else
 						{
 							// システム変数
-							const auto sysvar = query_sysvar( ident );
+							const auto sysvar = ( reserved != nullptr ? reserved->sysvar_ : -1 );
 							if ( sysvar >= 0 )
 							{
 								if ( arg_num > 0 )
@@ -5791,8 +10822,9 @@ void generate_and_append_code( execute_environment_t* e, list_t* ast )
 									raise_error( "システム変数に添え字はありません : %s", ident );
 								}
 
-								code_write( e, OPERATOR_PUSH_SYSVAR );
-								code_write( e, sysvar );
+								code_write( code, REGISTER_OPERATOR_LOAD_SYSVAR );
+								code_write( code, allocate( c ) );
+								code_write( code, sysvar );
 							}
 							else
 							{
@@ -5802,99 +10834,88 @@ void generate_and_append_code( execute_environment_t* e, list_t* ast )
 									raise_error( "関数がみつかりません、配列変数の添え字は1次元までです@@ %s", ident );
 								}
 
-								const auto var = search_variable( e->variable_table_, ident );
-								assert( var != nullptr );
+								const auto var = search_variable_slot( e->variable_table_, ident );
+								assert( var >= 0 );
 
-								if ( arg_num == 0 )
-								{
-									code_write( e, OPERATOR_PUSH_INT );
-									code_write( e, 0 );
-								}
-
-								code_write( e, OPERATOR_PUSH_VARIABLE );
-								code_write( e, var );
+								code_write( code, REGISTER_OPERATOR_LOAD_VARIABLE );
+								code_write( code, allocate( c ) );
+								code_write( code, var );
+								code_write( code, arg_num == 0 ? -1 : top );
 							}
 						}
-
-						c->stack_ = top +1;
 						break;
 					}
 
 					case NODE_END:
-						code_write( e, OPERATOR_END );
+						code_write( code, REGISTER_OPERATOR_END );
 						break;
 
 					case NODE_RETURN:
 					{
-						if ( n->left_ )
+						const auto top = c->register_;
+						if ( ast_child( c->ast_, n, 0 ) )
 						{
-							walk( e, n->left_, c );
-							--c->stack_;
+							walk( e, ast_child( c->ast_, n, 0 ), c );
 						}
-						code_write( e, OPERATOR_RETURN );
-						code_write( e, n->left_==nullptr ? 0 : 1 );
+						code_write( code, REGISTER_OPERATOR_RETURN );
+						code_write( code, ast_child( c->ast_, n, 0 )==nullptr ? -1 : top );
+						c->register_ = top;
 						break;
 					}
 
 					case NODE_GOTO:
 					{
-						const auto label_node = n->left_;
+						const auto label_node = ast_child( c->ast_, n, 0 );
 						assert( label_node != nullptr );
 						assert( label_node->tag_ == NODE_LABEL );
 
 						const auto label_name = label_node->token_->content_;
-						const auto label = search_label( e, label_name );
-						if ( label == nullptr )
+						const auto label = search_label_index( e, label_name );
+						if ( label < 0 )
 						{
 							raise_error( "goto：ラベルがみつかりません@@ %s", label_name );
 						}
 
-						code_write( e, OPERATOR_GOTO );
-						code_write( e, label );
+						code_write( code, REGISTER_OPERATOR_GOTO );
+						code_write( code, label );
 						break;
 					}
 					case NODE_GOSUB:
 					{
-						const auto label_node = n->left_;
+						const auto label_node = ast_child( c->ast_, n, 0 );
 						assert( label_node != nullptr );
 						assert( label_node->tag_ == NODE_LABEL );
 
 						const auto label_name = label_node->token_->content_;
-						const auto label = search_label( e, label_name );
-						if ( label == nullptr )
+						const auto label = search_label_index( e, label_name );
+						if ( label < 0 )
 						{
 							raise_error( "gosub：ラベルがみつかりません@@ %s", label_name );
 						}
 
-						code_write( e, OPERATOR_GOSUB );
-						code_write( e, label );
+						code_write( code, REGISTER_OPERATOR_GOSUB );
+						code_write( code, label );
 						break;
 					}
 
 					case NODE_REPEAT:
 					{
-						if ( n->left_ )
-						{
-							walk( e, n->left_, c );
-							--c->stack_;
-						}
-						else
+						const auto top = c->register_;
+						if ( ast_child( c->ast_, n, 0 ) )
 						{
-							code_write( e, OPERATOR_PUSH_INT );
-							code_write( e, -1 );
+							walk( e, ast_child( c->ast_, n, 0 ), c );
 						}
-						const auto pos_head = e->execute_code_->code_size_;
-						code_write( e, OPERATOR_REPEAT );
-						code_write( e, 0 );// dummy TAIL
+						const auto pos_head = code->code_size_;
+						code_write( code, REGISTER_OPERATOR_REPEAT );
+						code_write( code, ast_child( c->ast_, n, 0 )==nullptr ? -1 : top );
+						code_write( code, 0 );// dummy TAIL
+						c->register_ = top;
 
-						if ( c->repeat_depth_ >= sizeof(c->repeat_head_) /sizeof(*c->repeat_head_) )
-						{
-							raise_error( "repeat-loop: ソースコード上でネストが深すぎます@@ %d行目", n->token_->appear_line_ );
-						}
+						check_repeat_nest( c->repeat_depth_, n );
 						c->repeat_head_[c->repeat_depth_] = static_cast<int>( pos_head );
 						++c->repeat_depth_;
 
-						code_write( e, OPERATOR_REPEAT_CHECK );
+						code_write( code, REGISTER_OPERATOR_REPEAT_CHECK );
 						break;
 					}
 					case NODE_LOOP:
@@ -5904,44 +10925,47 @@ void generate_and_append_code( execute_environment_t* e, list_t* ast )
 							raise_error( "repeat-loop: repeatがないのにloopを検出しました@@ %d行目", n->token_->appear_line_ );
 						}
 
-						const auto loop_head = e->execute_code_->code_size_;
-						code_write( e, OPERATOR_LOOP );
+						const auto loop_head = code->code_size_;
+						code_write( code, REGISTER_OPERATOR_LOOP );
 
-						const auto write_offset = c->repeat_head_[c->repeat_depth_ -1] +1;
-						e->execute_code_->code_[ write_offset ] = static_cast<int>( loop_head );
+						const auto write_offset = c->repeat_head_[c->repeat_depth_ -1] +2;
+						code->code_[ write_offset ] = static_cast<int>( loop_head );
 						--c->repeat_depth_;
 						break;
 					}
-					case NODE_CONTINUE:		code_write( e, OPERATOR_CONTINUE ); break;
-					case NODE_BREAK:		code_write( e, OPERATOR_BREAK ); break;
+					case NODE_CONTINUE:		code_write( code, REGISTER_OPERATOR_CONTINUE ); break;
+					case NODE_BREAK:		code_write( code, REGISTER_OPERATOR_BREAK ); break;
 
 					case NODE_IF:
 					{
-						assert( n->left_ != nullptr );
-						walk( e, n->left_, c );
+						const auto top = c->register_;
+						assert( ast_child( c->ast_, n, 0 ) != nullptr );
+						walk( e, ast_child( c->ast_, n, 0 ), c );
+						c->register_ = top;
 
-						assert( n->right_ != nullptr );
-						const auto dispatcher = n->right_;
+						assert( ast_child( c->ast_, n, 1 ) != nullptr );
+						const auto dispatcher = ast_child( c->ast_, n, 1 );
 						assert( dispatcher->tag_ == NODE_IF_DISPATCHER );
 
-						const auto pos_root = e->execute_code_->code_size_;
-						code_write( e, OPERATOR_IF );
-						code_write( e, 0 );// dummy FALSE
+						const auto pos_root = code->code_size_;
+						code_write( code, REGISTER_OPERATOR_IF );
+						code_write( code, top );
+						code_write( code, 0 );// dummy FALSE
 
-						walk( e, dispatcher->left_, c );
-						const auto pos_true_tail = e->execute_code_->code_size_;
-						code_write( e, OPERATOR_JUMP_RELATIVE );
-						code_write( e, 0 );// dummy TAIL
+						walk( e, ast_child( c->ast_, dispatcher, 0 ), c );
+						const auto pos_true_tail = code->code_size_;
+						code_write( code, REGISTER_OPERATOR_JUMP_RELATIVE );
+						code_write( code, 0 );// dummy TAIL
 
-						const auto pos_false_head = e->execute_code_->code_size_;
-						if ( dispatcher->right_ )
+						const auto pos_false_head = code->code_size_;
+						if ( ast_child( c->ast_, dispatcher, 1 ) )
 						{
-							walk( e, dispatcher->right_, c );
+							walk( e, ast_child( c->ast_, dispatcher, 1 ), c );
 						}
 
-						const auto pos_tail = e->execute_code_->code_size_;
-						e->execute_code_->code_[ pos_root +1 ] = static_cast<int>( pos_false_head - pos_root );
-						e->execute_code_->code_[ pos_true_tail +1 ] = static_cast<int>( pos_tail - pos_true_tail );
+						const auto pos_tail = code->code_size_;
+						code->code_[ pos_root +2 ] = static_cast<int>( pos_false_head - pos_root );
+						code->code_[ pos_true_tail +1 ] = static_cast<int>( pos_tail - pos_true_tail );
 						break;
 					}
 					case NODE_IF_DISPATCHER:
@@ -5954,7 +10978,7 @@ void generate_and_append_code( execute_environment_t* e, list_t* ast )
 		};
 
 		_::walk( e, node, &context );
-		st = st->next_;
+		assert( context.register_ == 0 );
 	}
 
 	if ( context.repeat_depth_ > 0 )
@@ -5962,19 +10986,26 @@ void generate_and_append_code( execute_environment_t* e, list_t* ast )
 		raise_error( "repeat-loop: 閉じられていないrepeat-loopが存在します" );
 	}
 
+	link_register_code( e, code_head );
+
 	// 何もないならとりあえず書いておく
-	if ( e->execute_code_->code_size_ <= 0 )
+	if ( e->register_code_->code_size_ <= 0 )
 	{
-		code_write( e, OPERATOR_NOP );
+		code_write( e->register_code_, REGISTER_OPERATOR_NOP );
+	}
+
+	if ( e->register_frame_size_ < context.register_max_ )
+	{
+		e->register_frame_size_ = context.register_max_;
 	}
 }
 
-value_t* evaluate_ast_immediate( ast_node_t* ast )
+value_t* evaluate_ast_immediate( const ast_t* ast, const ast_node_t* n )
 {
 	value_stack_t stack{};
 	initialize_value_stack( &stack );
 
-	const bool is_succeeded = evaluate_ast_node( ast, &stack );
+	const bool is_succeeded = evaluate_ast_node( ast, n, &stack );
 
 	// 戻り値
 	value_t* res = nullptr;
@@ -5987,15 +11018,15 @@ value_t* evaluate_ast_immediate( ast_node_t* ast )
 	return res;
 }
 
-bool evaluate_ast_node( ast_node_t* n, value_stack_t* stack )
+bool evaluate_ast_node( const ast_t* ast, const ast_node_t* n, value_stack_t* stack )
 {
 	switch( n->tag_ )
 	{
 		case NODE_EMPTY: break;
 
 		case NODE_EXPRESSION:
-			assert( n->left_ != nullptr );
-			return evaluate_ast_node( n->left_, stack );
+			assert( ast_child( ast, n, 0 ) != nullptr );
+			return evaluate_ast_node( ast, ast_child( ast, n, 0 ), stack );
 
 		case NODE_BOR:
 		case NODE_BAND:
@@ -6012,13 +11043,13 @@ bool evaluate_ast_node( ast_node_t* n, value_stack_t* stack )
 		case NODE_DIV:
 		case NODE_MOD:
 		{
-			assert( n->left_ != nullptr );
-			if ( !evaluate_ast_node( n->left_, stack ) )
+			assert( ast_child( ast, n, 0 ) != nullptr );
+			if ( !evaluate_ast_node( ast, ast_child( ast, n, 0 ), stack ) )
 			{
 				return false;
 			}
-			assert( n->right_ != nullptr );
-			if ( !evaluate_ast_node( n->right_, stack ) )
+			assert( ast_child( ast, n, 1 ) != nullptr );
+			if ( !evaluate_ast_node( ast, ast_child( ast, n, 1 ), stack ) )
 			{
 				return false;
 			}
@@ -6058,8 +11089,8 @@ bool evaluate_ast_node( ast_node_t* n, value_stack_t* stack )
 
 		case NODE_UNARY_MINUS:
 		{
-			assert( n->left_ != nullptr );
-			if ( !evaluate_ast_node( n->left_, stack ) )
+			assert( ast_child( ast, n, 0 ) != nullptr );
+			if ( !evaluate_ast_node( ast, ast_child( ast, n, 0 ), stack ) )
 			{
 				return false;
 			}
@@ -6078,54 +11109,98 @@ bool evaluate_ast_node( ast_node_t* n, value_stack_t* stack )
 		{
 			switch( n->token_->tag_ )
 			{
-				case TOKEN_INTEGER:	stack_push( stack, create_value( atoi( n->token_->content_ ) ) ); break;
-				case TOKEN_REAL:	stack_push( stack, create_value( atof( n->token_->content_ ) ) ); break;
-				case TOKEN_STRING:	stack_push( stack, create_value( n->token_->content_ ) ); break;
+				case TOKEN_INTEGER:	stack_push( stack, atoi( n->token_->content_ ) ); break;
+				case TOKEN_REAL:	stack_push( stack, atof( n->token_->content_ ) ); break;
+				case TOKEN_STRING:	stack_push( stack, n->token_->content_ ); break;
 				default: assert( false ); break;
 			}
 			break;
 		}
+
+		case NODE_IDENTIFIER_EXPR:
+		{
+			// 副作用のない組み込み関数のみ
+			const auto function = query_function( n->token_->content_ );
+			const auto arg_num = count_ast_arguments( ast_child( ast, n, 0 ) );
+			if ( function < 0 || arg_num != query_pure_function_arg_num( function ) )
+			{
+				print_error( "式評価：評価できない識別子です（%s）@@ %d行目\n", n->token_->content_, n->token_->appear_line_ + 1 );
+				return false;
+			}
+
+			const auto top = stack->top_;
+			const auto args = ast_child( ast, n, 0 );
+			for( int i=0; i<arg_num; ++i )
+			{
+				if ( !evaluate_ast_node( ast, ast_child( ast, args, i ), stack ) )
+				{
+					return false;
+				}
+			}
+			if ( stack->top_ != top +arg_num )
+			{
+				print_error( "式評価：関数の引数が正しく評価できませんでした（%s）@@ %d行目\n", n->token_->content_, n->token_->appear_line_ + 1 );
+				return false;
+			}
+
+			// 関数実体は値スタックしか触らない
+			execute_status_t status{};
+			status.stack_ = stack;
+			get_function_delegate( static_cast<builtin_function_tag>( function ) )( nullptr, &status, arg_num );
+			break;
+		}
+
 		default:
 			print_error( "式評価：サポートされてないノードの呼び出し（%s）@@ %d行目\n", n->token_->content_, n->token_->appear_line_ + 1 );
 			return false;
 	}
-	return true;
+	return true;
+}
+
+void fold_constant_ast( parse_context_t& c )
+{
+	if ( c.ast_->root_ >= 0 )
+	{
+		fold_constant_ast_node( c, &c.ast_->nodes_[ c.ast_->root_ ] );
+	}
 }
 
 //=============================================================================
-// ビルトイン
-
-int query_command( const char* s )
+// 命令プロファイル
+opcode_profile_t* create_opcode_profile( int ngram )
 {
-	static const struct
-	{
-		int				tag_;
-		const char*		word_;
-	} table[] =
-	{
-		{ COMMAND_DEVTERM,		"devterm" },
-		{ COMMAND_DIM,			"dim", },
-		{ COMMAND_DDIM,			"ddim", },
-		{ COMMAND_SDIM,			"sdim", },
-		{ COMMAND_POKE,			"poke", },
-		{ COMMAND_WPOKE,		"wpoke", },
-		{ COMMAND_LPOKE,		"lpoke", },
-		{ COMMAND_MES,			"mes", },
-		{ COMMAND_INPUT,		"input", },
-		{ COMMAND_RANDOMIZE,	"randomize", },
-#if NHSP_CONFIG_PERFORMANCE_TIMER
-		{ COMMAND_BENCH,		"bench", },
-#endif
-		{ -1,					nullptr },
-	};
+	if ( ngram < 1 || ngram > MAX_OPCODE_PROFILE_NGRAM )
+	{
+		raise_error( "命令プロファイル：n-gramの長さは1〜%dです@@ %d", MAX_OPCODE_PROFILE_NGRAM, ngram );
+	}
 
-	// 全探索
-	for( int i=0; table[i].tag_!=-1; ++i )
+	auto res = reinterpret_cast<opcode_profile_t*>( xmalloc( sizeof(opcode_profile_t) ) );
+	res->ngram_ = ngram;
+	res->table_size_ = 1;
+	for( int i=0; i<ngram; ++i )
 	{
-		if ( string_equal_igcase( s, table[i].word_ ) )
-		{ return table[i].tag_; }
+		res->table_size_ *= MAX_OPERATOR;
 	}
-	return -1;
+	res->count_table_ = reinterpret_cast<int*>( xmalloc( sizeof(int) *res->table_size_ ) );
+	memset( res->count_table_, 0, sizeof(int) *res->table_size_ );
+	res->key_ = 0;
+	res->executed_ = 0;
+	return res;
+}
+
+void destroy_opcode_profile( opcode_profile_t* p )
+{
+	xfree( p->count_table_ );
+	xfree( p );
+}
+
+//=============================================================================
+// ビルトイン
+
+int query_command( const char* s )
+{
+	const auto w = find_reserved_word( s );
+	return ( w != nullptr ? w->command_ : -1 );
 }
 
 command_delegate get_command_delegate( builtin_command_tag command )
@@ -6150,44 +11225,8 @@ command_delegate get_command_delegate( builtin_command_tag command )
 
 int query_function( const char* s )
 {
-	static const struct
-	{
-		int				tag_;
-		const char*		word_;
-	} table[] =
-	{
-		{ FUNCTION_INT,		"int", },
-		{ FUNCTION_DOUBLE,	"double", },
-		{ FUNCTION_STR,		"str", },
-		{ FUNCTION_PEEK,	"peek", },
-		{ FUNCTION_WPEEK,	"wpeek", },
-		{ FUNCTION_LPEEK,	"lpeek", },
-		{ FUNCTION_RND,		"rnd", },
-		{ FUNCTION_ABS,		"abs", },
-		{ FUNCTION_ABSF,	"absf", },
-		{ FUNCTION_DEG2RAD,	"deg2rad", },
-		{ FUNCTION_RAD2DEG,	"rad2deg", },
-		{ FUNCTION_SIN,		"sin", },
-		{ FUNCTION_COS,		"cos", },
-		{ FUNCTION_TAN,		"tan", },
-		{ FUNCTION_ATAN,	"atan", },
-		{ FUNCTION_EXPF,	"expf", },
-		{ FUNCTION_LOGF,	"logf", },
-		{ FUNCTION_POWF,	"powf", },
-		{ FUNCTION_SQRT,	"sqrt", },
-		{ FUNCTION_LIMIT,	"limit", },
-		{ FUNCTION_LIMITF,	"limitf", },
-		{ FUNCTION_STRLEN,	"strlen", },
-		{ -1,				nullptr },
-	};
-
-	// 全探索
-	for( int i=0; table[i].tag_!=-1; ++i )
-	{
-		if ( string_equal_igcase( s, table[i].word_ ) )
-		{ return table[i].tag_; }
-	}
-	return -1;
+	const auto w = find_reserved_word( s );
+	return ( w != nullptr ? w->function_ : -1 );
 }
 
 function_delegate get_function_delegate( builtin_function_tag function )
@@ -6223,11 +11262,11 @@ function_delegate get_function_delegate( builtin_function_tag function )
 
 //=============================================================================
 // ユーティリティ
-void dump_ast( list_t* ast, bool is_detail )
+void dump_ast( const ast_t* ast, bool is_detail )
 {
 	struct _
 	{
-		static void dump( int indent, ast_node_t* node, bool is_detail )
+		static void dump( int indent, const ast_t* ast, const ast_node_t* node, bool is_detail )
 		{
 			for( int i=0; i<indent; ++i )
 			{ printf( "  " ); }
@@ -6281,29 +11320,28 @@ void dump_ast( list_t* ast, bool is_detail )
 			assert( node->tag_>=0 && node->tag_<MAX_NODE );
 			printf( "%s", nodenames[node->tag_] );
 			if ( is_detail )
-			{ printf( " :%p", node ); }
+			{ printf( " :%d", static_cast<int>( node -ast->nodes_ ) ); }
 			if ( node->token_ )
 			{ printf( "[%s]", node->token_->content_ ); }
 			printf( "\n" );
-			if ( node->left_ )
-			{ dump( indent +1, node->left_, is_detail ); }
-			if ( node->right_ )
-			{ dump( indent +1, node->right_, is_detail ); }
 		}
 	};
 
 	printf( "====ast[%p]====\n", ast );
-	list_node_t* st =ast->head_;
-	while( st != nullptr )
+	ast_cursor_t cursor;
+	initialize_ast_cursor( &cursor, ast, ast->root_ );
+	int depth = 0;
+	while( const auto node = ast_cursor_next( &cursor, &depth ) )
 	{
-		ast_node_t* node = reinterpret_cast<ast_node_t*>( st->value_ );
-		_::dump( 1, node, is_detail );
-		st = st->next_;
+		// 最上位のブロック自体は出さない
+		if ( depth > 0 )
+		{ _::dump( depth, ast, node, is_detail ); }
 	}
+	uninitialize_ast_cursor( &cursor );
 	printf( "--------\n" );
 }
 
-void dump_variable( list_t* var_table, const char* name, int idx )
+void dump_variable( variable_table_t* var_table, const char* name, int idx )
 {
 	printf( "%s[%d]=", name, idx );
 	if ( auto v = search_variable( var_table, name ) )
@@ -6343,23 +11381,260 @@ void dump_stack( value_stack_t* stack )
 	printf( "----\n" );
 }
 
-void dump_code( const code_container_t* code )
+const char* get_operator_name( int op )
+{
+	static const char* opnames[] =
+	{
+		"NOP",
+
+		"PUSH_INT",
+		"PUSH_WIDE_INT",
+		"PUSH_DOUBLE",
+		"PUSH_STRING",
+		"PUSH_VARIABLE",
+		"PUSH_SYSVAR",
+
+		"ASSIGN",
+		"ADD_ASSIGN",
+		"SUB_ASSIGN",
+		"MUL_ASSIGN",
+		"DIV_ASSIGN",
+		"MOD_ASSIGN",
+		"BOR_ASSIGN",
+		"BAND_ASSIGN",
+		"BXOR_ASSIGN",
+
+		"BOR",
+		"BAND",
+		"BXOR",
+
+		"EQ",
+		"NEQ",
+		"GT",
+		"GTOE",
+		"LT",
+		"LTOE",
+
+		"ADD",
+		"SUB",
+		"MUL",
+		"DIV",
+		"MOD",
+
+		"UNARY_MINUS",
+
+		"IF",
+
+		"REPEAT",
+		"REPEAT_CHECK",
+		"LOOP",
+		"CONTINUE",
+		"BREAK",
+
+		"GOSUB",
+		"GOTO",
+
+		"COMMAND",
+		"FUNCTION",
+
+		"JUMP",
+		"JUMP_RELATIVE",
+		"RETURN",
+		"END",
+
+		"LOAD_SCALAR",
+		"INC_VAR",
+		"CMP_JUMP_IF_FALSE",
+
+		"ADD_INT_INT",
+		"SUB_INT_INT",
+		"MUL_INT_INT",
+		"EQ_INT_INT",
+		"NEQ_INT_INT",
+		"GT_INT_INT",
+		"GTOE_INT_INT",
+		"LT_INT_INT",
+		"LTOE_INT_INT",
+		"ADD_DOUBLE_DOUBLE",
+		"SUB_DOUBLE_DOUBLE",
+		"MUL_DOUBLE_DOUBLE",
+		"ASSIGN_INT",
+		"ASSIGN_DOUBLE",
+		"CMP_JUMP_IF_FALSE_INT_INT",
+	};
+	static_assert( sizeof(opnames) /sizeof(*opnames) == MAX_OPERATOR, "opnames size is not match with MAX_OPERATOR" );
+
+	assert( op>=0 && op<MAX_OPERATOR );
+	return opnames[op];
+}
+
+void dump_code( const execute_environment_t* e )
+{
+	struct _
+	{
+		static int dump( int indent, const execute_environment_t* e, const code_t* codes, int pc )
+		{
+			const auto* const var_table = e->variable_table_;
+			const auto* const constants = constant_base( e );
+			for( int i=0; i<indent; ++i )
+			{ printf( "  " ); }
+
+			const auto op = code_operator( codes[ pc ] );
+			const auto operand = code_operand( codes[ pc ] );
+			assert( op>=0 && op<MAX_OPERATOR );
+			printf( "%04d: %s[%d] ", pc, get_operator_name( op ), op );
+
+			const auto offset = code_operator_size( codes[ pc ] ) -1;
+			switch( op )
+			{
+				case OPERATOR_NOP:
+					break;
+
+				case OPERATOR_PUSH_INT:
+					printf( ": VAL[%d]", operand );
+					break;
+
+				case OPERATOR_PUSH_WIDE_INT:
+					printf( ": CONST[%d=%d]", operand, constants[ operand ].ivalue_ );
+					break;
+
+				case OPERATOR_PUSH_DOUBLE:
+					printf( ": CONST[%d=%lf]", operand, constants[ operand ].dvalue_ );
+					break;
+
+				case OPERATOR_PUSH_STRING:
+					printf( ": CONST[%d=%s]", operand, literal_base( e ) +constants[ operand ].ivalue_ );
+					break;
+
+				case OPERATOR_PUSH_VARIABLE:
+					printf( ": VAR[%d=%s]", operand, var_table->variables_[ operand ].name_ );
+					break;
+
+				case OPERATOR_PUSH_SYSVAR:
+					printf( ": VAL[%d]", operand );
+					break;
+
+				case OPERATOR_ASSIGN:
+				case OPERATOR_ADD_ASSIGN:
+				case OPERATOR_SUB_ASSIGN:
+				case OPERATOR_MUL_ASSIGN:
+				case OPERATOR_DIV_ASSIGN:
+				case OPERATOR_MOD_ASSIGN:
+				case OPERATOR_BOR_ASSIGN:
+				case OPERATOR_BAND_ASSIGN:
+				case OPERATOR_BXOR_ASSIGN:
+					break;
+
+				case OPERATOR_BOR:
+				case OPERATOR_BAND:
+				case OPERATOR_BXOR:
+				case OPERATOR_EQ:
+				case OPERATOR_NEQ:
+				case OPERATOR_GT:
+				case OPERATOR_GTOE:
+				case OPERATOR_LT:
+				case OPERATOR_LTOE:
+				case OPERATOR_ADD:
+				case OPERATOR_SUB:
+				case OPERATOR_MUL:
+				case OPERATOR_DIV:
+				case OPERATOR_MOD:
+					break;
+
+				case OPERATOR_UNARY_MINUS:
+					break;
+
+				case OPERATOR_IF:
+					printf( ": FALSE[%d]", operand );
+					break;
+
+				case OPERATOR_REPEAT:
+					printf( ": END[%d]", operand );
+					break;
+				case OPERATOR_REPEAT_CHECK:
+					break;
+
+				case OPERATOR_LOOP:
+				case OPERATOR_CONTINUE:
+				case OPERATOR_BREAK:
+					break;
+
+				case OPERATOR_GOSUB:
+				case OPERATOR_GOTO:
+				{
+					const auto name = search_label_name( e, operand, false );
+					printf( ": POS[%d] LABEL[%s]", operand, name != nullptr ? name : "?" );
+					break;
+				}
+
+				case OPERATOR_COMMAND:
+					printf( ": COMMAND[%d] ARG[%d]", code_call_callee( operand ), code_call_arg_num( operand ) );
+					break;
+				case OPERATOR_FUNCTION:
+					printf( ": FUNCTION[%d] ARG[%d]", code_call_callee( operand ), code_call_arg_num( operand ) );
+					break;
+
+				case OPERATOR_JUMP:
+					printf( ": POS[%d]", operand );
+					break;
+				case OPERATOR_JUMP_RELATIVE:
+					printf( ": OFFSET[%d]", operand );
+					break;
+				case OPERATOR_RETURN:
+					printf( ": ARG[%d]", operand );
+					break;
+
+				case OPERATOR_END:
+					break;
+
+				case OPERATOR_LOAD_SCALAR:
+					printf( ": VAR[%d=%s]", operand, var_table->variables_[ operand ].name_ );
+					break;
+				case OPERATOR_INC_VAR:
+					printf( ": VAR[%d=%s] VAL[%d]", operand, var_table->variables_[ operand ].name_, codes[ pc +1 ] );
+					break;
+				case OPERATOR_CMP_JUMP_IF_FALSE:
+				case OPERATOR_CMP_JUMP_IF_FALSE_INT_INT:
+					printf( ": CMP[%s] FALSE[%d]", get_operator_name( codes[ pc +1 ] ), operand );
+					break;
+
+				default:
+					break;
+			}
+			printf( "\n" );
+			return offset;
+		}
+	};
+
+	const auto* const code = e->execute_code_;
+	printf( "====code[%p] %d[words]====\n", code, static_cast<int>( code->code_size_ ) );
+	for( int i=0; i<static_cast<int>(code->code_size_); ++i )
+	{
+		i += _::dump( 1, e, code->code_, i );
+	}
+	printf( "  %04d: EOC\n", static_cast<int>( code->code_size_ ) );
+	printf( "--------\n" );
+}
+
+
+void dump_register_code( const execute_environment_t* e )
 {
 	struct _
 	{
-		static int dump( int indent, const code_t* codes, int pc )
+		static int dump( int indent, const execute_environment_t* e, const code_t* codes, int pc )
 		{
+			const auto* const var_table = e->variable_table_;
 			for( int i=0; i<indent; ++i )
 			{ printf( "  " ); }
 			static const char* opnames[] =
 			{
 				"NOP",
 
-				"PUSH_INT",
-				"PUSH_DOUBLE",
-				"PUSH_STRING",
-				"PUSH_VARIABLE",
-				"PUSH_SYSVAR",
+				"LOAD_INT",
+				"LOAD_DOUBLE",
+				"LOAD_STRING",
+				"LOAD_VARIABLE",
+				"LOAD_SYSVAR",
 
 				"ASSIGN",
 				"ADD_ASSIGN",
@@ -6398,173 +11673,146 @@ void dump_code( const code_container_t* code )
 				"CONTINUE",
 				"BREAK",
 
-				"LABEL",
-
 				"GOSUB",
 				"GOTO",
 
 				"COMMAND",
 				"FUNCTION",
 
-				"JUMP",
 				"JUMP_RELATIVE",
 				"RETURN",
 				"END",
 			};
-			static_assert( sizeof(opnames) /sizeof(*opnames) == MAX_OPERATOR, "opnames size is not match with MAX_OPERATOR" );
+			static_assert( sizeof(opnames) /sizeof(*opnames) == MAX_REGISTER_OPERATOR, "opnames size is not match with MAX_REGISTER_OPERATOR" );
 
 			const auto op = codes[ pc ];
-			assert( op>=0 && op<MAX_OPERATOR );
+			assert( op>=0 && op<MAX_REGISTER_OPERATOR );
 			printf( "%04d: %s[%d] ", pc, opnames[op], op );
 
 			int offset =0;
 			switch( op )
 			{
-				case OPERATOR_NOP:
+				case REGISTER_OPERATOR_NOP:
 					break;
 
-				case OPERATOR_PUSH_INT:
-					printf( ": VAL[%d]", codes[ pc +1 ] );
-					++offset;
+				case REGISTER_OPERATOR_LOAD_INT:
+					printf( ": R[%d] VAL[%d]", codes[ pc +1 ], codes[ pc +2 ] );
+					offset += 2;
 					break;
 
-				case OPERATOR_PUSH_DOUBLE:
+				case REGISTER_OPERATOR_LOAD_DOUBLE:
 				{
-					double v =0.0;
-					const auto stride = code_get_block( v, codes, pc +1 );
-					printf( ": VAL[%lf]", v );
-					offset += stride;
+					const auto index = codes[ pc +2 ];
+					printf( ": R[%d] CONST[%d=%lf]", codes[ pc +1 ], index, constant_base( e )[ index ].dvalue_ );
+					offset += 2;
 					break;
 				}
 
-				case OPERATOR_PUSH_STRING:
+				case REGISTER_OPERATOR_LOAD_STRING:
 				{
-					const char* v =nullptr;
-					const auto stride = code_get_block( v, codes, pc +1 );
-					printf( ": VAL[%s]", v );
-					offset += stride;
+					const auto index = codes[ pc +2 ];
+					printf( ": R[%d] CONST[%d=%s]", codes[ pc +1 ], index, literal_base( e ) +constant_base( e )[ index ].ivalue_ );
+					offset += 2;
 					break;
 				}
 
-				case OPERATOR_PUSH_VARIABLE:
+				case REGISTER_OPERATOR_LOAD_VARIABLE:
 				{
-					variable_t* var =nullptr;
-					const auto stride = code_get_block( var, codes, pc +1 );
-					printf( ": VAR[%p=%s]", var, var->name_ );
-					offset += stride;
+					const auto slot = codes[ pc +2 ];
+					printf( ": R[%d] VAR[%d=%s] IDX[%d]", codes[ pc +1 ], slot, var_table->variables_[ slot ].name_, codes[ pc +3 ] );
+					offset += 3;
 					break;
 				}
 
-				case OPERATOR_PUSH_SYSVAR:
-				{
-					const auto sysvar = codes[ pc +1 ];
-					printf( ": VAL[%d]", sysvar );
-					++offset;
+				case REGISTER_OPERATOR_LOAD_SYSVAR:
+					printf( ": R[%d] VAL[%d]", codes[ pc +1 ], codes[ pc +2 ] );
+					offset += 2;
 					break;
-				}
 
-				case OPERATOR_ASSIGN:
-				case OPERATOR_ADD_ASSIGN:
-				case OPERATOR_SUB_ASSIGN:
-				case OPERATOR_MUL_ASSIGN:
-				case OPERATOR_DIV_ASSIGN:
-				case OPERATOR_MOD_ASSIGN:
-				case OPERATOR_BOR_ASSIGN:
-				case OPERATOR_BAND_ASSIGN:
-				case OPERATOR_BXOR_ASSIGN:
+				case REGISTER_OPERATOR_ASSIGN:
+				case REGISTER_OPERATOR_ADD_ASSIGN:
+				case REGISTER_OPERATOR_SUB_ASSIGN:
+				case REGISTER_OPERATOR_MUL_ASSIGN:
+				case REGISTER_OPERATOR_DIV_ASSIGN:
+				case REGISTER_OPERATOR_MOD_ASSIGN:
+				case REGISTER_OPERATOR_BOR_ASSIGN:
+				case REGISTER_OPERATOR_BAND_ASSIGN:
+				case REGISTER_OPERATOR_BXOR_ASSIGN:
+				{
+					const auto slot = codes[ pc +1 ];
+					printf( ": VAR[%d=%s] IDX[%d] R[%d]", slot, var_table->variables_[ slot ].name_, codes[ pc +2 ], codes[ pc +3 ] );
+					offset += 3;
 					break;
+				}
 
-				case OPERATOR_BOR:
-				case OPERATOR_BAND:
-				case OPERATOR_BXOR:
-				case OPERATOR_EQ:
-				case OPERATOR_NEQ:
-				case OPERATOR_GT:
-				case OPERATOR_GTOE:
-				case OPERATOR_LT:
-				case OPERATOR_LTOE:
-				case OPERATOR_ADD:
-				case OPERATOR_SUB:
-				case OPERATOR_MUL:
-				case OPERATOR_DIV:
-				case OPERATOR_MOD:
+				case REGISTER_OPERATOR_BOR:
+				case REGISTER_OPERATOR_BAND:
+				case REGISTER_OPERATOR_BXOR:
+				case REGISTER_OPERATOR_EQ:
+				case REGISTER_OPERATOR_NEQ:
+				case REGISTER_OPERATOR_GT:
+				case REGISTER_OPERATOR_GTOE:
+				case REGISTER_OPERATOR_LT:
+				case REGISTER_OPERATOR_LTOE:
+				case REGISTER_OPERATOR_ADD:
+				case REGISTER_OPERATOR_SUB:
+				case REGISTER_OPERATOR_MUL:
+				case REGISTER_OPERATOR_DIV:
+				case REGISTER_OPERATOR_MOD:
+					printf( ": R[%d] R[%d] R[%d]", codes[ pc +1 ], codes[ pc +2 ], codes[ pc +3 ] );
+					offset += 3;
 					break;
 
-				case OPERATOR_UNARY_MINUS:
+				case REGISTER_OPERATOR_UNARY_MINUS:
+					printf( ": R[%d] R[%d]", codes[ pc +1 ], codes[ pc +2 ] );
+					offset += 2;
 					break;
 
-				case OPERATOR_IF:
-				{
-					const auto false_head = codes[ pc +1 ];
-					printf( ": FALSE[%d]", false_head );
-					++offset;
+				case REGISTER_OPERATOR_IF:
+					printf( ": R[%d] FALSE[%d]", codes[ pc +1 ], codes[ pc +2 ] );
+					offset += 2;
 					break;
-				}
 
-				case OPERATOR_REPEAT:
-				{
-					const auto end_position = codes[ pc +1 ];
-					printf( ": END[%d]", end_position );
-					++offset;
-					break;
-				}
-				case OPERATOR_REPEAT_CHECK:
+				case REGISTER_OPERATOR_REPEAT:
+					printf( ": R[%d] END[%d]", codes[ pc +1 ], codes[ pc +2 ] );
+					offset += 2;
 					break;
-
-				case OPERATOR_LOOP:
-				case OPERATOR_CONTINUE:
-				case OPERATOR_BREAK:
+				case REGISTER_OPERATOR_REPEAT_CHECK:
 					break;
 
-				case OPERATOR_LABEL:
+				case REGISTER_OPERATOR_LOOP:
+				case REGISTER_OPERATOR_CONTINUE:
+				case REGISTER_OPERATOR_BREAK:
 					break;
 
-				case OPERATOR_GOSUB:
-				case OPERATOR_GOTO:
+				case REGISTER_OPERATOR_GOSUB:
+				case REGISTER_OPERATOR_GOTO:
 				{
-					label_node_t* label =nullptr;
-					const auto stride = code_get_block( label, codes, pc +1 );
-					assert( label != nullptr );
-					printf( ": LABEL[%p=%s] POS[%d]", label, label->name_, label->position_ );
-					offset += stride;
+					const auto name = search_label_name( e, codes[ pc +1 ], true );
+					printf( ": POS[%d] LABEL[%s]", codes[ pc +1 ], name != nullptr ? name : "?" );
+					++offset;
 					break;
 				}
 
-				case OPERATOR_COMMAND:
-				{
-					const auto command = codes[ pc +1 ];
-					assert( command >= 0 );
-					const auto arg_num = codes[ pc +2 ];
-					printf( ": COMMAND[%d] ARG[%d]", command, arg_num );
-					offset += 2;
+				case REGISTER_OPERATOR_COMMAND:
+					printf( ": COMMAND[%d] R[%d] ARG[%d]", codes[ pc +1 ], codes[ pc +2 ], codes[ pc +3 ] );
+					offset += 3;
 					break;
-				}
-				case OPERATOR_FUNCTION:
-				{
-					const auto function = codes[ pc +1 ];
-					assert( function >= 0 );
-					const auto arg_num = codes[ pc +2 ];
-					printf( ": FUNCTION[%d] ARG[%d]", function, arg_num );
-					offset += 2;
+				case REGISTER_OPERATOR_FUNCTION:
+					printf( ": R[%d] FUNCTION[%d] R[%d] ARG[%d]", codes[ pc +1 ], codes[ pc +2 ], codes[ pc +3 ], codes[ pc +4 ] );
+					offset += 4;
 					break;
-				}
 
-				case OPERATOR_JUMP:
-					printf( ": POS[%d]", codes[ pc +1 ] );
-					++offset;
-					break;
-				case OPERATOR_JUMP_RELATIVE:
+				case REGISTER_OPERATOR_JUMP_RELATIVE:
 					printf( ": OFFSET[%d]", codes[ pc +1 ] );
 					++offset;
 					break;
-				case OPERATOR_RETURN:
-				{
-					printf( ": ARG[%d]", codes[ pc +1 ] );
+				case REGISTER_OPERATOR_RETURN:
+					printf( ": R[%d]", codes[ pc +1 ] );
 					++offset;
 					break;
-				}
 
-				case OPERATOR_END:
+				case REGISTER_OPERATOR_END:
 					break;
 			}
 			printf( "\n" );
@@ -6572,15 +11820,75 @@ void dump_code( const code_container_t* code )
 		}
 	};
 
-	printf( "====code[%p] %d[words]====\n", code, static_cast<int>( code->code_size_ ) );
+	const auto* const code = e->register_code_;
+	printf( "====register code[%p] %d[words]====\n", code, static_cast<int>( code->code_size_ ) );
 	for( int i=0; i<static_cast<int>(code->code_size_); ++i )
 	{
-		i += _::dump( 1, code->code_, i );
+		i += _::dump( 1, e, code->code_, i );
 	}
 	printf( "  %04d: EOC\n", static_cast<int>( code->code_size_ ) );
 	printf( "--------\n" );
 }
 
 
+void dump_opcode_profile( const opcode_profile_t* p, int max_num )
+{
+	// 出現したものだけ集めて多い順に並べる
+	int found_num =0;
+	for( int i=0; i<p->table_size_; ++i )
+	{
+		if ( p->count_table_[i] > 0 )
+		{ ++found_num; }
+	}
+
+	struct entry_t
+	{
+		int			key_;
+		int			count_;
+
+		static int compare( const void* l, const void* r )
+		{
+			const auto lc = reinterpret_cast<const entry_t*>( l )->count_;
+			const auto rc = reinterpret_cast<const entry_t*>( r )->count_;
+			return ( lc < rc ? 1 : ( lc > rc ? -1 : 0 ) );
+		}
+	};
+	auto entries = reinterpret_cast<entry_t*>( xmalloc( sizeof(entry_t) *( found_num > 0 ? found_num : 1 ) ) );
+	{
+		int n =0;
+		for( int i=0; i<p->table_size_; ++i )
+		{
+			if ( p->count_table_[i] > 0 )
+			{
+				entries[n].key_ = i;
+				entries[n].count_ = p->count_table_[i];
+				++n;
+			}
+		}
+	}
+	qsort( entries, found_num, sizeof(entry_t), entry_t::compare );
+
+	const long long total = ( p->executed_ >= p->ngram_ ? p->executed_ -p->ngram_ +1 : 0 );
+	printf( "====opcode %d-gram profile : %lld[executed] %d[kinds]====\n", p->ngram_, p->executed_, found_num );
+	for( int i=0; i<found_num && i<max_num; ++i )
+	{
+		const auto count = entries[i].count_;
+		printf( "  %10d %6.2lf%% :", count, ( total > 0 ? 100.0 *count /total : 0.0 ) );
+
+		// キーは古い命令が上位桁
+		int divisor =p->table_size_;
+		for( int j=0; j<p->ngram_; ++j )
+		{
+			divisor /= MAX_OPERATOR;
+			printf( " %s", get_operator_name( ( entries[i].key_ /divisor ) %MAX_OPERATOR ) );
+		}
+		printf( "\n" );
+	}
+	printf( "--------\n" );
+
+	xfree( entries );
+}
+
+
 }// namespace neteruhsp
 
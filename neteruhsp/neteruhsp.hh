@@ -53,6 +53,18 @@
 // value_t のメモリアロケーションのキャッシュ
 #define NHSP_CONFIG_VALUE_ALLOCATION_CACHE		(1)
 
+// 実行時に観測した型で演算命令を特殊化した命令に書き換える
+#define NHSP_CONFIG_QUICKENING					(1)
+
+// 命令ごとにハンドラのアドレスへ直接ジャンプするスレッデッドコードでの実行を有効化（GCC/Clangのみ）
+#define NHSP_CONFIG_THREADED_DISPATCH			(1)
+
+// 整数と実数の演算、数学関数だけを扱う repeat-loop をネイティブコードに翻訳する JIT を有効化（Linux x86-64のみ、実行時に指定した時だけ使う）
+#define NHSP_CONFIG_JIT							(1)
+
+// コンパイル済みのプログラムを読み取り専用で mmap し、コードとリテラルのページをプロセス間で共有する（POSIXのみ、使えなければ読み込む）
+#define NHSP_CONFIG_MAPPED_PROGRAM				(1)
+
 
 //=============================================================================
 // ソースコードこっから
@@ -72,6 +84,20 @@ void* xmalloc( size_t size );
 void  xfree( void* ptr );
 void* xrealloc( void* ptr, size_t size );
 
+// まとめて解放する領域
+// 確保した順に詰めていくだけで個別には解放できず、destroy_arena で一度に解放する
+struct arena_t
+{
+	char*			chunk_;// 各領域の先頭に一つ前の領域へのポインタを持つ
+	char*			cursor_;
+	size_t			rest_;
+	size_t			chunk_size_;
+};
+
+arena_t* create_arena( size_t initial_chunk_size = 1024 );
+void destroy_arena( arena_t* arena );
+void* arena_alloc( arena_t* arena, size_t size );
+
 //=============================================================================
 // 文字列バッファ
 struct string_buffer_t
@@ -89,6 +115,7 @@ void initialize_string_buffer( string_buffer_t* sb, size_t initial_len = 1024, i
 void uninitialize_string_buffer( string_buffer_t* sb );
 
 void string_buffer_append( string_buffer_t* sb, const char* s, int len = -1 );
+void string_buffer_clear( string_buffer_t* sb );
 
 //=============================================================================
 // リスト
@@ -122,6 +149,38 @@ void list_erase( list_t& list, list_node_t* node );
 list_node_t* list_find( list_t& list, void* value );
 void list_free_all( list_t& list );
 
+//=============================================================================
+// 名前表
+// 大文字小文字を区別しない名前で引くハッシュ表
+// 要素は登録順に並び、削除した要素は name_ が nullptr の空きとして残る
+// 削除しない限り、要素番号は登録順の連番のまま変わらない
+struct name_table_entry_t
+{
+	const char*		name_;// 値の側が持っている名前を指す
+	unsigned int	hash_;
+	int				next_;// 同じバケットの次の要素、-1で終端
+	void*			value_;
+};
+
+struct name_table_t
+{
+	name_table_entry_t*	entries_;
+	int					entry_num_;
+	int					entry_buffer_size_;
+	int					erased_num_;
+
+	int*				buckets_;
+	int					bucket_num_;
+};
+
+name_table_t* create_name_table();
+void destroy_name_table( name_table_t* table );
+
+unsigned int name_table_hash( const char* name, int len =-1 );
+int name_table_find( const name_table_t* table, const char* name, int len =-1 );
+int name_table_insert( name_table_t* table, const char* name, void* value );
+void name_table_erase( name_table_t* table, int entry );
+
 //=============================================================================
 // キーワード
 enum keyword_tag
@@ -199,10 +258,11 @@ enum token_tag
 	MAX_TOKEN,
 };
 
+// トークンは元のスクリプト上の範囲を持ち、文字列は読まれた時にパーサーが切り出す
 struct token_t
 {
 	token_tag		tag_;
-	char*			content_;
+	const char*		content_;// 読まれるまでは nullptr、識別子は同じ綴りなら共有される
 
 	int				cursor_begin_, cursor_end_;
 	int				appear_line_;
@@ -223,17 +283,31 @@ int query_token_shadow( const char* ident, size_t len );
 void initialize_tokenize_context( tokenize_context_t* c, const char* script );
 void uninitialize_tokenize_context( tokenize_context_t* c );
 
-token_t* get_token( tokenize_context_t& c );
-void destroy_token( token_t* t );
+bool get_token( tokenize_context_t& c, token_t& res, bool is_raise_error =true );
 
-char* create_token_string( const char* str, size_t len );
+size_t decode_token_string( char* dst, const char* str, size_t len );
 
 //=============================================================================
 // パーサ
+struct ast_t;
+struct prepro_stream_t;
+
 struct parse_context_t
 {
-	list_t*					token_list_;
-	list_node_t*			token_current_;
+	// 字句解析は初期化時にまとめて行い、以降この配列は伸長しない
+	// 読めない文字などがあればそこで止め、そのトークンが読まれた時にエラーにする
+	token_t*				tokens_;
+	int						token_num_;
+	int						token_current_;// 次に読むトークンの番号
+	int						token_read_num_;// 一度でも読まれたトークンの数
+	int						token_buffer_size_;
+
+	// トークンの文字列、定数畳み込みで作ったトークンはすべてこの領域に置き
+	// パーサーの破棄でまとめて解放する
+	arena_t*				arena_;
+	ast_t*					ast_;// 構文木、パーサーと一緒に解放される
+	name_table_t*			identifiers_;// 識別子の綴りの共有用、必要になるまで作らない
+
 	tokenize_context_t*		tokenize_context_;
 };
 
@@ -241,11 +315,13 @@ parse_context_t* create_parse_context();
 void destroy_parse_context( parse_context_t* p );
 
 void initialize_parse_context( parse_context_t* c, tokenize_context_t& t );
+void initialize_parse_context( parse_context_t* c, tokenize_context_t& t, prepro_stream_t& stream );
 void uninitialize_parse_context( parse_context_t* c );
 
 token_t* read_token( parse_context_t& c );
 void unread_token( parse_context_t& c, size_t num =1 );
 token_t* prev_token( parse_context_t& c, size_t num =0 );
+char* alloc_token_text( parse_context_t& c, size_t len );
 
 //=============================================================================
 // プリプロセッサ
@@ -298,6 +374,20 @@ struct macro_t
 
 	int					param_num_;
 	macro_param_t		params_[MACRO_PARAM_MAX];
+
+	// 引数の組ごとの置き換え結果、マクロと一緒に捨てられるので#undefや再定義で古い結果が残ることはない
+	name_table_t*		expansions_;// 最初に展開されるまで作らない
+};
+
+// 引数を改行でつないだものをキーにする、引数のないマクロは空文字列
+struct macro_expansion_t
+{
+	char*				args_;
+	char*				text_;
+
+	// text_ にもう展開するマクロがないか、マクロの登録や削除があれば調べ直す
+	bool				is_final_;
+	int					final_generation_;
 };
 
 macro_t* create_macro();
@@ -305,9 +395,14 @@ void destroy_macro( macro_t* m );
 
 void macro_free_content( macro_t* macro );
 
+macro_expansion_t* macro_find_expansion( const macro_t* macro, const char* args );
+macro_expansion_t* macro_register_expansion( macro_t* macro, const char* args, const char* text, size_t len );
+
 struct prepro_context_t
 {
-	list_t*				macro_list_;
+	name_table_t*		macro_table_;
+	bool				macro_initial_[256];// マクロ名の先頭文字（小文字）、登録時に立てるだけで消さない
+	int					macro_generation_;// マクロの登録、削除のたびに進む
 
 	string_buffer_t*	out_buffer_;
 
@@ -327,6 +422,21 @@ void prepro_register_default_macros( prepro_context_t* pctx );
 
 char* prepro_do( const char* src );
 
+// ソースを一論理行ずつ展開していくためのもの
+struct prepro_stream_t
+{
+	prepro_context_t*	pctx_;// 展開した行は pctx_->out_buffer_ の末尾に足されていく
+	const char*			cursor_;// 次の行の先頭、最後の行まで読んだら nullptr
+	string_buffer_t		work_;// コメントや行継続を取り除いた行の組み立て用、全行で使い回す
+};
+
+void initialize_prepro_stream( prepro_stream_t* s, const char* src, size_t out_buffer_size );
+void uninitialize_prepro_stream( prepro_stream_t* s );
+bool prepro_stream_next( prepro_stream_t* s );
+void prepro_emit_line( prepro_context_t* pctx, const char* line, int len, string_buffer_t* work );
+int prepro_find_plain_line_head( const prepro_context_t* pctx, const char* line, int len );
+bool prepro_is_expansion_final( const prepro_context_t* pctx, macro_expansion_t* expansion );
+
 char* prepro_line( prepro_context_t* pctx, const char* line, bool enable_preprocessor );
 char* prepro_line_expand( prepro_context_t* pctx, const char* line, bool* out_is_replaced = nullptr );
 
@@ -398,44 +508,89 @@ enum ast_node_flag_tag
 {
 };
 
+// 構文木はすべてのノードを一つの配列に並べ、子は32bitの番号で指す
+// 子の番号は ast_t::children_ 上に親ごとに連続して並び、ノードはその範囲を持つ
+// ブロック内の命令列や引数列も、子の数を持つ一つのノードになる
 struct ast_node_t
 {
-	node_tag		tag_;
 	token_t*		token_;
-	ast_node_t		*left_, *right_;
+	node_tag		tag_;
+	int				child_begin_;
+	int				child_num_;
 	unsigned int	flag_;
 };
 
-ast_node_t* create_ast_node( node_tag tag, ast_node_t* left =nullptr, ast_node_t* right =nullptr );
-ast_node_t* create_ast_node( node_tag tag, token_t* token, ast_node_t* left =nullptr );
-void destroy_ast_node( ast_node_t* node );
+struct ast_t
+{
+	ast_node_t*		nodes_;
+	int				node_num_;
+	int				node_buffer_size_;
+
+	int*			children_;
+	int				child_num_;
+	int				child_buffer_size_;
+
+	// 子の数が決まるまで子の番号を積んでおく、入れ子になっても後から積んだ方が先に使われる
+	int*			pending_;
+	int				pending_num_;
+	int				pending_buffer_size_;
+
+	int				root_;// 最上位の文を子に持つブロック、なければ-1
+};
+
+ast_t* create_ast();
+void destroy_ast( ast_t* ast );
+
+// i 番目の子、なければ nullptr
+// 返るポインタはノードを追加すると無効になる
+ast_node_t* ast_child( ast_t* ast, const ast_node_t* node, int i );
+const ast_node_t* ast_child( const ast_t* ast, const ast_node_t* node, int i );
+
+// 行きがけ順にノードを辿る、再帰せずに自前のスタックで辿る
+struct ast_cursor_t
+{
+	const ast_t*	ast_;
+	int*			stack_;// ノード番号と深さの組
+	int				stack_num_;
+	int				stack_buffer_size_;
+};
+
+void initialize_ast_cursor( ast_cursor_t* cur, const ast_t* ast, int root );
+void uninitialize_ast_cursor( ast_cursor_t* cur );
+const ast_node_t* ast_cursor_next( ast_cursor_t* cur, int* depth =nullptr );// 終わりなら nullptr
+
+// パーサーの構文木にノードを足してその番号を返す、負の子は無視する
+int create_ast_node( parse_context_t& c, node_tag tag, int left =-1, int right =-1 );
+int create_ast_node( parse_context_t& c, node_tag tag, token_t* token, int left =-1 );
+// pending_begin 以降に積んだ番号を子にしたノードを作る
+void push_ast_pending( parse_context_t& c, int node );
+int create_ast_node_from_pending( parse_context_t& c, node_tag tag, int pending_begin );
 
 bool is_eos_like_token( token_tag tag );
+bool is_assign_token( token_tag tag );
+bool is_control_keyword( int keyword );
 
-list_t* parse_script( parse_context_t& c );
-void destroy_ast( list_t* ast );
+int parse_script( parse_context_t& c );
 
-ast_node_t* parse_statement( parse_context_t& c );
+int parse_statement( parse_context_t& c );
 
-ast_node_t* parse_label_safe( parse_context_t& c );
+int parse_label_safe( parse_context_t& c );
 
-ast_node_t* parse_control_safe( parse_context_t& c );
+int parse_control_safe( parse_context_t& c );
 
-ast_node_t* parse_command_safe( parse_context_t& c );
-ast_node_t* parse_arguments( parse_context_t& c );
+int parse_command_safe( parse_context_t& c );
+int parse_arguments( parse_context_t& c );
 
-ast_node_t* parse_assign_safe( parse_context_t& c );
-ast_node_t* parse_variable_safe( parse_context_t& c );
+int parse_assign_safe( parse_context_t& c );
+int parse_variable_safe( parse_context_t& c );
 
-ast_node_t* parse_expression( parse_context_t& c );
-ast_node_t* parse_borand( parse_context_t& c );
-ast_node_t* parse_eqneq( parse_context_t& c );
-ast_node_t* parse_gtlt( parse_context_t& c );
-ast_node_t* parse_addsub( parse_context_t& c );
-ast_node_t* parse_muldivmod( parse_context_t& c );
-ast_node_t* parse_term( parse_context_t& c );
-ast_node_t* parse_primitive( parse_context_t& c );
-ast_node_t* parse_identifier_expression( parse_context_t& c );
+int binary_operator_precedence( token_tag tag );
+node_tag binary_operator_node( token_tag tag );
+int parse_expression( parse_context_t& c );
+int parse_binary_expression( parse_context_t& c, int min_precedence );
+int parse_term( parse_context_t& c );
+int parse_primitive( parse_context_t& c );
+int parse_identifier_expression( parse_context_t& c );
 
 //=============================================================================
 // 変数
@@ -460,15 +615,28 @@ struct variable_t
 	int				data_size_;
 };
 
-variable_t* create_variable( const char* name );
-void destroy_variable( variable_t* v );
+void initialize_variable( variable_t* v, const char* name );
+void uninitialize_variable( variable_t* v );
 void prepare_variable( variable_t* v, value_tag type, int granule_size, int length );
 
-list_t* create_variable_table();
-void destroy_variable_table( list_t* table );
+// 変数テーブル
+// 変数はコンパイル時に密なスロット番号を割り当てられ、連続した配列に格納される
+// 実行コードはスロット番号で変数を参照する
+struct variable_table_t
+{
+	variable_t*		variables_;
+	int				variable_num_;
+	int				variable_buffer_size_;
 
-variable_t* search_variable( list_t* table, const char* name );
-void variable_set( list_t* table, const value_t& v, const char* name, int idx );
+	name_table_t*	index_;// 変数は削除しないので、要素番号がそのままスロット番号
+};
+
+variable_table_t* create_variable_table();
+void destroy_variable_table( variable_table_t* table );
+
+int search_variable_slot( const variable_table_t* table, const char* name );
+variable_t* search_variable( variable_table_t* table, const char* name );
+int register_variable( variable_table_t* table, const char* name );
 void variable_set( variable_t* var, const value_t& v, int idx );
 void variable_add( variable_t* var, const value_t& v, int idx );
 void variable_sub( variable_t* var, const value_t& v, int idx );
@@ -490,6 +658,8 @@ char* variable_calc_string( const variable_t& r, int idx );
 struct value_t
 {
 	value_tag				type_;
+	bool					is_borrowed_;// VALUE_STRING の時だけ意味を持つ、svalue_ はリテラルプールを借りているだけなので解放も書き換えもしない
+	// svalue_ は借り物でなければ参照カウント付きの共有文字列、他の値と共有している間は書き換えない
 	union
 	{
 		int					ivalue_;
@@ -509,12 +679,14 @@ value_t* create_value( double v );
 value_t* create_value( const char* v );
 value_t* create_value( variable_t* v, int idx );
 value_t* create_value( const value_t& v );
+// *_move は共有文字列（value_calc_string が返すもの）の所有権を受け取る
 value_t* create_value_move( char* v );
 void destroy_value( value_t* t );
 
 void value_set( value_t* v, int i );
 void value_set( value_t* v, double d );
 void value_set( value_t* v, const char* s );
+void value_set_borrowed( value_t* v, const char* s );
 
 void value_move( value_t* v, char* s );
 void value_move( value_t* to, value_t* from );
@@ -546,9 +718,11 @@ void value_unary_minus( value_t* v );
 
 //=============================================================================
 // スタック
+// value_t を直接並べて持つ、push/peek/pop はその場で行う
+// stack_peek で得たポインタは push で無効になりうるので注意
 struct value_stack_t
 {
-	value_t**		stack_;
+	value_t*		stack_;
 	int				top_;
 	int				max_;
 };
@@ -559,8 +733,13 @@ void destroy_value_stack( value_stack_t* st );
 void initialize_value_stack( value_stack_t* st );
 void uninitialize_value_stack( value_stack_t* st );
 
-void stack_push( value_stack_t* st, value_t* v );
+void stack_push( value_stack_t* st, int v );
+void stack_push( value_stack_t* st, double v );
+void stack_push( value_stack_t* st, const char* v );
+void stack_push( value_stack_t* st, variable_t* v, int idx );
 void stack_push( value_stack_t* st, const value_t& v );
+void stack_push_move( value_stack_t* st, char* v );
+void stack_push_borrowed( value_stack_t* st, const char* v );
 value_t* stack_peek( value_stack_t* st, int i =-1 );
 void stack_pop( value_stack_t* st, size_t n =1 );
 
@@ -586,19 +765,28 @@ struct label_node_t
 {
 	char*			name_;
 	int				position_;
+	int				register_position_;
 };
 
 using code_t =int;
 
+// スタックマシンの命令語は下位8ビットが命令、上位24ビットが符号付きのオペランド
+// それ以外のオペランドは後ろに一語ずつ続く
+static const int CODE_OPERATOR_BITS = 8;
+static const int CODE_OPERATOR_MASK = ( 1 << CODE_OPERATOR_BITS ) -1;
+static const int MAX_CODE_OPERAND = ( 1 << ( 31 -CODE_OPERATOR_BITS ) ) -1;
+static const int MIN_CODE_OPERAND = -MAX_CODE_OPERAND -1;
+
 enum code_oprator_tag
 {
 	OPERATOR_NOP =0,
 
-	OPERATOR_PUSH_INT,
-	OPERATOR_PUSH_DOUBLE,
-	OPERATOR_PUSH_STRING,
-	OPERATOR_PUSH_VARIABLE,
-	OPERATOR_PUSH_SYSVAR,
+	OPERATOR_PUSH_INT,				// 即値
+	OPERATOR_PUSH_WIDE_INT,			// 定数の番号、命令語に収まらない整数
+	OPERATOR_PUSH_DOUBLE,			// 定数の番号
+	OPERATOR_PUSH_STRING,			// 定数の番号
+	OPERATOR_PUSH_VARIABLE,			// 変数のスロット
+	OPERATOR_PUSH_SYSVAR,			// システム変数
 
 	OPERATOR_ASSIGN,
 	OPERATOR_ADD_ASSIGN,
@@ -629,40 +817,161 @@ enum code_oprator_tag
 
 	OPERATOR_UNARY_MINUS,
 
-	OPERATOR_IF,
+	OPERATOR_IF,					// 偽の時の相対位置
 
-	OPERATOR_REPEAT,
+	OPERATOR_REPEAT,				// LOOPの位置
 	OPERATOR_REPEAT_CHECK,
 	OPERATOR_LOOP,
 	OPERATOR_CONTINUE,
 	OPERATOR_BREAK,
 
-	OPERATOR_LABEL,
-
-	OPERATOR_GOSUB,
-	OPERATOR_GOTO,
+	OPERATOR_GOSUB,					// 絶対位置、生成中はラベル表の番号
+	OPERATOR_GOTO,					// 絶対位置、生成中はラベル表の番号
 
-	OPERATOR_COMMAND,
-	OPERATOR_FUNCTION,
+	OPERATOR_COMMAND,				// コマンド | 引数の数 << 8
+	OPERATOR_FUNCTION,				// 関数 | 引数の数 << 8
 
-	OPERATOR_JUMP,
-	OPERATOR_JUMP_RELATIVE,
-	OPERATOR_RETURN,
+	OPERATOR_JUMP,					// 絶対位置
+	OPERATOR_JUMP_RELATIVE,			// 相対位置
+	OPERATOR_RETURN,				// 戻り値の数
 	OPERATOR_END,
 
+	// 頻出する命令列をまとめたもの
+	OPERATOR_LOAD_SCALAR,		// PUSH_INT 0; PUSH_VARIABLE var、変数のスロット
+	OPERATOR_INC_VAR,			// var += 即値、変数のスロット, 即値
+	OPERATOR_CMP_JUMP_IF_FALSE,	// 比較演算; IF、偽の時の相対位置, 比較演算
+
+	// 実行時に観測した型で書き換えられた命令、型が合わなければ元の命令と同じ処理をする
+	OPERATOR_ADD_INT_INT,
+	OPERATOR_SUB_INT_INT,
+	OPERATOR_MUL_INT_INT,
+	OPERATOR_EQ_INT_INT,
+	OPERATOR_NEQ_INT_INT,
+	OPERATOR_GT_INT_INT,
+	OPERATOR_GTOE_INT_INT,
+	OPERATOR_LT_INT_INT,
+	OPERATOR_LTOE_INT_INT,
+	OPERATOR_ADD_DOUBLE_DOUBLE,
+	OPERATOR_SUB_DOUBLE_DOUBLE,
+	OPERATOR_MUL_DOUBLE_DOUBLE,
+	OPERATOR_ASSIGN_INT,
+	OPERATOR_ASSIGN_DOUBLE,
+	OPERATOR_CMP_JUMP_IF_FALSE_INT_INT,
+
 	MAX_OPERATOR,
 };
 
+// 実行コードから番号で参照する定数、文字列は ivalue_ がリテラルプールでの位置
+union constant_t
+{
+	int				ivalue_;
+	double			dvalue_;
+};
+
+struct constant_pool_t
+{
+	constant_t*		constants_;
+	int				constant_num_;
+	int				constant_buffer_size_;
+};
+
+struct jit_region_t;
+
 struct code_container_t
 {
 	code_t*			code_;
 	size_t			code_size_;
 	size_t			code_buffer_size_;
+
+	// code_ の各命令位置に対応するハンドラのアドレス、code_size_ の位置は番兵
+	const void**	threaded_code_;
+	size_t			threaded_code_size_;
+
+	// code_ の各 repeat の位置に対応する JIT の翻訳結果、未翻訳なら nullptr
+	jit_region_t**	jit_regions_;
+	size_t			jit_regions_size_;
+
+	// code_ がプログラムイメージの中を指している、書き換えも解放もしない
+	bool			is_readonly_;
+};
+
+// JIT でネイティブコードに翻訳した repeat-loop
+struct jit_region_t
+{
+	void*			code_;// mmap した実行可能領域、翻訳できなかった時は nullptr
+	size_t			code_size_;
+
+	// ループ内で参照する変数のスロット番号と翻訳した時の型、実行の度に型が変わっていないことを確かめる
+	int*			variable_slots_;
+	value_tag*		variable_types_;
+	int				variable_num_;
 };
 
 code_container_t* create_code_container();
 void destroy_code_container( code_container_t* c );
 
+// レジスタマシン用の三番地コード
+// オペランドの r はコールフレームごとのレジスタウィンドウ内の番号、負ならオペランドなし
+enum register_code_operator_tag
+{
+	REGISTER_OPERATOR_NOP =0,
+
+	REGISTER_OPERATOR_LOAD_INT,			// rd, 即値
+	REGISTER_OPERATOR_LOAD_DOUBLE,		// rd, 定数の番号
+	REGISTER_OPERATOR_LOAD_STRING,		// rd, 定数の番号
+	REGISTER_OPERATOR_LOAD_VARIABLE,	// rd, 変数スロット, r添え字
+	REGISTER_OPERATOR_LOAD_SYSVAR,		// rd, システム変数
+
+	REGISTER_OPERATOR_ASSIGN,			// 変数スロット, r添え字, rs
+	REGISTER_OPERATOR_ADD_ASSIGN,
+	REGISTER_OPERATOR_SUB_ASSIGN,
+	REGISTER_OPERATOR_MUL_ASSIGN,
+	REGISTER_OPERATOR_DIV_ASSIGN,
+	REGISTER_OPERATOR_MOD_ASSIGN,
+	REGISTER_OPERATOR_BOR_ASSIGN,
+	REGISTER_OPERATOR_BAND_ASSIGN,
+	REGISTER_OPERATOR_BXOR_ASSIGN,
+
+	REGISTER_OPERATOR_BOR,				// rd, rl, rr
+	REGISTER_OPERATOR_BAND,
+	REGISTER_OPERATOR_BXOR,
+
+	REGISTER_OPERATOR_EQ,
+	REGISTER_OPERATOR_NEQ,
+	REGISTER_OPERATOR_GT,
+	REGISTER_OPERATOR_GTOE,
+	REGISTER_OPERATOR_LT,
+	REGISTER_OPERATOR_LTOE,
+
+	REGISTER_OPERATOR_ADD,
+	REGISTER_OPERATOR_SUB,
+	REGISTER_OPERATOR_MUL,
+	REGISTER_OPERATOR_DIV,
+	REGISTER_OPERATOR_MOD,
+
+	REGISTER_OPERATOR_UNARY_MINUS,		// rd, rs
+
+	REGISTER_OPERATOR_IF,				// r条件, 偽の時の相対位置
+
+	REGISTER_OPERATOR_REPEAT,			// r回数, LOOPの位置
+	REGISTER_OPERATOR_REPEAT_CHECK,
+	REGISTER_OPERATOR_LOOP,
+	REGISTER_OPERATOR_CONTINUE,
+	REGISTER_OPERATOR_BREAK,
+
+	REGISTER_OPERATOR_GOSUB,			// 絶対位置、生成中はラベル表の番号
+	REGISTER_OPERATOR_GOTO,				// 絶対位置、生成中はラベル表の番号
+
+	REGISTER_OPERATOR_COMMAND,			// コマンド, r先頭引数, 引数の数
+	REGISTER_OPERATOR_FUNCTION,			// rd, 関数, r先頭引数, 引数の数
+
+	REGISTER_OPERATOR_JUMP_RELATIVE,	// 相対位置
+	REGISTER_OPERATOR_RETURN,			// r戻り値
+	REGISTER_OPERATOR_END,
+
+	MAX_REGISTER_OPERATOR,
+};
+
 //=============================================================================
 // 実行環境
 struct call_frame_t
@@ -681,15 +990,26 @@ struct loop_frame_t
 };
 static const size_t MAX_LOOP_FRAME = 16;
 
+struct program_image_t;
+
 struct execute_environment_t
 {
+	// load_arg_t::retain_ast_ を指定した時だけ、構文木を持ったパーサーを残しておく
 	list_t*				parser_list_;
-	list_t*				ast_list_;
 
-	list_t*				label_table_;
-	list_t*				variable_table_;
+	string_buffer_t*	literal_pool_;// 文字列の定数が先頭からの位置で指す文字列リテラル、NUL終端で並べる
+	constant_pool_t*	constant_pool_;
+
+	name_table_t*		label_table_;// 実行時には引かない、ダンプとイメージの保存用
+	variable_table_t*	variable_table_;
 
 	code_container_t*	execute_code_;
+
+	code_container_t*	register_code_;
+	int					register_frame_size_;
+
+	// load_program で読み込んだ場合、コードと定数とリテラルはイメージの中を指す
+	program_image_t*	image_;
 };
 
 struct execute_status_t
@@ -706,14 +1026,32 @@ struct execute_status_t
 	bool			is_end_;
 	int				stat_;
 	double			refdval_;
-	char*			refstr_;
+	char*			refstr_;// 値と同じ共有文字列
 	int				strsize_;
+
+	// レジスタマシン用、コールフレームの深さごとに register_frame_size_ 個ずつ使う
+	value_t*		registers_;
+	int				register_num_;
+
+	bool			is_jit_enabled_;
+};
+
+enum backend_tag
+{
+	BACKEND_STACK = 0,
+	BACKEND_REGISTER,
+
+	MAX_BACKEND,
 };
 
 struct load_arg_t
 {
 	bool			dump_preprocessed_;
 	bool			dump_ast_;
+	bool			dump_code_;
+	backend_tag		backend_;
+	int				optimize_level_;// 0:最適化なし 1:のぞき穴最適化
+	bool			retain_ast_;// コード生成後も構文木を残す、指定しなければパーサーごと解放する
 };
 
 execute_environment_t* create_execute_environment();
@@ -722,14 +1060,107 @@ void destroy_execute_environment( execute_environment_t* e );
 void initialize_execute_status( execute_status_t* s );
 void uninitialize_execute_status( execute_status_t* s );
 
+enum dispatch_tag
+{
+	DISPATCH_SWITCH = 0,
+	DISPATCH_THREADED,
+
+	MAX_DISPATCH,
+};
+
+struct execute_arg_t
+{
+	dispatch_tag	dispatch_;
+	backend_tag		backend_;
+	int				profile_ngram_;// 0 以外なら実行された命令の n-gram 頻度を計測して出力する
+	bool			jit_;// スタックマシンで実行する時、repeat-loop を可能ならネイティブコードにして実行する
+};
+
+// 実行された命令列の n-gram 頻度
+static const int MAX_OPCODE_PROFILE_NGRAM = 3;
+
+struct opcode_profile_t
+{
+	int				ngram_;
+	int				table_size_;
+	int*			count_table_;
+	int				key_;
+	long long		executed_;
+};
+
+opcode_profile_t* create_opcode_profile( int ngram );
+void destroy_opcode_profile( opcode_profile_t* p );
+
 void load_script( execute_environment_t* e, const char* script, const load_arg_t* arg =nullptr );
-void execute_inner( execute_environment_t* e, execute_status_t* s );
-void execute( execute_environment_t* e, int initial_pc =0 );
 
-void generate_and_append_code( execute_environment_t* e, list_t* ast );
+// コンパイル済みのプログラムの保存形式
+// ヘッダのあとに、リテラルプール、定数、名前の文字列、変数名、ラベル、スタックマシンのコード、レジスタマシンのコードが続く
+// 各部分の位置はイメージの先頭からのオフセットで、ポインタを含まないのでそのまま mmap して実行できる
+// 数値はすべて書き出したマシンのバイト順
+static const int PROGRAM_FORMAT_VERSION = 4;
 
-value_t* evaluate_ast_immediate( ast_node_t* ast );
-bool evaluate_ast_node( ast_node_t* n, value_stack_t* stack );
+struct program_header_t
+{
+	char				magic_[4];// "NHBC"
+	int					version_;
+	int					code_unit_size_;// sizeof(code_t)
+	int					register_frame_size_;
+	unsigned long long	source_hash_;
+	unsigned long long	body_hash_;// ヘッダより後ろ全体のハッシュ、壊れたファイルを読まないため
+
+	int					literal_offset_;// 文字列の定数はここからの位置
+	int					literal_size_;
+	int					constant_offset_;// 実行コードのオペランドはここの番号
+	int					constant_num_;
+	int					name_offset_;// 変数名とラベル名、NUL終端で並べる
+	int					name_size_;
+	int					variable_offset_;// 名前の位置の配列
+	int					variable_num_;
+	int					label_offset_;// program_label_t の配列、コードは位置で飛ぶのでダンプにしか使わない
+	int					label_num_;
+	int					code_offset_;
+	int					code_size_;
+	int					register_code_offset_;
+	int					register_code_size_;
+};
+
+struct program_label_t
+{
+	int					name_;// 名前の文字列の中での位置
+	int					position_;
+	int					register_position_;
+};
+
+// 読み込んだプログラムイメージ、プロセスごとに書き換える変数やラベル表は実行環境の側に作る
+struct program_image_t
+{
+	char*				data_;
+	size_t				size_;
+	bool				is_mapped_;// mmap したものなら true、読み込んだものなら false
+};
+
+unsigned long long hash_script( const char* script );
+
+// 読み込むのは load_script も load_program もしていない実行環境だけ、読み込んだあとにスクリプトは追加できない
+// 形式やバージョン、ソースのハッシュが合わなければ実行環境に触れずに false を返す
+bool save_program( const execute_environment_t* e, const char* path, unsigned long long source_hash );
+bool load_program( execute_environment_t* e, const char* path, unsigned long long source_hash );
+void execute_inner( execute_environment_t* e, execute_status_t* s );
+void execute_inner_threaded( execute_environment_t* e, execute_status_t* s );
+void translate_threaded_code( execute_environment_t* e );
+bool is_dispatch_available( dispatch_tag dispatch );
+bool is_jit_available();
+void execute_inner_register( execute_environment_t* e, execute_status_t* s );
+void execute_inner_profile( execute_environment_t* e, execute_status_t* s, opcode_profile_t* p );
+void execute( execute_environment_t* e, int initial_pc =0, const execute_arg_t* arg =nullptr );
+
+void generate_and_append_code( execute_environment_t* e, const ast_t* ast );
+void generate_and_append_register_code( execute_environment_t* e, const ast_t* ast );
+void optimize_code( execute_environment_t* e );
+
+value_t* evaluate_ast_immediate( const ast_t* ast, const ast_node_t* n );
+bool evaluate_ast_node( const ast_t* ast, const ast_node_t* n, value_stack_t* stack );
+void fold_constant_ast( parse_context_t& c );
 
 //=============================================================================
 // ビルトイン
@@ -790,10 +1221,13 @@ function_delegate get_function_delegate( builtin_function_tag command );
 
 //=============================================================================
 // ユーティリティ
-void dump_ast( list_t* ast, bool is_detail =false );
-void dump_variable( list_t* var_table, const char* name, int idx );
+void dump_ast( const ast_t* ast, bool is_detail =false );
+void dump_variable( variable_table_t* var_table, const char* name, int idx );
 void dump_stack( value_stack_t* stack );
-void dump_code( const code_container_t* code );
+const char* get_operator_name( int op );
+void dump_code( const execute_environment_t* e );
+void dump_opcode_profile( const opcode_profile_t* p, int max_num );
+void dump_register_code( const execute_environment_t* e );
 
 
 }// namespace neteruhsp
@@ -0,0 +1,32 @@
+#!/bin/bash
+# test_script 以下のスクリプトをスタックマシンとレジスタマシンで実行して、出力と終了コードが一致することを確かめる
+# 使い方 : backend_check.sh <neteruhsp> [両方に渡すオプション...]
+set -u
+
+BIN=${1:?"neteruhsp の実行ファイルを指定してください"}
+shift
+DIR=$(cd "$(dirname "$0")" && pwd)
+
+run()
+{
+	"$BIN" "$@" < /dev/null 2>&1
+	echo "exit: $?"
+}
+
+failed=0
+for script in "$DIR"/*.hsp; do
+	for opt in -O1 -O0; do
+		stack=$(run -b stack $opt "$@" -f "$script")
+		register=$(run -b register $opt "$@" -f "$script")
+		if [ "$stack" != "$register" ]; then
+			echo "NG : $(basename "$script") $opt"
+			diff <(echo "$stack") <(echo "$register")
+			failed=1
+		fi
+	done
+done
+
+if [ $failed -ne 0 ]; then
+	exit 1
+fi
+echo "OK : スタックマシンとレジスタマシンの出力が一致しました"
@@ -0,0 +1,118 @@
+#!/bin/bash
+# test_script 以下のスクリプトをコンパイルキャッシュ(-c)を使って実行して、次のことを確かめる
+# ・キャッシュを使った実行の出力と終了コードが、使わない実行と一致する（スタックマシンとレジスタマシンの両方）
+# ・二回目の実行はイメージを再利用し、書き直さない
+# ・壊れたイメージや途中で切れたイメージは使わずにコンパイルし直し、正しいイメージで置き換える
+# 使い方 : compile_cache_check.sh <neteruhsp> [すべての実行に渡すオプション...]
+set -u
+
+BIN=${1:?"neteruhsp の実行ファイルを指定してください"}
+shift
+DIR=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/compile_cache_check.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+CACHE="$WORK/cache"
+
+run()
+{
+	"$BIN" "$@" < /dev/null 2>&1
+	echo "exit: $?"
+}
+
+failed=0
+ng()
+{
+	echo "NG : $*"
+	failed=1
+}
+
+# イメージのファイルを書き直したかどうかを inode と更新時刻で見分ける
+image_stat()
+{
+	stat -c '%i %s %y' "$1"
+}
+
+# 末尾の近くを書き換える、ヘッダの検査ではなく中身のハッシュで弾かれることを確かめる
+corrupt_image()
+{
+	local size
+	size=$(stat -c '%s' "$1")
+	printf '\xa5\x5a\xa5\x5a' | dd of="$1" bs=1 seek=$(( size -4 )) conv=notrunc 2> /dev/null
+}
+
+# 半分で切る、書き込みの途中で止まったイメージに相当する
+truncate_image()
+{
+	local size
+	size=$(stat -c '%s' "$1")
+	head -c $(( size /2 )) "$1" > "$WORK/truncated"
+	mv "$WORK/truncated" "$1"
+}
+
+for script in "$DIR"/*.hsp; do
+	name=$(basename "$script")
+	for backend in stack register; do
+		for opt in -O1 -O0; do
+			label="$name -b $backend $opt"
+			args=( -b $backend $opt "$@" )
+			expected=$(run "${args[@]}" -f "$script")
+
+			rm -rf "$CACHE"
+			mkdir "$CACHE"
+			first=$(run "${args[@]}" -c "$CACHE" -f "$script")
+			if [ "$first" != "$expected" ]; then
+				ng "$label : キャッシュを作る実行の出力が違います"
+				diff <(echo "$expected") <(echo "$first")
+				continue
+			fi
+
+			images=( "$CACHE"/* )
+			if [ ! -e "${images[0]}" ]; then
+				# コンパイルできないスクリプトはイメージを残さない
+				if [ "${expected##*exit: }" = "0" ]; then
+					ng "$label : イメージが書き出されていません"
+				fi
+				continue
+			fi
+			if [ ${#images[@]} -ne 1 ]; then
+				ng "$label : イメージ以外のファイルが残っています ${images[*]}"
+				continue
+			fi
+			image=${images[0]}
+			cp "$image" "$WORK/good"
+			before=$(image_stat "$image")
+
+			second=$(run "${args[@]}" -c "$CACHE" -f "$script")
+			if [ "$second" != "$expected" ]; then
+				ng "$label : イメージを再利用した実行の出力が違います"
+				diff <(echo "$expected") <(echo "$second")
+			fi
+			if [ "$(image_stat "$image")" != "$before" ]; then
+				ng "$label : 二回目の実行でイメージが書き直されました"
+			fi
+
+			for damage in corrupt_image truncate_image; do
+				$damage "$image"
+				recompiled=$(run "${args[@]}" -c "$CACHE" -f "$script")
+				if [ "$recompiled" != "$expected" ]; then
+					ng "$label : $damage の後の出力が違います"
+					diff <(echo "$expected") <(echo "$recompiled")
+				fi
+				if ! cmp -s "$image" "$WORK/good"; then
+					ng "$label : $damage の後にイメージが作り直されていません"
+					cp "$WORK/good" "$image"
+				fi
+			done
+
+			images=( "$CACHE"/* )
+			if [ ${#images[@]} -ne 1 ]; then
+				ng "$label : 一時ファイルが残っています ${images[*]}"
+			fi
+		done
+	done
+done
+
+if [ $failed -ne 0 ]; then
+	exit 1
+fi
+echo "OK : コンパイルキャッシュを使った実行の出力が一致し、イメージを正しく再利用しました"
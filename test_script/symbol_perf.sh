@@ -0,0 +1,17 @@
+#!/bin/bash
+# 大量のラベル、マクロ、変数を持つスクリプトを生成して、読み込みと実行にかかる時間を計る
+# 使い方 : symbol_perf.sh <neteruhsp> [個数(既定は50000)]
+set -e
+
+BIN=${1:?"neteruhsp の実行ファイルを指定してください"}
+NUM=${2:-50000}
+SCRIPT=$(mktemp "${TMPDIR:-/tmp}/symbol_perf.XXXXXX")
+trap 'rm -f "$SCRIPT"' EXIT
+
+awk -v n="$NUM" 'BEGIN {
+	for ( i=0; i<n; ++i ) printf( "#define M%d %d\n", i, i );
+	for ( i=0; i<n; ++i ) printf( "*L%d\n\tv%d = M%d\n", i, i, i );
+	printf( "mes \"\" +v%d\n", n -1 );
+}' > "$SCRIPT"
+
+time "$BIN" -f "$SCRIPT" < /dev/null